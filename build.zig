@@ -26,6 +26,13 @@ pub fn build(b: *Builder) !void {
             break :x val;
         },
 
+        .precompile_lua = b.option(
+            bool,
+            "precompile-lua",
+            "Install the lua runtime precompiled to LuaJIT bytecode." ++
+                " (default: true)",
+        ) orelse true,
+
         .plugin_cpp_objects = b.addSystemCommand(&.{ "make", "plugin_objs" }),
     };
 
@@ -76,30 +83,91 @@ pub fn build(b: *Builder) !void {
         break :gen_lua_header src.toOwnedSlice();
     });
 
-    b.installFile("lua/wf.lua", b.fmt("{s}/wf.lua", .{shared.lua_runtime_dir}));
-    b.installDirectory(.{
+    const install_wf_lua = b.addInstallFile(
+        "lua/wf.lua",
+        b.fmt("{s}/wf.lua", .{shared.lua_runtime_dir}),
+    );
+    b.getInstallStep().dependOn(&install_wf_lua.step);
+    const install_wf_dir = b.addInstallDirectory(.{
         .source_dir = "lua/wf",
         .install_dir = InstallDir{ .Custom = shared.lua_runtime_dir },
         .install_subdir = "wf",
     });
-    installFromWriteFile(.{
+    b.getInstallStep().dependOn(&install_wf_dir.step);
+    const install_wf_h = installFromWriteFile(.{
         .builder = b,
         .wfs = gen_lua_header,
         .base_name = "wf_h.lua.out",
         .dest_rel_path = b.fmt("{s}/wf/wf_h.lua", .{shared.lua_runtime_dir}),
     });
 
+    if (shared.precompile_lua) {
+        precompileLua(b, b.fmt(
+            "{s}/wf.lua",
+            .{shared.lua_runtime_dir},
+        ), &install_wf_lua.step);
+        precompileLua(b, b.fmt(
+            "{s}/wf/wf_h.lua",
+            .{shared.lua_runtime_dir},
+        ), &install_wf_h.step);
+
+        var dir = try std.fs.cwd().openDir(
+            b.pathFromRoot("lua/wf"),
+            .{ .iterate = true },
+        );
+        defer dir.close();
+
+        var it = dir.iterate();
+        while (try it.next()) |entry| {
+            if (entry.kind != .File or
+                !std.mem.endsWith(u8, entry.name, ".lua"))
+                continue;
+            precompileLua(b, b.fmt(
+                "{s}/wf/{s}",
+                .{ shared.lua_runtime_dir, entry.name },
+            ), &install_wf_dir.step);
+        }
+    }
+
     const wfmsg = b.addExecutable("wf-msg", "src/wf-msg.zig");
     wfmsg.addIncludeDir("src");
     wfmsg.install();
 
+    // Stand-in for wf.cpp and libwayfire so that the plugin runs without a
+    // compositor. Tests and benchmarks link against it.
+    const wf_mock = b.addObject("wf-mock", "src/wf-mock.zig");
+    wf_mock.setBuildMode(mode);
+    wf_mock.addIncludeDir("src");
+    wf_mock.defineCMacro("WLR_USE_UNSTABLE");
+    wf_mock.linkLibC();
+    wf_mock.linkSystemLibrary("wlroots");
+    wf_mock.linkSystemLibrary("wayland-server");
+    wf_mock.linkSystemLibrary("xkbcommon");
+
     var main_tests = b.addTest("src/wf-lua.zig");
-    addLibs(b, shared, main_tests);
+    addMockLibs(wf_mock, main_tests);
     defineConstants(b, shared, main_tests);
     main_tests.setBuildMode(mode);
 
     const test_step = b.step("test", "Run library tests");
     test_step.dependOn(&main_tests.step);
+
+    const bench = b.addExecutable("wf-bench", "src/wf-bench.zig");
+    addMockLibs(wf_mock, bench);
+    defineConstants(b, shared, bench);
+    bench.setBuildMode(mode);
+    // Lets LuaJIT's ffi find the plugin and mock symbols.
+    bench.rdynamic = true;
+
+    const run_bench = bench.run();
+    // The lua runtime is loaded from the install prefix.
+    run_bench.step.dependOn(b.getInstallStep());
+
+    const bench_step = b.step(
+        "bench",
+        "Benchmark the plugin against a mock compositor",
+    );
+    bench_step.dependOn(&run_bench.step);
 }
 
 fn addLibs(b: *Builder, shared: anytype, step: *std.build.LibExeObjStep) void {
@@ -118,6 +186,21 @@ fn addLibs(b: *Builder, shared: anytype, step: *std.build.LibExeObjStep) void {
     step.linkSystemLibrary("xkbcommon");
 }
 
+/// Link against the mock compositor instead of wayfire.
+fn addMockLibs(
+    wf_mock: *std.build.LibExeObjStep,
+    step: *std.build.LibExeObjStep,
+) void {
+    step.addObject(wf_mock);
+
+    step.addIncludeDir("src");
+    step.linkLibC();
+    step.linkSystemLibrary("wlroots");
+    step.linkSystemLibrary("wayland-server");
+    step.linkSystemLibrary("luajit");
+    step.linkSystemLibrary("xkbcommon");
+}
+
 fn defineConstants(
     b: *Builder,
     shared: anytype,
@@ -139,10 +222,30 @@ const InstallFromWriteFileOpts = struct {
     dest_rel_path: []const u8,
 };
 
-fn installFromWriteFile(opts: InstallFromWriteFileOpts) void {
+fn installFromWriteFile(
+    opts: InstallFromWriteFileOpts,
+) *InstallFromWriteFileStep {
     const step = InstallFromWriteFileStep.create(opts);
     step.step.dependOn(&opts.wfs.step);
     opts.builder.getInstallStep().dependOn(&step.step);
+    return step;
+}
+
+/// Compile an installed lua file to LuaJIT bytecode next to it (`foo.lua` ->
+/// `foo.ljbc`). The plugin loads it in place of the source while it isn't
+/// older than the source. Debug info is kept for error messages.
+fn precompileLua(b: *Builder, rel_path: []const u8, installed: *Step) void {
+    const src_path = b.getInstallPath(.Prefix, rel_path);
+    const dest_path = b.fmt(
+        "{s}.ljbc",
+        .{src_path[0 .. src_path.len - ".lua".len]},
+    );
+
+    const compile = b.addSystemCommand(&.{
+        "luajit", "-b", "-g", src_path, dest_path,
+    });
+    compile.step.dependOn(installed);
+    b.getInstallStep().dependOn(&compile.step);
 }
 
 const InstallFromWriteFileStep = struct {
@@ -28,16 +28,14 @@ mapped view. Pass -w to watch for this event indefinitely.
 
         local handler
         handler = wf.outputs:hook('view-mapped', function(output, data)
-            if data.view:get_app_id() == app_id then
-                local msg = "View mapped! " .. data.view:get_title()
-                if watch then
-                    promise:notify(msg)
-                else
-                    promise:resolve(msg)
-                    wf.outputs:unhook('view-mapped', handler)
-                end
+            local msg = "View mapped! " .. data.view:get_title()
+            if watch then
+                promise:notify(msg)
+            else
+                promise:resolve(msg)
+                wf.outputs:unhook('view-mapped', handler)
             end
-        end)
+        end, {filter = {app_id = app_id}})
 
         -- Clean up if the client shutsdown the connection before the command is
         -- resolved.
@@ -48,18 +46,26 @@ mapped view. Pass -w to watch for this event indefinitely.
     end
 }
 
+-- Publish the title of the focused view for status bars.
+-- Watch it with 'wf-msg subscribe -c focus'.
+wf.outputs:hook('view-focused', function(output, data)
+    if data.view ~= nil then
+        wf_ipc.publish('focus', data.view:get_title())
+    end
+end)
+
 wf.set {
     'zoom',
     interpolation_method = 0 -- Linear interpolation
 }
 
 -- Open a terminal window on super + shift + return.
-wf.map('s-S-Return', function() wf.get_core():run 'foot' end)
+wf.map('s-S-Return', wf.action.run 'foot')
 
 -- Vim/emacs-like Modal keybinds :)
 --
 -- Toggle music on 'super + n' followed by 'p'.
-wf.map('s-N p', function() wf.get_core():run 'mpc toggle' end)
+wf.map('s-N p', wf.action.run 'mpc toggle')
 
 -- Reload init file.
 wf.map('s-N r', wf.reload_init)
@@ -67,16 +73,10 @@ wf.map('s-N r', wf.reload_init)
 -- Shutdown the wayfire session.
 wf.map('s-N q', function() wf.get_core():shutdown() end)
 
-local function _call_plugin(activator)
-    return function()
-        wf.get_core():get_active_output():call_plugin(activator)
-    end
-end
-
-wf.map('s-N h', _call_plugin 'vswitch/binding_left')
-wf.map('s-N j', _call_plugin 'vswitch/binding_down')
-wf.map('s-N k', _call_plugin 'vswitch/binding_up')
-wf.map('s-N l', _call_plugin 'vswitch/binding_right')
+wf.map('s-N h', wf.action.call_plugin 'vswitch/binding_left')
+wf.map('s-N j', wf.action.call_plugin 'vswitch/binding_down')
+wf.map('s-N k', wf.action.call_plugin 'vswitch/binding_up')
+wf.map('s-N l', wf.action.call_plugin 'vswitch/binding_right')
 
 local function print_output(output)
     print('output:          ' .. tostring(output))
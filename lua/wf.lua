@@ -6,6 +6,7 @@
 --
 require 'wf.wf_h' -- Load the wf.h c header.
 local ipc = require 'wf.ipc'
+local Modules = require 'wf.modules'
 
 local ffi = require 'ffi'
 local util = require 'wf.util'
@@ -13,110 +14,283 @@ local Log = require 'wf.log'
 
 -- FFI Logic
 
-local Raw = {lifetime_callbacks = {}, signal_callbacks = {}}
+local Raw = {
+    -- { object_id: {handle, emitter_ptr, hook} }
+    lifetime_callbacks = {},
+    -- { handle: lifetime_callbacks entry }
+    lifetime_handles = {},
+    -- { object_id: {emitter_ptr, lifetime_handler, signals = {signal: entry}} }
+    signal_callbacks = {},
+    -- { handle: {handle, emitter_ptr, hook} }
+    signal_handles = {},
+    -- { signal: signal_id }
+    signal_ids = {},
+    -- { handle: Timer }
+    timers = {},
+    -- { handle: Process }
+    processes = {}
+}
 
 local function object_id(emitter_ptr)
     return tostring(ffi.cast('void *', emitter_ptr))
 end
 
+local EVENT_TYPE_SIGNAL = ffi.C.WFLUA_EVENT_TYPE_SIGNAL
+local EVENT_TYPE_EMITTER_DESTROYED = ffi.C.WFLUA_EVENT_TYPE_EMITTER_DESTROYED
+local EVENT_TYPE_TIMER = ffi.C.WFLUA_EVENT_TYPE_TIMER
+local EVENT_TYPE_PROCESS_STDOUT = ffi.C.WFLUA_EVENT_TYPE_PROCESS_STDOUT
+local EVENT_TYPE_PROCESS_STDERR = ffi.C.WFLUA_EVENT_TYPE_PROCESS_STDERR
+local EVENT_TYPE_PROCESS_EXIT = ffi.C.WFLUA_EVENT_TYPE_PROCESS_EXIT
+local EVENT_TYPE_WORKER_RESULT = ffi.C.WFLUA_EVENT_TYPE_WORKER_RESULT
+
+-- User handlers are run through the plugin which accounts the time they take
+-- and holds them to the handler budget, in the scope of their module.
+local function call_handler(handler, ...)
+    return Modules.call(wf__profiled_call, handler, ...)
+end
+
+local function dispatch_event(event_type, handle, signal_id, signal_data)
+    if event_type == EVENT_TYPE_SIGNAL then
+        -- A signal was emitted to the signal_connection.
+        local entry = Raw.signal_handles[handle]
+        entry.hook:call_with(call_handler, entry.emitter_ptr, signal_data)
+
+    elseif event_type == EVENT_TYPE_EMITTER_DESTROYED then
+        local entry = Raw.lifetime_handles[handle]
+        if Log.debug_enabled then
+            Log.debug('EMITTER DIED: ', entry.emitter_id)
+        end
+
+        entry.hook:call_with(call_handler, entry.emitter_ptr)
+        Raw.lifetime_handles[handle] = nil
+        Raw.lifetime_callbacks[entry.emitter_id] = nil
+
+    elseif event_type == EVENT_TYPE_TIMER then
+        local timer = Raw.timers[handle]
+        -- One-shot timers are already released by the plugin.
+        if timer.interval == 0 then Raw.timers[handle] = nil end
+        call_handler(timer.callback)
+
+    elseif event_type == EVENT_TYPE_PROCESS_STDOUT or event_type ==
+        EVENT_TYPE_PROCESS_STDERR then
+        local process = Raw.processes[handle]
+        local handler = event_type == EVENT_TYPE_PROCESS_STDOUT and
+                            process.on_stdout or process.on_stderr
+        if handler then
+            local chunk = ffi.cast('const wf_String *', signal_data)
+            call_handler(handler, ffi.string(chunk.data, chunk.len), process)
+        end
+
+    elseif event_type == EVENT_TYPE_PROCESS_EXIT then
+        local process = Raw.processes[handle]
+        -- The plugin already released the handle.
+        Raw.processes[handle] = nil
+        local exit = ffi.cast('const wflua_ProcessExit *', signal_data)
+        process.exit_code = exit.code
+        process.exit_signal = exit.signal
+        if process.on_exit then
+            call_handler(process.on_exit, exit.code, exit.signal, process)
+        end
+
+    elseif event_type == EVENT_TYPE_WORKER_RESULT then
+        local result = ffi.cast('const wflua_WorkerResult *', signal_data)
+        ipc.__worker_result(handle, result.ok,
+                            ffi.string(result.result.data, result.result.len))
+    end
+end
+
 -- There is a cap on the amount of allowed lua-created C callbacks so we
 -- reuse this same one for all signals.
 Raw.event_callback = ffi.cast("wflua_EventCallback",
-                              function(emitter, event_type, signal, signal_data)
-    local success, err = pcall(function()
-        if event_type == ffi.C.WFLUA_EVENT_TYPE_SIGNAL then
-            -- NOTE: The address of the emitter is assumed to be constant for any
-            -- given emitter.
-            -- A signal was emitted to the signal_connection.
-            Log.debug('SIGNAL EVENT: on ' .. object_id(emitter) .. ' : "' ..
-                          ffi.string(signal) .. '"')
-
-            local emitter_signals = Raw.signal_callbacks[object_id(emitter)]
-                                        .signals
-            emitter_signals[ffi.string(signal)]:call(emitter, signal_data)
-
-        elseif event_type == ffi.C.WFLUA_EVENT_TYPE_EMITTER_DESTROYED then
-            Log.debug('EMITTER DIED: ', object_id(emitter))
-
-            local emitter_id = object_id(emitter)
-            Raw.lifetime_callbacks[emitter_id].hook:call(emitter)
-            Raw.lifetime_callbacks[emitter_id] = nil
-        end
-    end)
+                              function(event_type, handle, signal_id,
+                                       signal_data)
+    local success, err = pcall(dispatch_event, event_type, handle, signal_id,
+                               signal_data)
 
     if not success then Log.err('Error in lua event-callback:\n', err) end
 end)
 
 function Raw:subscribe_lifetime(emitter_ptr, handler)
+    Modules.adopt(handler)
     local emitter = object_id(emitter_ptr)
 
-    Log.debug('subscribing to ' .. emitter .. ' lifetime')
+    if Log.debug_enabled then
+        Log.debug('subscribing to ' .. emitter .. ' lifetime')
+    end
 
-    if not self.lifetime_callbacks[emitter] then
-        ffi.C.wflua_lifetime_subscribe(emitter_ptr)
-        self.lifetime_callbacks[emitter] = {
+    local entry = self.lifetime_callbacks[emitter]
+    if not entry then
+        entry = {
+            emitter_id = emitter,
             emitter_ptr = emitter_ptr,
             hook = util.Hook {handler}
         }
+        entry.handle = ffi.C.wflua_lifetime_subscribe(emitter_ptr)
+        self.lifetime_callbacks[emitter] = entry
+        self.lifetime_handles[entry.handle] = entry
     else
-        self.lifetime_callbacks[emitter].hook:hook(handler)
+        entry.hook:hook(handler)
     end
     return handler
 end
 
 function Raw:unsubscribe_lifetime(emitter_ptr, handler)
     local emitter = object_id(emitter_ptr)
+    local entry = self.lifetime_callbacks[emitter]
 
-    self.lifetime_callbacks[emitter].hook:unhook(handler)
+    entry.hook:unhook(handler)
 
-    if self.lifetime_callbacks[emitter].hook:is_empty() then
-        ffi.C.wflua_lifetime_unsubscribe(emitter_ptr)
+    if entry.hook:is_empty() then
+        ffi.C.wflua_lifetime_unsubscribe(entry.handle)
+        self.lifetime_handles[entry.handle] = nil
         self.lifetime_callbacks[emitter] = nil
     end
 end
 
 function Raw:reset_lifetimes()
-    for emitter, lt_cb in pairs(self.lifetime_callbacks) do
-        print('-Emitter:', emitter, tostring(lt_cb.emitter_ptr))
-        ffi.C.wflua_lifetime_unsubscribe(lt_cb.emitter_ptr)
-        print('+Emitter:', emitter, tostring(lt_cb.emitter_ptr))
+    for _, entry in pairs(self.lifetime_callbacks) do
+        ffi.C.wflua_lifetime_unsubscribe(entry.handle)
     end
     self.lifetime_callbacks = {}
+    self.lifetime_handles = {}
+end
+
+--- Get the interned id of a signal name.
+-- @local
+function Raw:signal_id(signal)
+    local id = self.signal_ids[signal]
+    if not id then
+        id = ffi.C.wflua_signal_intern(signal)
+        self.signal_ids[signal] = id
+    end
+    return id
+end
+
+-- Filter fields by the kind of signal data they apply to.
+local FILTER_FIELDS = {
+    view = {
+        app_id = ffi.C.WFLUA_FILTER_FIELD_VIEW_APP_ID,
+        title = ffi.C.WFLUA_FILTER_FIELD_VIEW_TITLE,
+        output = ffi.C.WFLUA_FILTER_FIELD_VIEW_OUTPUT
+    },
+    output = {output = ffi.C.WFLUA_FILTER_FIELD_OUTPUT_NAME}
+}
+-- Filter keys in a fixed order so that equal filters get the same key.
+local FILTER_KEYS = {'app_id', 'title', 'output'}
+
+--- Resolve a hook's `filter` option to native filters.
+-- Values are either a string to compare against or `{glob = pattern}`.
+-- @local
+function Raw:parse_filter(emitter_type, signal, filter)
+    local data_kind = self.signal_data_kinds[emitter_type][signal]
+    local fields = FILTER_FIELDS[data_kind]
+    if not fields then
+        error(string.format('signal `%s` can not be filtered', signal), 0)
+    end
+
+    for key, _ in pairs(filter) do
+        if not fields[key] then
+            error(string.format('can not filter `%s` by `%s`', signal, key),
+                  0)
+        end
+    end
+
+    local parsed = {}
+    for _, key in ipairs(FILTER_KEYS) do
+        local value = filter[key]
+        if value ~= nil then
+            local match = ffi.C.WFLUA_FILTER_MATCH_EQUAL
+            if type(value) == 'table' then
+                match = ffi.C.WFLUA_FILTER_MATCH_GLOB
+                value = value.glob
+            end
+            if type(value) ~= 'string' then
+                error(string.format('invalid filter value for `%s`', key), 0)
+            end
+            table.insert(parsed, {field = fields[key], match = match,
+                                  pattern = value, key = key})
+        end
+    end
+    return parsed
 end
 
-function Raw:subscribe(emitter_ptr, signal, handler, opts)
+-- Subscriptions are shared by the handlers hooking the same signal with the
+-- same options. Coalesced and filtered ones are separate native subscriptions
+-- stored under a distinct key.
+local function subscription_key(signal, coalesce, filters)
+    local key = signal
+    if coalesce then key = key .. '\0coalesce' end
+    for _, filter in ipairs(filters) do
+        local op = filter.match == ffi.C.WFLUA_FILTER_MATCH_GLOB and '~' or '='
+        key = key .. '\0' .. filter.key .. op .. filter.pattern
+    end
+    return key
+end
+
+-- `emitter_type` is the kind of emitter, as in `signal_data_converters`.
+function Raw:subscribe(emitter_ptr, signal, handler, opts, emitter_type)
+    Modules.adopt(handler)
     local lifetime_cleanup = true
+    local coalesce = false
+    local filters = {}
     if opts ~= nil and type(opts) == 'table' then
         if opts.lifetime_cleanup == false then lifetime_cleanup = false end
+        if opts.coalesce then coalesce = true end
+        if opts.filter then
+            filters = self:parse_filter(emitter_type, signal, opts.filter)
+        end
     end
 
     local emitter = object_id(emitter_ptr)
 
-    Log.debug('subscribing to ' .. emitter .. ' ' .. signal)
+    if Log.debug_enabled then
+        Log.debug('subscribing to ' .. emitter .. ' ' .. signal)
+    end
 
     if not self.signal_callbacks[emitter] then
         local lifetime_handler = false
         if lifetime_cleanup then
             -- Clean up when the C++ emitter object dies.
             lifetime_handler = self:subscribe_lifetime(emitter_ptr, function()
-                self.signal_callbacks[emitter] = nil
-                ffi.C.wflua_signal_unsubscribe_all(emitter_ptr)
+                self:unsubscribe_all(emitter)
             end)
         end
         self.signal_callbacks[emitter] = {
             emitter_ptr = emitter_ptr,
-            lifetime_handler = lifetime_cleanup,
+            lifetime_handler = lifetime_handler,
             signals = {}
         }
     end
 
     local emitter_cbs = self.signal_callbacks[emitter].signals
-    if not emitter_cbs[signal] then
-        ffi.C.wflua_signal_subscribe(emitter_ptr, signal)
+    local key = subscription_key(signal, coalesce, filters)
+    local entry = emitter_cbs[key]
+    if not entry then
+        local mode = coalesce and ffi.C.WFLUA_SUBSCRIBE_MODE_COALESCE or
+                         ffi.C.WFLUA_SUBSCRIBE_MODE_IMMEDIATE
 
-        emitter_cbs[signal] = util.Hook {handler}
+        entry = {
+            emitter_ptr = emitter_ptr,
+            signal = signal,
+            hook = util.Hook {handler}
+        }
+        if emitter_type == 'view' and #filters > 0 then
+            -- Filters read the view's property cache. Create it before
+            -- connecting so that it is refreshed before filters run on the
+            -- view's own 'title-changed' and 'app-id-changed'.
+            ffi.C.wf_View_get_properties(emitter_ptr)
+        end
+        entry.handle = ffi.C.wflua_signal_subscribe(emitter_ptr,
+                                                    self:signal_id(signal),
+                                                    mode)
+        for _, filter in ipairs(filters) do
+            ffi.C.wflua_signal_add_filter(entry.handle, filter.field,
+                                          filter.match, filter.pattern)
+        end
+        self.signal_handles[entry.handle] = entry
+        emitter_cbs[key] = entry
     else
-        emitter_cbs[signal]:hook(handler)
+        entry.hook:hook(handler)
     end
     return handler
 end
@@ -126,51 +300,124 @@ function Raw:unsubscribe(emitter_ptr, signal, handler)
 
     local emitter_entry = self.signal_callbacks[emitter]
     local emitter_cbs = emitter_entry.signals
-    emitter_cbs[signal]:unhook(handler)
 
-    if emitter_cbs[signal]:is_empty() then
-        ffi.C.wflua_signal_unsubscribe(emitter_ptr, signal)
+    local key, entry
+    for k, e in pairs(emitter_cbs) do
+        if e.signal == signal and e.hook:has(handler) then
+            key, entry = k, e
+            break
+        end
+    end
+    entry.hook:unhook(handler)
+
+    if entry.hook:is_empty() then
+        ffi.C.wflua_signal_unsubscribe(entry.handle)
 
-        emitter_cbs[signal] = nil
+        self.signal_handles[entry.handle] = nil
+        emitter_cbs[key] = nil
 
         -- No signals being listened for for this emitter
         if not next(emitter_cbs) then
             if emitter_entry.lifetime_handler ~= false then
                 -- No longer need to listen for emitter destroyed
-                self.unsubscribe_lifetime(emitter_ptr,
+                self:unsubscribe_lifetime(emitter_ptr,
                                           emitter_entry.lifetime_handler)
             end
             self.signal_callbacks[emitter] = nil
         end
     end
 end
+
+--- Drop all the signal subscriptions of an emitter.
+-- @local
+function Raw:unsubscribe_all(emitter)
+    for _, entry in pairs(self.signal_callbacks[emitter].signals) do
+        ffi.C.wflua_signal_unsubscribe(entry.handle)
+        self.signal_handles[entry.handle] = nil
+    end
+    self.signal_callbacks[emitter] = nil
+end
+
 function Raw:reset_signals()
-    for emitter, sig_cb in pairs(self.signal_callbacks) do
-        ffi.C.wflua_signal_unsubscribe_all(sig_cb.emitter_ptr)
+    for emitter, _ in pairs(self.signal_callbacks) do
+        self:unsubscribe_all(emitter)
     end
     self.signal_callbacks = {}
+    self.signal_handles = {}
+    self.signal_ids = {}
 end
 
 ffi.C.wflua_register_event_callback(Raw.event_callback)
 
---- Set the value of an option.
--- The option must already by registered by Wayfire.
--- @local
-function Raw.set_option(sect, opt, val)
-    local val_str = string.format('%s', val)
+-- Resolved option handles: { 'section/option': {ptr, type} }
+Raw.options = {}
 
-    local r = ffi.C.wf_set_option_str(sect, opt, val_str)
+-- Out-parameters of wf_find_option, reused across lookups.
+local option_out = ffi.new('wf_Option *[1]')
+local option_type_out = ffi.new('wf_OptionType[1]')
 
+local function check_option_error(r, sect, opt, val)
     if r == ffi.C.WF_INVALID_OPTION_VALUE then
         error(string.format('`%s` is not a valid value for %s/%s', val, sect,
-                            opt))
+                            opt), 0)
     elseif r == ffi.C.WF_INVALID_OPTION_SECTION then
-        error(string.format('`%s` is not a valid section name', sect))
+        error(string.format('`%s` is not a valid section name', sect), 0)
     elseif r == ffi.C.WF_INVALID_OPTION then
-        error(string.format('`%s` is not a valid option in `%s`', opt, sect))
+        error(string.format('`%s` is not a valid option in `%s`', opt, sect),
+              0)
     end
 end
 
+--- Get the handle of an option, resolving it the first time.
+-- The option must already by registered by Wayfire.
+-- @local
+function Raw.find_option(sect, opt)
+    local key = sect .. '/' .. opt
+    local option = Raw.options[key]
+    if option then return option end
+
+    local r = ffi.C.wf_find_option(sect, opt, option_out, option_type_out)
+    check_option_error(r, sect, opt)
+
+    option = {ptr = option_out[0], type = option_type_out[0]}
+    Raw.options[key] = option
+    return option
+end
+
+-- Option changes are staged in this transaction until committed. Outside of
+-- `wf.batch`, every call to `wf.set` commits.
+Raw.option_tx = ffi.gc(ffi.C.wf_create_option_transaction(),
+                       ffi.C.wf_destroy_option_transaction)
+Raw.batch_depth = 0
+Raw.batch_emit_reload = false
+
+local OPTION_TYPE_INT = ffi.C.WF_OPTION_TYPE_INT
+local OPTION_TYPE_DOUBLE = ffi.C.WF_OPTION_TYPE_DOUBLE
+local OPTION_TYPE_BOOL = ffi.C.WF_OPTION_TYPE_BOOL
+
+--- Stage the new value of an option.
+-- Values of the option's own type are passed as is. Anything else is
+-- converted to a string and parsed by the option.
+-- @local
+function Raw.stage_option(sect, opt, val)
+    local option = Raw.find_option(sect, opt)
+    local tx = Raw.option_tx
+    local val_type = type(val)
+
+    local r
+    if val_type == 'number' and option.type == OPTION_TYPE_INT and
+        val % 1 == 0 then
+        r = ffi.C.wf_OptionTransaction_set_int(tx, option.ptr, val)
+    elseif val_type == 'number' and option.type == OPTION_TYPE_DOUBLE then
+        r = ffi.C.wf_OptionTransaction_set_double(tx, option.ptr, val)
+    elseif val_type == 'boolean' and option.type == OPTION_TYPE_BOOL then
+        r = ffi.C.wf_OptionTransaction_set_bool(tx, option.ptr, val)
+    else
+        r = ffi.C.wf_OptionTransaction_set_str(tx, option.ptr, tostring(val))
+    end
+    check_option_error(r, sect, opt, val)
+end
+
 do
     local function view_signal(sig_data)
         return {view = ffi.C.wf_get_signaled_view(sig_data)}
@@ -221,6 +468,17 @@ do
             ['set-output'] = output_signal
         }
     }
+
+    -- The kind of data of each signal, for filtering it natively.
+    local data_kinds = {[view_signal] = 'view', [output_signal] = 'output'}
+    Raw.signal_data_kinds = {}
+    for emitter_type, converters in pairs(Raw.signal_data_converters) do
+        local kinds = {}
+        for signal, converter in pairs(converters) do
+            kinds[signal] = data_kinds[converter]
+        end
+        Raw.signal_data_kinds[emitter_type] = kinds
+    end
 end
 
 function Raw:convert_signal_data(type, signal, raw_data)
@@ -230,6 +488,9 @@ function Raw:convert_signal_data(type, signal, raw_data)
     -- lua-land.
     if not data_converter then return nil end
 
+    -- Coalesced signals are delivered without data.
+    if raw_data == nil then return nil end
+
     return data_converter(raw_data)
 end
 
@@ -244,6 +505,9 @@ local M = {}
 -- The section and option names must already be registered in wayfire by it or
 -- some plugin.
 --
+-- All the values are applied together, and only if they are all valid. Inside
+-- `wf.batch`, they are applied once the batch ends.
+--
 -- @usage
 -- --The arguments are passed in the form: 
 -- set { 'section', option = value, ...}
@@ -262,9 +526,72 @@ function M.set(args)
     end
 
     local sect = args[1]
-    for opt, val in pairs(args) do
-        if opt ~= 1 then Raw.set_option(sect, opt, val) end
+    local staged = ffi.C.wf_OptionTransaction_size(Raw.option_tx)
+    local ok, err = pcall(function()
+        for opt, val in pairs(args) do
+            if opt ~= 1 then Raw.stage_option(sect, opt, val) end
+        end
+    end)
+    if not ok then
+        -- Nothing from a failed call is applied, even if the batch around it
+        -- carries on.
+        ffi.C.wf_OptionTransaction_rollback(Raw.option_tx, staged)
+        error(err, 2)
+    end
+
+    if Raw.batch_depth == 0 then
+        ffi.C.wf_OptionTransaction_commit(Raw.option_tx, false)
+    end
+end
+
+--- Apply all the options set by a function at once.
+--
+-- The calls to `wf.set` made by `fn` are only applied once it returns, back to
+-- back, with no lua code running in between. If `fn` raises an error, none of
+-- them are applied. Batches can be nested; everything is applied when the
+-- outermost one returns.
+--
+-- If `opts.emit_reload` is set, the `'reload-config'` signal is emitted on the
+-- core once everything is applied. Plugins not listening for changes to
+-- individual options pick up the new values then.
+--
+-- @usage
+-- wf.batch({emit_reload = true}, function()
+--     wf.set {'core', background_color = '#344B5DFF'}
+--     wf.set {'decoration', border_size = 2, active_color = '#FFFFFFFF'}
+-- end)
+-- @tparam ?{emit_reload:bool} opts Optional options table.
+-- @tparam fn() fn
+-- @within Functions
+function M.batch(opts, fn)
+    -- Optional opts argument
+    if fn == nil then
+        fn = opts
+        opts = {}
     end
+
+    local staged = ffi.C.wf_OptionTransaction_size(Raw.option_tx)
+    local outer_emit_reload = Raw.batch_emit_reload
+    Raw.batch_depth = Raw.batch_depth + 1
+    Raw.batch_emit_reload = Raw.batch_emit_reload or opts.emit_reload == true
+    local ok, err = pcall(fn)
+    Raw.batch_depth = Raw.batch_depth - 1
+
+    -- Nothing from a failed batch is applied, even if the batch around it
+    -- catches the error and carries on.
+    if not ok then
+        ffi.C.wf_OptionTransaction_rollback(Raw.option_tx, staged)
+        Raw.batch_emit_reload = outer_emit_reload
+    end
+    if Raw.batch_depth > 0 then
+        if not ok then error(err, 0) end
+        return
+    end
+
+    local emit_reload = Raw.batch_emit_reload
+    Raw.batch_emit_reload = false
+    if not ok then error(err, 0) end
+    ffi.C.wf_OptionTransaction_commit(Raw.option_tx, emit_reload)
 end
 
 --- Map a sequence of keys to an action.
@@ -321,9 +648,25 @@ end
 -- wf.map('s-n p', function() 
 --     wf.get_core():run('mpc toggle')
 -- end)
--- @tparam ?{pop_keys:number} opts Optional options table.
+--
+-- `opts.timeout` is a time in milliseconds after which a partially typed
+-- sequence of this mapping is dropped. By default pending sequences never
+-- expire.
+--
+-- @usage
+-- -- Forget about 'super + n' if 'p' doesn't follow within a second.
+-- wf.map({timeout = 1000}, 's-n p', function()
+--     wf.get_core():run('mpc toggle')
+-- end)
+--
+-- The handler may also be one of the native actions from `wf.action`. These
+-- are run by the plugin itself without calling into lua on key press.
+--
+-- @usage
+-- wf.map('s-Return', wf.action.run 'foot')
+-- @tparam ?{pop_keys:number,timeout:number} opts Optional options table.
 -- @tparam string keys A string representing a sequence of key presses.
--- @tparam fn() handler The handler callback to run.
+-- @tparam fn()|table handler The handler callback or native action to run.
 -- @within Functions
 function M.map(opts, keys, handler)
     -- Optional opts argument
@@ -333,7 +676,332 @@ function M.map(opts, keys, handler)
         opts = {}
     end
 
-    wf__map_keys(keys, handler, opts.pop_keys)
+    if type(handler) ~= 'function' and type(handler) ~= 'table' then
+        error('The handler should be a function or a wf.action', 2)
+    end
+    local timeout = opts.timeout
+    if timeout ~= nil and (type(timeout) ~= 'number' or timeout % 1 ~= 0 or
+        timeout < 0 or timeout > 0x7fffffff) then
+        error('The timeout should be a whole number of milliseconds', 2)
+    end
+
+    if type(handler) == 'function' and Modules.current then
+        -- The plugin runs mappings itself, bring them in their module's scope.
+        local fn = Modules.adopt(handler)
+        handler = function() return call_handler(fn) end
+    end
+
+    local id = wf__map_keys(keys, handler, opts.pop_keys, opts.timeout)
+    if id then Modules.track(function() wf__unmap_keys(keys, id) end) end
+end
+
+--- Native actions to be used as `wf.map` handlers.
+--
+-- Each function returns a description of the action for the plugin to run
+-- directly on key press.
+--
+-- @usage
+-- wf.map('s-N h', wf.action.call_plugin 'vswitch/binding_left')
+-- @within Functions
+M.action = {}
+
+--- Spawn a shell command.
+-- @tparam string command
+-- @within Functions
+function M.action.run(command)
+    return {action = 'run', command}
+end
+
+--- Call a plugin activator on the active output.
+-- @tparam string activator The activator option name, e.g.
+-- `'vswitch/binding_left'`.
+-- @within Functions
+function M.action.call_plugin(activator)
+    return {action = 'call_plugin', activator}
+end
+
+--- Focus the output with the given name.
+-- @tparam string name
+-- @within Functions
+function M.action.focus_output(name)
+    return {action = 'focus_output', name}
+end
+
+--- Set the value of an option.
+-- @tparam string section
+-- @tparam string option
+-- @param value Converted to a string.
+-- @within Functions
+function M.action.set_option(section, option, value)
+    return {action = 'set_option', section, option, tostring(value)}
+end
+
+---A pending timeout or interval.
+-- @type Timer
+local Timer = {}
+Timer.__index = Timer
+
+-- Raise an error at `level` unless `ms` is a whole number of milliseconds no
+-- less than `min`.
+local function check_ms(ms, min, level)
+    if type(ms) ~= 'number' or ms % 1 ~= 0 or ms < min or ms > 0x7fffffff then
+        error('The time should be a whole number of milliseconds from ' ..
+                  min .. ' to 2147483647', level + 1)
+    end
+end
+
+local function add_timer(ms, repeating, callback)
+    -- An interval of 0 would make a one-shot timer.
+    check_ms(ms, repeating and 1 or 0, 3)
+    local interval = repeating and ms or 0
+    if type(callback) ~= 'function' then
+        error('The callback should be a function', 3)
+    end
+
+    local handle = ffi.C.wflua_timer_add(ms, interval)
+    if handle == 0 then error('Failed to add timer', 3) end
+
+    local timer = setmetatable({
+        handle = handle,
+        interval = interval,
+        callback = Modules.adopt(callback)
+    }, Timer)
+    Raw.timers[handle] = timer
+    Modules.track(function() timer:cancel() end)
+    return timer
+end
+
+--- Stop the timer. Does nothing if it already fired or was cancelled.
+-- @tparam Timer self
+function Timer:cancel()
+    if Raw.timers[self.handle] ~= self then return end
+    Raw.timers[self.handle] = nil
+    ffi.C.wflua_timer_cancel(self.handle)
+end
+
+--- Whether the timer is still pending.
+-- @tparam Timer self
+-- @treturn bool
+function Timer:is_active() return Raw.timers[self.handle] == self end
+
+--- Call a function once after some time.
+--
+-- All timers run off a single native timer and are cancelled when the init
+-- file is reloaded.
+--
+-- @usage
+-- local timer = wf.timeout(500, function() print('Half a second later') end)
+-- -- Changed our mind.
+-- timer:cancel()
+-- @tparam number ms The delay in milliseconds.
+-- @tparam fn() callback
+-- @treturn Timer
+-- @within Functions
+function M.timeout(ms, callback) return add_timer(ms, false, callback) end
+
+--- Call a function repeatedly.
+--
+-- Intervals missed while wayfire was busy are skipped rather than run back to
+-- back.
+--
+-- @usage
+-- wf.interval(60 * 1000, function() print('Another minute went by') end)
+-- @tparam number ms The period in milliseconds, at least 1.
+-- @tparam fn() callback
+-- @treturn Timer
+-- @within Functions
+function M.interval(ms, callback) return add_timer(ms, true, callback) end
+
+--- Wrap a function to only run once calls to it settle.
+--
+-- Every call to the returned function restarts a timer. `fn` is called with
+-- the arguments of the last call once no call was made for `ms`.
+--
+-- @usage
+-- -- Recompute the layout once after a burst of views being mapped.
+-- local relayout = wf.debounce(50, function(output) layout(output) end)
+-- wf.outputs:hook('view-mapped', relayout)
+-- @tparam number ms The quiet time in milliseconds.
+-- @tparam fn(...) fn
+-- @treturn fn(...)
+-- @within Functions
+function M.debounce(ms, fn)
+    check_ms(ms, 0, 2)
+    local timer, args
+    local function run() fn(unpack(args, 1, args.n)) end
+
+    return function(...)
+        args = {n = select('#', ...), ...}
+        if timer then timer:cancel() end
+        timer = M.timeout(ms, run)
+    end
+end
+
+--- Wrap a function to run at most once per period.
+--
+-- The first call runs `fn` right away. Calls made during the following `ms`
+-- are collapsed into a single call with the last arguments, run at the end of
+-- the period.
+--
+-- @usage
+-- -- Publish the focused view at most 10 times a second.
+-- wf.outputs:hook('view-focused', wf.throttle(100, function(output, data)
+--     publish_focus(data.view)
+-- end))
+-- @tparam number ms The period in milliseconds.
+-- @tparam fn(...) fn
+-- @treturn fn(...)
+-- @within Functions
+function M.throttle(ms, fn)
+    check_ms(ms, 0, 2)
+    local timer, pending
+
+    local function period_end()
+        timer = nil
+        if not pending then return end
+
+        local args = pending
+        pending = nil
+        timer = M.timeout(ms, period_end)
+        fn(unpack(args, 1, args.n))
+    end
+
+    return function(...)
+        if timer and timer:is_active() then
+            pending = {n = select('#', ...), ...}
+            return
+        end
+        timer = M.timeout(ms, period_end)
+        fn(...)
+    end
+end
+
+---A process started with `wf.spawn`.
+-- @field exit_code The exit code, or -1 if killed by a signal. `nil` until the
+-- process exits.
+-- @field exit_signal The signal that killed the process or 0. `nil` until the
+-- process exits.
+-- @type Process
+local Process = {}
+Process.__index = Process
+
+--- Whether the process is still running or has output left to deliver.
+-- @tparam Process self
+-- @treturn bool
+function Process:is_running() return Raw.processes[self.handle] == self end
+
+--- Get the pid of the process.
+-- @tparam Process self
+-- @treturn number the pid, or `nil` once the process exited.
+function Process:get_pid()
+    if not self:is_running() then return nil end
+    return ffi.C.wflua_process_get_pid(self.handle)
+end
+
+--- Send a signal to the process.
+-- @tparam Process self
+-- @tparam ?number signal From 0 to 64. Defaults to 15 (SIGTERM).
+-- @treturn bool whether the signal was sent.
+function Process:kill(signal)
+    signal = signal or 15
+    if type(signal) ~= 'number' or signal % 1 ~= 0 or signal < 0 or
+        signal > 64 then
+        error('The signal should be a whole number from 0 to 64', 2)
+    end
+
+    if not self:is_running() then return false end
+    return ffi.C.wflua_process_kill(self.handle, signal)
+end
+
+-- Forward the output of a process to an ipc command's notifications.
+local function pipe_to_promise(promise, process)
+    if promise.pending then promise:begin_notifications() end
+    promise:hook_cancel(function() process:kill() end)
+
+    local on_stdout, on_exit = process.on_stdout, process.on_exit
+    process.on_stdout = function(line)
+        if promise.notifying then promise:notify(line) end
+        if on_stdout then on_stdout(line, process) end
+    end
+    process.on_exit = function(code, signal)
+        if promise.notifying then
+            if code ~= 0 then
+                promise:notify(signal ~= 0 and
+                                   ('Killed by signal ' .. signal) or
+                                   ('Exited with code ' .. code))
+            end
+            promise:end_notifications()
+        end
+        if on_exit then on_exit(code, signal, process) end
+    end
+end
+
+--- Run a command without blocking the compositor.
+--
+-- `argv` is either an array of the program and its arguments, looked up in
+-- `$PATH`, or a string run with `/bin/sh -c`. The output of the process is
+-- read on the event loop as it comes and passed to `opts.on_stdout` and
+-- `opts.on_stderr`, one line at a time (without the line break). Set
+-- `opts.buffer` to `'chunk'` to get the output as it is read instead.
+-- `opts.on_exit` is called once the process exited and all of its output was
+-- delivered, with the exit code (-1 if killed) and the signal that killed it
+-- (or 0).
+--
+-- With `opts.promise`, every line of stdout is sent as a notification of that
+-- ipc command. The notifications end when the process exits, and the process
+-- is killed if the command is cancelled.
+--
+-- Processes still running when the init file is reloaded are left running
+-- but their output is dropped.
+--
+-- @usage
+-- wf.spawn({'mpc', 'current'}, {
+--     on_stdout = function(line) print('Now playing: ' .. line) end,
+--     on_exit = function(code) print('mpc exited with ' .. code) end
+-- })
+-- @usage
+-- -- 'wf-msg journal' streams the session's logs.
+-- wf_ipc.def_cmd {
+--     'journal', [[
+-- Follow the journal.
+--
+-- USAGE:
+--     journal
+-- ]], function(promise, args)
+--         wf.spawn({'journalctl', '-f', '--user'}, {promise = promise})
+--     end
+-- }
+-- @tparam {string,...}|string argv
+-- @tparam ?table opts Optional options table.
+-- @treturn Process
+-- @within Functions
+function M.spawn(argv, opts)
+    if type(argv) == 'string' then argv = {'/bin/sh', '-c', argv} end
+    if type(argv) ~= 'table' or #argv == 0 then
+        error('The command should be a string or an array of strings', 2)
+    end
+
+    opts = opts or {}
+    local process = setmetatable({
+        on_stdout = opts.on_stdout,
+        on_stderr = opts.on_stderr,
+        on_exit = opts.on_exit
+    }, Process)
+
+    local c_argv = ffi.new('const char *[?]', #argv + 1)
+    for i, arg in ipairs(argv) do c_argv[i - 1] = tostring(arg) end
+    c_argv[#argv] = nil
+
+    local handle = ffi.C.wflua_process_spawn(c_argv, opts.buffer ~= 'chunk')
+    if handle == 0 then error('Failed to spawn ' .. tostring(argv[1]), 2) end
+
+    process.handle = handle
+    Raw.processes[handle] = process
+    if opts.promise then pipe_to_promise(opts.promise, process) end
+    Modules.adopt(process.on_stdout)
+    Modules.adopt(process.on_stderr)
+    Modules.adopt(process.on_exit)
+    return process
 end
 
 ---A rectangle.
@@ -369,47 +1037,98 @@ ffi.metatype("wf_Pointf", {
     end
 })
 
+local output_layout_ptr = ffi.typeof('wf_OutputLayout *')
+
 --- Lua-local data attached to wayfire objects.
+--
+-- The id of an object's data table is stored on the object itself by the
+-- plugin so that looking it up doesn't go through a string. The ids of objects
+-- that died are handed back by the plugin and their tables freed the next time
+-- a table is created.
 -- @type ObjectData
 -- @local
 local ObjectData = {
-    data = {},
+    -- { id: data }
+    tables = {},
+    -- Ids free for reuse.
+    free_ids = {},
+    next_id = 1,
+    -- The output layout isn't a wayfire object and can't hold data.
+    -- { object_id: data }
+    plain = {},
+
+    --- Free the tables of the objects that died.
+    -- @local
+    collect = function(self)
+        local id = ffi.C.wflua_object_data_take_released()
+        while id ~= 0 do
+            self.tables[id] = nil
+            table.insert(self.free_ids, id)
+            id = ffi.C.wflua_object_data_take_released()
+        end
+    end,
 
-    --- Store some data.
-    --
-    -- Delete some stored data by setting it to `nil`.
+    --- Get the data table of an object.
     -- @local
-    set = function(self, object_ptr, key, value, opts)
-        local lifetime_cleanup = true
-        if opts ~= nil and type(opts) == 'table' then
-            if opts.lifetime_cleanup == false then
-                lifetime_cleanup = false
+    data_of = function(self, object_ptr, create)
+        if ffi.istype(output_layout_ptr, object_ptr) then
+            local object = object_id(object_ptr)
+            local data = self.plain[object]
+            if not data and create then
+                data = {}
+                self.plain[object] = data
             end
+            return data
         end
 
-        local object = object_id(object_ptr)
-        if not self.data[object] then
-            if value == nil then return end
+        -- Wrappers may outlive their object. Only objects known to hold an
+        -- id are looked into.
+        if ffi.C.wflua_object_data_exists(object_ptr) then
+            return self.tables[ffi.C.wflua_object_data_get(object_ptr)]
+        end
+        if not create then return nil end
 
-            self.data[object] = {[key] = value}
-            if lifetime_cleanup then
-                Raw:subscribe_lifetime(object_ptr,
-                                       function()
-                    self.data[object] = nil
-                end)
-            end
-        else
-            self.data[object][key] = value
+        self:collect()
+        local id = table.remove(self.free_ids)
+        if not id then
+            id = self.next_id
+            self.next_id = id + 1
+        end
+        if not ffi.C.wflua_object_data_set(object_ptr, id) then
+            error('Failed to store object data.')
         end
+        local data = {}
+        self.tables[id] = data
+        return data
+    end,
+
+    --- Store some data.
+    --
+    -- Delete some stored data by setting it to `nil`.
+    -- @local
+    set = function(self, object_ptr, key, value)
+        local data = self:data_of(object_ptr, value ~= nil)
+        if data then data[key] = value end
     end,
 
     --- Retrieve some stored data.
     -- @local
     get = function(self, object_ptr, key)
-        return self.data[object_id(object_ptr)][key]
+        local data = self:data_of(object_ptr, false)
+        return data and data[key]
     end
 }
 
+-- Unhook a handler when its module is reloaded. Skipped if it was unhooked in
+-- the meantime or the object died.
+local function track_hook(object, signal, handler)
+    Modules.track(function()
+        if ObjectData:get(object, handler) then
+            object:unhook(signal, handler)
+        end
+    end)
+end
+
 do
     -- We don't need to actually call wayfire's get_core everytime since it should
     -- never change.
@@ -417,6 +1136,11 @@ do
     function M.get_core() return core end
 end
 
+-- Snapshot storage reused across calls to Core:snapshot_views(). It is only
+-- ever grown.
+local view_snapshots = {capacity = 64}
+view_snapshots.buf = ffi.new('wf_ViewSnapshot[?]', view_snapshots.capacity)
+
 ---The Wayfire compositor instance.
 -- @usage local core = wf.get_core()
 -- -- move the cursor to (100, 100)
@@ -492,6 +1216,33 @@ ffi.metatype("wf_Core", {
             return ffi.C.wf_Core_get_view_at(self, point)
         end,
 
+        --- Take a snapshot of every view in a single call.
+        --
+        -- Returns a zero-indexed array of `ViewSnapshot`s along with the number
+        -- of views in it. The array is reused by every call so the snapshots
+        -- are only valid until the next call.
+        --
+        -- @usage local snapshots, count = wf.get_core():snapshot_views()
+        -- for i = 0, count - 1 do
+        --     local snap = snapshots[i]
+        --     print(snap.view, snap:get_app_id(), snap.wm_geometry)
+        -- end
+        -- @tparam Core self the wayfire instance.
+        -- @treturn {ViewSnapshot,...} the snapshots (zero-indexed).
+        -- @treturn number the number of snapshots.
+        snapshot_views = function(self)
+            local count = ffi.C.wf_Core_snapshot_views(self, view_snapshots.buf,
+                                                       view_snapshots.capacity)
+            if count > view_snapshots.capacity then
+                view_snapshots.capacity = count * 2
+                view_snapshots.buf = ffi.new('wf_ViewSnapshot[?]',
+                                             view_snapshots.capacity)
+                count = ffi.C.wf_Core_snapshot_views(self, view_snapshots.buf,
+                                                     view_snapshots.capacity)
+            end
+            return view_snapshots.buf, count
+        end,
+
         --- Give a view keyboard focus.
         --
         -- @tparam Core self the wayfire instance.
@@ -562,6 +1313,8 @@ ffi.metatype("wf_Core", {
         -- others in order to make the process properly aware of the Wayfire
         -- session.
         --
+        -- Use `wf.spawn` to get the output or exit status of the process.
+        --
         -- @tparam Core self the wayfire instance.
         -- @tparam string command the command to run.
         -- @treturn int the PID of the process.
@@ -587,6 +1340,12 @@ ffi.metatype("wf_Core", {
         -- The type of `data` depends on the signal being listened for.
         -- See (TODO: signal definitions page).
         --
+        -- If `opts.coalesce` is set, emissions are queued and `handler` is
+        -- called at most once per event loop iteration, with `nil` data.
+        --
+        -- If `opts.filter` is set, `handler` is only called for emissions
+        -- whose data matches it. See `wf.outputs:hook`.
+        --
         -- @usage wf.get_core():hook('reload-config', function(core, data)
         --     print('The wayfire config has been reloaded!')
         -- end)
@@ -614,15 +1373,17 @@ ffi.metatype("wf_Core", {
         -- @tparam Core self
         -- @tparam string signal
         -- @tparam fn(core,data) handler
+        -- @tparam ?{coalesce:bool,filter:table} opts Optional options table.
         -- @treturn fn(core,data) handler
-        hook = function(self, signal, handler)
+        hook = function(self, signal, handler, opts)
             local raw_handler = function(_emitter, data)
                 data = Raw:convert_signal_data('core', signal, data)
                 handler(self, data)
             end
 
+            Raw:subscribe(self, signal, raw_handler, opts, 'core')
             ObjectData:set(self, handler, raw_handler)
-            Raw:subscribe(self, signal, raw_handler)
+            track_hook(self, signal, handler)
             return handler
         end,
 
@@ -705,6 +1466,24 @@ ffi.metatype("wf_OutputLayout", {
             return ffi.C.wf_OutputLayout_get_num_outputs(self)
         end,
 
+        --- Get all the current outputs.
+        --
+        -- @usage for _, output in ipairs(output_layout:get_outputs()) do
+        --     print("Output:", output)
+        -- end
+        -- @tparam OutputLayout self the output layout object.
+        -- @treturn {Output,...} the outputs.
+        get_outputs = function(self)
+            local max = ffi.C.wf_OutputLayout_get_num_outputs(self)
+            local buf = ffi.new('wf_Output *[?]', max)
+            local count = math.min(max, ffi.C.wf_OutputLayout_get_outputs(self,
+                                                                       buf, max))
+
+            local outputs = {}
+            for i = 0, count - 1 do outputs[i + 1] = buf[i] end
+            return outputs
+        end,
+
         --- Iterate through the current outputs.
         -- 
         -- Start by calling this function with `nil` as parameter and then
@@ -743,6 +1522,12 @@ ffi.metatype("wf_OutputLayout", {
         -- The type of `data` depends on the signal being listened for.
         -- See (TODO: signal definitions page).
         --
+        -- If `opts.coalesce` is set, emissions are queued and `handler` is
+        -- called at most once per event loop iteration, with `nil` data.
+        --
+        -- If `opts.filter` is set, `handler` is only called for emissions
+        -- whose data matches it. See `wf.outputs:hook`.
+        --
         -- @usage local layout = wf.get_core():get_output_layout()
         -- layout:hook('output-added', function(layout, data)
         --     print('An output has been added:', data.output)
@@ -753,16 +1538,21 @@ ffi.metatype("wf_OutputLayout", {
         -- @tparam OutputLayout self
         -- @tparam string signal
         -- @tparam fn(layout,data) handler
+        -- @tparam ?{coalesce:bool,filter:table} opts Optional options table.
         -- @treturn fn(layout,data) handler
-        hook = function(self, signal, handler)
+        hook = function(self, signal, handler, opts)
             local raw_handler = function(_emitter, data)
                 data = Raw:convert_signal_data('output-layout', signal, data)
                 handler(self, data)
             end
 
-            ObjectData:set(self, handler, raw_handler,
-                           {lifetime_cleanup = false})
-            Raw:subscribe(self, signal, raw_handler, {lifetime_cleanup = false})
+            Raw:subscribe(self, signal, raw_handler, {
+                lifetime_cleanup = false,
+                coalesce = opts ~= nil and opts.coalesce,
+                filter = opts ~= nil and opts.filter
+            }, 'output-layout')
+            ObjectData:set(self, handler, raw_handler)
+            track_hook(self, signal, handler)
             return handler
         end,
 
@@ -913,6 +1703,12 @@ ffi.metatype("wf_Output", {
         -- The type of `data` depends on the signal being listened for.
         -- See (TODO: signal definitions page).
         --
+        -- If `opts.coalesce` is set, emissions are queued and `handler` is
+        -- called at most once per event loop iteration, with `nil` data.
+        --
+        -- If `opts.filter` is set, `handler` is only called for emissions
+        -- whose data matches it. See `wf.outputs:hook`.
+        --
         -- @usage output:hook('view-mapped', function(output, data)
         --     print('View ', data.view:get_title(), ' mapped!')
         -- end)
@@ -921,15 +1717,17 @@ ffi.metatype("wf_Output", {
         -- @tparam Output self
         -- @tparam string signal
         -- @tparam fn(output,data) handler
+        -- @tparam ?{coalesce:bool,filter:table} opts Optional options table.
         -- @treturn fn(output,data) handler
-        hook = function(self, signal, handler)
+        hook = function(self, signal, handler, opts)
             local raw_handler = function(_emitter, data)
                 data = Raw:convert_signal_data('output', signal, data)
                 handler(self, data)
             end
 
+            Raw:subscribe(self, signal, raw_handler, opts, 'output')
             ObjectData:set(self, handler, raw_handler)
-            Raw:subscribe(self, signal, raw_handler)
+            track_hook(self, signal, handler)
             return handler
         end,
 
@@ -959,6 +1757,29 @@ ffi.metatype("wf_Output", {
     }
 })
 
+-- Lua copies of view titles and app ids by view address, each next to the
+-- serial it was made from so that it is only replaced once the property
+-- changes. Weak so that the copies of dead views go away, live views make
+-- theirs again after a collection.
+local view_strings = setmetatable({}, {__mode = 'v'})
+-- Slots of the serial of a property in the copies of a view, its copy follows.
+local VIEW_TITLE, VIEW_APP_ID = 1, 3
+
+local function view_string(view, slot, str, serial)
+    local key = tonumber(ffi.cast('uintptr_t', view))
+    local copies = view_strings[key]
+    if not copies then
+        copies = {}
+        view_strings[key] = copies
+    elseif copies[slot] == serial then
+        return copies[slot + 1]
+    end
+
+    local copy = ffi.string(str.data, str.len)
+    copies[slot], copies[slot + 1] = serial, copy
+    return copy
+end
+
 ---A wayfire view.
 -- @usage
 -- -- If view is foot, then set its geometry and hook into the 'title-changed'
@@ -978,17 +1799,27 @@ ffi.metatype("wf_View", {
     end,
     __index = {
         --- Get the view's title.
+        --
+        -- Read from a cache kept on the view which is only refreshed when the
+        -- title changes.
         -- @tparam View self the view.
         -- @treturn string the view's title.
         get_title = function(self)
-            return ffi.string(ffi.C.wf_View_get_title(self))
+            local props = ffi.C.wf_View_get_properties(self)
+            return view_string(self, VIEW_TITLE, props.title,
+                               props.title_serial)
         end,
 
         --- Get the view's app id.
+        --
+        -- Read from a cache kept on the view which is only refreshed when the
+        -- app id changes.
         -- @tparam View self the view.
         -- @treturn string the view's app id.
         get_app_id = function(self)
-            return ffi.string(ffi.C.wf_View_get_app_id(self))
+            local props = ffi.C.wf_View_get_properties(self)
+            return view_string(self, VIEW_APP_ID, props.app_id,
+                               props.app_id_serial)
         end,
 
         --- Get the view's wm geometry.
@@ -1031,6 +1862,12 @@ ffi.metatype("wf_View", {
         -- The type of `data` depends on the signal being listened for.
         -- See (TODO: signal definitions page).
         --
+        -- If `opts.coalesce` is set, emissions are queued and `handler` is
+        -- called at most once per event loop iteration, with `nil` data.
+        --
+        -- If `opts.filter` is set, `handler` is only called for emissions
+        -- whose data matches it. See `wf.outputs:hook`.
+        --
         -- @usage view:hook('title-changed', function(view, data)
         --     print('View title changed! New title:', data.view:get_title())
         --     assert(view == data.view)
@@ -1040,15 +1877,17 @@ ffi.metatype("wf_View", {
         -- @tparam View self
         -- @tparam string signal
         -- @tparam fn(view,data) handler
+        -- @tparam ?{coalesce:bool,filter:table} opts Optional options table.
         -- @treturn fn(view,data) handler
-        hook = function(self, signal, handler)
+        hook = function(self, signal, handler, opts)
             local raw_handler = function(_emitter, data)
                 data = Raw:convert_signal_data('view', signal, data)
                 handler(self, data)
             end
 
+            Raw:subscribe(self, signal, raw_handler, opts, 'view')
             ObjectData:set(self, handler, raw_handler)
-            Raw:subscribe(self, signal, raw_handler)
+            track_hook(self, signal, handler)
             return handler
         end,
 
@@ -1076,6 +1915,39 @@ ffi.metatype("wf_View", {
     }
 })
 
+---A plain copy of a view's state.
+--
+-- Returned by `Core:snapshot_views`. Only valid until the next snapshot is
+-- taken or the view changes.
+-- @field view the `View`.
+-- @field output the `Output` the view is on.
+-- @field wm_geometry the view's wm `Geometry`.
+-- @field mapped whether the view is mapped.
+-- @type ViewSnapshot
+ffi.metatype("wf_ViewSnapshot", {
+    __tostring = function(self)
+        return string.format("ViewSnapshot{ %s, %s }", self:get_app_id(),
+                             tostring(self.wm_geometry))
+    end,
+    __index = {
+        --- Get the view's title.
+        -- @tparam ViewSnapshot self the snapshot.
+        -- @treturn string the view's title.
+        get_title = function(self)
+            return view_string(self.view, VIEW_TITLE, self.title,
+                               self.title_serial)
+        end,
+
+        --- Get the view's app id.
+        -- @tparam ViewSnapshot self the snapshot.
+        -- @treturn string the view's app id.
+        get_app_id = function(self)
+            return view_string(self.view, VIEW_APP_ID, self.app_id,
+                               self.app_id_serial)
+        end
+    }
+})
+
 -- Outputs represented as a single outputs table since there is only only
 -- central wflua instance per wayfire session.
 local init_outputs = function()
@@ -1086,13 +1958,9 @@ local init_outputs = function()
     do
         local _raw_outputs = {}
 
-        local first = output_layout:get_next_output(nil)
-        local output = first
-        repeat
+        for _, output in ipairs(output_layout:get_outputs()) do
             _raw_outputs[object_id(output)] = output
-
-            local output = output_layout:get_next_output(output)
-        until output == first
+        end
 
         outputs._raw_outputs = _raw_outputs
     end
@@ -1103,7 +1971,7 @@ local init_outputs = function()
             if outputs._raw_outputs[object_id(data.output)] == nil then
                 outputs._raw_outputs[object_id(data.output)] = data.output
                 for _, sig in pairs(outputs._hooked_signals) do
-                    data.output:hook(sig.signal, sig.handler)
+                    data.output:hook(sig.signal, sig.handler, sig.opts)
                 end
             end
         end)
@@ -1125,26 +1993,48 @@ local init_outputs = function()
     -- `output` as we are hooking into this signal for *all* outputs
     -- simultaneously.
     --
+    -- If `opts.coalesce` is set, emissions are queued and `handler` is called
+    -- at most once per event loop iteration per output, with `nil` data.
+    --
+    -- If `opts.filter` is set, `handler` is only called for emissions whose
+    -- data matches it. Filters are checked before entering lua so unmatched
+    -- emissions cost next to nothing. Signals with a view in their data can be
+    -- filtered by the view's `app_id`, `title` and `output` name. Signals with
+    -- an output can be filtered by its `output` name. Values are either a
+    -- string compared as is or `{glob = pattern}` matching shell wildcards.
+    -- All given fields must match.
+    --
     -- @usage 
     -- local wf = require 'wf'
     --
     -- wf.outputs:hook('view-focused', function(output, data)
     --     print('View ', data.view, ' focused on output ', output)
     -- end)
+    -- @usage
+    -- wf.outputs:hook('view-mapped', function(output, data)
+    --     print('A terminal was mapped: ', data.view:get_title())
+    -- end, {filter = {app_id = 'foot', title = {glob = '*vim*'}}})
     -- @usage assert(handler == wf.outputs:hook('view-focused', handler))
     --
     -- @tparam string signal
     -- @tparam fn(output,data) handler
+    -- @tparam ?{coalesce:bool,filter:table} opts Optional options table.
     -- @treturn fn(output,data) handler
     -- @within Functions
-    function outputs:hook(signal, handler)
-        self._hooked_signals[signal .. tostring(handler)] = {
+    function outputs:hook(signal, handler, opts)
+        local key = signal .. tostring(handler)
+        self._hooked_signals[key] = {
             signal = signal,
-            handler = handler
+            handler = handler,
+            opts = opts
         }
         for _, output in pairs(self._raw_outputs) do
-            output:hook(signal, handler)
+            output:hook(signal, handler, opts)
         end
+
+        Modules.track(function()
+            if self._hooked_signals[key] then self:unhook(signal, handler) end
+        end)
         return handler
     end
 
@@ -1180,8 +2070,18 @@ init_outputs()
 local reset_state = function()
     Raw:reset_signals()
     Raw:reset_lifetimes()
+    -- The plugin drops the native timers and orphans the processes when
+    -- reloading.
+    Raw.timers = {}
+    Raw.processes = {}
+    -- The plugin drops the ids stored on objects.
+    ObjectData.tables = {}
+    ObjectData.free_ids = {}
+    ObjectData.next_id = 1
+    ObjectData.plain = {}
     init_outputs()
     ipc.__reset_state()
+    Modules.reset()
 end
 
 --- Reload the lua init file.
@@ -1195,4 +2095,36 @@ function M.reload_init()
     ffi.C.wflua_reload_init()
 end
 
+--- Reload modules as their files change.
+--
+-- Every module loaded with `require` (outside of the wf runtime) is watched.
+-- When a module's file changes, the mappings, hooks, timers and ipc commands
+-- it registered are dropped and the module is run again. This includes what
+-- was registered later by the callbacks the module registered, such as a hook
+-- mapping keys whenever a view is mapped.
+-- Everything else is left alone: other modules keep their registrations and
+-- ipc clients stay connected.
+--
+-- Changing the init file itself reloads everything like `wf.reload_init`.
+--
+-- Note that other modules holding on to values returned by a reloaded module
+-- keep seeing the old ones.
+--
+-- @usage
+-- -- In init.lua:
+-- wf.watch_modules()
+-- require 'keybinds' -- Reloaded whenever keybinds.lua is saved.
+-- @within Functions
+function M.watch_modules() Modules.watch() end
+
+-- Called by the plugin when a watched file changes. `name` is nil for the init
+-- file.
+wf__reload_module = function(name)
+    if name == nil then
+        M.reload_init()
+    else
+        Modules.reload(name)
+    end
+end
+
 return M
@@ -7,8 +7,11 @@
 --
 local ffi = require 'ffi'
 local util = require 'wf.util'
+local Modules = require 'wf.modules'
 
 local commands = {}
+-- { job handle: Promise }
+local worker_jobs = {}
 
 wf__ipc_command_callback = function(id, command_name, args)
     local cmd = commands[command_name]
@@ -135,7 +138,7 @@ wf__ipc_command_callback = function(id, command_name, args)
         end
     }
 
-    cb(promise, args)
+    Modules.call(wf__profiled_call, cb, promise, args)
 
     if promise.pending or promise.notifying == true then
         promise.end_notifications = function(self)
@@ -179,17 +182,60 @@ wf__ipc_command_callback = function(id, command_name, args)
 
         return 0, nil, nil, function()
             promise.pending = false
+            if promise.notifying then promise.notifying = false end
             promise.cancel_hook:call()
         end
     elseif promise.notifying ~= nil then
         assert(promise.pending == false)
         assert(type(result) == 'table')
-        return 2, result, nil, function() promise.cancel_hook:call() end
+        return 2, result, nil, function()
+            promise.notifying = false
+            promise.cancel_hook:call()
+        end
     else
         return 1, result, error_code, nil
     end
 end
 
+-- Wrap the handler of a worker command into a regular command handler.
+local function worker_handler(name, fn)
+    if debug.getupvalue(fn, 1) ~= nil then
+        error('The handler of worker command `' .. name ..
+                  '` must not have upvalues.', 3)
+    end
+
+    local code = string.dump(fn)
+    local id = ffi.C.wflua_worker_load(code, #code)
+    if id == 0 then
+        -- Workers are disabled: run on the compositor thread instead.
+        return function(promise, args)
+            local ok, result = pcall(fn, args)
+            if ok then
+                promise:resolve(result or '')
+            else
+                promise:reject(result)
+            end
+        end
+    end
+
+    return function(promise, args)
+        local arr = ffi.new('wf_String[?]', #args)
+        for i, arg in ipairs(args) do
+            arr[i - 1].data = arg
+            arr[i - 1].len = #arg
+        end
+
+        local job = ffi.C.wflua_worker_run(id, arr, #args)
+        if job == 0 then
+            promise:reject('Failed to queue the command on a worker.')
+            return
+        end
+
+        worker_jobs[job] = promise
+        promise:hook_cancel(function() worker_jobs[job] = nil end)
+    end
+end
+
 ---Functions
 -- @section Functions
 
@@ -286,6 +332,34 @@ local M = {}
 --         end)
 --     end
 -- }
+-- @usage
+-- -- An example "worker" command. Its handler runs on a lua state of its own
+-- -- on another thread and can't block the compositor.
+-- -- Can be run with 'wf-msg sum 1 2 3'.
+--
+-- local wf_ipc = require('wf.ipc')
+--
+-- wf_ipc.def_cmd {
+--     'sum', [[
+-- Add up numbers.
+--
+-- USAGE:
+--     sum <NUMBER>...
+-- ]], function(args)
+--         local total = 0
+--         for _, n in ipairs(args) do total = total + tonumber(n) end
+--         return total
+--     end,
+--     worker = true
+-- }
+--
+-- With `worker = true` the handler is given only the array of command
+-- arguments and resolves the command with the string or number it returns.
+-- Errors it raises reject the command. It runs on a separate lua state so it
+-- has no access to `wf`, to the globals of the init file nor to upvalues.
+-- Modules it needs must be required from within it. Without workers, enabled
+-- with the `ipc_workers` option, it runs on the compositor thread.
+--
 -- @tparam {string,string,fn(promise,args)} args The definition of the command.
 function M.def_cmd(args)
     if type(args) ~= 'table' or #args ~= 3 then
@@ -314,16 +388,58 @@ The second argument to def_cmd needs to contain the following in this order:
 - Any amount of trailing text to be included as additional documentation.]], 2)
     end
 
-    commands[args[1]] = {
+    local name = args[1]
+    local handler = args[3]
+    if args.worker then handler = worker_handler(name, handler) end
+
+    local cmd = {
         summary = summary,
         usage = usage,
         description = desc,
-        handler = args[3]
+        handler = Modules.adopt(handler)
     }
+    commands[name] = cmd
+
+    Modules.track(function()
+        if commands[name] == cmd then commands[name] = nil end
+    end)
+end
+
+--- Publish a message to an IPC topic.
+--
+-- The message is sent to every client subscribed to the topic with the
+-- builtin `subscribe` command. Publishing to a topic nobody is subscribed to
+-- costs next to nothing.
+--
+-- @usage
+-- -- Can be watched with 'wf-msg subscribe focus'.
+-- wf.outputs:hook('view-focused', function(output, data)
+--     if data.view ~= nil then
+--         wf_ipc.publish('focus', data.view:get_title())
+--     end
+-- end)
+-- @tparam string topic
+-- @tparam string msg
+function M.publish(topic, msg)
+    ffi.C.wflua_ipc_publish(topic, tostring(msg))
+end
+
+function M.__worker_result(job, ok, result)
+    local promise = worker_jobs[job]
+    -- The client may have dropped the connection meanwhile.
+    if not promise then return end
+    worker_jobs[job] = nil
+
+    if ok then
+        promise:resolve(result)
+    else
+        promise:reject(result)
+    end
 end
 
 function M.__reset_state()
     commands = {}
+    worker_jobs = {}
 end
 
 return M
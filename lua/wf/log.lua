@@ -11,8 +11,14 @@ local function log(lvl, ...)
     ffi.C.wflua_log(lvl, table.concat(to_strings({...}), ' '))
 end
 
+-- Checked by callers on hot paths to avoid building messages for nothing.
+Log.debug_enabled = ffi.C.wflua_log_enabled(ffi.C.WFLUA_LOGLVL_DEBUG)
+
 function Log.err(...) return log(ffi.C.WFLUA_LOGLVL_ERR,  ...) end
 function Log.warn(...) return log(ffi.C.WFLUA_LOGLVL_WARN, ...) end
-function Log.debug(...) return log(ffi.C.WFLUA_LOGLVL_DEBUG, ...) end
+function Log.debug(...)
+    if not Log.debug_enabled then return end
+    return log(ffi.C.WFLUA_LOGLVL_DEBUG, ...)
+end
 
 return Log
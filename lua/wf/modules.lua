@@ -0,0 +1,134 @@
+-- Ownership of what user modules register, for reloading a single module.
+--
+-- Modules loaded with `require` run in their own scope. Mappings, hooks, timers
+-- and ipc commands registered meanwhile are owned by the module and undone
+-- before it is reloaded. The callbacks a module registers run in its scope
+-- too, so whatever they register later is owned by the module as well. The wf
+-- runtime itself is never reloaded.
+local ffi = require 'ffi'
+local Log = require 'wf.log'
+
+local Modules = {
+    -- Name of the module being run, either loaded or through one of its
+    -- callbacks. nil outside of modules.
+    current = nil,
+    -- { module: {undo functions in registration order} }
+    owned = {},
+    -- { callback: module } for the callbacks registered by modules. Weak so
+    -- that callbacks are not kept alive.
+    owners = setmetatable({}, {__mode = 'k'}),
+    -- { module: path }
+    paths = {},
+    watching = false
+}
+
+--- Record how to undo something registered by the module being run.
+function Modules.track(undo)
+    local owner = Modules.current
+    if not owner then return end
+    -- Nothing is owned by a module that failed to reload.
+    local owned = Modules.owned[owner]
+    if owned then table.insert(owned, undo) end
+end
+
+--- Make a callback registered by the module being run part of the module.
+-- Returns the callback.
+function Modules.adopt(callback)
+    local owner = Modules.current
+    if owner and type(callback) == 'function' and
+        not Modules.owners[callback] then
+        Modules.owners[callback] = owner
+    end
+    return callback
+end
+
+local function leave(outer, ok, ...)
+    Modules.current = outer
+    if not ok then error((...), 0) end
+    return ...
+end
+
+--- Make `caller(callback, ...)` in the scope of the module owning `callback`,
+-- or outside of modules if it has none.
+function Modules.call(caller, callback, ...)
+    local owner = Modules.owners[callback]
+    if owner == Modules.current then return caller(callback, ...) end
+
+    local outer = Modules.current
+    Modules.current = owner
+    return leave(outer, pcall(caller, callback, ...))
+end
+
+local function undo_all(name)
+    local owned = Modules.owned[name]
+    if not owned then return end
+    Modules.owned[name] = nil
+
+    for i = #owned, 1, -1 do
+        local ok, err = pcall(owned[i])
+        if not ok then
+            Log.err('Failed to unregister from', name, ':\n', err)
+        end
+    end
+end
+
+local function is_runtime(name) return name == 'wf' or name:match('^wf%.') end
+
+-- Wrap the lua file searcher so that modules run in their own scope.
+local search_file = package.loaders[2]
+package.loaders[2] = function(name)
+    local chunk = search_file(name)
+    if type(chunk) ~= 'function' or is_runtime(name) then return chunk end
+
+    local path = package.searchpath(name, package.path)
+    Modules.paths[name] = path
+    if Modules.watching then ffi.C.wflua_watch_module(name, path) end
+
+    return function(...)
+        local outer = Modules.current
+        Modules.current = name
+        Modules.owned[name] = {}
+
+        local ok, ret = pcall(chunk, ...)
+        Modules.current = outer
+        if not ok then
+            undo_all(name)
+            error(ret, 0)
+        end
+        return ret
+    end
+end
+
+--- Start reloading modules when their file changes.
+function Modules.watch()
+    if Modules.watching then return end
+    Modules.watching = true
+
+    ffi.C.wflua_watch_modules()
+    for name, path in pairs(Modules.paths) do
+        ffi.C.wflua_watch_module(name, path)
+    end
+end
+
+--- Undo what a module registered and run it again.
+function Modules.reload(name)
+    if not Modules.paths[name] then return end
+
+    undo_all(name)
+    package.loaded[name] = nil
+
+    local ok, err = pcall(require, name)
+    if not ok then Log.err('Failed to reload module', name, ':\n', err) end
+end
+
+--- Forget every module so that they run again with the init file.
+-- Their registrations are dropped wholesale by the full reload.
+function Modules.reset()
+    for name, _ in pairs(Modules.paths) do package.loaded[name] = nil end
+    Modules.current = nil
+    Modules.owned = {}
+    Modules.owners = setmetatable({}, {__mode = 'k'})
+    Modules.paths = {}
+end
+
+return Modules
@@ -27,6 +27,7 @@ function M.Hook(handlers)
     return {
         _hooked = _hooked,
         is_empty = function(self) return not next(self._hooked) end,
+        has = function(self, cb) return self._hooked[cb] == true end,
         hook = function(self, cb)
             self._hooked[cb] = true
             return cb
@@ -34,6 +35,10 @@ function M.Hook(handlers)
         unhook = function(self, cb) self._hooked[cb] = nil end,
         call = function(self, ...)
             for h, _ in pairs(self._hooked) do h(...) end
+        end,
+        -- Call every handler as `caller(handler, ...)`.
+        call_with = function(self, caller, ...)
+            for h, _ in pairs(self._hooked) do caller(h, ...) end
         end
     }
 end
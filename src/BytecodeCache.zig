@@ -0,0 +1,251 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Lua = @import("Lua.zig");
+const getPluginBytecodeCache =
+    @import("Plugin.zig").getPluginBytecodeCache;
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Lua files are loaded from LuaJIT bytecode when possible. For a `foo.lua`
+/// file, this is either a precompiled `foo.ljbc` next to it (as installed for
+/// the wf runtime) or bytecode dumped to the user cache on a previous load.
+/// Anything failing to load falls back to the source.
+const bytecode_ext = ".ljbc";
+
+allocator: *Allocator,
+
+/// Where bytecode dumped from source files is written. Entries are keyed by
+/// path, mtime, size and LuaJIT version so stale entries are never loaded.
+/// Null when no cache directory could be found.
+cache_dir: ?[]const u8,
+
+/// Load a lua file and push its chunk. Used in place of the stock lua file
+/// searcher of `require`.
+///
+/// Returns the chunk or nil and an error message.
+fn loadFileLua(L: ?*c.lua_State) callconv(.C) c_int {
+    const self = getPluginBytecodeCache();
+
+    self.loadFile(L.?, Lua.tostring(L.?, 1)) catch {
+        c.lua_pushnil(L);
+        c.lua_insert(L, -2);
+        return 2;
+    };
+    return 1;
+}
+
+/// Find the bytecode cache directory using the following precedence:
+/// $XDG_CACHE_HOME/wf-lua
+/// > $HOME/.cache/wf-lua
+fn getCacheDir(allocator: *Allocator) !?[]const u8 {
+    const path = std.fs.path;
+
+    if (std.os.getenv("XDG_CACHE_HOME")) |dir| {
+        return try path.join(allocator, &[_][]const u8{ dir, "wf-lua" });
+    } else if (std.os.getenv("HOME")) |dir| {
+        return try path.join(allocator, &[_][]const u8{
+            dir,
+            ".cache/wf-lua",
+        });
+    }
+    return null;
+}
+
+fn statFile(path: []const u8) !std.fs.File.Stat {
+    const file = try std.fs.cwd().openFile(path, .{});
+    defer file.close();
+    return file.stat();
+}
+
+/// Load bytecode, leaving the stack untouched on failure.
+fn tryLoadBytecode(L: *c.lua_State, path: [:0]const u8) bool {
+    if (c.luaL_loadfile(L, path) == 0)
+        return true;
+
+    std.log.warn("Ignoring bytecode: {s}", .{Lua.tostring(L, -1)});
+    c.lua_pop(L, 1);
+    return false;
+}
+
+/// Load the precompiled bytecode next to a source file if it is up to date.
+fn loadPrecompiled(
+    L: *c.lua_State,
+    file: []const u8,
+    source: std.fs.File.Stat,
+) bool {
+    if (!std.mem.endsWith(u8, file, ".lua"))
+        return false;
+
+    var buf: [std.fs.MAX_PATH_BYTES]u8 = undefined;
+    const bytecode_path = std.fmt.bufPrintZ(
+        &buf,
+        "{s}" ++ bytecode_ext,
+        .{file[0 .. file.len - ".lua".len]},
+    ) catch return false;
+
+    const bytecode = statFile(bytecode_path) catch return false;
+    if (bytecode.mtime < source.mtime)
+        return false;
+
+    return tryLoadBytecode(L, bytecode_path);
+}
+
+/// Get the path of the cache entry for a source file.
+fn cachePath(
+    self: *This,
+    buf: []u8,
+    file: []const u8,
+    source: std.fs.File.Stat,
+) ?[:0]const u8 {
+    const cache_dir = self.cache_dir orelse return null;
+
+    var real_buf: [std.fs.MAX_PATH_BYTES]u8 = undefined;
+    const real_path = std.os.realpath(file, &real_buf) catch return null;
+
+    var hasher = std.hash.Wyhash.init(0);
+    hasher.update(real_path);
+    hasher.update(std.mem.asBytes(&source.mtime));
+    hasher.update(std.mem.asBytes(&source.size));
+    hasher.update(c.LUAJIT_VERSION);
+
+    return std.fmt.bufPrintZ(
+        buf,
+        "{s}/{x:0>16}" ++ bytecode_ext,
+        .{ cache_dir, hasher.final() },
+    ) catch null;
+}
+
+fn dumpWriter(
+    L: ?*c.lua_State,
+    chunk: ?*const c_void,
+    size: usize,
+    data: ?*c_void,
+) callconv(.C) c_int {
+    if (size == 0)
+        return 0;
+
+    const bytes = @ptrCast(
+        *std.ArrayList(u8),
+        @alignCast(@alignOf(std.ArrayList(u8)), data),
+    );
+    const chunk_bytes = @ptrCast([*]const u8, chunk.?)[0..size];
+    bytes.appendSlice(chunk_bytes) catch return 1;
+    return 0;
+}
+
+/// Dump the function on top of the stack to a cache entry. The entry is
+/// written to a temporary file first so that it is never seen half-written.
+fn writeCache(self: *This, L: *c.lua_State, cache_path: []const u8) !void {
+    var bytes = std.ArrayList(u8).init(self.allocator);
+    defer bytes.deinit();
+
+    if (c.lua_dump(L, dumpWriter, @ptrCast(*c_void, &bytes)) != 0)
+        return error.DumpFailed;
+
+    var dir = try std.fs.cwd().makeOpenPath(self.cache_dir.?, .{});
+    defer dir.close();
+
+    var file = try dir.atomicFile(std.fs.path.basename(cache_path), .{});
+    defer file.deinit();
+    try file.file.writeAll(bytes.items);
+    try file.finish();
+}
+
+/// Load a lua file and push its chunk like `luaL_loadfile`. On failure, the
+/// error message is pushed instead.
+pub fn loadFile(
+    self: *This,
+    L: *c.lua_State,
+    file: [:0]const u8,
+) Lua.LuaError!void {
+    const source = statFile(file) catch {
+        // Let lua report the error.
+        if (c.luaL_loadfile(L, file) != 0)
+            return Lua.LuaError.LoadFileFailed;
+        return;
+    };
+
+    if (loadPrecompiled(L, file, source))
+        return;
+
+    var cache_buf: [std.fs.MAX_PATH_BYTES]u8 = undefined;
+    const cache_path = self.cachePath(&cache_buf, file, source);
+    if (cache_path) |path| {
+        if (std.os.access(path, std.os.F_OK)) |_| {
+            if (tryLoadBytecode(L, path))
+                return;
+        } else |_| {}
+    }
+
+    if (c.luaL_loadfile(L, file) != 0)
+        return Lua.LuaError.LoadFileFailed;
+
+    if (cache_path) |path| {
+        self.writeCache(L, path) catch |err| {
+            std.log.warn(
+                "Failed to cache bytecode for {s}: {any}",
+                .{ file, err },
+            );
+        };
+    }
+}
+
+/// Same as `Lua.doFile` but loading through the cache.
+pub fn doFile(
+    self: *This,
+    L: *c.lua_State,
+    file: [:0]const u8,
+) Lua.LuaError!void {
+    self.loadFile(L, file) catch |err| {
+        std.log.err(
+            "Failed to load file: {s}",
+            .{Lua.tostring(L, -1)},
+        );
+        c.lua_pop(L, 1);
+        return err;
+    };
+
+    if (c.lua_pcall(L, 0, c.LUA_MULTRET, 0) != 0) {
+        std.log.err(
+            "Failed to run file: {s}",
+            .{Lua.tostring(L, -1)},
+        );
+        c.lua_pop(L, 1);
+        return Lua.LuaError.RunFileFailed;
+    }
+}
+
+/// Set up the cache and make `require` load lua files through it. Must be
+/// called once `package.path` is set.
+pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) !void {
+    self.allocator = allocator;
+
+    self.cache_dir = try getCacheDir(allocator);
+    errdefer if (self.cache_dir) |dir| allocator.free(dir);
+    if (self.cache_dir == null)
+        std.log.warn("$HOME is unset. Lua bytecode won't be cached.", .{});
+
+    c.lua_pushcfunction(L, loadFileLua);
+    c.lua_setglobal(L, "wf__load_file");
+
+    // Replace the stock lua file searcher.
+    try Lua.doString(L,
+        \\package.loaders[2] = function(name)
+        \\    local path, err = package.searchpath(name, package.path)
+        \\    if not path then return err end
+        \\    local chunk, load_err = wf__load_file(path)
+        \\    if not chunk then
+        \\        error(("error loading module '%s' from file '%s':\n\t%s")
+        \\                  :format(name, path, load_err), 0)
+        \\    end
+        \\    return chunk
+        \\end
+    );
+}
+
+pub fn deinit(self: *This) void {
+    if (self.cache_dir) |dir|
+        self.allocator.free(dir);
+    self.cache_dir = null;
+}
@@ -2,6 +2,9 @@ const std = @import("std");
 const c = @import("c.zig");
 const ipc = @import("ipc.zig");
 const Lua = @import("Lua.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginIpcServer = Plugin.getPluginIpcServer;
+const getOptionInt = Plugin.getOptionInt;
 
 const io = std.io;
 const os = std.os;
@@ -21,30 +24,85 @@ L: *c.lua_State,
 /// The ipc command lua callback ref.
 command_callback_ref: Lua.Ref,
 
+/// Topics with at least one subscriber, by name.
+topics: std.StringHashMap(*Topic),
+
 fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
     return struct {
         const AsyncServer = @This();
 
+        /// Output shared by several clients, e.g. a message broadcast to all
+        /// of them.
+        pub const SharedBuf = struct {
+            refs: u32 = 1,
+            /// Queued buffers with the same key replace each other when
+            /// coalescing.
+            key: usize,
+            bytes: []u8,
+
+            pub fn create(
+                allocator: *Allocator,
+                key: usize,
+                bytes: []u8,
+            ) !*SharedBuf {
+                const buf = try allocator.create(SharedBuf);
+                buf.* = .{ .key = key, .bytes = bytes };
+                return buf;
+            }
+
+            pub fn unref(self: *SharedBuf, allocator: *Allocator) void {
+                self.refs -= 1;
+                if (self.refs == 0) {
+                    allocator.free(self.bytes);
+                    allocator.destroy(self);
+                }
+            }
+        };
+
         pub const ClientFrameState = struct {
             stream: net.Stream,
+            event_source: *c.wl_event_source,
+            /// Timer disconnecting the client once idle. Null when clients
+            /// never time out.
+            idle_source: ?*c.wl_event_source,
 
-            waiting_for: ?WaitingFor = null,
             suspended_frame: ?anyframe = null,
             stop_loop: bool = false,
             wl_event_mask: ?u32 = null,
             async_server: *AsyncServer,
-            inbox: ?union(enum) {
-                IpcCommandResolve: [*:0]const u8,
-                IpcCommandReject: struct {
-                    err: [*:0]const u8,
-                    error_code: c_int,
-                },
-                IpcCommandBeginNotifs: void,
-                IpcCommandEndNotifs: void,
-                IpcCommandNotify: [*:0]const u8,
-            } = null,
 
-            const WaitingFor = enum { read, write, ipc_command };
+            /// Output the socket did not accept yet. Flushed once it becomes
+            /// writable so that writing never suspends the client frame.
+            out_buf: std.ArrayList(u8),
+            /// Whether the event source also waits for the socket to become
+            /// writable.
+            wants_writable: bool = false,
+            /// Whether the event source waits for requests. Not while waiting
+            /// for output to drain, the socket would stay readable.
+            wants_readable: bool = true,
+            /// Set once writing failed. The client is gone so further output
+            /// is dropped.
+            write_failed: bool = false,
+
+            /// Shared output waiting for `out_buf` to drain. Bounded by
+            /// `Limits.max_queued_shared` so a client not reading can't hold
+            /// on to an unbounded amount of broadcasts.
+            shared_queue: std.ArrayListUnmanaged(*SharedBuf) = .{},
+            /// Bytes of the buffers in `shared_queue`. Counted with `out_buf`
+            /// against `Limits.max_queued_bytes`.
+            shared_bytes: usize = 0,
+            /// Whether what is written counts against
+            /// `Limits.max_queued_bytes`. Set while writing notifications the
+            /// client did not just ask for. Responses always queue, the client
+            /// is just not read from until they drain.
+            budgeted: bool = false,
+            /// Set while the frame waits for output to drain before reading
+            /// the next request.
+            waiting_drain: bool = false,
+
+            /// Requests the handler is still answering. A client is only
+            /// idle when this is 0.
+            pending_requests: u32 = 0,
 
             const ResumeError = error{
                 ClientFrameShuttingDown,
@@ -52,7 +110,7 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                 WlSocketHangup,
             };
             pub const ReadError = os.ReadError || ResumeError;
-            pub const WriteError = os.WriteError || ResumeError;
+            pub const WriteError = os.WriteError || Allocator.Error;
 
             pub const Reader = io.Reader(*@This(), ReadError, read);
             pub const Writer = io.Writer(*@This(), WriteError, write);
@@ -68,21 +126,30 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                         self.stream.handle,
                     ).?;
 
+                    // Last chance for the responses still buffered.
+                    self.flush();
+                    self.out_buf.deinit();
+                    self.dropShared();
+                    self.shared_queue.deinit(server.allocator);
+
                     self.stream.close();
                     _ = c.wl_event_source_remove(kv.value.event_source);
-                    // free the ClientFrame.
-                    server.allocator.destroy(kv.value.frame);
+                    if (self.idle_source) |idle_source|
+                        _ = c.wl_event_source_remove(idle_source);
+                    server.releaseFrame(kv.value.frame);
+
+                    std.log.debug(
+                        "Active ipc connections: {d}",
+                        .{server.active_clients.?.count()},
+                    );
                 }
             }
 
-            fn suspendFrame(self: *@This(), reason: WaitingFor) !void {
+            fn suspendFrame(self: *@This()) !void {
                 suspend {
-                    self.waiting_for = reason;
-                    self.inbox = null;
                     self.suspended_frame = @frame();
                     self.wl_event_mask = null;
                 }
-                self.waiting_for = null;
                 self.suspended_frame = null;
                 defer self.wl_event_mask = null;
 
@@ -98,12 +165,27 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
             }
 
             pub fn read(self: *@This(), buf: []u8) ReadError!usize {
+                // Take no more requests from a client not reading its
+                // responses.
+                while (!self.write_failed and self.overBudget()) {
+                    self.waiting_drain = true;
+                    self.updateEventMask();
+                    defer {
+                        self.waiting_drain = false;
+                        self.updateEventMask();
+                    }
+                    self.suspendFrame() catch |err| switch (err) {
+                        error.WlSocketHangup => return 0,
+                        else => |e| return e,
+                    };
+                }
+
+                self.resetIdleTimeout();
                 while (true) {
                     return self.stream.read(buf) catch |err| switch (err) {
                         error.WouldBlock => {
                             // Treat HUP as EOF.
-                            self.suspendFrame(.read) catch |err2|
-                                switch (err2) {
+                            self.suspendFrame() catch |err2| switch (err2) {
                                 error.WlSocketHangup => return 0,
                                 else => |e| return e,
                             };
@@ -114,16 +196,233 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                 }
             }
 
+            /// Queue output for the client. Never suspends: whatever the
+            /// socket doesn't take right away is buffered. A client letting
+            /// more than `Limits.max_queued_bytes` of budgeted output pile up
+            /// is disconnected.
             pub fn write(self: *@This(), buf: []const u8) WriteError!usize {
-                while (true) {
-                    return self.stream.write(buf) catch |err| switch (err) {
-                        error.WouldBlock => {
-                            try self.suspendFrame(.write);
-                            continue;
+                if (self.write_failed)
+                    return buf.len;
+
+                var written: usize = 0;
+                if (self.out_buf.items.len == 0) {
+                    written = self.stream.write(buf) catch |err| switch (err) {
+                        error.WouldBlock => 0,
+                        else => |e| {
+                            self.write_failed = true;
+                            return e;
                         },
-                        else => |e| return e,
                     };
                 }
+
+                if (written < buf.len) {
+                    const rest = buf[written..];
+                    const limit = self.async_server.limits.max_queued_bytes;
+
+                    // Broadcasts are the first to go, they may be dropped.
+                    while (self.budgeted and
+                        self.shared_queue.items.len > 0 and
+                        self.queuedBytes() + rest.len > limit)
+                        self.dropOldestShared();
+                    if (self.budgeted and
+                        self.queuedBytes() + rest.len > limit)
+                    {
+                        self.overflow();
+                        return buf.len;
+                    }
+
+                    try self.out_buf.appendSlice(rest);
+                    self.updateEventMask();
+                }
+                return buf.len;
+            }
+
+            /// Bytes waiting to be written to the client.
+            fn queuedBytes(self: *@This()) usize {
+                return self.out_buf.items.len + self.shared_bytes;
+            }
+
+            fn overBudget(self: *@This()) bool {
+                const limit = self.async_server.limits.max_queued_bytes;
+                return self.out_buf.items.len > limit;
+            }
+
+            /// Drop all output and hang up on a client not reading what it is
+            /// sent. Its frame sees the hangup and finishes on its own.
+            fn overflow(self: *@This()) void {
+                std.log.warn(
+                    "Disconnecting ipc client with over {d} bytes unread.",
+                    .{self.async_server.limits.max_queued_bytes},
+                );
+                self.async_server.stats.overflowed += 1;
+                self.write_failed = true;
+                self.out_buf.clearAndFree();
+                self.dropShared();
+                self.updateEventMask();
+                _ = os.linux.shutdown(self.stream.handle, os.SHUT_RDWR);
+            }
+
+            /// Write out as much of the buffered output as the socket takes.
+            fn flush(self: *@This()) void {
+                while (!self.write_failed and self.out_buf.items.len > 0) {
+                    const written = self.stream.write(
+                        self.out_buf.items,
+                    ) catch |err| switch (err) {
+                        error.WouldBlock => break,
+                        else => {
+                            std.log.err(
+                                "Failed to write to ipc client: {}",
+                                .{err},
+                            );
+                            self.write_failed = true;
+                            break;
+                        },
+                    };
+
+                    const rest = self.out_buf.items[written..];
+                    std.mem.copy(u8, self.out_buf.items, rest);
+                    self.out_buf.shrinkRetainingCapacity(rest.len);
+                }
+                if (self.write_failed) {
+                    self.out_buf.clearAndFree();
+                    self.dropShared();
+                }
+
+                self.writeShared();
+                self.updateEventMask();
+            }
+
+            /// Queue shared output for the client, taking a reference to it.
+            /// When the queue is full the oldest buffer is dropped. With
+            /// `coalesce`, a queued buffer with the same key is replaced
+            /// instead.
+            pub fn queueShared(
+                self: *@This(),
+                buf: *SharedBuf,
+                coalesce: bool,
+            ) void {
+                if (self.write_failed)
+                    return;
+
+                const server = self.async_server;
+                const queue = &self.shared_queue;
+                buf.refs += 1;
+
+                if (coalesce) {
+                    for (queue.items) |*queued| {
+                        if (queued.*.key == buf.key) {
+                            self.shared_bytes -= queued.*.bytes.len;
+                            self.shared_bytes += buf.bytes.len;
+                            queued.*.unref(server.allocator);
+                            queued.* = buf;
+                            server.stats.coalesced_shared += 1;
+                            return;
+                        }
+                    }
+                }
+
+                const limit = server.limits.max_queued_bytes;
+                if (self.out_buf.items.len + buf.bytes.len > limit) {
+                    buf.unref(server.allocator);
+                    server.stats.dropped_shared += 1;
+                    return;
+                }
+                while (queue.items.len > 0 and
+                    (queue.items.len >= server.limits.max_queued_shared or
+                    self.queuedBytes() + buf.bytes.len > limit))
+                    self.dropOldestShared();
+                queue.append(server.allocator, buf) catch {
+                    buf.unref(server.allocator);
+                    server.stats.dropped_shared += 1;
+                    return;
+                };
+                self.shared_bytes += buf.bytes.len;
+
+                self.writeShared();
+            }
+
+            fn dropOldestShared(self: *@This()) void {
+                const server = self.async_server;
+                const buf = self.shared_queue.orderedRemove(0);
+                self.shared_bytes -= buf.bytes.len;
+                buf.unref(server.allocator);
+                server.stats.dropped_shared += 1;
+            }
+
+            fn dropShared(self: *@This()) void {
+                for (self.shared_queue.items) |buf|
+                    buf.unref(self.async_server.allocator);
+                self.shared_queue.clearRetainingCapacity();
+                self.shared_bytes = 0;
+            }
+
+            /// Move queued shared output to the socket while nothing else is
+            /// waiting to be written.
+            fn writeShared(self: *@This()) void {
+                const allocator = self.async_server.allocator;
+                while (self.out_buf.items.len == 0 and
+                    self.shared_queue.items.len > 0)
+                {
+                    const buf = self.shared_queue.orderedRemove(0);
+                    defer buf.unref(allocator);
+                    self.shared_bytes -= buf.bytes.len;
+
+                    // Partially written buffers end up in out_buf.
+                    _ = self.write(buf.bytes) catch |err| {
+                        std.log.err(
+                            "Failed to write to ipc client: {}",
+                            .{err},
+                        );
+                    };
+                    if (self.write_failed)
+                        break;
+                }
+            }
+
+            fn resetIdleTimeout(self: *@This()) void {
+                const limits = self.async_server.limits;
+                if (self.idle_source) |idle_source| {
+                    _ = c.wl_event_source_timer_update(
+                        idle_source,
+                        @intCast(c_int, limits.idle_timeout_ms),
+                    );
+                }
+            }
+
+            fn idleTimeoutCB(data: ?*c_void) callconv(.C) c_int {
+                const self = @ptrCast(
+                    *@This(),
+                    @alignCast(@alignOf(@This()), data),
+                );
+
+                // Watchers can go quiet for a long time. That is not idle.
+                if (self.pending_requests > 0) {
+                    self.resetIdleTimeout();
+                    return 0;
+                }
+
+                std.log.debug("Closing idle ipc client.", .{});
+                self.async_server.stats.closed_idle += 1;
+                self.stop_loop = true;
+                self.resumeFrame();
+                return 0;
+            }
+
+            fn updateEventMask(self: *@This()) void {
+                const wants_writable = self.out_buf.items.len > 0;
+                const wants_readable = !self.waiting_drain;
+                if (wants_writable == self.wants_writable and
+                    wants_readable == self.wants_readable)
+                    return;
+                self.wants_writable = wants_writable;
+                self.wants_readable = wants_readable;
+
+                var mask: u32 = 0;
+                if (wants_readable)
+                    mask |= c.WL_EVENT_READABLE;
+                if (wants_writable)
+                    mask |= c.WL_EVENT_WRITABLE;
+                _ = c.wl_event_source_fd_update(self.event_source, mask);
             }
 
             pub fn reader(self: *@This()) Reader {
@@ -139,6 +438,42 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
             frame: @Frame(runClientHandler),
             state: ClientFrameState,
         };
+        /// Maximum number of frames kept in the pool.
+        const max_pooled_frames = 64;
+
+        pub const Limits = struct {
+            /// Pending connections the kernel queues up for us.
+            backlog: u31 = 128,
+            /// Connections beyond this many clients are refused. 0 means no
+            /// limit.
+            max_clients: u32 = 0,
+            /// Clients with nothing in flight are disconnected after this
+            /// long. 0 means never.
+            idle_timeout_ms: u32 = 0,
+            /// Shared buffers queued per client before dropping some.
+            max_queued_shared: u32 = 64,
+            /// Bytes of output queued per client. Shared buffers are dropped
+            /// to stay under it, and clients going over it with notifications
+            /// they did not just ask for are disconnected. Responses always
+            /// queue but no more requests are read while over it.
+            max_queued_bytes: usize = 1024 * 1024,
+        };
+
+        pub const Stats = struct {
+            accepted: u64 = 0,
+            refused: u64 = 0,
+            closed_idle: u64 = 0,
+            peak_clients: u32 = 0,
+            /// Frames allocated because the pool was empty.
+            frames_allocated: u64 = 0,
+            /// Shared buffers dropped or replaced by a newer one because a
+            /// client wasn't reading fast enough.
+            dropped_shared: u64 = 0,
+            coalesced_shared: u64 = 0,
+            /// Clients disconnected for leaving too much output unread.
+            overflowed: u64 = 0,
+        };
+
         const ActiveClientsMap = std.AutoHashMap(
             os.socket_t,
             struct {
@@ -158,6 +493,11 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
         active_clients: ?ActiveClientsMap = null,
         allocator: *Allocator,
 
+        /// Frames of closed connections kept around for the next ones.
+        frame_pool: std.ArrayList(*ClientFrame) = undefined,
+        limits: Limits = .{},
+        stats: Stats = .{},
+
         // NOTE: once initialized, this struct should no longer be copied/moved
         // around.
         pub fn init(
@@ -165,13 +505,19 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
             allocator: *Allocator,
             socket_path: []const u8,
             parent: *Parent,
+            limits: Limits,
         ) !void {
             self.allocator = allocator;
             self.parent = parent;
+            self.limits = limits;
+            self.stats = .{};
 
             self.active_clients = ActiveClientsMap.init(allocator);
             errdefer self.active_clients.?.deinit();
 
+            self.frame_pool = std.ArrayList(*ClientFrame).init(allocator);
+            errdefer self.frame_pool.deinit();
+
             const address = try net.Address.initUnix(socket_path);
             const sock_flags =
                 os.SOCK_STREAM | os.SOCK_CLOEXEC | os.SOCK_NONBLOCK;
@@ -193,7 +539,7 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                 },
                 else => return err,
             };
-            try os.listen(sock_fd, 5);
+            try os.listen(sock_fd, limits.backlog);
 
             // NOTE: a normal `async self.mainLoop();` call here crashes the
             // compiler :(. This is just a workaround.
@@ -214,6 +560,10 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
             if (self.active_clients) |*active_conns| {
                 self.stopClientFrames();
                 active_conns.deinit();
+
+                for (self.frame_pool.items) |frame|
+                    self.allocator.destroy(frame);
+                self.frame_pool.deinit();
             }
 
             if (self.is_loop_active) {
@@ -233,9 +583,42 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
             }
         }
 
-        pub fn reset(self: *@This()) void {
+        pub fn reset(self: *@This(), limits: Limits) void {
             if (self.active_clients != null)
                 self.stopClientFrames();
+
+            if (self.sock_fd) |sock_fd| {
+                // Listening again just updates the backlog.
+                if (limits.backlog != self.limits.backlog) {
+                    os.listen(sock_fd, limits.backlog) catch |err| {
+                        std.log.err("Failed to update backlog: {}", .{err});
+                    };
+                }
+            }
+            self.limits = limits;
+        }
+
+        fn acquireFrame(self: *@This()) !*ClientFrame {
+            if (self.frame_pool.popOrNull()) |frame|
+                return frame;
+
+            std.log.debug(
+                "Client frame size: {d}",
+                .{@sizeOf(ClientFrame)},
+            );
+            const frame = try self.allocator.create(ClientFrame);
+            self.stats.frames_allocated += 1;
+            return frame;
+        }
+
+        fn releaseFrame(self: *@This(), frame: *ClientFrame) void {
+            if (self.frame_pool.items.len < max_pooled_frames) {
+                self.frame_pool.append(frame) catch {
+                    self.allocator.destroy(frame);
+                };
+            } else {
+                self.allocator.destroy(frame);
+            }
         }
 
         fn stopClientFrames(self: *@This()) void {
@@ -279,22 +662,18 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                 @alignCast(@alignOf(ClientFrame), data),
             );
 
-            const need_resume = x: {
-                if (mask & (c.WL_EVENT_ERROR | c.WL_EVENT_HANGUP) != 0) {
-                    break :x true;
-                } else if (client_frame.state.waiting_for) |waiting_for| {
-                    if ((waiting_for == .read and
-                        mask & c.WL_EVENT_READABLE != 0) or
-                        (waiting_for == .write and
-                        mask & c.WL_EVENT_WRITABLE != 0))
-                    {
-                        break :x true;
-                    }
-                }
-                break :x false;
-            };
-
-            if (need_resume) {
+            const state = &client_frame.state;
+            if (mask & c.WL_EVENT_WRITABLE != 0)
+                state.flush();
+
+            // Frames only ever suspend waiting for requests, or for their
+            // responses to drain before reading more.
+            const drained = state.waiting_drain and
+                (state.write_failed or !state.overBudget());
+            if (drained or mask & (c.WL_EVENT_READABLE |
+                c.WL_EVENT_ERROR |
+                c.WL_EVENT_HANGUP) != 0)
+            {
                 client_frame.state.wl_event_mask = mask;
                 client_frame.state.resumeFrame();
             }
@@ -305,10 +684,7 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
         fn mainLoop(self: *@This()) void {
             self.is_loop_active = true;
             while (true) {
-                // TODO: only suspend on EWOULDBLOCK error. So we can handle all
-                // pending connections before waiting for more.
-
-                // Wait to be resumed on a new connection.
+                // Wait to be resumed on new connections.
                 suspend {
                     self.suspended_frame = @frame();
                 }
@@ -319,77 +695,113 @@ fn AsyncSocketServer(comptime Parent: type, comptime Handler: type) type {
                     return;
                 }
 
-                const conn_fd = os.accept(
-                    self.sock_fd.?,
-                    null,
-                    null,
-                    os.SOCK_NONBLOCK | os.SOCK_CLOEXEC,
-                ) catch |err| {
-                    std.log.err(
-                        "Failed to accept ipc client connection: {}",
-                        .{err},
-                    );
-                    continue;
-                };
-                const conn_stream = net.Stream{ .handle = conn_fd };
+                // Take in every pending connection before waiting again.
+                while (true) {
+                    const conn_fd = os.accept(
+                        self.sock_fd.?,
+                        null,
+                        null,
+                        os.SOCK_NONBLOCK | os.SOCK_CLOEXEC,
+                    ) catch |err| switch (err) {
+                        error.WouldBlock => break,
+                        else => {
+                            std.log.err(
+                                "Failed to accept ipc client connection: {}",
+                                .{err},
+                            );
+                            break;
+                        },
+                    };
+                    self.startClient(conn_fd);
+                }
+            }
+        }
 
-                std.log.debug(
-                    "Client frame size: {d}",
-                    .{@sizeOf(ClientFrame)},
+        fn startClient(self: *@This(), conn_fd: os.socket_t) void {
+            const conn_stream = net.Stream{ .handle = conn_fd };
+
+            const active_clients = &self.active_clients.?;
+            if (self.limits.max_clients != 0 and
+                active_clients.count() >= self.limits.max_clients)
+            {
+                std.log.warn(
+                    "Refusing ipc client. Already {d} connected.",
+                    .{active_clients.count()},
                 );
-                const conn_frame = self.allocator.create(
-                    ClientFrame,
-                ) catch |err| {
-                    std.log.err(
-                        "Failed to allocate connection handler frame: {}",
-                        .{err},
-                    );
-                    conn_stream.close();
-                    continue;
-                };
+                self.stats.refused += 1;
+                conn_stream.close();
+                return;
+            }
 
-                const event_source = c.wl_event_loop_add_fd(
-                    c.wf_Core_get_event_loop(c.wf_get_core()),
-                    conn_fd,
-                    c.WL_EVENT_READABLE | c.WL_EVENT_WRITABLE,
-                    clientFrameTick,
-                    @ptrCast(*c_void, conn_frame),
-                ).?;
-
-                self.active_clients.?.put(
-                    conn_fd,
-                    .{
-                        .frame = conn_frame,
-                        .event_source = event_source,
-                    },
-                ) catch |err| {
-                    std.log.err(
-                        "Failed to put new active_connection entry: {}",
-                        .{err},
-                    );
-                    conn_stream.close();
-                    self.allocator.destroy(conn_frame);
-                    _ = c.wl_event_source_remove(event_source);
-                    continue;
-                };
+            const conn_frame = self.acquireFrame() catch |err| {
+                std.log.err(
+                    "Failed to allocate connection handler frame: {}",
+                    .{err},
+                );
+                conn_stream.close();
+                return;
+            };
 
-                std.log.debug(
-                    "Active ipc connections: {d}",
-                    .{self.active_clients.?.count()},
+            const event_loop = c.wf_Core_get_event_loop(c.wf_get_core());
+            const event_source = c.wl_event_loop_add_fd(
+                event_loop,
+                conn_fd,
+                c.WL_EVENT_READABLE,
+                clientFrameTick,
+                @ptrCast(*c_void, conn_frame),
+            ).?;
+            const idle_source = if (self.limits.idle_timeout_ms != 0)
+                c.wl_event_loop_add_timer(
+                    event_loop,
+                    ClientFrameState.idleTimeoutCB,
+                    @ptrCast(*c_void, &conn_frame.state),
+                ).?
+            else
+                null;
+
+            active_clients.put(
+                conn_fd,
+                .{
+                    .frame = conn_frame,
+                    .event_source = event_source,
+                },
+            ) catch |err| {
+                std.log.err(
+                    "Failed to put new active_connection entry: {}",
+                    .{err},
                 );
+                conn_stream.close();
+                self.releaseFrame(conn_frame);
+                _ = c.wl_event_source_remove(event_source);
+                if (idle_source) |source|
+                    _ = c.wl_event_source_remove(source);
+                return;
+            };
 
-                conn_frame.* = ClientFrame{
-                    .state = ClientFrameState{
-                        .stream = conn_stream,
-                        .async_server = self,
-                    },
-                    .frame = undefined,
-                };
-                _ = @asyncCall(&conn_frame.frame, {}, runClientHandler, .{
-                    self,
-                    &conn_frame.state,
-                });
-            }
+            self.stats.accepted += 1;
+            self.stats.peak_clients = std.math.max(
+                self.stats.peak_clients,
+                @intCast(u32, active_clients.count()),
+            );
+            std.log.debug(
+                "Active ipc connections: {d}",
+                .{active_clients.count()},
+            );
+
+            conn_frame.* = ClientFrame{
+                .state = ClientFrameState{
+                    .stream = conn_stream,
+                    .event_source = event_source,
+                    .idle_source = idle_source,
+                    .async_server = self,
+                    .out_buf = std.ArrayList(u8).init(self.allocator),
+                },
+                .frame = undefined,
+            };
+            _ = @asyncCall(&conn_frame.frame, {}, runClientHandler, .{
+                self,
+                &conn_frame.state,
+            });
         }
 
         fn runClientHandler(self: *@This(), state: *ClientFrameState) void {
@@ -438,122 +850,521 @@ fn getSocketPath(out_buf: []u8) ![:0]const u8 {
     }
 }
 
+const ClientState = IpcAsyncSocketServer.ClientFrameState;
+const Proto = ipc.Protocol(ClientState.Reader, ClientState.Writer);
+
+/// Protocol state of a connection.
+const Client = struct {
+    state: *ClientState,
+    proto: Proto,
+    /// Requests lua hasn't finished answering, by request id.
+    pending: std.AutoHashMap(u32, *PendingRequest),
+};
+
+/// A named stream of messages published from lua.
+const Topic = struct {
+    name: []const u8,
+    subscribers: std.ArrayListUnmanaged(*Subscription) = .{},
+};
+
+const Subscription = struct {
+    topic: *Topic,
+    request: *PendingRequest,
+    /// Replace a message of the topic still queued for the client instead of
+    /// queuing another one.
+    coalesce: bool,
+};
+
+/// A pending request. Its address is the handle lua answers through.
+const PendingRequest = struct {
+    server: *IpcServer,
+    client: *Client,
+    id: u32,
+    /// Encoding of the request, answers use it even once the client sent
+    /// requests in another one.
+    encoding: ipc.Encoding,
+    /// Set once the command promise outlives its dispatch.
+    cancel_ref: ?Lua.Ref = null,
+    /// Topics the request subscribed to.
+    subscriptions: std.ArrayListUnmanaged(*Subscription) = .{},
+
+    fn fromHandle(handle: *c_void) *PendingRequest {
+        return @ptrCast(
+            *PendingRequest,
+            @alignCast(@alignOf(PendingRequest), handle),
+        );
+    }
+
+    /// Forget about the request once it is fully answered.
+    fn finish(self: *PendingRequest) void {
+        _ = self.client.pending.remove(self.id);
+        self.client.state.pending_requests -= 1;
+        if (self.cancel_ref) |cancel_ref|
+            Lua.unref(self.server.L, cancel_ref);
+        for (self.subscriptions.items) |subscription|
+            self.server.unsubscribe(subscription);
+        self.subscriptions.deinit(self.server.allocator);
+        self.server.allocator.destroy(self);
+    }
+
+    /// Let lua know nobody is waiting for an answer anymore.
+    fn cancel(self: *PendingRequest) void {
+        std.log.info(
+            "Cancelling command promise for request {d}.",
+            .{self.id},
+        );
+        if (self.cancel_ref) |cancel_ref| {
+            Lua.rawGetRef(self.server.L, cancel_ref);
+            Lua.pcall(
+                self.server.L,
+                .{ .nargs = 0, .nresults = 0 },
+            ) catch |err| {
+                std.log.err("Command cancel callback failed: {}", .{err});
+            };
+        }
+        self.finish();
+    }
+
+    fn send(self: *PendingRequest, msg: anytype) void {
+        // Notifications come whenever lua sends them, only the client
+        // reading them keeps their output bounded.
+        const state = self.client.state;
+        state.budgeted = switch (@TypeOf(msg)) {
+            ipc.Command.RespSend => false,
+            ipc.Command.NotifSend => true,
+            else => @compileError("Unexpected message type"),
+        };
+        defer state.budgeted = false;
+
+        const result = self.client.proto.sendIn(self.encoding, msg);
+        result catch |err| {
+            std.log.err(
+                "Failed to send answer to request {d}: {}",
+                .{ self.id, err },
+            );
+        };
+    }
+};
+
 export fn wflua_ipc_command_resolve(
-    state_: *c_void,
+    handle: *c_void,
     result: [*:0]const u8,
 ) void {
-    const State = IpcAsyncSocketServer.ClientFrameState;
-    const state = @ptrCast(*State, @alignCast(@alignOf(*State), state_));
+    const request = PendingRequest.fromHandle(handle);
+    defer request.finish();
 
-    std.debug.assert(state.waiting_for.? == .ipc_command);
-    state.inbox = .{ .IpcCommandResolve = result };
-    state.resumeFrame();
+    request.send(ipc.Command.RespSend{ .Result = .{
+        .id = request.id,
+        .result = .{ .cmd_result = std.mem.span(result) },
+    } });
 }
 export fn wflua_ipc_command_reject(
-    state_: *c_void,
+    handle: *c_void,
     err: [*:0]const u8,
     error_code: c_int,
 ) void {
-    const State = IpcAsyncSocketServer.ClientFrameState;
-    const state = @ptrCast(*State, @alignCast(@alignOf(*State), state_));
-
-    std.debug.assert(state.waiting_for.? == .ipc_command);
-    state.inbox = .{
-        .IpcCommandReject = .{ .err = err, .error_code = error_code },
-    };
-    state.resumeFrame();
+    const request = PendingRequest.fromHandle(handle);
+    defer request.finish();
+
+    request.send(ipc.Command.RespSend{ .Error = .{
+        .id = request.id,
+        .@"error" = .{
+            .code = @intToEnum(ipc.RpcErrorCode, @intCast(i32, error_code)),
+            .message = std.mem.span(err),
+        },
+    } });
 }
 export fn wflua_ipc_command_begin_notifications(
-    state_: *c_void,
+    handle: *c_void,
 ) void {
-    const State = IpcAsyncSocketServer.ClientFrameState;
-    const state = @ptrCast(*State, @alignCast(@alignOf(*State), state_));
+    const request = PendingRequest.fromHandle(handle);
 
-    std.debug.assert(state.waiting_for.? == .ipc_command);
-    state.inbox = .{ .IpcCommandBeginNotifs = {} };
-    state.resumeFrame();
+    request.send(ipc.Command.RespSend{
+        .BeginingNotifs = .{ .id = request.id, .result = .{} },
+    });
 }
 export fn wflua_ipc_command_notify(
-    state_: *c_void,
+    handle: *c_void,
     notif: ?[*:0]const u8,
 ) void {
-    const State = IpcAsyncSocketServer.ClientFrameState;
-    const state = @ptrCast(*State, @alignCast(@alignOf(*State), state_));
+    const request = PendingRequest.fromHandle(handle);
 
-    std.debug.assert(state.waiting_for.? == .ipc_command);
     if (notif) |n| {
-        state.inbox = .{ .IpcCommandNotify = n };
+        request.send(ipc.Command.NotifSend{ .Notif = .{
+            .params = .{ .id = request.id, .notif = std.mem.span(n) },
+        } });
     } else {
-        state.inbox = .{ .IpcCommandEndNotifs = {} };
+        defer request.finish();
+        request.send(ipc.Command.NotifSend{ .NotifEnd = .{
+            .params = .{ .id = request.id },
+        } });
     }
-    state.resumeFrame();
 }
 
-fn forwardAsyncNotifs(
+/// Commands implemented natively. They shadow lua commands of the same name.
+const builtin_commands = .{
+    .{ "ipc_stats", ipcStatsCommand },
+    .{ "lua_memory", luaMemoryCommand },
+    .{ "profile", profileCommand },
+    .{ "subscribe", subscribeCommand },
+    .{ "trace", traceCommand },
+};
+
+const subscribe_usage = "subscribe [-c] <TOPIC>...";
+
+/// Stream the messages published to the given topics. With -c, a message
+/// still queued for the client is replaced by newer ones of its topic.
+fn subscribeCommand(
     self: *This,
-    state: *IpcAsyncSocketServer.ClientFrameState,
-    proto: anytype,
+    client: *Client,
     req: ipc.Command.ReqRecv,
-    cancel_ref: Lua.Ref,
 ) !void {
-    notifs: while (true) {
-        state.suspendFrame(.ipc_command) catch |err| switch (err) {
-            error.WlSocketHangup,
-            error.WlSocketError,
-            error.ClientFrameShuttingDown,
-            => |e| {
-                std.log.info(
-                    "Received {} while command notifying. " ++
-                        "Cancelling command promise for {s}.",
-                    .{ e, req.params.command },
-                );
-                Lua.rawGetRef(self.L, cancel_ref);
-                try Lua.pcall(self.L, .{ .nargs = 0, .nresults = 0 });
+    var topics = req.params.args;
+    var coalesce = false;
+    if (topics.len > 0 and std.mem.eql(u8, topics[0], "-c")) {
+        coalesce = true;
+        topics = topics[1..];
+    }
 
-                if (e == error.ClientFrameShuttingDown) {
-                    return e;
-                } else {
-                    return;
-                }
+    if (topics.len == 0) {
+        try client.proto.sendResponse(ipc.Command.RespSend{ .Error = .{
+            .id = req.id,
+            .@"error" = .{
+                .code = .CommandInvalidArgs,
+                .message = "No topics given.\nUsage: " ++ subscribe_usage,
             },
-            else => |e| return e,
+        } });
+        return;
+    }
+
+    const request = (try self.beginRequest(client, req.id)) orelse return;
+    errdefer request.finish();
+
+    for (topics) |topic|
+        try self.subscribe(request, topic, coalesce);
+
+    try client.proto.sendResponse(ipc.Command.RespSend{
+        .BeginingNotifs = .{ .id = req.id, .result = .{} },
+    });
+}
+
+fn subscribe(
+    self: *This,
+    request: *PendingRequest,
+    topic_name: []const u8,
+    coalesce: bool,
+) !void {
+    const gop = try self.topics.getOrPut(topic_name);
+    if (!gop.found_existing) {
+        errdefer _ = self.topics.remove(topic_name);
+
+        const topic = try self.allocator.create(Topic);
+        errdefer self.allocator.destroy(topic);
+        topic.* = .{ .name = try self.allocator.dupe(u8, topic_name) };
+
+        gop.key_ptr.* = topic.name;
+        gop.value_ptr.* = topic;
+    }
+    const topic = gop.value_ptr.*;
+    errdefer if (topic.subscribers.items.len == 0) self.removeTopic(topic);
+
+    const subscription = try self.allocator.create(Subscription);
+    errdefer self.allocator.destroy(subscription);
+    subscription.* = .{
+        .topic = topic,
+        .request = request,
+        .coalesce = coalesce,
+    };
+
+    try topic.subscribers.append(self.allocator, subscription);
+    errdefer _ = topic.subscribers.pop();
+    try request.subscriptions.append(self.allocator, subscription);
+}
+
+fn unsubscribe(self: *This, subscription: *Subscription) void {
+    const topic = subscription.topic;
+    const subscribers = &topic.subscribers;
+    for (subscribers.items) |sub, i| {
+        if (sub == subscription) {
+            _ = subscribers.swapRemove(i);
+            break;
+        }
+    }
+    self.allocator.destroy(subscription);
+
+    if (subscribers.items.len == 0)
+        self.removeTopic(topic);
+}
+
+fn removeTopic(self: *This, topic: *Topic) void {
+    _ = self.topics.remove(topic.name);
+    topic.subscribers.deinit(self.allocator);
+    self.allocator.free(topic.name);
+    self.allocator.destroy(topic);
+}
+
+/// Send a message to every subscriber of a topic. The message is encoded at
+/// most once per encoding in use by the subscribers.
+export fn wflua_ipc_publish(
+    topic_name: [*:0]const u8,
+    msg: [*:0]const u8,
+) void {
+    const self = getPluginIpcServer();
+
+    const topic = self.topics.get(std.mem.span(topic_name)) orelse return;
+    const notif = ipc.Topic.NotifSend{ .params = .{
+        .topic = topic.name,
+        .notif = std.mem.span(msg),
+    } };
+
+    const SharedBuf = IpcAsyncSocketServer.SharedBuf;
+    var encoded = [_]?*SharedBuf{null} ** 2;
+    defer {
+        for (encoded) |maybe_buf| {
+            if (maybe_buf) |buf|
+                buf.unref(self.allocator);
+        }
+    }
+
+    for (topic.subscribers.items) |subscription| {
+        const client = subscription.request.client;
+        const encoding = subscription.request.encoding;
+
+        const buf = encoded[@enumToInt(encoding)] orelse x: {
+            const buf = encodeShared(
+                self.allocator,
+                topic,
+                encoding,
+                notif,
+            ) catch |err| {
+                std.log.err("Failed to encode topic message: {}", .{err});
+                return;
+            };
+            encoded[@enumToInt(encoding)] = buf;
+            break :x buf;
         };
-        switch (state.inbox.?) {
-            .IpcCommandNotify => |notif| {
-                try proto.sendNotif(ipc.Command.NotifSend{ .Notif = .{
-                    .params = .{ .id = req.id, .notif = std.mem.span(notif) },
-                } });
+
+        client.state.queueShared(buf, subscription.coalesce);
+    }
+}
+
+fn encodeShared(
+    allocator: *Allocator,
+    topic: *Topic,
+    encoding: ipc.Encoding,
+    notif: ipc.Topic.NotifSend,
+) !*IpcAsyncSocketServer.SharedBuf {
+    var bytes = std.ArrayList(u8).init(allocator);
+    defer bytes.deinit();
+    try ipc.writeMsg(&bytes, encoding, notif);
+
+    const owned_bytes = bytes.toOwnedSlice();
+    errdefer allocator.free(owned_bytes);
+    return IpcAsyncSocketServer.SharedBuf.create(
+        allocator,
+        @ptrToInt(topic),
+        owned_bytes,
+    );
+}
+
+/// Report the connection metrics of the ipc server.
+fn ipcStatsCommand(
+    self: *This,
+    client: *Client,
+    req: ipc.Command.ReqRecv,
+) !void {
+    const server = &self.socket_server;
+    const stats = server.stats;
+
+    var buf: [512]u8 = undefined;
+    const result = try std.fmt.bufPrint(&buf,
+        \\clients: {d}
+        \\peak_clients: {d}
+        \\accepted: {d}
+        \\refused: {d}
+        \\closed_idle: {d}
+        \\frames_allocated: {d}
+        \\frames_pooled: {d}
+        \\topics: {d}
+        \\dropped_notifs: {d}
+        \\coalesced_notifs: {d}
+        \\overflowed: {d}
+    , .{
+        server.active_clients.?.count(),
+        stats.peak_clients,
+        stats.accepted,
+        stats.refused,
+        stats.closed_idle,
+        stats.frames_allocated,
+        server.frame_pool.items.len,
+        self.topics.count(),
+        stats.dropped_shared,
+        stats.coalesced_shared,
+        stats.overflowed,
+    });
+
+    try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+        .id = req.id,
+        .result = .{ .cmd_result = result },
+    } });
+}
+
+/// Report the memory use and garbage collection pauses of the lua state.
+fn luaMemoryCommand(
+    self: *This,
+    client: *Client,
+    req: ipc.Command.ReqRecv,
+) !void {
+    var buf: [512]u8 = undefined;
+    var stream = std.io.fixedBufferStream(&buf);
+    try Plugin.getPluginLuaAllocator().writeStats(stream.writer());
+
+    try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+        .id = req.id,
+        .result = .{ .cmd_result = stream.getWritten() },
+    } });
+}
+
+const profile_usage = "profile [reset]";
+
+/// Report the time spent in every lua handler. With reset, the stats are
+/// cleared instead.
+fn profileCommand(
+    self: *This,
+    client: *Client,
+    req: ipc.Command.ReqRecv,
+) !void {
+    const profiler = Plugin.getPluginProfiler();
+    const args = req.params.args;
+
+    if (args.len == 1 and std.mem.eql(u8, args[0], "reset")) {
+        profiler.reset();
+        try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+            .id = req.id,
+            .result = .{ .cmd_result = "" },
+        } });
+        return;
+    } else if (args.len > 0) {
+        try client.proto.sendResponse(ipc.Command.RespSend{ .Error = .{
+            .id = req.id,
+            .@"error" = .{
+                .code = .CommandInvalidArgs,
+                .message = "Invalid arguments.\nUsage: " ++ profile_usage,
             },
-            .IpcCommandEndNotifs => {
-                try proto.sendNotif(ipc.Command.NotifSend{ .NotifEnd = .{
-                    .params = .{ .id = req.id },
-                } });
-                break :notifs;
+        } });
+        return;
+    }
+
+    var report = std.ArrayList(u8).init(self.allocator);
+    defer report.deinit();
+    try profiler.writeReport(report.writer());
+
+    try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+        .id = req.id,
+        .result = .{ .cmd_result = report.items },
+    } });
+}
+
+const trace_usage = "trace [start|stop|clear|dump]";
+
+/// Control the event tracer. Without arguments, report its state. The dump is
+/// a trace loadable in Perfetto or chrome://tracing.
+fn traceCommand(
+    self: *This,
+    client: *Client,
+    req: ipc.Command.ReqRecv,
+) !void {
+    const tracer = Plugin.getPluginTracer();
+    const args = req.params.args;
+
+    var result = std.ArrayList(u8).init(self.allocator);
+    defer result.deinit();
+
+    const action = if (args.len == 1) args[0] else "";
+    if (args.len == 0) {
+        try result.writer().print(
+            \\enabled: {}
+            \\records: {d}
+            \\capacity: {d}
+        , .{ tracer.enabled, tracer.count(), tracer.capacity });
+    } else if (std.mem.eql(u8, action, "start")) {
+        try tracer.start();
+    } else if (std.mem.eql(u8, action, "stop")) {
+        tracer.stop();
+    } else if (std.mem.eql(u8, action, "clear")) {
+        tracer.clear();
+    } else if (std.mem.eql(u8, action, "dump")) {
+        try tracer.writeChromeTrace(result.writer());
+    } else {
+        try client.proto.sendResponse(ipc.Command.RespSend{ .Error = .{
+            .id = req.id,
+            .@"error" = .{
+                .code = .CommandInvalidArgs,
+                .message = "Invalid arguments.\nUsage: " ++ trace_usage,
             },
+        } });
+        return;
+    }
 
-            // These are invalid/impossible since we already began
-            // notifications.
-            .IpcCommandResolve,
-            .IpcCommandReject,
-            .IpcCommandBeginNotifs,
-            => unreachable,
-        }
+    try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+        .id = req.id,
+        .result = .{ .cmd_result = result.items },
+    } });
+}
+
+/// Track a new request. Answers with an error and returns null if the id is
+/// already taken by another request of the client.
+fn beginRequest(self: *This, client: *Client, id: u32) !?*PendingRequest {
+    if (client.pending.contains(id)) {
+        try client.proto.sendResponse(ipc.Command.RespSend{ .Error = .{
+            .id = id,
+            .@"error" = .{
+                .code = .RequestIdInUse,
+                .message = "Request id already in use.",
+            },
+        } });
+        return null;
     }
+
+    const request = try self.allocator.create(PendingRequest);
+    request.* = .{
+        .server = self,
+        .client = client,
+        .id = id,
+        .encoding = client.proto.recv_encoding,
+    };
+    client.pending.putNoClobber(id, request) catch |err| {
+        self.allocator.destroy(request);
+        return err;
+    };
+    client.state.pending_requests += 1;
+    return request;
 }
 
+/// Hand a request to lua. This never waits for the command to complete, lua
+/// answers later through the request handle if needed.
 fn dispatchCommand(
     self: *This,
-    state: *IpcAsyncSocketServer.ClientFrameState,
-    proto: anytype,
+    client: *Client,
     req: ipc.Command.ReqRecv,
 ) !void {
+    inline for (builtin_commands) |builtin| {
+        if (std.mem.eql(u8, req.params.command, builtin[0]))
+            return builtin[1](self, client, req);
+    }
+
+    const request = (try self.beginRequest(client, req.id)) orelse return;
     const orig_stack_len = c.lua_gettop(self.L);
 
+    // The request is done with unless lua keeps the promise around.
+    var keep_request = false;
+    defer if (!keep_request) request.finish();
+
     Lua.rawGetRef(self.L, self.command_callback_ref);
 
     // 3 arguments: handle, command, args
-    const handle = @ptrCast(*c_void, @alignCast(@alignOf(*c_void), state));
-    c.lua_pushlightuserdata(self.L, handle);
+    c.lua_pushlightuserdata(self.L, @ptrCast(*c_void, request));
+    // NOTE: msgpack request strings point straight into the receive buffer.
     c.lua_pushlstring(self.L, req.params.command.ptr, req.params.command.len);
     {
         c.lua_createtable(self.L, @intCast(c_int, req.params.args.len), 0);
@@ -577,70 +1388,15 @@ fn dispatchCommand(
         // promise pending (request-response/notifier command),
         0 => {
             // CASE0: Command resolves on some future event. Pending returned.
-            //        Result/Error resolved later.
+            //        Result/Error resolved later through the request handle.
 
             // Top of the stack is the last return value which is the cancel cb.
-            // We take a ref so that we can leave the stack clean before
-            // suspending.
-            const cancel_ref = Lua.ref(self.L); // pops the cancel_cb
-            defer Lua.unref(self.L, cancel_ref);
+            request.cancel_ref = Lua.ref(self.L); // pops the cancel_cb
             c.lua_pop(self.L, 3); // pops the rest of the returns
+            keep_request = true;
 
             // Stack should be clean now.
             std.debug.assert(c.lua_gettop(self.L) == orig_stack_len);
-
-            state.suspendFrame(.ipc_command) catch |err| switch (err) {
-                error.WlSocketHangup,
-                error.WlSocketError,
-                error.ClientFrameShuttingDown,
-                => |e| {
-                    std.log.info(
-                        "Received {} while command pending. " ++
-                            "Cancelling command promise for {s}.",
-                        .{ e, req.params.command },
-                    );
-                    Lua.rawGetRef(self.L, cancel_ref);
-                    try Lua.pcall(self.L, .{ .nargs = 0, .nresults = 0 });
-
-                    if (e == error.ClientFrameShuttingDown) {
-                        return e;
-                    } else {
-                        return;
-                    }
-                },
-                else => |e| return e,
-            };
-            switch (state.inbox.?) {
-                .IpcCommandResolve => |result| {
-                    try proto.sendResponse(ipc.Command.RespSend{ .Result = .{
-                        .id = req.id,
-                        .result = .{ .cmd_result = std.mem.span(result) },
-                    } });
-                },
-                .IpcCommandReject => |inbox| {
-                    try proto.sendResponse(ipc.Command.RespSend{
-                        .Error = .{
-                            .id = req.id,
-                            .@"error" = .{
-                                .code = @intToEnum(
-                                    ipc.RpcErrorCode,
-                                    @intCast(i32, inbox.error_code),
-                                ),
-                                .message = std.mem.span(inbox.err),
-                            },
-                        },
-                    });
-                },
-                .IpcCommandBeginNotifs => {
-                    try proto.sendResponse(ipc.Command.RespSend{
-                        .BeginingNotifs = .{ .id = req.id, .result = .{} },
-                    });
-                    try self.forwardAsyncNotifs(state, proto, req, cancel_ref);
-                },
-                .IpcCommandEndNotifs,
-                .IpcCommandNotify,
-                => unreachable,
-            }
         },
 
         // promise resolved (request-response command),
@@ -655,12 +1411,12 @@ fn dispatchCommand(
             const error_code = @intCast(i32, c.lua_tointeger(self.L, -2));
 
             if (error_code == 0) {
-                try proto.sendResponse(ipc.Command.RespSend{ .Result = .{
+                try client.proto.sendResponse(ipc.Command.RespSend{ .Result = .{
                     .id = req.id,
                     .result = .{ .cmd_result = result },
                 } });
             } else {
-                try proto.sendResponse(ipc.Command.RespSend{ .Error = .{
+                try client.proto.sendResponse(ipc.Command.RespSend{ .Error = .{
                     .id = req.id,
                     .@"error" = .{
                         .code = @intToEnum(ipc.RpcErrorCode, error_code),
@@ -675,7 +1431,7 @@ fn dispatchCommand(
             // CASE2: Command is a notifier command.
             // return values: 2, result(array of notifs), nil, cancel_cb
 
-            try proto.sendResponse(ipc.Command.RespSend{
+            try client.proto.sendResponse(ipc.Command.RespSend{
                 .BeginingNotifs = .{ .id = req.id, .result = .{} },
             });
 
@@ -690,7 +1446,7 @@ fn dispatchCommand(
                     if (c.lua_isstring(self.L, -1) != 0) {
                         const notif = Lua.tostring(self.L, -1);
 
-                        try proto.sendNotif(ipc.Command.NotifSend{
+                        try client.proto.sendNotif(ipc.Command.NotifSend{
                             .Notif = .{
                                 .params = .{ .id = req.id, .notif = notif },
                             },
@@ -699,7 +1455,7 @@ fn dispatchCommand(
                         // end_notifications was sent.
                         std.debug.assert(i == notifs_len);
 
-                        try proto.sendNotif(ipc.Command.NotifSend{
+                        try client.proto.sendNotif(ipc.Command.NotifSend{
                             .NotifEnd = .{
                                 .params = .{ .id = req.id },
                             },
@@ -718,16 +1474,12 @@ fn dispatchCommand(
             }
 
             // Top of the stack is the last return value which is the cancel cb.
-            // We take a ref so that we can leave the stack clean before
-            // suspending.
-            const cancel_ref = Lua.ref(self.L); // pops the cancel_cb
-            defer Lua.unref(self.L, cancel_ref);
+            request.cancel_ref = Lua.ref(self.L); // pops the cancel_cb
             c.lua_pop(self.L, 3); // pops the rest of the returns
+            keep_request = true;
 
             // Stack should be clean now.
             std.debug.assert(c.lua_gettop(self.L) == orig_stack_len);
-
-            try self.forwardAsyncNotifs(state, proto, req, cancel_ref);
         },
 
         else => unreachable,
@@ -742,32 +1494,61 @@ const IpcAsyncSocketServer = AsyncSocketServer(IpcServer, struct {
     ) !void {
         std.log.debug("New connection!", .{});
 
-        const Reader = @TypeOf(state.*).Reader;
-        const Writer = @TypeOf(state.*).Writer;
-        const proto = ipc.Protocol(Reader, Writer){
-            .allocator = self.allocator,
-            .reader = state.reader(),
-            .writer = state.writer(),
+        var client = Client{
+            .state = state,
+            // The encoding follows whatever the client sends.
+            .proto = Proto.init(
+                self.allocator,
+                state.reader(),
+                state.writer(),
+                .json,
+            ),
+            .pending = std.AutoHashMap(u32, *PendingRequest).init(
+                self.allocator,
+            ),
         };
+        defer {
+            // Nobody is left to answer to.
+            while (client.pending.count() > 0)
+                client.pending.valueIterator().next().?.*.cancel();
+            client.pending.deinit();
+            client.proto.deinit();
+        }
 
-        while (try proto.nextRequest()) |req| {
-            defer proto.freeRequest(req);
+        // Requests are read and dispatched back to back. Their answers are
+        // sent whenever lua resolves them, possibly out of order.
+        while (try client.proto.nextRequest()) |req| {
+            defer client.proto.freeRequest(req);
 
-            var timer = try std.time.Timer.start();
-            try self.dispatchCommand(
-                state,
-                proto,
-                req.Command,
-            );
-            std.log.debug("Command handled in {d}ms", .{
-                @intToFloat(f64, timer.read()) / std.time.ns_per_ms,
+            const span = Plugin.getPluginTracer().begin();
+            defer Plugin.getPluginTracer().end(span, .{
+                .kind = .ipc_command,
+                .request_id = req.Command.id,
             });
+            try self.dispatchCommand(&client, req.Command);
         }
 
         std.log.debug("Connection closed.", .{});
     }
 });
 
+fn getLimits() IpcAsyncSocketServer.Limits {
+    const backlog = getOptionInt("ipc_backlog", 128);
+    return .{
+        .backlog = @intCast(u31, std.math.clamp(backlog, 1, 4096)),
+        .max_clients = getOptionInt("ipc_max_clients", 512),
+        .idle_timeout_ms = getOptionInt("ipc_idle_timeout", 0),
+        .max_queued_shared = std.math.max(
+            getOptionInt("ipc_topic_queue_size", 64),
+            1,
+        ),
+        .max_queued_bytes = @as(usize, std.math.max(
+            getOptionInt("ipc_client_buffer_size", 1024),
+            1,
+        )) * 1024,
+    };
+}
+
 pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) !void {
     var socket_path_buf: [120]u8 = undefined;
     const socket_path = try getSocketPath(&socket_path_buf);
@@ -783,15 +1564,22 @@ pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) !void {
     c.lua_getglobal(self.L, "wf__ipc_command_callback");
     self.command_callback_ref = Lua.ref(self.L);
 
-    try self.socket_server.init(allocator, socket_path, self);
+    self.topics = std.StringHashMap(*Topic).init(allocator);
+    errdefer self.topics.deinit();
+
+    try self.socket_server.init(allocator, socket_path, self, getLimits());
 }
 
 pub fn deinit(self: *This) !void {
     try self.socket_server.deinit();
 
+    // Topics are gone with their last subscriber.
+    std.debug.assert(self.topics.count() == 0);
+    self.topics.deinit();
+
     Lua.unref(self.L, self.command_callback_ref);
 }
 
 pub fn reset(self: *This) void {
-    self.socket_server.reset();
+    self.socket_server.reset(getLimits());
 }
@@ -2,7 +2,8 @@ const std = @import("std");
 const c = @import("c.zig");
 const Lua = @import("Lua.zig");
 
-const getPluginKeyMappings = @import("Plugin.zig").getPluginKeyMappings;
+const Plugin = @import("Plugin.zig");
+const getPluginKeyMappings = Plugin.getPluginKeyMappings;
 
 const Allocator = std.mem.Allocator;
 
@@ -91,117 +92,369 @@ const Key = packed struct {
     }
 };
 
-const KeysContext = struct {
-    pub fn hash(self: @This(), keys: []const Key) u64 {
-        var wh = std.hash.Wyhash.init(5);
-        for (keys) |key| {
-            wh.update(std.mem.asBytes(&key.keysym));
-            wh.update(std.mem.asBytes(&key.modifiers));
+/// An action run directly by the plugin when a mapping is triggered, without
+/// going through lua. All strings are owned by the mapping.
+const NativeAction = union(enum) {
+    /// Spawn a shell command.
+    run: [:0]const u8,
+    /// Call a plugin activator on the active output.
+    call_plugin: [:0]const u8,
+    /// Focus the output with the given name.
+    focus_output: [:0]const u8,
+    /// Set an option value.
+    set_option: struct {
+        section: [:0]const u8,
+        option: [:0]const u8,
+        value: [:0]const u8,
+    },
+
+    fn deinit(self: NativeAction, allocator: *Allocator) void {
+        switch (self) {
+            .run, .call_plugin, .focus_output => |str| allocator.free(str),
+            .set_option => |opt| {
+                allocator.free(opt.section);
+                allocator.free(opt.option);
+                allocator.free(opt.value);
+            },
         }
-        return wh.final();
     }
-    pub fn eql(self: @This(), a: []const Key, b: []const Key) bool {
-        if (a.len != b.len) return false;
-        for (a) |e, i|
-            if (!std.meta.eql(e, b[i])) return false;
-        return true;
+
+    fn execute(self: NativeAction) void {
+        const core = c.wf_get_core();
+        switch (self) {
+            .run => |command| {
+                _ = c.wf_Core_run(core, command);
+            },
+            .call_plugin => |activator| {
+                const output = c.wf_Core_get_active_output(core) orelse {
+                    std.log.warn(
+                        "No active output to call plugin on: {s}",
+                        .{activator},
+                    );
+                    return;
+                };
+                const ok = c.wf_Output_call_plugin_plain(
+                    output,
+                    activator,
+                    .{
+                        .source = .WF_ACTIVATOR_SOURCE_PLUGIN,
+                        .activation_data = 0,
+                    },
+                );
+                if (!ok)
+                    std.log.warn("Failed to call plugin: {s}", .{activator});
+            },
+            .focus_output => |name| {
+                const output = c.wf_OutputLayout_find_output(
+                    c.wf_Core_get_output_layout(core),
+                    name,
+                ) orelse {
+                    std.log.warn("No output named: {s}", .{name});
+                    return;
+                };
+                c.wf_Core_focus_output(core, output);
+            },
+            .set_option => |opt| {
+                const err = c.wf_set_option_str(
+                    opt.section,
+                    opt.option,
+                    opt.value,
+                );
+                if (err != .WF_OK)
+                    std.log.err(
+                        "Failed to set option {s}/{s} to '{s}': {}",
+                        .{ opt.section, opt.option, opt.value, err },
+                    );
+            },
+        }
     }
 };
 
-const Mappings = std.HashMap(
-    []const Key,
-    struct {
-        // An entry is a "path" of keys that may either be a mapping, a prefix
-        // to some other mapping, or both.
-        //
-        // If path_refs == 0 and mappings == null, it is safe to remove this
-        // entry from the mappings table.
-
-        mapping: ?struct {
-            handler: Lua.Ref,
-            pop_keys: u16,
-        } = null,
-
-        /// Amount of mappings using this entry as a prefix path.
-        path_refs: u16 = 0,
-    },
-    KeysContext,
-    std.hash_map.default_max_load_percentage,
-);
+const Handler = union(enum) {
+    lua: Lua.Ref,
+    native: NativeAction,
+
+    fn deinit(self: Handler, key_mappings: *This) void {
+        switch (self) {
+            .lua => |ref| Lua.unref(key_mappings.L, ref),
+            .native => |action| action.deinit(key_mappings.allocator),
+        }
+    }
+};
+
+const Mapping = struct {
+    /// Identifies this mapping among the ones made on the same keys so that
+    /// unmapping doesn't drop a newer mapping.
+    id: u32,
+    handler: Handler,
+    pop_keys: u16,
+};
+
+/// A node in the mappings trie. The path of keys from the root to a node is a
+/// key sequence which may either be a mapping, a prefix to some other mapping,
+/// or both.
+const Node = struct {
+    children: std.AutoHashMapUnmanaged(Key, *Node) = .{},
+    mapping: ?Mapping = null,
+
+    /// Time in ms after which a pending sequence stopped at this node is
+    /// dropped. 0 means the sequence never expires. Never above maxInt(c_int)
+    /// as timers take a c_int.
+    timeout_ms: u32 = 0,
+
+    fn deinit(self: *Node, key_mappings: *This) void {
+        var it = self.children.valueIterator();
+        while (it.next()) |child| {
+            child.*.deinit(key_mappings);
+            key_mappings.allocator.destroy(child.*);
+        }
+        self.children.deinit(key_mappings.allocator);
+
+        if (self.mapping) |mapping|
+            mapping.handler.deinit(key_mappings);
+    }
+};
 
 allocator: *Allocator,
 L: *c.lua_State,
-mappings: Mappings,
+/// Root of the mappings trie. Never holds a mapping itself.
+root: Node,
 keyboard_key_signal: *c.wf_SignalConnection,
-pending_keys: std.ArrayList(Key),
+/// The nodes visited by the keys pressed so far. The last one is the current
+/// state. Empty when at the root.
+pending_path: std.ArrayList(*Node),
+/// Timer dropping the pending sequence when it times out.
+timeout_source: *c.wl_event_source,
+/// Id of the next mapping made.
+next_mapping_id: u32,
+
+/// Read an optional unsigned integer argument, raising a lua error if it
+/// doesn't fit in `T`.
+fn optIntArg(
+    comptime T: type,
+    L: *c.lua_State,
+    index: c_int,
+    comptime name: []const u8,
+) ?T {
+    if (c.lua_isnil(L, index))
+        return null;
+
+    const value = c.lua_tonumber(L, index);
+    if (c.lua_isnumber(L, index) == 0 or value != @floor(value) or
+        value < 0 or value > std.math.maxInt(T))
+    {
+        const msg = name ++ " must be an integer from 0 to " ++
+            std.fmt.comptimePrint("{d}", .{std.math.maxInt(T)});
+        c.lua_pushlstring(L, msg.ptr, msg.len);
+        _ = c.lua_error(L);
+        unreachable;
+    }
+    return @floatToInt(T, value);
+}
 
 fn mapKeys(L: ?*c.lua_State) callconv(.C) c_int {
-    // 3 Parameters: keys, handler, ?pop_keys
-    std.debug.assert(c.lua_gettop(L.?) == 3);
+    // 4 Parameters: keys, handler, ?pop_keys, ?timeout
+    std.debug.assert(c.lua_gettop(L.?) == 4);
+
+    // Checked first as raising errors past this point would leak the handler.
+    const pop_keys = optIntArg(u16, L.?, 3, "pop_keys");
+    // Timers take a c_int.
+    const timeout_ms: u32 = optIntArg(u31, L.?, 4, "timeout") orelse 0;
 
     const keys = Lua.tostring(L.?, 1);
     const handler = x: {
-        c.lua_pushvalue(L.?, 2); // push copy
-        break :x Lua.ref(L.?); // pop and ref
-    };
-    const pop_keys = x: {
-        if (c.lua_isnil(L.?, 3)) {
-            break :x null;
-        } else {
-            break :x @intCast(u16, c.lua_tointeger(L.?, 3));
+        if (c.lua_type(L.?, 2) == c.LUA_TTABLE) {
+            const allocator = getPluginKeyMappings().allocator;
+            const action = parseNativeAction(allocator, L.?, 2) catch |err| {
+                std.log.err(
+                    "Invalid action for keys: '{s}': {}",
+                    .{ keys, err },
+                );
+                return 0;
+            };
+            break :x Handler{ .native = action };
         }
-    };
 
-    mapKeysImpl(keys, handler, pop_keys) catch |err| switch (err) {
+        c.lua_pushvalue(L.?, 2); // push copy
+        break :x Handler{ .lua = Lua.ref(L.?) }; // pop and ref
+    };
+    const id = mapKeysImpl(
+        keys,
+        handler,
+        pop_keys,
+        timeout_ms,
+    ) catch |err| switch (err) {
         ParserError.InvalidModifier,
         ParserError.InvalidKeySymbol,
         ParserError.InvalidEmptyKeys,
         => {
             std.log.err("Error parsing keys: '{s}': {}", .{ keys, err });
+            handler.deinit(getPluginKeyMappings());
+            return 0;
         },
         else => unreachable,
     };
 
+    // The id is needed to unmap these keys.
+    c.lua_pushinteger(L, id);
+    return 1;
+}
+
+fn unmapKeys(L: ?*c.lua_State) callconv(.C) c_int {
+    // 2 Parameters: keys, id
+    std.debug.assert(c.lua_gettop(L.?) == 2);
+
+    const keys = Lua.tostring(L.?, 1);
+    const id = @intCast(u32, c.lua_tointeger(L.?, 2));
+
+    if (getPluginKeyMappings().unmapKeysImpl(keys, id)) |_| {} else |err| {
+        std.log.err("Error unmapping keys: '{s}': {}", .{ keys, err });
+    }
     return 0;
 }
 
-// TODO: remove entry when handler is null
-fn mapKeysImpl(keys: []const u8, handler: Lua.Ref, pop_keys: ?u16) !void {
+/// Parse an action table as built by `wf.action.*` in lua:
+///
+///     { action = 'name', arg1, arg2, ... }
+///
+fn parseNativeAction(
+    allocator: *Allocator,
+    L: *c.lua_State,
+    index: c_int,
+) !NativeAction {
+    c.lua_getfield(L, index, "action");
+    defer c.lua_pop(L, 1);
+    if (c.lua_type(L, -1) != c.LUA_TSTRING)
+        return error.InvalidAction;
+    const name = Lua.tostring(L, -1);
+
+    if (std.mem.eql(u8, name, "run")) {
+        return NativeAction{ .run = try dupeActionArg(allocator, L, index, 1) };
+    } else if (std.mem.eql(u8, name, "call_plugin")) {
+        return NativeAction{
+            .call_plugin = try dupeActionArg(allocator, L, index, 1),
+        };
+    } else if (std.mem.eql(u8, name, "focus_output")) {
+        return NativeAction{
+            .focus_output = try dupeActionArg(allocator, L, index, 1),
+        };
+    } else if (std.mem.eql(u8, name, "set_option")) {
+        const section = try dupeActionArg(allocator, L, index, 1);
+        errdefer allocator.free(section);
+        const option = try dupeActionArg(allocator, L, index, 2);
+        errdefer allocator.free(option);
+        const value = try dupeActionArg(allocator, L, index, 3);
+        return NativeAction{ .set_option = .{
+            .section = section,
+            .option = option,
+            .value = value,
+        } };
+    }
+
+    return error.InvalidAction;
+}
+
+/// Copy the n-th positional argument of an action table.
+fn dupeActionArg(
+    allocator: *Allocator,
+    L: *c.lua_State,
+    index: c_int,
+    n: c_int,
+) ![:0]const u8 {
+    c.lua_rawgeti(L, index, n);
+    defer c.lua_pop(L, 1);
+    if (c.lua_isstring(L, -1) == 0)
+        return error.InvalidAction;
+    return allocator.dupeZ(u8, Lua.tostring(L, -1));
+}
+
+fn mapKeysImpl(
+    keys: []const u8,
+    handler: Handler,
+    pop_keys: ?u16,
+    timeout_ms: u32,
+) !u32 {
     const self = getPluginKeyMappings();
 
     const parsed_keys: []Key = try parseKeys(self.allocator, keys);
+    defer self.allocator.free(parsed_keys);
     std.debug.assert(parsed_keys.len > 0);
 
     std.log.debug("Keys: {any}", .{parsed_keys});
 
-    {
-        const gop = try self.mappings.getOrPut(parsed_keys);
-        const new_mapping = .{
-            .pop_keys = @intCast(u16, pop_keys orelse parsed_keys.len),
-            .handler = handler,
-        };
+    var node = &self.root;
+    for (parsed_keys) |key, i| {
+        // Every proper prefix of the sequence expires after the shortest
+        // timeout of the mappings going through it.
+        if (i > 0 and timeout_ms > 0) {
+            if (node.timeout_ms == 0 or timeout_ms < node.timeout_ms)
+                node.timeout_ms = timeout_ms;
+        }
+
+        const gop = try node.children.getOrPut(self.allocator, key);
         if (!gop.found_existing) {
-            gop.value_ptr.* = .{ .mapping = new_mapping };
-        } else {
-            if (gop.value_ptr.mapping) |old_mapping| {
-                Lua.unref(self.L, old_mapping.handler);
-            }
-            gop.value_ptr.mapping = new_mapping;
+            errdefer _ = node.children.remove(key);
+            const child = try self.allocator.create(Node);
+            child.* = .{};
+            gop.value_ptr.* = child;
         }
+        node = gop.value_ptr.*;
     }
 
-    var key_path = parsed_keys;
-    key_path.len -= 1;
+    if (node.mapping) |old_mapping|
+        old_mapping.handler.deinit(self);
 
-    while (key_path.len > 0) : (key_path.len -= 1) {
-        const gop = try self.mappings.getOrPut(key_path);
-        if (gop.found_existing) {
-            gop.value_ptr.path_refs += 1;
-        } else {
-            gop.key_ptr.* = try self.allocator.dupe(Key, key_path);
-            gop.value_ptr.* = .{ .path_refs = 1 };
-        }
+    const id = self.next_mapping_id;
+    self.next_mapping_id += 1;
+    node.mapping = .{
+        .id = id,
+        .pop_keys = @intCast(u16, pop_keys orelse parsed_keys.len),
+        .handler = handler,
+    };
+    return id;
+}
+
+/// Remove the mapping of a key sequence if it still is the one with the given
+/// id. Nodes left without mappings are freed. Returns whether a mapping was
+/// removed.
+///
+/// NOTE: Prefixes keep the timeout of the shortest mapping that went through
+///       them.
+fn unmapKeysImpl(self: *This, keys: []const u8, id: u32) !bool {
+    const parsed_keys: []Key = try parseKeys(self.allocator, keys);
+    defer self.allocator.free(parsed_keys);
+
+    // The nodes from the root to the mapping.
+    const path = try self.allocator.alloc(*Node, parsed_keys.len + 1);
+    defer self.allocator.free(path);
+
+    path[0] = &self.root;
+    for (parsed_keys) |key, i|
+        path[i + 1] = path[i].children.get(key) orelse return false;
+
+    const node = path[parsed_keys.len];
+    const mapping = node.mapping orelse return false;
+    if (mapping.id != id)
+        return false;
+
+    // The pending sequence may go through the nodes about to be freed.
+    self.pending_path.clearRetainingCapacity();
+    self.updateTimeout();
+
+    mapping.handler.deinit(self);
+    node.mapping = null;
+
+    var i = parsed_keys.len;
+    while (i > 0) : (i -= 1) {
+        const child = path[i];
+        if (child.mapping != null or child.children.count() > 0)
+            break;
+
+        _ = path[i - 1].children.remove(parsed_keys[i - 1]);
+        child.deinit(self);
+        self.allocator.destroy(child);
     }
+    return true;
 }
 
 const ParserError = error{
@@ -336,16 +589,15 @@ fn parseModifier(rest: *[]const u8) !ModifierMask {
     return error.InvalidModifier;
 }
 
-// TODO: write tests for this parser once zig build allows us to run our tests
-//       without crashing due to undefined wayfire symbols we aren't using.
-// test "parseKey" {
-//     var key = std.mem.span("M-C-a");
+test "parseKey" {
+    var key: []const u8 = "M-C-a";
 
-//     try std.testing.expectEqual(Key{
-//         .keysym = 'a',
-//         .modifiers = c.WLR_MODIFIER_ALT | c.WLR_MODIFIER_CTRL,
-//     }, try parseKey(&key));
-// }
+    try std.testing.expectEqual(Key{
+        .keysym = 'a',
+        .modifiers = c.WLR_MODIFIER_ALT | c.WLR_MODIFIER_CTRL,
+    }, try parseKey(&key));
+    try std.testing.expectEqual(@as(usize, 0), key.len);
+}
 
 fn handleKeyboardKeyCB(
     sig_data: ?*c_void,
@@ -402,10 +654,14 @@ fn handleKeyboardKeyCB(
             .modifiers = modifiers & ~consumed_mods,
         };
 
-        self.pending_keys.append(key) catch unreachable;
+        const span = Plugin.getPluginTracer().begin();
+        defer Plugin.getPluginTracer().end(span, .{
+            .kind = .key,
+            .handle = ks,
+        });
 
-        if (self.mappings.get(self.pending_keys.items)) |entry| {
-            if (entry.mapping) |mapping|
+        if (self.step(key)) |node| {
+            if (node.mapping) |mapping|
                 runMappingHandler(self, mapping);
 
             // NOTE: It'd be nice to have more options for
@@ -416,48 +672,81 @@ fn handleKeyboardKeyCB(
                 c.wf_InputEventProcessingMode
                     .WF_INPUT_EVENT_PROC_MODE_NO_CLIENT,
             );
-        } else {
-            // Try again with just the last keysym entered.
+        }
+        self.updateTimeout();
 
-            self.pending_keys.clearRetainingCapacity();
-            self.pending_keys.append(key) catch unreachable;
+        std.log.debug("{}, pending: {d}", .{ key, self.pending_path.items.len });
+    }
+}
 
-            if (self.mappings.get(self.pending_keys.items)) |entry| {
-                if (entry.mapping) |mapping|
-                    runMappingHandler(self, mapping);
+/// Advance the pending sequence by one key. Returns the node reached or null
+/// if no mapping starts with the pending keys.
+fn step(self: *This, key: Key) ?*Node {
+    const current = self.currentNode();
+    if (current.children.get(key)) |next| {
+        self.pending_path.append(next) catch unreachable;
+        return next;
+    }
 
-                c.wf_set_signaled_keyboard_key_mode(
-                    sig_data,
-                    c.wf_InputEventProcessingMode
-                        .WF_INPUT_EVENT_PROC_MODE_NO_CLIENT,
-                );
-            } else {
-                self.pending_keys.clearRetainingCapacity();
-            }
+    // Try again with just the last keysym entered.
+    self.pending_path.clearRetainingCapacity();
+    if (current != &self.root) {
+        if (self.root.children.get(key)) |next| {
+            self.pending_path.append(next) catch unreachable;
+            return next;
         }
-        std.log.debug("{any}, {}", .{ self.pending_keys.items, key });
     }
+    return null;
 }
 
-fn runMappingHandler(self: *This, mapping: anytype) void {
-    Lua.rawGetRef(self.L, mapping.handler);
-    Lua.pcall(
-        self.L,
-        .{ .nargs = 0, .nresults = 0 },
-    ) catch |err| switch (err) {
-        Lua.LuaError.PCallFailed => {
-            std.log.err(
-                "Failed to run keymapping handler lua function.",
-                .{},
-            );
+fn currentNode(self: *This) *Node {
+    const path = self.pending_path.items;
+    return if (path.len > 0) path[path.len - 1] else &self.root;
+}
+
+/// (Re)arm the timeout of the pending sequence, or disarm it if the sequence
+/// doesn't expire.
+fn updateTimeout(self: *This) void {
+    const timeout_ms = self.currentNode().timeout_ms;
+    _ = c.wl_event_source_timer_update(
+        self.timeout_source,
+        @intCast(c_int, timeout_ms),
+    );
+}
+
+fn handleTimeoutCB(data: ?*c_void) callconv(.C) c_int {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+
+    std.log.debug("Pending key sequence timed out.", .{});
+    self.pending_path.clearRetainingCapacity();
+    return 0;
+}
+
+fn runMappingHandler(self: *This, mapping: Mapping) void {
+    switch (mapping.handler) {
+        // Native actions never touch the lua state.
+        .native => |action| action.execute(),
+        .lua => |handler| {
+            Lua.rawGetRef(self.L, handler);
+            Plugin.getPluginProfiler().pcall(
+                self.L,
+                .{ .nargs = 0, .nresults = 0 },
+            ) catch |err| switch (err) {
+                Lua.LuaError.PCallFailed => {
+                    std.log.err(
+                        "Failed to run keymapping handler lua function.",
+                        .{},
+                    );
+                },
+                else => unreachable,
+            };
         },
-        else => unreachable,
-    };
+    }
 
-    const pending_len = self.pending_keys.items.len;
-    self.pending_keys.resize(
+    const pending_len = self.pending_path.items.len;
+    self.pending_path.shrinkRetainingCapacity(
         pending_len - std.math.min(mapping.pop_keys, pending_len),
-    ) catch unreachable;
+    );
 }
 
 pub fn init(self: *@This(), allocator: *Allocator, L: *c.lua_State) !void {
@@ -466,19 +755,32 @@ pub fn init(self: *@This(), allocator: *Allocator, L: *c.lua_State) !void {
 
     c.lua_pushcfunction(L, mapKeys);
     c.lua_setglobal(L, "wf__map_keys");
+    c.lua_pushcfunction(L, unmapKeys);
+    c.lua_setglobal(L, "wf__unmap_keys");
+
+    self.next_mapping_id = 1;
+
+    self.root = .{};
+    errdefer {
+        // NOTE: the trie should still be empty in this function.
+        self.root.deinit(self);
+        self.root = undefined;
+    }
 
-    self.mappings = Mappings.init(allocator);
+    self.pending_path = try std.ArrayList(*Node).initCapacity(allocator, 10);
     errdefer {
-        // NOTE: not deallocating any elements since this should stay empty in
-        // this function.
-        self.mappings.deinit();
-        self.mappings = undefined;
+        self.pending_path.deinit();
+        self.pending_path = undefined;
     }
 
-    self.pending_keys = try std.ArrayList(Key).initCapacity(allocator, 10);
+    self.timeout_source = c.wl_event_loop_add_timer(
+        c.wf_Core_get_event_loop(c.wf_get_core()),
+        handleTimeoutCB,
+        @ptrCast(*c_void, self),
+    ).?;
     errdefer {
-        self.pending_keys.deinit();
-        self.pending_keys = undefined;
+        _ = c.wl_event_source_remove(self.timeout_source);
+        self.timeout_source = undefined;
     }
 
     self.keyboard_key_signal = c.wf_create_signal_connection(
@@ -501,18 +803,12 @@ pub fn deinit(self: *@This()) void {
     c.wf_destroy_signal_connection(self.keyboard_key_signal);
     self.keyboard_key_signal = undefined;
 
-    self.pending_keys.deinit();
-    self.pending_keys = undefined;
+    _ = c.wl_event_source_remove(self.timeout_source);
+    self.timeout_source = undefined;
 
-    {
-        var it = self.mappings.iterator();
-        while (it.next()) |entry| {
-            if (entry.value_ptr.mapping) |mapping|
-                Lua.unref(self.L, mapping.handler);
+    self.pending_path.deinit();
+    self.pending_path = undefined;
 
-            self.allocator.free(entry.key_ptr.*);
-        }
-        self.mappings.deinit();
-        self.mappings = undefined;
-    }
+    self.root.deinit(self);
+    self.root = undefined;
 }
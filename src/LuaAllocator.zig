@@ -0,0 +1,369 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Plugin = @import("Plugin.zig");
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Lua needs its memory aligned for any C type.
+const alignment = 16;
+const Block = [*]align(alignment) u8;
+
+/// Allocations up to the largest size class are carved out of chunks and
+/// recycled through a free list per class. Larger ones go straight to the root
+/// allocator. Chunks are kept until the state is closed.
+const min_class_bits = 4;
+const max_class_bits = 12;
+const class_count = max_class_bits - min_class_bits + 1;
+const max_class_size = 1 << max_class_bits;
+const chunk_size = 64 * 1024;
+
+/// The heap may grow up to twice its live size, and at least this much, before
+/// collection stops waiting for the event loop to be idle.
+const min_backstop = 8 * 1024 * 1024;
+
+const FreeBlock = struct {
+    next: ?*FreeBlock,
+};
+
+pub const Stats = struct {
+    /// Bytes held by lua.
+    in_use: usize = 0,
+    peak: usize = 0,
+    /// Bytes allocated since the state was created.
+    allocated: u64 = 0,
+    /// Allocations refused for going over the limit.
+    refused: u64 = 0,
+    /// Bytes of the chunks backing the size classes.
+    pooled: usize = 0,
+
+    gc_steps: u64 = 0,
+    gc_cycles: u64 = 0,
+    gc_total_ns: u64 = 0,
+    gc_max_ns: u64 = 0,
+    /// Times the heap outgrew the backstop and lua was let to collect on its
+    /// own until the next idle step.
+    gc_backstops: u64 = 0,
+};
+
+allocator: *Allocator,
+
+free_lists: [class_count]?*FreeBlock,
+chunks: std.ArrayListUnmanaged([]align(alignment) u8),
+
+/// Hard cap on the bytes held by lua. 0 for no cap.
+///
+/// Refusing an allocation raises a lua error. Outside of a pcall nothing
+/// catches it and lua aborts, taking the compositor with it, so the cap is
+/// only enforced while `protected` is set. The limit must never abort the
+/// process.
+limit: usize,
+/// Number of nested protected calls lua is in, through `enterProtected`.
+protected: u32,
+stats: Stats,
+
+/// Whether a state runs on this allocator. LuaJIT builds without GC64 can't
+/// use custom allocators on 64 bit targets.
+attached: bool,
+
+/// State whose collection is driven from idle callbacks. Null until
+/// `startGc`.
+L: ?*c.lua_State,
+event_loop: ?*c.wl_event_loop,
+gc_source: ?*c.wl_event_source,
+clock: std.time.Timer,
+/// Least amount of kilobytes freed by an idle step.
+gc_step_kb: u32,
+/// Bytes allocated since the last idle step.
+gc_debt: usize,
+/// Heap size past which lua collects on its own again.
+gc_backstop: usize,
+gc_backstop_hit: bool,
+
+/// lua_Alloc over the size class pool. `ud` is the LuaAllocator.
+pub fn luaAlloc(
+    ud: ?*c_void,
+    ptr: ?*c_void,
+    osize: usize,
+    nsize: usize,
+) callconv(.C) ?*c_void {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), ud));
+    const old: ?Block = if (ptr) |p|
+        @ptrCast(Block, @alignCast(alignment, p))
+    else
+        null;
+
+    if (nsize == 0) {
+        if (old) |block| {
+            self.free(block[0..osize]);
+            self.stats.in_use -= osize;
+        }
+        return null;
+    }
+
+    // Lua counts on shrinking never failing so only growth is capped.
+    const in_use = self.stats.in_use - osize + nsize;
+    if (nsize > osize and self.limit > 0 and self.protected > 0 and
+        in_use > self.limit)
+    {
+        self.stats.refused += 1;
+        return null;
+    }
+
+    const new = self.realloc(old, osize, nsize) orelse return null;
+    self.stats.in_use = in_use;
+    self.stats.peak = std.math.max(self.stats.peak, in_use);
+    if (nsize > osize) {
+        self.stats.allocated += nsize - osize;
+        self.addDebt(nsize - osize);
+    }
+    return new;
+}
+
+/// Enforce the limit until the matching `leaveProtected`. Only to be called
+/// around a lua_pcall.
+pub fn enterProtected(self: *This) void {
+    self.protected += 1;
+}
+
+pub fn leaveProtected(self: *This) void {
+    self.protected -= 1;
+}
+
+/// Lift the limit while native code calls back into lua outside of a pcall,
+/// e.g. through an FFI callback, until `restoreProtected`.
+pub fn suspendProtected(self: *This) u32 {
+    const protected = self.protected;
+    self.protected = 0;
+    return protected;
+}
+
+pub fn restoreProtected(self: *This, protected: u32) void {
+    self.protected = protected;
+}
+
+fn classOf(size: usize) usize {
+    const bits = std.math.log2_int_ceil(
+        usize,
+        std.math.max(size, 1 << min_class_bits),
+    );
+    return @as(usize, bits) - min_class_bits;
+}
+
+fn realloc(self: *This, old: ?Block, osize: usize, nsize: usize) ?Block {
+    if (old) |block| {
+        if (osize <= max_class_size and nsize <= max_class_size) {
+            if (classOf(osize) == classOf(nsize))
+                return block;
+        } else if (osize > max_class_size and nsize > max_class_size) {
+            const buf = self.allocator.reallocAdvanced(
+                block[0..osize],
+                alignment,
+                nsize,
+                .exact,
+            ) catch return null;
+            return buf.ptr;
+        }
+    }
+
+    const new = self.alloc(nsize) orelse return null;
+    if (old) |block| {
+        const len = std.math.min(osize, nsize);
+        std.mem.copy(u8, new[0..len], block[0..len]);
+        self.free(block[0..osize]);
+    }
+    return new;
+}
+
+fn alloc(self: *This, size: usize) ?Block {
+    if (size > max_class_size) {
+        const buf = self.allocator.allocAdvanced(
+            u8,
+            alignment,
+            size,
+            .exact,
+        ) catch return null;
+        return buf.ptr;
+    }
+
+    const class = classOf(size);
+    if (self.free_lists[class] == null) {
+        self.refill(class) catch return null;
+    }
+    const block = self.free_lists[class].?;
+    self.free_lists[class] = block.next;
+    return @ptrCast(Block, @alignCast(alignment, block));
+}
+
+fn free(self: *This, buf: []align(alignment) u8) void {
+    if (buf.len > max_class_size) {
+        self.allocator.free(buf);
+        return;
+    }
+
+    const class = classOf(buf.len);
+    const block = @ptrCast(*FreeBlock, buf.ptr);
+    block.next = self.free_lists[class];
+    self.free_lists[class] = block;
+}
+
+/// Carve a new chunk into blocks of a size class.
+fn refill(self: *This, class: usize) !void {
+    const chunk = try self.allocator.allocAdvanced(
+        u8,
+        alignment,
+        chunk_size,
+        .exact,
+    );
+    errdefer self.allocator.free(chunk);
+    try self.chunks.append(self.allocator, chunk);
+    self.stats.pooled += chunk_size;
+
+    const block_size = @as(usize, 1) << @intCast(u6, class + min_class_bits);
+    var offset: usize = chunk_size;
+    while (offset >= block_size) {
+        offset -= block_size;
+        const block = @ptrCast(*FreeBlock, @alignCast(
+            @alignOf(FreeBlock),
+            chunk.ptr + offset,
+        ));
+        block.next = self.free_lists[class];
+        self.free_lists[class] = block;
+    }
+}
+
+fn addDebt(self: *This, bytes: usize) void {
+    const L = self.L orelse return;
+    self.gc_debt += bytes;
+
+    if (!self.gc_backstop_hit and self.stats.in_use > self.gc_backstop) {
+        // Only resets the collector's threshold. Safe from an allocation.
+        _ = c.lua_gc(L, c.LUA_GCRESTART, 0);
+        self.gc_backstop_hit = true;
+        self.stats.gc_backstops += 1;
+    }
+
+    const step_bytes = @as(usize, self.gc_step_kb) * 1024;
+    if (self.gc_source == null and self.gc_debt >= step_bytes) {
+        self.gc_source = c.wl_event_loop_add_idle(
+            self.event_loop,
+            gcIdleCB,
+            @ptrCast(*c_void, self),
+        );
+    }
+}
+
+fn gcIdleCB(data: ?*c_void) callconv(.C) void {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+
+    // Idle sources are removed after being dispatched.
+    self.gc_source = null;
+    const L = self.L orelse return;
+
+    // Pay back what was allocated since the last step so that collection
+    // keeps up with allocation.
+    const step_kb = std.math.min(
+        std.math.max(self.gc_step_kb, self.gc_debt / 1024),
+        std.math.maxInt(c_int),
+    );
+    self.gc_debt = 0;
+
+    const start = self.clock.read();
+    const finished = c.lua_gc(L, c.LUA_GCSTEP, @intCast(c_int, step_kb)) == 1;
+    // Stepping rearms automatic collection.
+    _ = c.lua_gc(L, c.LUA_GCSTOP, 0);
+    const elapsed = self.clock.read() - start;
+
+    self.stats.gc_steps += 1;
+    self.stats.gc_total_ns += elapsed;
+    self.stats.gc_max_ns = std.math.max(self.stats.gc_max_ns, elapsed);
+    if (finished) {
+        self.stats.gc_cycles += 1;
+        self.gc_backstop = std.math.max(self.stats.in_use * 2, min_backstop);
+    }
+    self.gc_backstop_hit = false;
+}
+
+/// Collect garbage in steps from idle callbacks on the event loop rather than
+/// whenever lua allocates, which is usually in the middle of a handler.
+pub fn startGc(
+    self: *This,
+    L: *c.lua_State,
+    event_loop: *c.wl_event_loop,
+) !void {
+    self.clock = try std.time.Timer.start();
+    self.L = L;
+    self.event_loop = event_loop;
+    self.gc_debt = 0;
+    self.gc_backstop = std.math.max(self.stats.in_use * 2, min_backstop);
+    self.gc_backstop_hit = false;
+    _ = c.lua_gc(L, c.LUA_GCSTOP, 0);
+}
+
+/// Hand collection back to lua.
+pub fn stopGc(self: *This) void {
+    if (self.gc_source) |source|
+        _ = c.wl_event_source_remove(source);
+    self.gc_source = null;
+
+    if (self.L) |L|
+        _ = c.lua_gc(L, c.LUA_GCRESTART, 0);
+    self.L = null;
+}
+
+/// Write the memory and collection stats of the state.
+pub fn writeStats(self: *This, writer: anytype) !void {
+    try writer.print(
+        \\allocator: {s}
+        \\in_use_kb: {d}
+        \\peak_kb: {d}
+        \\pooled_kb: {d}
+        \\limit_kb: {d}
+        \\allocated_kb: {d}
+        \\refused: {d}
+        \\gc_steps: {d}
+        \\gc_cycles: {d}
+        \\gc_total_ms: {d:.3}
+        \\gc_max_ms: {d:.3}
+        \\gc_backstops: {d}
+    , .{
+        if (self.attached) "pool" else "luajit",
+        self.stats.in_use / 1024,
+        self.stats.peak / 1024,
+        self.stats.pooled / 1024,
+        self.limit / 1024,
+        self.stats.allocated / 1024,
+        self.stats.refused,
+        self.stats.gc_steps,
+        self.stats.gc_cycles,
+        @intToFloat(f64, self.stats.gc_total_ns) / std.time.ns_per_ms,
+        @intToFloat(f64, self.stats.gc_max_ns) / std.time.ns_per_ms,
+        self.stats.gc_backstops,
+    });
+}
+
+pub fn init(self: *This, allocator: *Allocator) void {
+    self.allocator = allocator;
+
+    self.free_lists = [_]?*FreeBlock{null} ** class_count;
+    self.chunks = .{};
+    self.limit = @as(usize, Plugin.getOptionInt("lua_memory_limit", 0)) *
+        1024 * 1024;
+    self.protected = 0;
+    self.stats = .{};
+    self.attached = false;
+
+    self.L = null;
+    self.event_loop = null;
+    self.gc_source = null;
+    self.gc_step_kb = std.math.max(Plugin.getOptionInt("lua_gc_step", 256), 1);
+}
+
+/// Release the pool. The state must be closed first.
+pub fn deinit(self: *This) void {
+    std.debug.assert(self.L == null);
+
+    for (self.chunks.items) |chunk|
+        self.allocator.free(chunk);
+    self.chunks.deinit(self.allocator);
+}
@@ -0,0 +1,249 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Lua = @import("Lua.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginModuleWatcher = Plugin.getPluginModuleWatcher;
+
+const os = std.os;
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Directories are watched rather than files since editors often save by
+/// renaming a new file over the old one.
+const watch_mask = os.linux.IN_CLOSE_WRITE | os.linux.IN_MOVED_TO;
+
+allocator: *Allocator,
+L: *c.lua_State,
+
+/// Null until watching is started from lua.
+inotify_fd: ?os.fd_t,
+event_source: ?*c.wl_event_source,
+
+/// Watched directories by watch descriptor.
+dirs: std.AutoHashMap(i32, []const u8),
+/// Real path of the init file. Changing it reloads everything.
+init_file: ?[]const u8,
+/// Module names by the real path of their file.
+modules: std.StringHashMap([:0]const u8),
+
+/// Modules changed since the last reload. Reloads are deferred to an idle
+/// callback so that a burst of events only reloads each module once.
+changed_modules: std.ArrayList([:0]const u8),
+init_file_changed: bool,
+reload_source: ?*c.wl_event_source,
+
+/// Start watching the init file. Modules are added as they are loaded.
+export fn wflua_watch_modules() void {
+    const self = getPluginModuleWatcher();
+    self.start() catch |err| {
+        std.log.err("Failed to start watching lua modules: {any}", .{err});
+    };
+}
+
+/// Reload a module whenever its file changes.
+export fn wflua_watch_module(name: [*:0]const u8, path: [*:0]const u8) void {
+    const self = getPluginModuleWatcher();
+    self.watch(std.mem.span(path), std.mem.span(name)) catch |err| {
+        std.log.err("Failed to watch lua module {s}: {any}", .{ name, err });
+    };
+}
+
+fn start(self: *This) !void {
+    if (self.inotify_fd != null)
+        return;
+
+    const fd = try os.inotify_init1(
+        os.linux.IN_NONBLOCK | os.linux.IN_CLOEXEC,
+    );
+    errdefer os.close(fd);
+
+    self.event_source = c.wl_event_loop_add_fd(
+        c.wf_Core_get_event_loop(c.wf_get_core()),
+        fd,
+        c.WL_EVENT_READABLE,
+        handleEventsCB,
+        @ptrCast(*c_void, self),
+    ) orelse return error.AddEventSourceFailed;
+    self.inotify_fd = fd;
+
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+    try self.watch(try Plugin.getInitFile(&arena.allocator), null);
+}
+
+/// Watch a file. `module` is null for the init file.
+fn watch(self: *This, path: []const u8, module: ?[]const u8) !void {
+    const inotify_fd = self.inotify_fd orelse return error.NotWatching;
+
+    var real_buf: [std.fs.MAX_PATH_BYTES]u8 = undefined;
+    const real_path = try os.realpath(path, &real_buf);
+    const dir = std.fs.path.dirname(real_path) orelse
+        return error.InvalidPath;
+
+    const wd = try os.inotify_add_watch(inotify_fd, dir, watch_mask);
+    if (!self.dirs.contains(wd)) {
+        const owned_dir = try self.allocator.dupe(u8, dir);
+        errdefer self.allocator.free(owned_dir);
+        try self.dirs.put(wd, owned_dir);
+    }
+
+    if (module) |name| {
+        if (self.modules.contains(real_path))
+            return;
+
+        const owned_path = try self.allocator.dupe(u8, real_path);
+        errdefer self.allocator.free(owned_path);
+        const owned_name = try self.allocator.dupeZ(u8, name);
+        errdefer self.allocator.free(owned_name);
+        try self.modules.put(owned_path, owned_name);
+    } else if (self.init_file == null) {
+        self.init_file = try self.allocator.dupe(u8, real_path);
+    }
+
+    std.log.debug("Watching lua file: {s}", .{real_path});
+}
+
+fn handleEventsCB(fd: c_int, mask: u32, data: ?*c_void) callconv(.C) c_int {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+    const Event = os.linux.inotify_event;
+
+    var buf: [4096]u8 align(@alignOf(Event)) = undefined;
+    while (true) {
+        const len = os.read(fd, &buf) catch |err| switch (err) {
+            error.WouldBlock => break,
+            else => {
+                std.log.err("Failed to read file events: {any}", .{err});
+                break;
+            },
+        };
+
+        var i: usize = 0;
+        while (i < len) {
+            const event = @ptrCast(
+                *const Event,
+                @alignCast(@alignOf(Event), &buf[i]),
+            );
+            const name_start = i + @sizeOf(Event);
+            i = name_start + event.len;
+
+            // Events on the directory itself have no name.
+            if (event.len == 0)
+                continue;
+            // The name is padded with null bytes.
+            const name = std.mem.span(
+                @ptrCast([*:0]const u8, &buf[name_start]),
+            );
+            self.fileChanged(event.wd, name);
+        }
+    }
+    return 0;
+}
+
+fn fileChanged(self: *This, wd: i32, name: []const u8) void {
+    const dir = self.dirs.get(wd) orelse return;
+
+    var path_buf: [std.fs.MAX_PATH_BYTES]u8 = undefined;
+    const path = std.fmt.bufPrint(&path_buf, "{s}/{s}", .{ dir, name }) catch
+        return;
+
+    if (self.init_file != null and std.mem.eql(u8, path, self.init_file.?)) {
+        self.init_file_changed = true;
+    } else if (self.modules.get(path)) |module| {
+        for (self.changed_modules.items) |changed| {
+            if (changed.ptr == module.ptr)
+                return;
+        }
+        self.changed_modules.append(module) catch {
+            std.log.err("Failed to queue reload of module: {s}", .{module});
+            return;
+        };
+    } else {
+        return;
+    }
+
+    if (self.reload_source == null) {
+        self.reload_source = c.wl_event_loop_add_idle(
+            c.wf_Core_get_event_loop(c.wf_get_core()),
+            reloadCB,
+            @ptrCast(*c_void, self),
+        );
+    }
+}
+
+fn reloadCB(data: ?*c_void) callconv(.C) void {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+
+    // Idle sources are removed after being dispatched.
+    self.reload_source = null;
+    defer self.changed_modules.clearRetainingCapacity();
+
+    // A full reload runs the changed modules again anyway.
+    if (self.init_file_changed) {
+        self.init_file_changed = false;
+        self.callReload(null);
+        return;
+    }
+
+    for (self.changed_modules.items) |module|
+        self.callReload(module);
+}
+
+fn callReload(self: *This, module: ?[:0]const u8) void {
+    std.log.info("Reloading lua module: {s}", .{module orelse "init"});
+
+    c.lua_getglobal(self.L, "wf__reload_module");
+    if (module) |name| {
+        c.lua_pushstring(self.L, name);
+    } else {
+        c.lua_pushnil(self.L);
+    }
+
+    Lua.pcall(self.L, .{ .nargs = 1, .nresults = 0 }) catch {
+        std.log.err("Failed to reload lua module.", .{});
+    };
+}
+
+pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) void {
+    self.allocator = allocator;
+    self.L = L;
+
+    self.inotify_fd = null;
+    self.event_source = null;
+    self.dirs = std.AutoHashMap(i32, []const u8).init(allocator);
+    self.init_file = null;
+    self.modules = std.StringHashMap([:0]const u8).init(allocator);
+
+    self.changed_modules = std.ArrayList([:0]const u8).init(allocator);
+    self.init_file_changed = false;
+    self.reload_source = null;
+}
+
+pub fn deinit(self: *This) void {
+    if (self.reload_source) |source|
+        _ = c.wl_event_source_remove(source);
+    self.reload_source = null;
+    self.changed_modules.deinit();
+
+    if (self.event_source) |source|
+        _ = c.wl_event_source_remove(source);
+    self.event_source = null;
+    if (self.inotify_fd) |fd|
+        os.close(fd);
+    self.inotify_fd = null;
+
+    var dirs = self.dirs.valueIterator();
+    while (dirs.next()) |dir|
+        self.allocator.free(dir.*);
+    self.dirs.deinit();
+
+    var modules = self.modules.iterator();
+    while (modules.next()) |entry| {
+        self.allocator.free(entry.key_ptr.*);
+        self.allocator.free(entry.value_ptr.*);
+    }
+    self.modules.deinit();
+
+    if (self.init_file) |path|
+        self.allocator.free(path);
+    self.init_file = null;
+}
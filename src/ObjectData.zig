@@ -0,0 +1,84 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginObjectData = Plugin.getPluginObjectData;
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Ids of the data tables lua keeps for objects. They are allocated by lua and
+/// stored on the objects themselves. 0 is never a valid id.
+pub const Id = c_int;
+
+allocator: *Allocator,
+
+/// Objects holding an id. Only needed to erase the ids of the objects still
+/// alive when the state goes away.
+objects: std.AutoHashMap(*c_void, void),
+/// Ids of objects that died, for lua to free its tables. Objects may die in the
+/// middle of a call from lua so lua is never called back.
+released: std.ArrayList(Id),
+
+fn releaseCB(object: ?*c_void, id: c_int, data: ?*c_void) callconv(.C) void {
+    const self = getPluginObjectData();
+
+    _ = self.objects.remove(object.?);
+    self.released.append(id) catch {
+        // Not being able to recycle the id just leaks its table.
+    };
+}
+
+/// Get the id of the data table of an object or 0 if it has none.
+export fn wflua_object_data_get(object: *c_void) Id {
+    return c.wf_object_data_get(object);
+}
+
+/// Store the id of the data table of an object, releasing any it held.
+export fn wflua_object_data_set(object: *c_void, id: Id) bool {
+    const self = getPluginObjectData();
+
+    // Releasing the old id drops the object from the set so do it first.
+    if (self.objects.contains(object))
+        c.wf_object_data_erase(object);
+
+    self.objects.put(object, {}) catch |err| {
+        std.log.err("Failed to store object data: {any}", .{err});
+        return false;
+    };
+    c.wf_object_data_set(object, id, releaseCB, null);
+    return true;
+}
+
+/// Whether an object holds a data table. Unlike `wflua_object_data_get` this
+/// never touches the object so it is safe to ask about dead ones.
+export fn wflua_object_data_exists(object: *c_void) bool {
+    const self = getPluginObjectData();
+    return self.objects.contains(object);
+}
+
+/// Take the id of a data table whose object died, or 0 if there is none left.
+export fn wflua_object_data_take_released() Id {
+    const self = getPluginObjectData();
+    return self.released.popOrNull() orelse 0;
+}
+
+pub fn init(self: *This, allocator: *Allocator) void {
+    self.allocator = allocator;
+    self.objects = std.AutoHashMap(*c_void, void).init(allocator);
+    self.released = std.ArrayList(Id).init(allocator);
+}
+
+/// Erase the ids of every object still alive.
+pub fn deinit(self: *This) void {
+    // Erasing calls back into `releaseCB` which removes from the set being
+    // iterated so iterate over a detached one.
+    var objects = self.objects;
+    defer objects.deinit();
+    self.objects = std.AutoHashMap(*c_void, void).init(self.allocator);
+
+    var it = objects.iterator();
+    while (it.next()) |entry|
+        c.wf_object_data_erase(entry.key_ptr.*);
+    self.objects.deinit();
+    self.released.deinit();
+}
@@ -5,6 +5,15 @@ const Lua = @import("Lua.zig");
 const SignalDispatcher = @import("SignalDispatcher.zig");
 const KeyMappings = @import("KeyMappings.zig");
 const IpcServer = @import("IpcServer.zig");
+const BytecodeCache = @import("BytecodeCache.zig");
+const ModuleWatcher = @import("ModuleWatcher.zig");
+const Timers = @import("Timers.zig");
+const Processes = @import("Processes.zig");
+const Profiler = @import("Profiler.zig");
+const Tracer = @import("Tracer.zig");
+const LuaAllocator = @import("LuaAllocator.zig");
+const Workers = @import("Workers.zig");
+const ObjectData = @import("ObjectData.zig");
 
 const Allocator = std.mem.Allocator;
 const This = @This();
@@ -22,16 +31,56 @@ pub fn getPluginSignalDispatcher() *SignalDispatcher {
 pub fn getPluginKeyMappings() *KeyMappings {
     return &getPlugin().key_mappings;
 }
+pub fn getPluginIpcServer() *IpcServer {
+    return &getPlugin().ipc_server;
+}
+pub fn getPluginBytecodeCache() *BytecodeCache {
+    return &getPlugin().bytecode_cache;
+}
+pub fn getPluginModuleWatcher() *ModuleWatcher {
+    return &getPlugin().module_watcher;
+}
+pub fn getPluginTimers() *Timers {
+    return &getPlugin().timers;
+}
+pub fn getPluginProcesses() *Processes {
+    return &getPlugin().processes;
+}
+pub fn getPluginProfiler() *Profiler {
+    return &getPlugin().profiler;
+}
+pub fn getPluginTracer() *Tracer {
+    return &getPlugin().tracer;
+}
+pub fn getPluginLuaAllocator() *LuaAllocator {
+    return &getPlugin().lua_allocator;
+}
+pub fn getPluginWorkers() *Workers {
+    return &getPlugin().workers;
+}
+pub fn getPluginObjectData() *ObjectData {
+    return &getPlugin().object_data;
+}
 
 /// Root allocator used for the lifetime of the plugin.
 allocator: *Allocator,
 
 /// The lua state handle.
 L: ?*c.lua_State,
+/// Memory of the lua state.
+lua_allocator: LuaAllocator,
 
 signal_dispatcher: SignalDispatcher,
+object_data: ObjectData,
 key_mappings: KeyMappings,
 ipc_server: IpcServer,
+bytecode_cache: BytecodeCache,
+module_watcher: ModuleWatcher,
+timers: Timers,
+processes: Processes,
+workers: Workers,
+profiler: Profiler,
+tracer: Tracer,
 
 /// Exposed standard zig logger to lua.
 export fn wflua_log(lvl: c.wflua_LogLvl, msg: [*:0]const u8) void {
@@ -44,6 +93,32 @@ export fn wflua_log(lvl: c.wflua_LogLvl, msg: [*:0]const u8) void {
     }
 }
 
+/// Whether messages at the given level make it through the zig logger. Lets lua
+/// skip building log messages that would be dropped anyway.
+export fn wflua_log_enabled(lvl: c.wflua_LogLvl) bool {
+    const level: std.log.Level = switch (lvl) {
+        .WFLUA_LOGLVL_DEBUG => .debug,
+        .WFLUA_LOGLVL_WARN => .warn,
+        .WFLUA_LOGLVL_ERR => .err,
+        _ => unreachable,
+    };
+    return @enumToInt(level) <= @enumToInt(std.log.level);
+}
+
+/// Read an int option of the plugin, falling back to a default.
+pub fn getOptionInt(option: [*:0]const u8, default: u32) u32 {
+    var val: c_int = undefined;
+    const err = c.wf_get_option_int("wf-lua", option, &val);
+    if (err != .WF_OK or val < 0) {
+        std.log.warn("Using default value for option {s}: {}", .{
+            option,
+            err,
+        });
+        return default;
+    }
+    return @intCast(u32, val);
+}
+
 /// Reset and rerun the lua init file.
 export fn wflua_reload_init() void {
     getPlugin().reinit() catch |err| {
@@ -58,7 +133,7 @@ export fn wflua_reload_init() void {
 /// > $XDG_CONFIG_HOME/wayfire/init.lua
 /// > $HOME/.config/wayfire/init.lua
 /// Only env vars are checked for existence (not files).
-fn getInitFile(allocator: *Allocator) ![:0]const u8 {
+pub fn getInitFile(allocator: *Allocator) ![:0]const u8 {
     const path = std.fs.path;
 
     if (std.os.getenv("WFLUA_INIT")) |file| {
@@ -85,11 +160,19 @@ fn runUserInit(self: *This) !void {
 
     const init_file = try getInitFile(&arena.allocator);
     std.log.info("Running init file from: {s}", .{init_file});
-    try Lua.doFile(self.L, init_file);
+    self.lua_allocator.enterProtected();
+    defer self.lua_allocator.leaveProtected();
+    try self.bytecode_cache.doFile(self.L.?, init_file);
 
     std.log.info("Done running init.", .{});
 }
 
+/// Last resort for errors raised outside of any pcall, before lua aborts.
+fn luaPanic(L: ?*c.lua_State) callconv(.C) c_int {
+    std.log.err("Unprotected lua error: {s}", .{Lua.tostring(L, -1)});
+    return 0;
+}
+
 /// Plugin entry point.
 pub fn init(self: *This, allocator: *Allocator) !void {
     // NOTE: SIGPIPE needs to be handled locally. So we need to disable the
@@ -104,8 +187,20 @@ pub fn init(self: *This, allocator: *Allocator) !void {
 
     std.debug.print("\n\nHello, wayfireee!!\n\n\n", .{});
 
-    self.L = c.luaL_newstate();
+    self.lua_allocator.init(allocator);
+    errdefer self.lua_allocator.deinit();
+
+    self.L = c.lua_newstate(LuaAllocator.luaAlloc, &self.lua_allocator);
+    if (self.L == null) {
+        std.log.warn("LuaJIT refused the plugin's allocator. " ++
+            "Lua memory is not accounted nor collected when idle.", .{});
+        self.L = c.luaL_newstate();
+    } else {
+        self.lua_allocator.attached = true;
+        _ = c.lua_atpanic(self.L, luaPanic);
+    }
     errdefer {
+        self.lua_allocator.stopGc();
         c.lua_close(self.L);
         self.L = null;
     }
@@ -113,18 +208,53 @@ pub fn init(self: *This, allocator: *Allocator) !void {
 
     c.luaL_openlibs(L);
 
+    if (self.lua_allocator.attached) {
+        try self.lua_allocator.startGc(
+            L.?,
+            c.wf_Core_get_event_loop(c.wf_get_core()),
+        );
+    }
+
     // Add the wf-lua runtime dir to the path.
     try Lua.doString(L, "package.path = package.path .. ';" ++
         build_options.LUA_RUNTIME ++ "/?.lua'");
 
+    // Load lua files from bytecode when possible.
+    try self.bytecode_cache.init(self.allocator, self.L.?);
+    errdefer self.bytecode_cache.deinit();
+
+    // Tracing is off until asked for over ipc.
+    try self.tracer.init(self.allocator);
+    errdefer self.tracer.deinit();
+
+    // Lua handlers are called through the profiler.
+    try self.profiler.init(self.allocator, self.L.?);
+    errdefer self.profiler.deinit();
+
     // Prepare the dispatcher state.
     try self.signal_dispatcher.init(self.allocator, self.L.?);
     errdefer self.signal_dispatcher.deinit();
 
+    self.object_data.init(self.allocator);
+    errdefer self.object_data.deinit();
+
     // Prepare the mappings state.
     try self.key_mappings.init(self.allocator, self.L.?);
     errdefer self.key_mappings.deinit();
 
+    try self.timers.init(self.allocator);
+    errdefer self.timers.deinit();
+
+    self.processes.init(self.allocator);
+    errdefer self.processes.deinit();
+
+    try self.workers.init(self.allocator);
+    errdefer self.workers.deinit();
+
+    // Lua modules are only watched once asked for by the init file.
+    self.module_watcher.init(self.allocator, self.L.?);
+    errdefer self.module_watcher.deinit();
+
     // Run the init file.
     try self.runUserInit();
 
@@ -135,10 +265,20 @@ pub fn init(self: *This, allocator: *Allocator) !void {
 /// Plugin cleanup.
 pub fn fini(self: *This) !void {
     try self.ipc_server.deinit();
+    self.module_watcher.deinit();
+    self.workers.deinit();
+    self.processes.deinit();
+    self.timers.deinit();
     self.key_mappings.deinit();
+    self.object_data.deinit();
     self.signal_dispatcher.deinit();
+    self.profiler.deinit();
+    self.tracer.deinit();
 
+    self.lua_allocator.stopGc();
     c.lua_close(self.L);
+    self.lua_allocator.deinit();
+    self.bytecode_cache.deinit();
 
     std.log.info("Goodbye.", .{});
 }
@@ -149,17 +289,32 @@ pub fn fini(self: *This) !void {
 fn reinit(self: *This) !void {
     std.log.info("Reloading wflua.", .{});
 
+    // Records refer to signal ids that are about to be interned anew.
+    self.tracer.clear();
+
+    self.processes.reset();
+    self.workers.reset();
+    self.timers.deinit();
     self.key_mappings.deinit();
+    // Object data only maps hooked handlers to the wrappers subscribed to
+    // signals, which are all dropped.
+    self.object_data.deinit();
     self.signal_dispatcher.deinit();
 
     // Prepare the dispatcher state.
     try self.signal_dispatcher.init(self.allocator, self.L.?);
     errdefer self.signal_dispatcher.deinit();
 
+    self.object_data.init(self.allocator);
+    errdefer self.object_data.deinit();
+
     // Prepare the mappings state.
     try self.key_mappings.init(self.allocator, self.L.?);
     errdefer self.key_mappings.deinit();
 
+    try self.timers.init(self.allocator);
+    errdefer self.timers.deinit();
+
     // Run the init file.
     try self.runUserInit();
 
@@ -0,0 +1,474 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginProcesses = Plugin.getPluginProcesses;
+
+const os = std.os;
+const linux = os.linux;
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Handles are 1-based like signal handles. 0 is never a valid handle.
+pub const Handle = u32;
+
+/// How often the exit of a process is polled for when pidfds are unsupported.
+const exit_poll_ms = 100;
+/// Output is read in chunks of this size.
+const read_size = 4096;
+
+const StreamKind = enum(u1) { stdout, stderr };
+
+const Stream = struct {
+    /// Null once the stream is closed.
+    fd: ?os.fd_t = null,
+    source: ?*c.wl_event_source = null,
+    /// Data of an incomplete line when line buffered.
+    line: std.ArrayList(u8),
+};
+
+const Process = struct {
+    pid: os.pid_t,
+    line_buffered: bool,
+    streams: [2]Stream,
+
+    /// pidfd becoming readable once the process exits, or a timer polling for
+    /// it when pidfds are unsupported.
+    exit_fd: ?os.fd_t = null,
+    exit_source: ?*c.wl_event_source = null,
+    /// Set once the process has been reaped.
+    exit: ?c.wflua_ProcessExit = null,
+
+    /// Orphaned processes were spawned before the last reload. Their output
+    /// is dropped and they are only kept around to be reaped.
+    orphaned: bool = false,
+};
+
+allocator: *Allocator,
+
+processes: std.ArrayList(?*Process),
+free_handles: std.ArrayList(Handle),
+
+/// Spawn a process. Returns 0 on failure.
+export fn wflua_process_spawn(
+    argv: [*:null]const ?[*:0]const u8,
+    line_buffered: bool,
+) Handle {
+    const self = getPluginProcesses();
+    return self.spawn(argv, line_buffered) catch |err| {
+        std.log.err("Failed to spawn {s}: {any}", .{ argv[0], err });
+        return 0;
+    };
+}
+
+/// Send a signal to a spawned process. Fails on signals out of range, lua
+/// checks them first to raise an error.
+export fn wflua_process_kill(handle: Handle, signal: c_int) bool {
+    const self = getPluginProcesses();
+    const process = self.get(handle) orelse return false;
+    if (process.exit != null)
+        return false;
+
+    // Invalid signals are unreachable in os.kill.
+    const sig = std.math.cast(u8, signal) catch os.NSIG;
+    if (sig >= os.NSIG) {
+        std.log.err("Invalid signal {d} for process {d}.", .{
+            signal,
+            process.pid,
+        });
+        return false;
+    }
+
+    os.kill(process.pid, sig) catch |err| {
+        std.log.err("Failed to kill process {d}: {any}", .{
+            process.pid,
+            err,
+        });
+        return false;
+    };
+    return true;
+}
+
+/// Get the pid of a spawned process, or 0 once it was released.
+export fn wflua_process_get_pid(handle: Handle) c_int {
+    const self = getPluginProcesses();
+    const process = self.get(handle) orelse return 0;
+    return process.pid;
+}
+
+fn get(self: *This, handle: Handle) ?*Process {
+    if (handle == 0 or handle > self.processes.items.len)
+        return null;
+    return self.processes.items[handle - 1];
+}
+
+fn addHandle(self: *This, process: *Process) !Handle {
+    if (self.free_handles.popOrNull()) |handle| {
+        self.processes.items[handle - 1] = process;
+        return handle;
+    }
+    try self.processes.append(process);
+    return @intCast(Handle, self.processes.items.len);
+}
+
+/// Pack a handle and stream into the data of an event source.
+fn streamData(handle: Handle, kind: StreamKind) ?*c_void {
+    return @intToPtr(?*c_void, (@as(usize, handle) << 1) | @enumToInt(kind));
+}
+
+fn eventLoop() ?*c.wl_event_loop {
+    return c.wf_Core_get_event_loop(c.wf_get_core());
+}
+
+fn spawn(
+    self: *This,
+    argv: [*:null]const ?[*:0]const u8,
+    line_buffered: bool,
+) !Handle {
+    const dev_null = try os.openZ("/dev/null", os.O_RDONLY | os.O_CLOEXEC, 0);
+    defer os.close(dev_null);
+
+    const stdout_pipe = try os.pipe2(os.O_CLOEXEC);
+    errdefer os.close(stdout_pipe[0]);
+    defer os.close(stdout_pipe[1]);
+    const stderr_pipe = try os.pipe2(os.O_CLOEXEC);
+    errdefer os.close(stderr_pipe[0]);
+    defer os.close(stderr_pipe[1]);
+
+    const process = try self.allocator.create(Process);
+    errdefer self.allocator.destroy(process);
+
+    const handle = try self.addHandle(process);
+    errdefer {
+        self.processes.items[handle - 1] = null;
+        self.free_handles.append(handle) catch {};
+    }
+
+    const pid = try os.fork();
+    if (pid == 0)
+        execChild(argv, dev_null, stdout_pipe[1], stderr_pipe[1]);
+
+    process.* = .{
+        .pid = pid,
+        .line_buffered = line_buffered,
+        .streams = .{
+            .{ .line = std.ArrayList(u8).init(self.allocator) },
+            .{ .line = std.ArrayList(u8).init(self.allocator) },
+        },
+    };
+
+    // From here on failures are reported through the process events since
+    // the child is already running.
+    self.watchStream(handle, .stdout, stdout_pipe[0]);
+    self.watchStream(handle, .stderr, stderr_pipe[0]);
+    self.watchExit(handle);
+
+    std.log.debug("Spawned process {s} ({d})", .{ argv[0], pid });
+    return handle;
+}
+
+/// Set up the child's stdio and run the command. Never returns.
+fn execChild(
+    argv: [*:null]const ?[*:0]const u8,
+    stdin: os.fd_t,
+    stdout: os.fd_t,
+    stderr: os.fd_t,
+) noreturn {
+    os.dup2(stdin, 0) catch c._exit(127);
+    os.dup2(stdout, 1) catch c._exit(127);
+    os.dup2(stderr, 2) catch c._exit(127);
+
+    // Undo what the compositor set for itself. Ignored signals and the signal
+    // mask are inherited through exec.
+    os.sigprocmask(os.SIG_SETMASK, &os.empty_sigset, null);
+    os.sigaction(os.SIGPIPE, &.{
+        .handler = .{ .sigaction = os.SIG_DFL },
+        .mask = os.empty_sigset,
+        .flags = 0,
+    }, null);
+
+    const envp = @ptrCast([*:null]const ?[*:0]const u8, std.c.environ);
+    _ = os.execvpeZ(argv[0].?, argv, envp);
+    c._exit(127);
+}
+
+fn watchStream(
+    self: *This,
+    handle: Handle,
+    kind: StreamKind,
+    fd: os.fd_t,
+) void {
+    const stream = &self.get(handle).?.streams[@enumToInt(kind)];
+    stream.fd = fd;
+
+    const flags = os.fcntl(fd, os.F_GETFL, 0) catch 0;
+    _ = os.fcntl(fd, os.F_SETFL, flags | os.O_NONBLOCK) catch {};
+
+    stream.source = c.wl_event_loop_add_fd(
+        eventLoop(),
+        fd,
+        c.WL_EVENT_READABLE,
+        handleStreamCB,
+        streamData(handle, kind),
+    );
+    if (stream.source == null) {
+        std.log.err("Failed to watch process output.", .{});
+        closeStream(stream);
+    }
+}
+
+fn pidfdOpen(pid: os.pid_t) ?os.fd_t {
+    const rc = linux.syscall2(.pidfd_open, @bitCast(usize, @as(isize, pid)), 0);
+    if (linux.getErrno(rc) != 0)
+        return null;
+    return @intCast(os.fd_t, rc);
+}
+
+fn watchExit(self: *This, handle: Handle) void {
+    const process = self.get(handle).?;
+    const data = @intToPtr(?*c_void, handle);
+
+    if (pidfdOpen(process.pid)) |fd| {
+        process.exit_source = c.wl_event_loop_add_fd(
+            eventLoop(),
+            fd,
+            c.WL_EVENT_READABLE,
+            handleExitFdCB,
+            data,
+        );
+        if (process.exit_source != null) {
+            process.exit_fd = fd;
+            return;
+        }
+        os.close(fd);
+    }
+
+    process.exit_source = c.wl_event_loop_add_timer(
+        eventLoop(),
+        handleExitTimerCB,
+        data,
+    );
+    if (process.exit_source) |source| {
+        _ = c.wl_event_source_timer_update(source, exit_poll_ms);
+    } else {
+        std.log.err("Failed to watch process {d} exit.", .{process.pid});
+    }
+}
+
+fn closeStream(stream: *Stream) void {
+    if (stream.source) |source|
+        _ = c.wl_event_source_remove(source);
+    stream.source = null;
+    if (stream.fd) |fd|
+        os.close(fd);
+    stream.fd = null;
+}
+
+fn emitOutput(
+    self: *This,
+    handle: Handle,
+    process: *Process,
+    kind: StreamKind,
+    data: []const u8,
+) void {
+    if (process.orphaned)
+        return;
+
+    const event_type: c.wflua_EventType = switch (kind) {
+        .stdout => .WFLUA_EVENT_TYPE_PROCESS_STDOUT,
+        .stderr => .WFLUA_EVENT_TYPE_PROCESS_STDERR,
+    };
+    var chunk = c.wf_String{ .len = data.len, .data = data.ptr };
+    Plugin.getPluginSignalDispatcher().sendEvent(
+        event_type,
+        handle,
+        0,
+        @ptrCast(*c_void, &chunk),
+        null,
+    );
+}
+
+/// Send the complete lines of a chunk of output and keep the rest.
+fn emitLines(
+    self: *This,
+    handle: Handle,
+    process: *Process,
+    kind: StreamKind,
+    data: []const u8,
+) void {
+    const line_buf = &process.streams[@enumToInt(kind)].line;
+
+    var rest = data;
+    while (std.mem.indexOfScalar(u8, rest, '\n')) |end| {
+        if (line_buf.items.len > 0) {
+            line_buf.appendSlice(rest[0..end]) catch {
+                std.log.err("Failed to buffer process output.", .{});
+            };
+            self.emitOutput(handle, process, kind, line_buf.items);
+            line_buf.clearRetainingCapacity();
+        } else {
+            self.emitOutput(handle, process, kind, rest[0..end]);
+        }
+        rest = rest[end + 1 ..];
+    }
+
+    line_buf.appendSlice(rest) catch {
+        std.log.err("Failed to buffer process output. Dropping it.", .{});
+    };
+}
+
+fn handleStreamCB(fd: c_int, mask: u32, data: ?*c_void) callconv(.C) c_int {
+    const self = getPluginProcesses();
+    const packed_data = @ptrToInt(data);
+    const handle = @intCast(Handle, packed_data >> 1);
+    const kind = @intToEnum(StreamKind, @truncate(u1, packed_data));
+    const process = self.get(handle) orelse return 0;
+
+    var buf: [read_size]u8 = undefined;
+    const len = os.read(fd, &buf) catch |err| switch (err) {
+        error.WouldBlock => return 0,
+        else => 0,
+    };
+
+    if (len > 0) {
+        if (process.line_buffered) {
+            self.emitLines(handle, process, kind, buf[0..len]);
+        } else {
+            self.emitOutput(handle, process, kind, buf[0..len]);
+        }
+        return 0;
+    }
+
+    // End of the stream. Flush an unterminated last line.
+    const stream = &process.streams[@enumToInt(kind)];
+    if (stream.line.items.len > 0) {
+        self.emitOutput(handle, process, kind, stream.line.items);
+        stream.line.clearRetainingCapacity();
+    }
+    closeStream(stream);
+    self.finishIfDone(handle, process);
+    return 0;
+}
+
+fn reap(self: *This, handle: Handle, process: *Process) void {
+    var status: u32 = undefined;
+    const rc = linux.waitpid(process.pid, &status, os.WNOHANG);
+    const errno = linux.getErrno(rc);
+    if (errno == 0 and rc == 0)
+        return;
+
+    if (errno != 0) {
+        // Someone else reaped it.
+        process.exit = .{ .code = -1, .signal = 0 };
+    } else if (os.WIFSIGNALED(status)) {
+        process.exit = .{
+            .code = -1,
+            .signal = @intCast(c_int, os.WTERMSIG(status)),
+        };
+    } else {
+        process.exit = .{
+            .code = @intCast(c_int, os.WEXITSTATUS(status)),
+            .signal = 0,
+        };
+    }
+
+    if (process.exit_source) |source|
+        _ = c.wl_event_source_remove(source);
+    process.exit_source = null;
+    if (process.exit_fd) |fd|
+        os.close(fd);
+    process.exit_fd = null;
+
+    self.finishIfDone(handle, process);
+}
+
+fn handleExitFdCB(fd: c_int, mask: u32, data: ?*c_void) callconv(.C) c_int {
+    const self = getPluginProcesses();
+    const handle = @intCast(Handle, @ptrToInt(data));
+    const process = self.get(handle) orelse return 0;
+
+    self.reap(handle, process);
+    return 0;
+}
+
+fn handleExitTimerCB(data: ?*c_void) callconv(.C) c_int {
+    const self = getPluginProcesses();
+    const handle = @intCast(Handle, @ptrToInt(data));
+    const process = self.get(handle) orelse return 0;
+
+    if (process.exit_source) |source|
+        _ = c.wl_event_source_timer_update(source, exit_poll_ms);
+    self.reap(handle, process);
+    return 0;
+}
+
+/// Send the exit event once the process is reaped and its output fully read,
+/// then release it.
+fn finishIfDone(self: *This, handle: Handle, process: *Process) void {
+    const exit = process.exit orelse return;
+    for (process.streams) |stream| {
+        if (stream.fd != null)
+            return;
+    }
+
+    std.log.debug("Process {d} exited.", .{process.pid});
+    self.release(handle, process);
+
+    if (!process.orphaned) {
+        var exit_data = exit;
+        Plugin.getPluginSignalDispatcher().sendEvent(
+            .WFLUA_EVENT_TYPE_PROCESS_EXIT,
+            handle,
+            0,
+            @ptrCast(*c_void, &exit_data),
+            null,
+        );
+    }
+    self.allocator.destroy(process);
+}
+
+fn release(self: *This, handle: Handle, process: *Process) void {
+    for (process.streams) |*stream| {
+        closeStream(stream);
+        stream.line.deinit();
+    }
+    if (process.exit_source) |source|
+        _ = c.wl_event_source_remove(source);
+    if (process.exit_fd) |fd|
+        os.close(fd);
+
+    self.processes.items[handle - 1] = null;
+    self.free_handles.append(handle) catch {
+        // Not being able to recycle the slot just leaks it.
+    };
+}
+
+pub fn init(self: *This, allocator: *Allocator) void {
+    self.allocator = allocator;
+    self.processes = std.ArrayList(?*Process).init(allocator);
+    self.free_handles = std.ArrayList(Handle).init(allocator);
+}
+
+/// Stop sending the events of running processes to lua. They are still
+/// reaped when they exit. Closing their output lets them see a broken pipe.
+pub fn reset(self: *This) void {
+    for (self.processes.items) |slot| {
+        const process = slot orelse continue;
+        process.orphaned = true;
+        for (process.streams) |*stream| {
+            closeStream(stream);
+            stream.line.clearAndFree();
+        }
+    }
+}
+
+/// Processes still running are left alone. The compositor is going away and
+/// will not reap them anyway.
+pub fn deinit(self: *This) void {
+    for (self.processes.items) |slot, i| {
+        const process = slot orelse continue;
+        self.release(@intCast(Handle, i + 1), process);
+        self.allocator.destroy(process);
+    }
+    self.processes.deinit();
+    self.free_handles.deinit();
+}
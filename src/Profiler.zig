@@ -0,0 +1,256 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Lua = @import("Lua.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginProfiler = Plugin.getPluginProfiler;
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Accounting of the calls to a lua handler. Handlers are told apart by where
+/// they are defined so that their stats carry over reloads of the init file.
+const Entry = struct {
+    /// "source:line" of the handler's definition. Owned.
+    location: []const u8,
+    calls: u64 = 0,
+    total_ns: u64 = 0,
+    max_ns: u64 = 0,
+    /// Bytes allocated over the calls. When lua runs on LuaJIT's allocator
+    /// only the growth of the heap is known, a lower bound.
+    alloc_bytes: u64 = 0,
+    /// Calls aborted for exceeding the budget.
+    aborted: u64 = 0,
+};
+
+allocator: *Allocator,
+
+/// The main lua state. Calls are made on the state passed to `call`, which
+/// may be a coroutine of it.
+L: *c.lua_State,
+
+clock: std.time.Timer,
+
+entries: std.ArrayList(Entry),
+/// Index in `entries` by location. Keys are owned by the entries.
+entry_indices: std.StringHashMap(u32),
+
+/// Number of lua instructions a handler may run before it is aborted. 0 when
+/// handlers run unbounded.
+budget: u32,
+/// Number of profiled calls in progress. Handlers may run other handlers, only
+/// the outermost call is held to the budget.
+depth: u32,
+/// Whether the budget of the outermost call was exceeded.
+over_budget: bool,
+
+/// Call a handler through the profiler: `wf__profiled_call(fn, ...)`. Returns
+/// what the handler returns and raises its errors. The call is made on the
+/// calling state, which may be a coroutine.
+fn profiledCall(L: ?*c.lua_State) callconv(.C) c_int {
+    const self = getPluginProfiler();
+    const nargs = c.lua_gettop(L.?) - 1;
+    if (self.call(L.?, nargs, c.LUA_MULTRET) != 0)
+        return c.lua_error(L.?);
+    return c.lua_gettop(L.?);
+}
+
+fn budgetHook(L: ?*c.lua_State, ar: ?*c.lua_Debug) callconv(.C) void {
+    const self = getPluginProfiler();
+    self.over_budget = true;
+
+    // Handlers catching the error keep hitting it until they give up.
+    _ = c.lua_sethook(L.?, budgetHook, c.LUA_MASKCOUNT, 1);
+
+    var buf: [64]u8 = undefined;
+    const msg = std.fmt.bufPrint(
+        &buf,
+        "handler exceeded its budget of {d} instructions",
+        .{self.budget},
+    ) catch unreachable;
+    c.lua_pushlstring(L.?, msg.ptr, msg.len);
+    _ = c.lua_error(L.?);
+}
+
+/// Bytes allocated by lua so far, or the size of its heap when it doesn't run
+/// on the plugin's allocator.
+fn allocatedBytes(L: *c.lua_State) u64 {
+    const lua_allocator = Plugin.getPluginLuaAllocator();
+    if (lua_allocator.attached)
+        return lua_allocator.stats.allocated;
+
+    const kbytes = @intCast(u64, c.lua_gc(L, c.LUA_GCCOUNT, 0));
+    return kbytes * 1024 + @intCast(u64, c.lua_gc(L, c.LUA_GCCOUNTB, 0));
+}
+
+/// Find the entry of the function at `index` of the stack of `L`, adding it if
+/// needed. Returns null for values that aren't lua functions.
+fn entryIndex(self: *This, L: *c.lua_State, index: c_int) !?u32 {
+    if (c.lua_type(L, index) != c.LUA_TFUNCTION)
+        return null;
+
+    var ar: c.lua_Debug = undefined;
+    c.lua_pushvalue(L, index);
+    if (c.lua_getinfo(L, ">S", &ar) == 0)
+        return null;
+
+    var buf: [c.LUA_IDSIZE + 16]u8 = undefined;
+    const location = std.fmt.bufPrint(&buf, "{s}:{d}", .{
+        std.mem.spanZ(@ptrCast([*:0]const u8, &ar.short_src)),
+        ar.linedefined,
+    }) catch unreachable;
+
+    const gop = try self.entry_indices.getOrPut(location);
+    if (!gop.found_existing) {
+        errdefer _ = self.entry_indices.remove(location);
+
+        const owned = try self.allocator.dupe(u8, location);
+        errdefer self.allocator.free(owned);
+        try self.entries.append(.{ .location = owned });
+
+        gop.key_ptr.* = owned;
+        gop.value_ptr.* = @intCast(u32, self.entries.items.len - 1);
+    }
+    return gop.value_ptr.*;
+}
+
+/// Like lua_pcall on `L`, accounting the call to the handler being called.
+/// Returns the status of lua_pcall.
+pub fn call(self: *This, L: *c.lua_State, nargs: c_int, nresults: c_int) c_int {
+    // Not being able to account a call is no reason not to make it.
+    const index = self.entryIndex(L, -nargs - 1) catch |err| x: {
+        std.log.err("Failed to profile handler: {any}", .{err});
+        break :x null;
+    };
+
+    const outermost = self.depth == 0;
+    if (outermost and self.budget > 0) {
+        self.over_budget = false;
+        _ = c.lua_sethook(
+            L,
+            budgetHook,
+            c.LUA_MASKCOUNT,
+            @intCast(c_int, self.budget),
+        );
+    }
+
+    const allocated_before = allocatedBytes(L);
+    const start = self.clock.read();
+
+    const lua_allocator = Plugin.getPluginLuaAllocator();
+    self.depth += 1;
+    lua_allocator.enterProtected();
+    const status = c.lua_pcall(L, nargs, nresults, 0);
+    lua_allocator.leaveProtected();
+    self.depth -= 1;
+
+    const elapsed = self.clock.read() - start;
+    const allocated_after = allocatedBytes(L);
+
+    const aborted = outermost and self.over_budget;
+    if (outermost and self.budget > 0) {
+        _ = c.lua_sethook(L, null, 0, 0);
+        self.over_budget = false;
+    }
+
+    // Nested calls may have added entries, only the index is stable.
+    if (index) |i| {
+        const entry = &self.entries.items[i];
+        entry.calls += 1;
+        entry.total_ns += elapsed;
+        entry.max_ns = std.math.max(entry.max_ns, elapsed);
+        if (allocated_after > allocated_before)
+            entry.alloc_bytes += allocated_after - allocated_before;
+        if (aborted) {
+            entry.aborted += 1;
+            std.log.warn("Aborted handler {s} after {d} instructions.", .{
+                entry.location,
+                self.budget,
+            });
+        }
+    }
+    return status;
+}
+
+/// Like Lua.pcall, accounting the call to the handler being called.
+pub fn pcall(self: *This, L: *c.lua_State, opts: struct {
+    nargs: c_int,
+    nresults: c_int,
+}) Lua.LuaError!void {
+    if (self.call(L, opts.nargs, opts.nresults) != 0) {
+        std.log.err(
+            "pcall failed: {s}",
+            .{Lua.tostring(L, -1)},
+        );
+        c.lua_pop(L, 1);
+        return Lua.LuaError.PCallFailed;
+    }
+}
+
+fn totalGreaterThan(self: *This, a: u32, b: u32) bool {
+    return self.entries.items[a].total_ns > self.entries.items[b].total_ns;
+}
+
+/// Write a line of stats per handler, most time consuming first.
+pub fn writeReport(self: *This, writer: anytype) !void {
+    var order = try self.allocator.alloc(u32, self.entries.items.len);
+    defer self.allocator.free(order);
+    for (order) |*i, n|
+        i.* = @intCast(u32, n);
+    std.sort.sort(u32, order, self, totalGreaterThan);
+
+    try writer.print("budget: {d}\n", .{self.budget});
+    for (order) |i| {
+        const entry = self.entries.items[i];
+        try writer.print(
+            "{s}: calls={d} total_ms={d:.3} max_ms={d:.3} " ++
+                "alloc_kb={d} aborted={d}\n",
+            .{
+                entry.location,
+                entry.calls,
+                @intToFloat(f64, entry.total_ns) / std.time.ns_per_ms,
+                @intToFloat(f64, entry.max_ns) / std.time.ns_per_ms,
+                entry.alloc_bytes / 1024,
+                entry.aborted,
+            },
+        );
+    }
+}
+
+/// Forget the stats of every handler.
+pub fn reset(self: *This) void {
+    for (self.entries.items) |entry|
+        self.allocator.free(entry.location);
+    self.entries.clearRetainingCapacity();
+    self.entry_indices.clearRetainingCapacity();
+}
+
+pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) !void {
+    self.allocator = allocator;
+    self.L = L;
+
+    self.clock = try std.time.Timer.start();
+    self.entries = std.ArrayList(Entry).init(allocator);
+    self.entry_indices = std.StringHashMap(u32).init(allocator);
+
+    self.depth = 0;
+    self.over_budget = false;
+    self.budget = Plugin.getOptionInt("handler_budget", 0);
+    if (self.budget > 0) {
+        // Count hooks only run in the interpreter. Compiled code would outrun
+        // the budget so the JIT is turned off for good.
+        _ = c.luaJIT_setmode(L, 0, c.LUAJIT_MODE_ENGINE | c.LUAJIT_MODE_OFF);
+        _ = c.luaJIT_setmode(L, 0, c.LUAJIT_MODE_ENGINE | c.LUAJIT_MODE_FLUSH);
+        std.log.info("Lua handlers are limited to {d} instructions.", .{
+            self.budget,
+        });
+    }
+
+    c.lua_pushcfunction(L, profiledCall);
+    c.lua_setglobal(L, "wf__profiled_call");
+}
+
+pub fn deinit(self: *This) void {
+    self.reset();
+    self.entries.deinit();
+    self.entry_indices.deinit();
+}
@@ -1,14 +1,119 @@
 const std = @import("std");
 const c = @import("c.zig");
-const getPluginSignalDispatcher =
-    @import("Plugin.zig").getPluginSignalDispatcher;
+const Plugin = @import("Plugin.zig");
+const getPluginSignalDispatcher = Plugin.getPluginSignalDispatcher;
 
 const Allocator = std.mem.Allocator;
 const This = @This();
 
-// { emitter: { signal-name: connection } }
-const ObjectConnections = std.StringHashMap(*c.wf_SignalConnection);
-const ActiveConnectionsMap = std.AutoHashMap(*c_void, ObjectConnections);
+/// Handles and signal ids are 1-based so that they can directly index lua
+/// arrays. 0 is never a valid handle.
+pub const Handle = u32;
+pub const SignalId = u32;
+
+const Connection = struct {
+    emitter: *c_void,
+    signal_id: SignalId,
+    connection: *c.wf_SignalConnection,
+    coalesce: bool,
+    /// Whether a coalesced emission is waiting to be flushed.
+    queued: bool = false,
+    /// Emissions not matching all of these never reach lua.
+    filters: []Filter = &[_]Filter{},
+};
+
+const Filter = struct {
+    field: c.wflua_FilterField,
+    match: c.wflua_FilterMatch,
+    pattern: [:0]const u8,
+
+    /// Get the string a filter looks at in the signal data.
+    fn fieldValue(self: Filter, sig_data: ?*c_void) ?[*:0]const u8 {
+        if (sig_data == null)
+            return null;
+
+        var value: [*c]const u8 = null;
+        if (self.field == .WFLUA_FILTER_FIELD_OUTPUT_NAME) {
+            const output = c.wf_get_signaled_output(sig_data) orelse
+                return null;
+            value = c.wf_Output_get_name(output);
+        } else {
+            const view = c.wf_get_signaled_view(sig_data) orelse return null;
+            if (self.field == .WFLUA_FILTER_FIELD_VIEW_OUTPUT) {
+                const output = c.wf_View_get_output(view) orelse return null;
+                value = c.wf_Output_get_name(output);
+            } else {
+                // Read from the view's property cache to avoid copying the
+                // strings on every emission.
+                const props = c.wf_View_get_properties(view);
+                value = if (self.field == .WFLUA_FILTER_FIELD_VIEW_APP_ID)
+                    props.*.app_id.data
+                else
+                    props.*.title.data;
+            }
+        }
+
+        if (value == null)
+            return null;
+        return @ptrCast([*:0]const u8, value);
+    }
+
+    fn matches(self: Filter, sig_data: ?*c_void) bool {
+        const value = self.fieldValue(sig_data) orelse return false;
+
+        if (self.match == .WFLUA_FILTER_MATCH_GLOB)
+            return c.fnmatch(self.pattern, value, 0) == 0;
+        return std.mem.eql(u8, std.mem.span(value), self.pattern);
+    }
+};
+
+/// A table of slots addressed by handle. Freed slots are recycled.
+fn HandleTable(comptime T: type) type {
+    return struct {
+        slots: std.ArrayList(?T),
+        free_handles: std.ArrayList(Handle),
+
+        fn init(allocator: *Allocator) @This() {
+            return .{
+                .slots = std.ArrayList(?T).init(allocator),
+                .free_handles = std.ArrayList(Handle).init(allocator),
+            };
+        }
+
+        fn deinit(self: *@This()) void {
+            self.slots.deinit();
+            self.free_handles.deinit();
+        }
+
+        fn add(self: *@This(), value: T) !Handle {
+            if (self.free_handles.popOrNull()) |handle| {
+                self.slots.items[handle - 1] = value;
+                return handle;
+            }
+            try self.slots.append(value);
+            return @intCast(Handle, self.slots.items.len);
+        }
+
+        fn get(self: *@This(), handle: Handle) ?T {
+            if (handle == 0 or handle > self.slots.items.len)
+                return null;
+            return self.slots.items[handle - 1];
+        }
+
+        fn remove(self: *@This(), handle: Handle) ?T {
+            const value = self.get(handle) orelse return null;
+            self.slots.items[handle - 1] = null;
+            self.free_handles.append(handle) catch {
+                // Not being able to recycle the slot just leaks it.
+            };
+            return value;
+        }
+    };
+}
+
+/// Number of times a dispatcher was initialized. Tells the callbacks running
+/// lua whether it reinitialized the dispatcher.
+var init_count: u32 = 0;
 
 allocator: *Allocator,
 L: *c.lua_State,
@@ -16,39 +121,180 @@ L: *c.lua_State,
 /// This callback is used for most C -> lua communication.
 event_callback: c.wflua_EventCallback,
 
-/// Map of active signal connections grouped by wayfire object.
-/// { emitter: { signal-name: connection, ... }, ... }
-/// All stored memory should be in our root allocator.
-active_connections: ActiveConnectionsMap,
+/// Interned signal names. A signal's id is its index + 1.
+signal_names: std.ArrayList([:0]const u8),
+signal_ids: std.StringHashMap(SignalId),
+
+/// Active signal connections.
+connections: HandleTable(Connection),
+
+/// Objects having their lifetime watched.
+lifetimes: HandleTable(Lifetime),
+
+/// Coalesced subscriptions with an emission waiting for the next flush.
+queued_events: std.ArrayList(Handle),
+/// The queue currently being flushed. Kept around to reuse its memory.
+flushing_events: std.ArrayList(Handle),
+/// Pending idle callback flushing the queue, if any.
+flush_source: ?*c.wl_event_source,
+
+const Lifetime = struct {
+    object: *c_void,
+    /// Identifies our callback in the object's lifetime tracker.
+    token: c_uint,
+};
 
 fn lifetimeCB(emitter: ?*c_void, data: ?*c_void) callconv(.C) void {
     const self = getPluginSignalDispatcher();
+    const handle = @intCast(Handle, @ptrToInt(data));
 
     std.log.debug("Object died: {x}", .{emitter.?});
-    self.event_callback.?(
-        emitter.?,
+    // The object is gone. Its lifetime tracker is being destroyed so there is
+    // nothing left to unsubscribe from.
+    _ = self.lifetimes.remove(handle);
+    self.sendEvent(
         .WFLUA_EVENT_TYPE_EMITTER_DESTROYED,
+        handle,
+        0,
         null,
-        null,
+        emitter,
     );
 }
 
+/// Pass an event to lua through the event callback, tracing it.
+pub fn sendEvent(
+    self: *This,
+    event_type: c.wflua_EventType,
+    handle: Handle,
+    signal_id: SignalId,
+    data: ?*c_void,
+    emitter: ?*c_void,
+) void {
+    const tracer = Plugin.getPluginTracer();
+    const span = tracer.begin();
+
+    // Events may be sent from within a handler. The callback only catches
+    // errors once in lua so it must not run out of memory before that.
+    const lua_allocator = Plugin.getPluginLuaAllocator();
+    const protected = lua_allocator.suspendProtected();
+    self.event_callback.?(event_type, handle, signal_id, data);
+    lua_allocator.restoreProtected(protected);
+
+    tracer.end(span, .{
+        .kind = switch (event_type) {
+            .WFLUA_EVENT_TYPE_SIGNAL => .signal,
+            .WFLUA_EVENT_TYPE_EMITTER_DESTROYED => .lifetime,
+            .WFLUA_EVENT_TYPE_TIMER => .timer,
+            .WFLUA_EVENT_TYPE_PROCESS_STDOUT,
+            .WFLUA_EVENT_TYPE_PROCESS_STDERR,
+            => .process_output,
+            .WFLUA_EVENT_TYPE_PROCESS_EXIT => .process_exit,
+            .WFLUA_EVENT_TYPE_WORKER_RESULT => .worker_result,
+            _ => unreachable,
+        },
+        .emitter = emitter,
+        .signal_id = signal_id,
+        .handle = handle,
+    });
+}
+
 fn signalEventCB(
     sig_data: ?*c_void,
-    object: ?*c_void,
-    signal_: ?*c_void,
+    data1: ?*c_void,
+    data2: ?*c_void,
 ) callconv(.C) void {
     const self = getPluginSignalDispatcher();
-    const signal = @ptrCast([*:0]const u8, signal_);
-    std.log.debug("Object {x} emitted {s}", .{ object.?, signal });
-    self.event_callback.?(
-        object,
+    const handle = @intCast(Handle, @ptrToInt(data1));
+    const signal_id = @intCast(SignalId, @ptrToInt(data2));
+
+    const conn = &(self.connections.slots.items[handle - 1].?);
+    for (conn.filters) |filter| {
+        if (!filter.matches(sig_data))
+            return;
+    }
+
+    if (conn.coalesce) {
+        self.queueEvent(handle, conn);
+        return;
+    }
+
+    self.sendEvent(
         .WFLUA_EVENT_TYPE_SIGNAL,
-        signal,
+        handle,
+        signal_id,
         sig_data,
+        conn.emitter,
     );
 }
 
+/// Queue a coalesced emission to be delivered on the next flush.
+fn queueEvent(self: *This, handle: Handle, conn: *Connection) void {
+    if (conn.queued)
+        return;
+
+    self.queued_events.append(handle) catch {
+        std.log.err("Failed to queue coalesced signal. Dropping it.", .{});
+        return;
+    };
+    conn.queued = true;
+
+    if (self.flush_source == null) {
+        self.flush_source = c.wl_event_loop_add_idle(
+            c.wf_Core_get_event_loop(c.wf_get_core()),
+            flushEventsCB,
+            @ptrCast(*c_void, self),
+        );
+    }
+}
+
+fn flushEventsCB(data: ?*c_void) callconv(.C) void {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+
+    // Idle sources are removed after being dispatched.
+    self.flush_source = null;
+
+    // Anything emitted by the lua handlers gets queued for the next flush.
+    // The queue being flushed is held here as a handler reloading the init
+    // file deinitializes the dispatcher under our feet.
+    var events = self.queued_events;
+    self.queued_events = self.flushing_events;
+    self.flushing_events = std.ArrayList(Handle).init(self.allocator);
+    const generation = init_count;
+    defer {
+        if (generation == init_count) {
+            // Keep the memory around for the next flush.
+            events.clearRetainingCapacity();
+            self.flushing_events = events;
+        } else {
+            events.deinit();
+        }
+    }
+
+    for (events.items) |handle| {
+        // The connections are gone if the dispatcher was reinitialized.
+        if (generation != init_count)
+            break;
+
+        // The subscription may have been dropped (and its handle reused) since
+        // the emission was queued. Only still-queued connections are flushed.
+        const slot = &self.connections.slots.items[handle - 1];
+        if (slot.* == null)
+            continue;
+        const conn = &(slot.*.?);
+        if (!conn.queued)
+            continue;
+        conn.queued = false;
+
+        self.sendEvent(
+            .WFLUA_EVENT_TYPE_SIGNAL,
+            handle,
+            conn.signal_id,
+            null,
+            conn.emitter,
+        );
+    }
+}
+
 /// Register the lua event callback.
 export fn wflua_register_event_callback(callback: c.wflua_EventCallback) void {
     const self = getPluginSignalDispatcher();
@@ -56,146 +302,216 @@ export fn wflua_register_event_callback(callback: c.wflua_EventCallback) void {
     std.debug.assert(self.event_callback == null);
     self.event_callback = callback;
 }
+
 /// Start listening for an object being destroyed.
-export fn wflua_lifetime_subscribe(object: *c_void) void {
-    std.log.debug("Watching object lifetime: {x}", .{object});
-    c.wf_lifetime_subscribe(object, lifetimeCB, null);
+export fn wflua_lifetime_subscribe(object: *c_void) Handle {
+    const self = getPluginSignalDispatcher();
+
+    // The handle is passed to the callback so reserve it first.
+    const handle = self.lifetimes.add(.{
+        .object = object,
+        .token = 0,
+    }) catch unreachable;
+    const token = c.wf_lifetime_subscribe(
+        object,
+        lifetimeCB,
+        @intToPtr(?*c_void, handle),
+    );
+    self.lifetimes.slots.items[handle - 1] = .{
+        .object = object,
+        .token = token,
+    };
+
+    std.log.debug("Watching object lifetime: {x} ({d})", .{ object, handle });
+    return handle;
 }
+
 /// Stop listening for an object being destroyed.
-export fn wflua_lifetime_unsubscribe(object: *c_void) void {
-    std.log.debug("Stopped watching object lifetime: {x}", .{object});
-    c.wf_lifetime_unsubscribe(object, lifetimeCB);
+export fn wflua_lifetime_unsubscribe(handle: Handle) void {
+    const self = getPluginSignalDispatcher();
+
+    const lifetime = self.lifetimes.remove(handle) orelse {
+        std.log.err("Unsubscribed from unknown lifetime handle! {d}", .{handle});
+        return;
+    };
+    c.wf_lifetime_unsubscribe(lifetime.object, lifetime.token);
+
+    std.log.debug(
+        "Stopped watching object lifetime: {x}",
+        .{lifetime.object},
+    );
 }
 
-/// Start listening for an object's signal.
-export fn wflua_signal_subscribe(object: *c_void, signal: [*:0]const u8) void {
+/// Get the id of a signal name. The name is copied the first time it is seen.
+export fn wflua_signal_intern(signal: [*:0]const u8) SignalId {
     const self = getPluginSignalDispatcher();
+    return self.intern(std.mem.span(signal)) catch unreachable;
+}
 
-    var object_conns = mk_oc: {
-        const gop =
-            self.active_connections.getOrPut(object) catch unreachable;
-        if (!gop.found_existing) {
-            gop.value_ptr.* = ObjectConnections.init(self.allocator);
-        }
-        break :mk_oc gop.value_ptr;
-    };
+fn intern(self: *This, signal: []const u8) !SignalId {
+    if (self.signal_ids.get(signal)) |id|
+        return id;
 
-    const owned_signal =
-        self.allocator.dupeZ(u8, std.mem.span(signal)) catch unreachable;
+    const owned_signal = try self.allocator.dupeZ(u8, signal);
     errdefer self.allocator.free(owned_signal);
 
-    const connection = c.wf_create_signal_connection(
-        signalEventCB,
-        object,
-        @ptrCast(*c_void, owned_signal),
-    );
-    errdefer c.wf_destroy_signal_connection(connection);
-
-    if (object_conns.fetchPut(
-        owned_signal,
-        connection.?,
-    ) catch unreachable) |kv| {
-        std.log.err(
-            "Subscribed to signal more than once on the same object! {x}",
-            .{object},
-        );
-        self.allocator.free(kv.key);
-        c.wf_destroy_signal_connection(kv.value);
-    }
+    try self.signal_names.append(owned_signal);
+    errdefer _ = self.signal_names.pop();
 
-    c.wf_signal_subscribe(object, signal, connection);
+    const id = @intCast(SignalId, self.signal_names.items.len);
+    try self.signal_ids.put(owned_signal, id);
+    return id;
+}
 
-    std.log.debug(
-        "Watching object {x} for signal: {s}",
-        .{ object, signal },
-    );
+/// Get the name of an interned signal.
+pub fn signalName(self: *This, signal_id: SignalId) [:0]const u8 {
+    return self.signal_names.items[signal_id - 1];
 }
 
-/// Stop listening for an object's signal.
-export fn wflua_signal_unsubscribe(
+/// Start listening for an object's signal.
+/// The returned handle identifies this subscription in event callbacks.
+export fn wflua_signal_subscribe(
     object: *c_void,
-    signal: [*:0]const u8,
-) void {
-    // Just destroy the appropriate signal connection object and the signal will
-    // be disconnected.
-
+    signal_id: SignalId,
+    mode: c.wflua_SubscribeMode,
+) Handle {
     const self = getPluginSignalDispatcher();
+    return self.subscribe(
+        object,
+        signal_id,
+        mode == .WFLUA_SUBSCRIBE_MODE_COALESCE,
+    ) catch unreachable;
+}
 
-    var object_conns = self.active_connections.get(object) orelse {
-        std.log.err(
-            "Unsubscribed from non-subscribed-to object! {x}",
-            .{object},
-        );
-        return;
-    };
+fn subscribe(
+    self: *This,
+    object: *c_void,
+    signal_id: SignalId,
+    coalesce: bool,
+) !Handle {
+    // Reserve the handle first since the connection carries it.
+    const handle = try self.connections.add(undefined);
+    errdefer _ = self.connections.remove(handle);
 
-    const sig_entry = object_conns.fetchRemove(std.mem.span(signal)) orelse {
-        std.log.err(
-            "Unsubscribed from non-subscribed-to signal! {s} on {x}",
-            .{ signal, object },
-        );
-        return;
+    const connection = c.wf_create_signal_connection(
+        signalEventCB,
+        @intToPtr(?*c_void, handle),
+        @intToPtr(?*c_void, signal_id),
+    ).?;
+    self.connections.slots.items[handle - 1] = Connection{
+        .emitter = object,
+        .signal_id = signal_id,
+        .connection = connection,
+        .coalesce = coalesce,
     };
 
-    self.allocator.free(sig_entry.key);
-    c.wf_destroy_signal_connection(sig_entry.value);
-
-    if (object_conns.count() == 0) {
-        _ = self.active_connections.remove(object);
-        object_conns.deinit();
-    }
+    c.wf_signal_subscribe(object, self.signalName(signal_id), connection);
 
     std.log.debug(
-        "Stopped watching object {x} for signal: {s}",
-        .{ object, signal },
+        "Watching object {x} for signal: {s} ({d})",
+        .{ object, self.signalName(signal_id), handle },
     );
+    return handle;
 }
 
-/// Stop listening for any of an object's signals.
-export fn wflua_signal_unsubscribe_all(object: *c_void) void {
-    // Just free all the signal connections of an object and the signals will be
-    // disconnected.
+/// Only deliver the emissions of a subscription matching a pattern.
+export fn wflua_signal_add_filter(
+    handle: Handle,
+    field: c.wflua_FilterField,
+    match: c.wflua_FilterMatch,
+    pattern: [*:0]const u8,
+) void {
     const self = getPluginSignalDispatcher();
-
-    const ac = &self.active_connections;
-    var object_conns_entry = ac.fetchRemove(object) orelse {
-        std.log.err(
-            "Unsubscribed from non-subscribed-to object! {x}",
-            .{object},
-        );
-        return;
+    self.addFilter(handle, .{
+        .field = field,
+        .match = match,
+        .pattern = std.mem.span(pattern),
+    }) catch |err| {
+        std.log.err("Failed to add signal filter: {any}", .{err});
     };
+}
 
-    self.deinitObjectConnections(&object_conns_entry.value);
+fn addFilter(self: *This, handle: Handle, filter: Filter) !void {
+    if (self.connections.get(handle) == null)
+        return error.UnknownHandle;
+    const conn = &(self.connections.slots.items[handle - 1].?);
+
+    const owned_pattern = try self.allocator.dupeZ(u8, filter.pattern);
+    errdefer self.allocator.free(owned_pattern);
+
+    conn.filters = try self.allocator.realloc(
+        conn.filters,
+        conn.filters.len + 1,
+    );
+    conn.filters[conn.filters.len - 1] = .{
+        .field = filter.field,
+        .match = filter.match,
+        .pattern = owned_pattern,
+    };
 }
 
-/// Recursively deinit an ObjectConnections map.
-fn deinitObjectConnections(self: *This, obj_entry: *ObjectConnections) void {
-    var iter_sigs = obj_entry.iterator();
-    while (iter_sigs.next()) |kv| {
-        self.allocator.free(kv.key_ptr.*);
-        c.wf_destroy_signal_connection(kv.value_ptr.*);
-    }
-    obj_entry.deinit();
+fn destroyConnection(self: *This, conn: Connection) void {
+    c.wf_destroy_signal_connection(conn.connection);
+
+    for (conn.filters) |filter|
+        self.allocator.free(filter.pattern);
+    self.allocator.free(conn.filters);
 }
 
-/// Recursively deinit the active_connections map.
-fn deinitActiveConnections(self: *This) void {
-    var iter_objs = self.active_connections.valueIterator();
-    while (iter_objs.next()) |obj_conns| {
-        self.deinitObjectConnections(obj_conns);
-    }
-    self.active_connections.deinit();
+/// Stop listening for an object's signal.
+export fn wflua_signal_unsubscribe(handle: Handle) void {
+    // Just destroy the appropriate signal connection object and the signal will
+    // be disconnected.
+    const self = getPluginSignalDispatcher();
+
+    const conn = self.connections.remove(handle) orelse {
+        std.log.err("Unsubscribed from unknown signal handle! {d}", .{handle});
+        return;
+    };
+    self.destroyConnection(conn);
+
+    std.log.debug(
+        "Stopped watching object {x} for signal: {s}",
+        .{ conn.emitter, self.signalName(conn.signal_id) },
+    );
 }
 
 pub fn init(self: *This, allocator: *Allocator, L: *c.lua_State) !void {
+    init_count +%= 1;
     self.L = L;
     self.allocator = allocator;
 
-    self.active_connections = ActiveConnectionsMap.init(self.allocator);
-    errdefer self.deinitActiveConnections();
+    self.signal_names = std.ArrayList([:0]const u8).init(allocator);
+    self.signal_ids = std.StringHashMap(SignalId).init(allocator);
+    self.connections = HandleTable(Connection).init(allocator);
+    self.lifetimes = HandleTable(Lifetime).init(allocator);
+
+    self.queued_events = std.ArrayList(Handle).init(allocator);
+    self.flushing_events = std.ArrayList(Handle).init(allocator);
+    self.flush_source = null;
 }
 
 pub fn deinit(self: *This) void {
-    self.deinitActiveConnections();
+    if (self.flush_source) |source|
+        _ = c.wl_event_source_remove(source);
+    self.flush_source = null;
+    self.queued_events.deinit();
+    self.flushing_events.deinit();
+
+    for (self.connections.slots.items) |slot| {
+        if (slot) |conn|
+            self.destroyConnection(conn);
+    }
+    self.connections.deinit();
+
+    for (self.lifetimes.slots.items) |slot| {
+        if (slot) |lifetime|
+            c.wf_lifetime_unsubscribe(lifetime.object, lifetime.token);
+    }
+    self.lifetimes.deinit();
+
+    self.signal_ids.deinit();
+    for (self.signal_names.items) |name|
+        self.allocator.free(name);
+    self.signal_names.deinit();
 }
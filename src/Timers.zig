@@ -0,0 +1,511 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginTimers = Plugin.getPluginTimers;
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Timers are kept in a hierarchical timing wheel ticking every millisecond.
+/// Level 0 has a slot per tick and every slot of the next levels spans a full
+/// turn of the level below. Timers are moved down a level when their slot
+/// comes up, so adding, cancelling and firing a timer are all O(1). A single
+/// wayland timer is armed for the next slot with anything in it.
+const slot_bits = 6;
+const slots_per_level = 1 << slot_bits;
+const slot_mask = slots_per_level - 1;
+const levels = 4;
+/// About 4.6 hours. Timers further out are parked in the last level and moved
+/// down as it turns.
+const max_delta: u64 = (1 << (slot_bits * levels)) - 1;
+
+/// Handles are 1-based like signal handles. 0 is never a valid handle and
+/// marks the end of slot lists.
+pub const Handle = u32;
+
+const Timer = struct {
+    /// Tick at which the timer fires.
+    expires: u64,
+    /// Zero for one-shot timers.
+    interval_ms: u32,
+    /// Bumped whenever the handle is freed so that fired timers can be told
+    /// apart from newer timers reusing their handle.
+    generation: u32 = 0,
+    allocated: bool = false,
+    /// Whether the timer is in a slot of the wheel. Fired one-shot timers are
+    /// kept allocated but unlinked until their event is delivered.
+    linked: bool = false,
+    level: u8 = 0,
+    slot: u8 = 0,
+    prev: Handle = 0,
+    next: Handle = 0,
+};
+
+const Expired = struct {
+    handle: Handle,
+    generation: u32,
+};
+
+allocator: *Allocator,
+
+/// Monotonic clock. Ticks are milliseconds since it was started.
+clock: std.time.Timer,
+/// Last tick the wheel was advanced to.
+now: u64,
+
+timers: std.ArrayList(Timer),
+free_handles: std.ArrayList(Handle),
+
+/// Head of the timer list of every slot.
+wheel: [levels][slots_per_level]Handle,
+/// Number of timers in every level.
+level_counts: [levels]u32,
+
+/// Timers fired by the last advance, waiting to be delivered to lua.
+expired: std.ArrayList(Expired),
+
+timer_source: *c.wl_event_source,
+
+/// Call back lua after `timeout_ms`, then every `interval_ms` if not 0.
+/// Returns 0 on failure.
+export fn wflua_timer_add(timeout_ms: c_uint, interval_ms: c_uint) Handle {
+    const self = getPluginTimers();
+    return self.add(timeout_ms, interval_ms) catch |err| {
+        std.log.err("Failed to add timer: {any}", .{err});
+        return 0;
+    };
+}
+
+/// Cancel a pending timer.
+export fn wflua_timer_cancel(handle: Handle) void {
+    const self = getPluginTimers();
+    if (self.get(handle) == null) {
+        std.log.err("Cancelled unknown timer handle! {d}", .{handle});
+        return;
+    }
+    self.cancel(handle);
+    self.rearm();
+}
+
+fn clockNow(self: *This) u64 {
+    return self.clock.read() / std.time.ns_per_ms;
+}
+
+fn get(self: *This, handle: Handle) ?*Timer {
+    if (handle == 0 or handle > self.timers.items.len)
+        return null;
+    const timer = &self.timers.items[handle - 1];
+    return if (timer.allocated) timer else null;
+}
+
+fn add(self: *This, timeout_ms: u32, interval_ms: u32) !Handle {
+    // The wheel is only advanced when the wayland timer fires so it may lag
+    // behind the clock. Timers are placed relative to it but still expire at
+    // the right time. An empty wheel can just jump ahead.
+    const now = self.clockNow();
+    if (self.count() == 0)
+        self.now = now;
+    const handle = try self.insert(
+        now + std.math.max(timeout_ms, 1),
+        interval_ms,
+    );
+
+    self.rearm();
+    return handle;
+}
+
+/// Allocate a timer expiring at a tick and put it in the wheel.
+fn insert(self: *This, expires: u64, interval_ms: u32) !Handle {
+    const handle = if (self.free_handles.popOrNull()) |handle|
+        handle
+    else blk: {
+        try self.timers.append(.{ .expires = 0, .interval_ms = 0 });
+        break :blk @intCast(Handle, self.timers.items.len);
+    };
+
+    const timer = &self.timers.items[handle - 1];
+    timer.expires = expires;
+    timer.interval_ms = interval_ms;
+    timer.allocated = true;
+    self.link(handle);
+    return handle;
+}
+
+fn cancel(self: *This, handle: Handle) void {
+    const timer = self.get(handle).?;
+    if (timer.linked)
+        self.unlink(handle);
+    self.free(handle);
+}
+
+fn free(self: *This, handle: Handle) void {
+    const timer = &self.timers.items[handle - 1];
+    timer.allocated = false;
+    timer.generation +%= 1;
+    self.free_handles.append(handle) catch {
+        // Not being able to recycle the slot just leaks it.
+    };
+}
+
+fn count(self: *This) u64 {
+    var total: u64 = 0;
+    for (self.level_counts) |level_count|
+        total += level_count;
+    return total;
+}
+
+/// Put a timer in the slot its expiry falls in, relative to the wheel's
+/// current tick.
+fn link(self: *This, handle: Handle) void {
+    const timer = &self.timers.items[handle - 1];
+
+    const delta = std.math.min(
+        if (timer.expires > self.now) timer.expires - self.now else 0,
+        max_delta,
+    );
+    var level: usize = 0;
+    while (level + 1 < levels and
+        delta >= @as(u64, 1) << @intCast(u6, slot_bits * (level + 1)))
+        level += 1;
+    const tick = self.now + delta;
+    const slot = (tick >> @intCast(u6, slot_bits * level)) & slot_mask;
+
+    const head = self.wheel[level][slot];
+    timer.level = @intCast(u8, level);
+    timer.slot = @intCast(u8, slot);
+    timer.prev = 0;
+    timer.next = head;
+    timer.linked = true;
+    if (head != 0)
+        self.timers.items[head - 1].prev = handle;
+    self.wheel[level][slot] = handle;
+    self.level_counts[level] += 1;
+}
+
+fn unlink(self: *This, handle: Handle) void {
+    const timer = &self.timers.items[handle - 1];
+
+    if (timer.prev != 0) {
+        self.timers.items[timer.prev - 1].next = timer.next;
+    } else {
+        self.wheel[timer.level][timer.slot] = timer.next;
+    }
+    if (timer.next != 0)
+        self.timers.items[timer.next - 1].prev = timer.prev;
+
+    timer.linked = false;
+    self.level_counts[timer.level] -= 1;
+}
+
+/// Take all the timers out of a slot. Returns the head of their list.
+fn detach(self: *This, level: usize, slot: usize) Handle {
+    const head = self.wheel[level][slot];
+    self.wheel[level][slot] = 0;
+
+    var handle = head;
+    while (handle != 0) {
+        const timer = &self.timers.items[handle - 1];
+        timer.linked = false;
+        self.level_counts[level] -= 1;
+        handle = timer.next;
+    }
+    return head;
+}
+
+/// Move the timers of the slots coming up on the upper levels down.
+fn cascade(self: *This) void {
+    var level: usize = 1;
+    while (level < levels) : (level += 1) {
+        const shift = @intCast(u6, slot_bits * level);
+        // Only cascade when all the levels below just turned.
+        if (self.now & ((@as(u64, 1) << shift) - 1) != 0)
+            break;
+
+        var next = self.detach(level, (self.now >> shift) & slot_mask);
+        while (next != 0) {
+            const handle = next;
+            next = self.timers.items[handle - 1].next;
+            self.link(handle);
+        }
+    }
+}
+
+/// Fire the timers of the current level 0 slot. `target` is the tick the wheel
+/// is being advanced to.
+fn fireSlot(self: *This, target: u64) void {
+    var next = self.detach(0, self.now & slot_mask);
+    while (next != 0) {
+        const handle = next;
+        const timer = &self.timers.items[handle - 1];
+        next = timer.next;
+
+        if (timer.expires > self.now) {
+            self.link(handle);
+            continue;
+        }
+
+        self.expired.append(.{
+            .handle = handle,
+            .generation = timer.generation,
+        }) catch {
+            std.log.err("Failed to queue expired timer. Dropping it.", .{});
+        };
+        if (timer.interval_ms != 0) {
+            // Skip the intervals missed while the wheel lagged behind instead
+            // of firing them all in the same batch.
+            timer.expires += timer.interval_ms;
+            if (timer.expires <= target) {
+                const missed = (target - timer.expires) / timer.interval_ms;
+                timer.expires += (missed + 1) * timer.interval_ms;
+            }
+            self.link(handle);
+        }
+    }
+}
+
+/// Advance the wheel up to a tick, collecting the timers firing on the way.
+fn advance(self: *This, target: u64) void {
+    while (self.now < target) {
+        if (self.count() == 0) {
+            self.now = target;
+            break;
+        }
+        if (self.level_counts[0] == 0) {
+            // Nothing can fire before level 0 turns and the next cascade.
+            const last_tick = self.now | slot_mask;
+            if (last_tick >= target) {
+                self.now = target;
+                break;
+            }
+            self.now = last_tick;
+        }
+
+        self.now += 1;
+        self.cascade();
+        self.fireSlot(target);
+    }
+}
+
+/// Get the tick of the next slot with any timers in it. For upper levels this
+/// is when the slot is cascaded, which is never later than its timers expire.
+fn nextTick(self: *This) ?u64 {
+    var next: ?u64 = null;
+
+    var level: usize = 0;
+    while (level < levels) : (level += 1) {
+        if (self.level_counts[level] == 0)
+            continue;
+
+        const shift = @intCast(u6, slot_bits * level);
+        const current = self.now >> shift;
+        var i: u64 = 1;
+        while (i <= slots_per_level) : (i += 1) {
+            if (self.wheel[level][(current + i) & slot_mask] != 0) {
+                const tick = (current + i) << shift;
+                next = if (next) |n| std.math.min(n, tick) else tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/// Arm the wayland timer for the next slot with timers, or disarm it.
+fn rearm(self: *This) void {
+    const next = self.nextTick() orelse {
+        _ = c.wl_event_source_timer_update(self.timer_source, 0);
+        return;
+    };
+
+    const now = self.clockNow();
+    const delay = if (next > now) next - now else 1;
+    _ = c.wl_event_source_timer_update(
+        self.timer_source,
+        @intCast(c_int, std.math.min(delay, std.math.maxInt(c_int))),
+    );
+}
+
+fn handleTimerCB(data: ?*c_void) callconv(.C) c_int {
+    const self = @ptrCast(*This, @alignCast(@alignOf(This), data));
+
+    self.advance(self.clockNow());
+
+    // Timers added by the callbacks are not in this batch. Timers cancelled by
+    // them are skipped.
+    const dispatcher = Plugin.getPluginSignalDispatcher();
+    var i: usize = 0;
+    while (i < self.expired.items.len) : (i += 1) {
+        const expired = self.expired.items[i];
+        const timer = &self.timers.items[expired.handle - 1];
+        if (!timer.allocated or timer.generation != expired.generation)
+            continue;
+        if (timer.interval_ms == 0)
+            self.free(expired.handle);
+
+        dispatcher.sendEvent(
+            .WFLUA_EVENT_TYPE_TIMER,
+            expired.handle,
+            0,
+            null,
+            null,
+        );
+    }
+    self.expired.clearRetainingCapacity();
+
+    self.rearm();
+    return 0;
+}
+
+pub fn init(self: *This, allocator: *Allocator) !void {
+    self.allocator = allocator;
+
+    self.clock = try std.time.Timer.start();
+    self.now = self.clockNow();
+
+    self.timers = std.ArrayList(Timer).init(allocator);
+    self.free_handles = std.ArrayList(Handle).init(allocator);
+    self.wheel = [_][slots_per_level]Handle{
+        [_]Handle{0} ** slots_per_level,
+    } ** levels;
+    self.level_counts = [_]u32{0} ** levels;
+    self.expired = std.ArrayList(Expired).init(allocator);
+
+    self.timer_source = c.wl_event_loop_add_timer(
+        c.wf_Core_get_event_loop(c.wf_get_core()),
+        handleTimerCB,
+        @ptrCast(*c_void, self),
+    ) orelse return error.AddEventSourceFailed;
+}
+
+pub fn deinit(self: *This) void {
+    _ = c.wl_event_source_remove(self.timer_source);
+    self.timer_source = undefined;
+
+    self.timers.deinit();
+    self.free_handles.deinit();
+    self.expired.deinit();
+}
+
+// == Tests ==
+
+const testing = std.testing;
+
+/// Set up the wheel alone, without the clock or the wayland timer.
+fn initTest(self: *This, now: u64) void {
+    self.allocator = testing.allocator;
+    self.clock = undefined;
+    self.now = now;
+    self.timers = std.ArrayList(Timer).init(testing.allocator);
+    self.free_handles = std.ArrayList(Handle).init(testing.allocator);
+    self.wheel = [_][slots_per_level]Handle{
+        [_]Handle{0} ** slots_per_level,
+    } ** levels;
+    self.level_counts = [_]u32{0} ** levels;
+    self.expired = std.ArrayList(Expired).init(testing.allocator);
+    self.timer_source = undefined;
+}
+
+fn deinitTest(self: *This) void {
+    self.timers.deinit();
+    self.free_handles.deinit();
+    self.expired.deinit();
+}
+
+/// Advance to a tick and check which timers fired on the way.
+fn expectFired(self: *This, target: u64, handles: []const Handle) !void {
+    self.advance(target);
+    defer self.expired.clearRetainingCapacity();
+
+    try testing.expectEqual(target, self.now);
+    try testing.expectEqual(handles.len, self.expired.items.len);
+    for (handles) |handle, i|
+        try testing.expectEqual(handle, self.expired.items[i].handle);
+}
+
+test "timers cascade down from upper levels" {
+    var self: This = undefined;
+    self.initTest(0);
+    defer self.deinitTest();
+
+    const near = try self.insert(100, 0);
+    const far = try self.insert(5000, 0);
+    try testing.expectEqual(@as(u8, 1), self.timers.items[near - 1].level);
+    try testing.expectEqual(@as(u8, 2), self.timers.items[far - 1].level);
+
+    // Level 1 turns at 64 and level 2 at 4096.
+    try self.expectFired(64, &.{});
+    try testing.expectEqual(@as(u8, 0), self.timers.items[near - 1].level);
+    try self.expectFired(99, &.{});
+    try self.expectFired(100, &.{near});
+
+    try self.expectFired(4096, &.{});
+    try testing.expectEqual(@as(u8, 1), self.timers.items[far - 1].level);
+    try self.expectFired(4999, &.{});
+    try testing.expectEqual(@as(u8, 0), self.timers.items[far - 1].level);
+    try self.expectFired(5000, &.{far});
+    try testing.expectEqual(@as(u64, 0), self.count());
+}
+
+test "timers at the wrap boundary" {
+    var self: This = undefined;
+    self.initTest(60);
+    defer self.deinitTest();
+
+    // Level 0 wraps from slot 63 to slot 0 between these.
+    const before = try self.insert(63, 0);
+    const wrapped = try self.insert(65, 0);
+    // Right below and at the span of level 0.
+    const last = try self.insert(60 + slot_mask, 0);
+    const first_up = try self.insert(60 + slots_per_level, 0);
+    try testing.expectEqual(@as(u8, 0), self.timers.items[last - 1].level);
+    try testing.expectEqual(@as(u8, 1), self.timers.items[first_up - 1].level);
+
+    try self.expectFired(63, &.{before});
+    try self.expectFired(65, &.{wrapped});
+    try self.expectFired(60 + slot_mask, &.{last});
+    try self.expectFired(60 + slots_per_level, &.{first_up});
+}
+
+test "cancelled timers free their handle for reuse" {
+    var self: This = undefined;
+    self.initTest(0);
+    defer self.deinitTest();
+
+    const cancelled = try self.insert(10, 0);
+    const kept = try self.insert(10, 0);
+    const generation = self.timers.items[cancelled - 1].generation;
+    self.cancel(cancelled);
+    try testing.expect(self.get(cancelled) == null);
+
+    // Lands in the same slot under the same handle.
+    const reused = try self.insert(10, 0);
+    try testing.expectEqual(cancelled, reused);
+    try testing.expect(self.timers.items[reused - 1].generation != generation);
+
+    self.advance(10);
+    defer self.expired.clearRetainingCapacity();
+    try testing.expectEqual(@as(usize, 2), self.expired.items.len);
+    for (self.expired.items) |expired| {
+        try testing.expect(expired.handle == kept or expired.handle == reused);
+        try testing.expectEqual(
+            self.timers.items[expired.handle - 1].generation,
+            expired.generation,
+        );
+    }
+}
+
+test "intervals skip missed ticks" {
+    var self: This = undefined;
+    self.initTest(0);
+    defer self.deinitTest();
+
+    const interval = try self.insert(10, 5);
+
+    // Lagging behind by 6 intervals fires once and keeps the phase.
+    try self.expectFired(42, &.{interval});
+    const expires = self.timers.items[interval - 1].expires;
+    try testing.expectEqual(@as(u64, 45), expires);
+    try self.expectFired(44, &.{});
+    try self.expectFired(45, &.{interval});
+    try self.expectFired(50, &.{interval});
+}
@@ -0,0 +1,200 @@
+const std = @import("std");
+const c = @import("c.zig");
+const Plugin = @import("Plugin.zig");
+
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+pub const Kind = enum(u8) {
+    signal,
+    lifetime,
+    timer,
+    process_output,
+    process_exit,
+    worker_result,
+    key,
+    ipc_command,
+};
+
+/// What is known of an event when it is traced.
+pub const Event = struct {
+    kind: Kind,
+    /// Object the event comes from, if any.
+    emitter: ?*c_void = null,
+    /// Interned signal name of signals.
+    signal_id: u32 = 0,
+    /// Id of the request of ipc commands.
+    request_id: u32 = 0,
+    /// Handle of the signal connection, lifetime, timer, process or worker job
+    /// the event is for, or keysym of keys.
+    handle: u32 = 0,
+};
+
+/// Records are kept binary and only formatted when dumped.
+const Record = struct {
+    /// Nanoseconds since the tracer was initialized.
+    start_ns: u64,
+    /// Time spent handling the event, mostly in lua.
+    duration_ns: u64,
+    event: Event,
+};
+
+/// An event being handled. Null when tracing is off.
+pub const Span = ?u64;
+
+allocator: *Allocator,
+
+clock: std.time.Timer,
+
+/// Events are only recorded while enabled.
+enabled: bool,
+
+/// Ring of the last records, allocated when first enabled. Records are taken
+/// and dumped on the compositor thread so it needs no locking. Its length is a
+/// power of two.
+records: []Record,
+/// Number of records taken since the last clear. The next record overwrites
+/// the oldest one once the ring is full.
+written: u64,
+/// Length of the ring once allocated.
+capacity: u32,
+
+/// Start tracing an event. This is all it costs when tracing is off.
+pub fn begin(self: *This) Span {
+    return if (self.enabled) self.clock.read() else null;
+}
+
+/// Record an event begun with `begin`.
+pub fn end(self: *This, span: Span, event: Event) void {
+    const start_ns = span orelse return;
+    const now = self.clock.read();
+
+    const mask = self.records.len - 1;
+    self.records[@intCast(usize, self.written) & mask] = .{
+        .start_ns = start_ns,
+        .duration_ns = now - start_ns,
+        .event = event,
+    };
+    self.written += 1;
+}
+
+pub fn start(self: *This) !void {
+    if (self.records.len == 0)
+        self.records = try self.allocator.alloc(Record, self.capacity);
+    self.enabled = true;
+}
+
+pub fn stop(self: *This) void {
+    self.enabled = false;
+}
+
+/// Drop every record.
+pub fn clear(self: *This) void {
+    self.written = 0;
+}
+
+/// Number of records held.
+pub fn count(self: *This) usize {
+    return @intCast(usize, std.math.min(self.written, self.records.len));
+}
+
+/// Write the records, oldest first, in the trace event format loaded by
+/// Perfetto and chrome://tracing.
+pub fn writeChromeTrace(self: *This, writer: anytype) !void {
+    try writer.writeAll("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" ++
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1," ++
+        "\"args\":{\"name\":\"compositor\"}}");
+
+    const held = self.count();
+    var i = self.written - held;
+    while (i < self.written) : (i += 1) {
+        const mask = self.records.len - 1;
+        const record = self.records[@intCast(usize, i) & mask];
+        try writer.writeAll(",\n");
+        try self.writeEvent(writer, record);
+    }
+
+    try writer.writeAll("\n]}\n");
+}
+
+fn writeEvent(self: *This, writer: anytype, record: Record) !void {
+    const event = record.event;
+
+    try writer.writeAll("{\"name\":");
+    switch (event.kind) {
+        .signal => {
+            const dispatcher = Plugin.getPluginSignalDispatcher();
+            try std.json.stringify(
+                dispatcher.signalName(event.signal_id),
+                .{},
+                writer,
+            );
+        },
+        .key => {
+            var buf: [128]u8 = undefined;
+            const len = c.xkb_keysym_get_name(event.handle, &buf, buf.len);
+            if (len > 0 and @intCast(usize, len) < buf.len) {
+                try std.json.stringify(
+                    buf[0..@intCast(usize, len)],
+                    .{},
+                    writer,
+                );
+            } else {
+                try writer.print("\"{x}\"", .{event.handle});
+            }
+        },
+        .lifetime => try writer.writeAll("\"emitter-destroyed\""),
+        .timer => try writer.writeAll("\"timer\""),
+        .process_output => try writer.writeAll("\"process-output\""),
+        .process_exit => try writer.writeAll("\"process-exit\""),
+        .worker_result => try writer.writeAll("\"worker-result\""),
+        .ipc_command => try writer.writeAll("\"ipc-command\""),
+    }
+
+    // Times are in microseconds.
+    try writer.print(
+        ",\"cat\":\"{s}\",\"ph\":\"X\",\"pid\":1,\"tid\":1," ++
+            "\"ts\":{d:.3},\"dur\":{d:.3},\"args\":{{",
+        .{
+            @tagName(event.kind),
+            @intToFloat(f64, record.start_ns) / std.time.ns_per_us,
+            @intToFloat(f64, record.duration_ns) / std.time.ns_per_us,
+        },
+    );
+    switch (event.kind) {
+        .signal, .lifetime => try writer.print(
+            "\"emitter\":\"{x}\",\"handle\":{d}",
+            .{ @ptrToInt(event.emitter), event.handle },
+        ),
+        .key => try writer.print("\"keysym\":{d}", .{event.handle}),
+        .ipc_command => try writer.print(
+            "\"request_id\":{d}",
+            .{event.request_id},
+        ),
+        .timer,
+        .process_output,
+        .process_exit,
+        .worker_result,
+        => try writer.print("\"handle\":{d}", .{event.handle}),
+    }
+    try writer.writeAll("}}");
+}
+
+pub fn init(self: *This, allocator: *Allocator) !void {
+    self.allocator = allocator;
+
+    self.clock = try std.time.Timer.start();
+    self.enabled = false;
+    self.records = &[_]Record{};
+    self.written = 0;
+    self.capacity = try std.math.ceilPowerOfTwo(
+        u32,
+        std.math.max(Plugin.getOptionInt("trace_buffer_size", 16384), 1),
+    );
+}
+
+pub fn deinit(self: *This) void {
+    if (self.records.len > 0)
+        self.allocator.free(self.records);
+    self.records = &[_]Record{};
+}
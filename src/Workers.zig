@@ -0,0 +1,479 @@
+const build_options = @import("build_options");
+const std = @import("std");
+const c = @import("c.zig");
+const Lua = @import("Lua.zig");
+const Plugin = @import("Plugin.zig");
+const getPluginWorkers = Plugin.getPluginWorkers;
+
+const os = std.os;
+const linux = os.linux;
+const Allocator = std.mem.Allocator;
+const This = @This();
+
+/// Job handles are 1-based like signal handles. 0 is never a valid handle.
+pub const Handle = u32;
+/// Ids of loaded functions are never reused, not even across reloads.
+pub const FunctionId = u32;
+
+/// Intrusive multi-producer single-consumer queue. Pushing never blocks nor
+/// allocates. Popping may miss a node whose push is still in progress, which
+/// is fine as producers wake the consumer once done.
+const Queue = struct {
+    const Node = struct {
+        next: ?*Node = null,
+    };
+
+    /// Last node pushed.
+    head: *Node,
+    /// Next node to pop.
+    tail: *Node,
+    /// Keeps the queue from ever being empty so that pushes only ever touch
+    /// the head.
+    stub: Node,
+
+    /// The queue must not move afterwards.
+    fn init(self: *Queue) void {
+        self.stub = .{};
+        self.head = &self.stub;
+        self.tail = &self.stub;
+    }
+
+    fn push(self: *Queue, node: *Node) void {
+        @atomicStore(?*Node, &node.next, null, .Monotonic);
+        const prev = @atomicRmw(*Node, &self.head, .Xchg, node, .AcqRel);
+        @atomicStore(?*Node, &prev.next, node, .Release);
+    }
+
+    fn pop(self: *Queue) ?*Node {
+        var tail = self.tail;
+        var next = @atomicLoad(?*Node, &tail.next, .Acquire);
+        if (tail == &self.stub) {
+            tail = next orelse return null;
+            self.tail = tail;
+            next = @atomicLoad(?*Node, &tail.next, .Acquire);
+        }
+        if (next) |node| {
+            self.tail = node;
+            return tail;
+        }
+
+        // The tail can only be popped once another node is behind it.
+        if (tail != @atomicLoad(*Node, &self.head, .Acquire))
+            return null;
+        self.push(&self.stub);
+        if (@atomicLoad(?*Node, &tail.next, .Acquire)) |node| {
+            self.tail = node;
+            return tail;
+        }
+        return null;
+    }
+};
+
+/// Bytecode of a function dumped by lua, shared by the jobs running it.
+const Function = struct {
+    id: FunctionId,
+    bytecode: []u8,
+    refs: u32 = 1,
+
+    fn acquire(self: *Function) *Function {
+        _ = @atomicRmw(u32, &self.refs, .Add, 1, .Monotonic);
+        return self;
+    }
+
+    fn release(self: *Function, allocator: *Allocator) void {
+        if (@atomicRmw(u32, &self.refs, .Sub, 1, .AcqRel) > 1)
+            return;
+        allocator.free(self.bytecode);
+        allocator.destroy(self);
+    }
+};
+
+const Job = struct {
+    node: Queue.Node = .{},
+    handle: Handle,
+    function: *Function,
+    /// Workers forget the functions they loaded when this changes.
+    generation: u32,
+    args: [][]u8,
+};
+
+const Result = struct {
+    node: Queue.Node = .{},
+    handle: Handle,
+    ok: bool,
+    value: []u8,
+};
+
+/// A lua state of its own running jobs on a thread.
+const Worker = struct {
+    pool: *This,
+    L: *c.lua_State,
+    thread: *std.Thread,
+    /// Written to when jobs are queued or the worker should stop.
+    wake_fd: os.fd_t,
+    jobs: Queue,
+    /// Jobs queued or running.
+    load: u32,
+    /// Table of the functions loaded, by id.
+    functions_ref: Lua.Ref,
+    generation: u32,
+
+    fn start(self: *Worker, pool: *This) !void {
+        self.pool = pool;
+        self.load = 0;
+        self.generation = pool.generation;
+        self.jobs.init();
+
+        self.L = c.luaL_newstate() orelse return error.OutOfMemory;
+        errdefer c.lua_close(self.L);
+        c.luaL_openlibs(self.L);
+        try Lua.doString(self.L, "package.path = package.path .. ';" ++
+            build_options.LUA_RUNTIME ++ "/?.lua'");
+        c.lua_newtable(self.L);
+        self.functions_ref = Lua.ref(self.L);
+
+        self.wake_fd = try os.eventfd(0, linux.EFD_CLOEXEC);
+        errdefer os.close(self.wake_fd);
+
+        self.thread = try std.Thread.spawn(run, self);
+    }
+
+    /// Wait for the thread to exit and drop the jobs it didn't get to.
+    fn stop(self: *Worker) void {
+        wake(self.wake_fd);
+        self.thread.wait();
+
+        while (self.jobs.pop()) |node|
+            self.pool.freeJob(@fieldParentPtr(Job, "node", node));
+        c.lua_close(self.L);
+        os.close(self.wake_fd);
+    }
+
+    fn run(self: *Worker) void {
+        const pool = self.pool;
+        while (true) {
+            var count: u64 = undefined;
+            _ = os.read(self.wake_fd, std.mem.asBytes(&count)) catch |err| {
+                std.log.err("Worker failed to wait for jobs: {any}", .{err});
+                return;
+            };
+
+            while (!@atomicLoad(bool, &pool.stopping, .Acquire)) {
+                const node = self.jobs.pop() orelse break;
+                const job = @fieldParentPtr(Job, "node", node);
+                const result = self.runJob(job);
+                pool.freeJob(job);
+                _ = @atomicRmw(u32, &self.load, .Sub, 1, .Release);
+
+                if (result) |r| {
+                    pool.results.push(&r.node);
+                    wake(pool.results_fd);
+                }
+            }
+            if (@atomicLoad(bool, &pool.stopping, .Acquire))
+                return;
+        }
+    }
+
+    fn runJob(self: *Worker, job: *Job) ?*Result {
+        const L = self.L;
+        const top = c.lua_gettop(L);
+        defer c.lua_settop(L, top);
+
+        var ok = self.callJob(job);
+        // The return value or error message is left on top.
+        const value: []const u8 = switch (c.lua_type(L, -1)) {
+            c.LUA_TNIL => "",
+            c.LUA_TSTRING, c.LUA_TNUMBER => Lua.tostring(L, -1),
+            else => x: {
+                ok = false;
+                break :x "Worker command returned neither a string " ++
+                    "nor a number.";
+            },
+        };
+
+        const allocator = self.pool.allocator;
+        const result = allocator.create(Result) catch return null;
+        result.* = .{
+            .handle = job.handle,
+            .ok = ok,
+            .value = allocator.dupe(u8, value) catch {
+                allocator.destroy(result);
+                return null;
+            },
+        };
+        return result;
+    }
+
+    fn callJob(self: *Worker, job: *Job) bool {
+        const L = self.L;
+
+        if (self.generation != job.generation) {
+            // The functions of the previous init file are of no use anymore.
+            c.lua_newtable(L);
+            c.lua_rawseti(L, c.LUA_REGISTRYINDEX, self.functions_ref.ref);
+            self.generation = job.generation;
+        }
+
+        const id = @intCast(c_int, job.function.id);
+        Lua.rawGetRef(L, self.functions_ref);
+        c.lua_rawgeti(L, -1, id);
+        if (c.lua_isnil(L, -1)) {
+            c.lua_pop(L, 1);
+            const bytecode = job.function.bytecode;
+            if (c.luaL_loadbuffer(L, bytecode.ptr, bytecode.len, "=worker") !=
+                0)
+                return false;
+            c.lua_pushvalue(L, -1);
+            c.lua_rawseti(L, -3, id);
+        }
+
+        // 1 argument: args
+        c.lua_createtable(L, @intCast(c_int, job.args.len), 0);
+        for (job.args) |arg, i| {
+            c.lua_pushlstring(L, arg.ptr, arg.len);
+            c.lua_rawseti(L, -2, @intCast(c_int, i + 1));
+        }
+        return c.lua_pcall(L, 1, 1, 0) == 0;
+    }
+};
+
+allocator: *Allocator,
+
+/// Fixed at init so that workers don't move.
+workers: []Worker,
+stopping: bool,
+
+/// Functions loaded since the last reload. The id of a function is its index
+/// plus `first_function_id`.
+functions: std.ArrayList(*Function),
+first_function_id: FunctionId,
+/// Bumped on reload.
+generation: u32,
+
+next_job: Handle,
+
+/// Results of the jobs, filled by the workers.
+results: Queue,
+/// Written to by the workers when they push results.
+results_fd: os.fd_t,
+results_source: ?*c.wl_event_source,
+
+fn wake(fd: os.fd_t) void {
+    const one: u64 = 1;
+    _ = os.write(fd, std.mem.asBytes(&one)) catch |err| {
+        std.log.err("Failed to wake up worker event fd: {any}", .{err});
+    };
+}
+
+/// Load a function dumped with string.dump for the workers to run. Returns 0
+/// if there are no workers.
+export fn wflua_worker_load(bytecode: [*]const u8, len: usize) FunctionId {
+    const self = getPluginWorkers();
+    if (self.workers.len == 0)
+        return 0;
+    return self.load(bytecode[0..len]) catch |err| {
+        std.log.err("Failed to load worker function: {any}", .{err});
+        return 0;
+    };
+}
+
+/// Run a loaded function on the least busy worker. Returns 0 on failure.
+export fn wflua_worker_run(
+    function: FunctionId,
+    args: ?[*]const c.wf_String,
+    nargs: usize,
+) Handle {
+    const self = getPluginWorkers();
+    const args_slice = if (args) |a| a[0..nargs] else &[_]c.wf_String{};
+    return self.queueJob(function, args_slice) catch |err| {
+        std.log.err("Failed to queue worker job: {any}", .{err});
+        return 0;
+    };
+}
+
+fn load(self: *This, bytecode: []const u8) !FunctionId {
+    const function = try self.allocator.create(Function);
+    errdefer self.allocator.destroy(function);
+    function.* = .{
+        .id = self.first_function_id +
+            @intCast(FunctionId, self.functions.items.len),
+        .bytecode = try self.allocator.dupe(u8, bytecode),
+    };
+    errdefer self.allocator.free(function.bytecode);
+
+    try self.functions.append(function);
+    return function.id;
+}
+
+fn queueJob(
+    self: *This,
+    function_id: FunctionId,
+    args: []const c.wf_String,
+) !Handle {
+    if (function_id < self.first_function_id or
+        function_id - self.first_function_id >= self.functions.items.len)
+        return error.UnknownFunction;
+    const function = self.functions.items[function_id - self.first_function_id];
+
+    const job = try self.allocator.create(Job);
+    errdefer self.allocator.destroy(job);
+
+    const owned_args = try self.allocator.alloc([]u8, args.len);
+    var duped: usize = 0;
+    errdefer {
+        for (owned_args[0..duped]) |arg|
+            self.allocator.free(arg);
+        self.allocator.free(owned_args);
+    }
+    for (args) |arg| {
+        owned_args[duped] = try self.allocator.dupe(
+            u8,
+            arg.data[0..@intCast(usize, arg.len)],
+        );
+        duped += 1;
+    }
+
+    const handle = self.next_job;
+    self.next_job +%= 1;
+    if (self.next_job == 0)
+        self.next_job = 1;
+
+    job.* = .{
+        .handle = handle,
+        .function = function.acquire(),
+        .generation = self.generation,
+        .args = owned_args,
+    };
+
+    var worker = &self.workers[0];
+    for (self.workers[1..]) |*other| {
+        if (@atomicLoad(u32, &other.load, .Acquire) <
+            @atomicLoad(u32, &worker.load, .Acquire))
+            worker = other;
+    }
+    _ = @atomicRmw(u32, &worker.load, .Add, 1, .AcqRel);
+    worker.jobs.push(&job.node);
+    wake(worker.wake_fd);
+
+    return handle;
+}
+
+fn freeJob(self: *This, job: *Job) void {
+    job.function.release(self.allocator);
+    for (job.args) |arg|
+        self.allocator.free(arg);
+    self.allocator.free(job.args);
+    self.allocator.destroy(job);
+}
+
+fn freeResult(self: *This, result: *Result) void {
+    self.allocator.free(result.value);
+    self.allocator.destroy(result);
+}
+
+fn handleResultsCB(fd: c_int, mask: u32, data: ?*c_void) callconv(.C) c_int {
+    const self = getPluginWorkers();
+
+    // Reset the counter before popping so that no wake up gets lost.
+    var count: u64 = undefined;
+    _ = os.read(fd, std.mem.asBytes(&count)) catch {};
+
+    const dispatcher = Plugin.getPluginSignalDispatcher();
+    while (self.results.pop()) |node| {
+        const result = @fieldParentPtr(Result, "node", node);
+        defer self.freeResult(result);
+
+        var event = c.wflua_WorkerResult{
+            .ok = result.ok,
+            .result = .{
+                .len = result.value.len,
+                .data = result.value.ptr,
+            },
+        };
+        dispatcher.sendEvent(
+            .WFLUA_EVENT_TYPE_WORKER_RESULT,
+            result.handle,
+            0,
+            @ptrCast(*c_void, &event),
+            null,
+        );
+    }
+    return 0;
+}
+
+pub fn init(self: *This, allocator: *Allocator) !void {
+    self.allocator = allocator;
+    self.workers = &[_]Worker{};
+    self.stopping = false;
+    self.functions = std.ArrayList(*Function).init(allocator);
+    self.first_function_id = 1;
+    self.generation = 0;
+    self.next_job = 1;
+    self.results.init();
+    self.results_source = null;
+
+    const count = Plugin.getOptionInt("ipc_workers", 2);
+    if (count == 0)
+        return;
+
+    self.results_fd = try os.eventfd(
+        0,
+        linux.EFD_CLOEXEC | linux.EFD_NONBLOCK,
+    );
+    errdefer os.close(self.results_fd);
+
+    self.results_source = c.wl_event_loop_add_fd(
+        c.wf_Core_get_event_loop(c.wf_get_core()),
+        self.results_fd,
+        c.WL_EVENT_READABLE,
+        handleResultsCB,
+        null,
+    ) orelse return error.WatchFailed;
+    errdefer _ = c.wl_event_source_remove(self.results_source);
+
+    const workers = try allocator.alloc(Worker, count);
+    var started: usize = 0;
+    errdefer {
+        @atomicStore(bool, &self.stopping, true, .Release);
+        for (workers[0..started]) |*worker|
+            worker.stop();
+        allocator.free(workers);
+    }
+    for (workers) |*worker| {
+        try worker.start(self);
+        started += 1;
+    }
+    self.workers = workers;
+}
+
+/// Forget the functions of the init file. Jobs already queued still run and
+/// send their results.
+pub fn reset(self: *This) void {
+    for (self.functions.items) |function|
+        function.release(self.allocator);
+    self.first_function_id +=
+        @intCast(FunctionId, self.functions.items.len);
+    self.functions.clearRetainingCapacity();
+    self.generation +%= 1;
+}
+
+/// Stop the workers. Jobs still queued and results not yet delivered are
+/// dropped.
+pub fn deinit(self: *This) void {
+    @atomicStore(bool, &self.stopping, true, .Release);
+    for (self.workers) |*worker|
+        worker.stop();
+    if (self.workers.len > 0) {
+        self.allocator.free(self.workers);
+        _ = c.wl_event_source_remove(self.results_source);
+        os.close(self.results_fd);
+    }
+    self.workers = &[_]Worker{};
+
+    while (self.results.pop()) |node|
+        self.freeResult(@fieldParentPtr(Result, "node", node));
+
+    self.reset();
+    self.functions.deinit();
+}
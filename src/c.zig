@@ -1,6 +1,7 @@
 pub usingnamespace @cImport({
     @cInclude("unistd.h");
     @cInclude("stdlib.h");
+    @cInclude("fnmatch.h");
 
     @cInclude("lua.h");
     @cInclude("lauxlib.h");
@@ -1,11 +1,25 @@
 const std = @import("std");
+const msgpack = @import("msgpack.zig");
 const json = std.json;
 const Allocator = std.mem.Allocator;
 
+/// Encoding of a message body.
+pub const Encoding = enum(u1) {
+    json = 0,
+    msgpack = 1,
+};
+
 pub const MsgHeader = packed struct {
-    len: u32 = 0,
+    len: u31 = 0,
+    /// Stored in the top bit of the header so that clients not knowing about
+    /// it implicitly send json.
+    encoding: Encoding = .json,
 };
 
+/// Message buffers grown past this size are released after use instead of
+/// being kept around for the next message.
+const max_retained_buf_size = 64 * 1024;
+
 fn RpcMethodSend(comptime method: []const u8, comptime params: type) type {
     return struct {
         method: []const u8 = method,
@@ -62,6 +76,7 @@ pub const RpcErrorCode = enum(i32) {
     // generic command error
     CommandError = @intCast(i32, c.WFLUA_IPC_COMMAND_ERROR),
     CommandInvalidArgs = @intCast(i32, c.WFLUA_IPC_COMMAND_INVALID_ARGS),
+    RequestIdInUse = @intCast(i32, c.WFLUA_IPC_REQUEST_ID_IN_USE),
 
     pub fn jsonStringify(
         self: @This(),
@@ -105,19 +120,101 @@ pub const Command = struct {
     pub const NotifRecv = union(enum) {
         Notif: RpcNotifRecv("cmd_notif", struct { id: u32, notif: []const u8 }),
         NotifEnd: RpcNotifRecv("cmd_notif_end", struct { id: u32 }),
+        TopicNotif: Topic.NotifRecv,
     };
 };
 
+/// Messages published to a topic. These are sent to every connection
+/// subscribed to the topic through the `subscribe` command. They don't carry
+/// a request id so that they can be encoded once for all subscribers.
+pub const Topic = struct {
+    pub const Params = struct { topic: []const u8, notif: []const u8 };
+
+    pub const NotifSend = RpcNotifSend("topic_notif", Params);
+    pub const NotifRecv = RpcNotifRecv("topic_notif", Params);
+};
+
 pub const RequestRecv = union(enum) {
     Command: Command.ReqRecv,
 };
 
+/// Anything a client can receive once requests are pipelined.
+pub const ServerMsgRecv = union(enum) {
+    Response: Command.RespRecv,
+    Notif: Command.NotifRecv,
+};
+
+/// Append a whole message, header included, to a buffer.
+pub fn writeMsg(
+    buf: *std.ArrayList(u8),
+    encoding: Encoding,
+    msg: anytype,
+) !void {
+    const start = buf.items.len;
+
+    // Leave room for the header.
+    try buf.appendNTimes(0, @sizeOf(MsgHeader));
+    errdefer buf.shrinkRetainingCapacity(start);
+
+    const msg_writer = buf.writer();
+    switch (encoding) {
+        .json => try json.stringify(msg, .{}, msg_writer),
+        .msgpack => try msgpack.encode(msg, msg_writer),
+    }
+
+    const header = MsgHeader{
+        .len = try std.math.cast(
+            u31,
+            buf.items.len - start - @sizeOf(MsgHeader),
+        ),
+        .encoding = encoding,
+    };
+    std.mem.copy(
+        u8,
+        buf.items[start .. start + @sizeOf(MsgHeader)],
+        std.mem.asBytes(&header),
+    );
+}
+
 pub fn Protocol(comptime Reader: type, comptime Writer: type) type {
     return struct {
         allocator: *Allocator,
         reader: Reader,
         writer: Writer,
 
+        /// Encoding of the messages sent. Servers answer in the encoding of
+        /// the last request received, answers sent after later requests were
+        /// read go through `sendIn` with the encoding of their own request.
+        encoding: Encoding,
+        /// Encoding of the last message received.
+        recv_encoding: Encoding = .json,
+
+        /// Reused across messages. Decoded msgpack strings point into
+        /// `recv_buf` and are only valid until the next message is read.
+        recv_buf: std.ArrayList(u8),
+        send_buf: std.ArrayList(u8),
+
+        pub fn init(
+            allocator: *Allocator,
+            reader: Reader,
+            writer: Writer,
+            encoding: Encoding,
+        ) @This() {
+            return .{
+                .allocator = allocator,
+                .reader = reader,
+                .writer = writer,
+                .encoding = encoding,
+                .recv_buf = std.ArrayList(u8).init(allocator),
+                .send_buf = std.ArrayList(u8).init(allocator),
+            };
+        }
+
+        pub fn deinit(self: *@This()) void {
+            self.recv_buf.deinit();
+            self.send_buf.deinit();
+        }
+
         fn getJsonParseOpts(self: *const @This()) json.ParseOptions {
             return .{
                 .allocator = self.allocator,
@@ -126,111 +223,131 @@ pub fn Protocol(comptime Reader: type, comptime Writer: type) type {
             };
         }
 
-        fn sendMsg(
-            self: *const @This(),
-            msg_buf: *std.ArrayList(u8),
-            msg: anytype,
-        ) !void {
-            try json.stringify(msg, .{}, msg_buf.writer());
+        fn recycleBuf(buf: *std.ArrayList(u8)) void {
+            if (buf.capacity > max_retained_buf_size) {
+                buf.clearAndFree();
+            } else {
+                buf.clearRetainingCapacity();
+            }
+        }
 
-            const header = MsgHeader{
-                .len = try std.math.cast(u32, msg_buf.items.len),
-            };
+        fn sendMsg(self: *@This(), encoding: Encoding, msg: anytype) !void {
+            recycleBuf(&self.send_buf);
 
-            try self.writer.writeStruct(header);
-            try self.writer.writeAll(msg_buf.items);
+            // Write everything at once.
+            try writeMsg(&self.send_buf, encoding, msg);
+            try self.writer.writeAll(self.send_buf.items);
         }
 
-        fn nextRequestImpl(
-            self: *const @This(),
-            comptime ReqType: type,
-        ) !?ReqType {
+        fn recvMsg(
+            self: *@This(),
+            comptime MsgType: type,
+            eof_ok: bool,
+        ) !?MsgType {
             var recv_header: MsgHeader = undefined;
-            const recv_len = try self.reader.read(
-                @ptrCast(*[@sizeOf(MsgHeader)]u8, &recv_header),
-            );
+            const header_bytes = std.mem.asBytes(&recv_header);
+            if (eof_ok) {
+                const recv_len = try self.reader.read(header_bytes);
 
-            // EOF between messages is well-formed
-            if (recv_len == 0)
-                return null;
+                // EOF between messages is well-formed
+                if (recv_len == 0)
+                    return null;
+                try self.reader.readNoEof(header_bytes[recv_len..]);
+            } else {
+                try self.reader.readNoEof(header_bytes);
+            }
 
-            var msg_buf = std.ArrayList(u8).init(self.allocator);
-            defer msg_buf.deinit();
+            recycleBuf(&self.recv_buf);
+            try self.recv_buf.resize(recv_header.len);
+            try self.reader.readNoEof(self.recv_buf.items);
 
-            try msg_buf.resize(recv_header.len);
-            try self.reader.readNoEof(msg_buf.items);
-            return try json.parse(
-                ReqType,
-                &json.TokenStream.init(msg_buf.items),
-                self.getJsonParseOpts(),
-            );
+            self.recv_encoding = recv_header.encoding;
+            return switch (self.recv_encoding) {
+                .json => try json.parse(
+                    MsgType,
+                    &json.TokenStream.init(self.recv_buf.items),
+                    self.getJsonParseOpts(),
+                ),
+                .msgpack => try msgpack.decode(
+                    MsgType,
+                    self.recv_buf.items,
+                    self.allocator,
+                ),
+            };
+        }
+
+        fn freeMsg(self: *const @This(), msg: anytype) void {
+            switch (self.recv_encoding) {
+                .json => json.parseFree(
+                    @TypeOf(msg),
+                    msg,
+                    self.getJsonParseOpts(),
+                ),
+                .msgpack => msgpack.free(@TypeOf(msg), msg, self.allocator),
+            }
         }
 
         // == Client ==
 
         pub fn nextNotif(
-            self: *const @This(),
+            self: *@This(),
             comptime NotifType: type,
         ) !?NotifType {
-            return self.nextRequestImpl(NotifType);
+            return self.recvMsg(NotifType, true);
         }
         pub fn freeNotif(self: *const @This(), notif: anytype) void {
-            json.parseFree(@TypeOf(notif), notif, self.getJsonParseOpts());
+            self.freeMsg(notif);
         }
 
         /// Make a request and read the response.
         pub fn request(
-            self: *const @This(),
+            self: *@This(),
             comptime Resp: type,
             req: anytype,
         ) !Resp {
-            var msg_buf = std.ArrayList(u8).init(self.allocator);
-            defer msg_buf.deinit();
+            try self.sendRequest(req);
+            return (try self.recvMsg(Resp, false)).?;
+        }
+        pub fn freeResponse(self: *const @This(), resp: anytype) void {
+            self.freeMsg(resp);
+        }
 
-            // Send:
-            try self.sendMsg(&msg_buf, req);
+        /// Send a request without waiting for its response. Responses and
+        /// notifications are then read with `nextServerMsg`.
+        pub fn sendRequest(self: *@This(), req: anytype) !void {
+            try self.sendMsg(self.encoding, req);
+        }
 
-            // Recv:
-            var recv_header: MsgHeader = undefined;
-            try self.reader.readNoEof(
-                @ptrCast(*[@sizeOf(MsgHeader)]u8, &recv_header),
-            );
-            try msg_buf.resize(recv_header.len);
-            try self.reader.readNoEof(msg_buf.items);
-            return try json.parse(
-                Resp,
-                &json.TokenStream.init(msg_buf.items),
-                self.getJsonParseOpts(),
-            );
-        }
-        pub fn freeResponse(
-            self: *const @This(),
-            resp: anytype,
-        ) void {
-            json.parseFree(@TypeOf(resp), resp, self.getJsonParseOpts());
+        pub fn nextServerMsg(self: *@This()) !?ServerMsgRecv {
+            return self.recvMsg(ServerMsgRecv, true);
+        }
+        pub fn freeServerMsg(self: *const @This(), msg: ServerMsgRecv) void {
+            self.freeMsg(msg);
         }
 
         // == Server ==
 
-        pub fn nextRequest(self: *const @This()) !?RequestRecv {
-            return self.nextRequestImpl(RequestRecv);
+        pub fn nextRequest(self: *@This()) !?RequestRecv {
+            const req = try self.recvMsg(RequestRecv, true);
+            self.encoding = self.recv_encoding;
+            return req;
         }
         pub fn freeRequest(self: *const @This(), req: RequestRecv) void {
-            json.parseFree(RequestRecv, req, self.getJsonParseOpts());
+            self.freeMsg(req);
         }
 
-        pub fn sendResponse(self: *const @This(), resp: anytype) !void {
-            var msg_buf = std.ArrayList(u8).init(self.allocator);
-            defer msg_buf.deinit();
-
-            try self.sendMsg(&msg_buf, resp);
+        pub fn sendResponse(self: *@This(), resp: anytype) !void {
+            try self.sendMsg(self.encoding, resp);
         }
 
-        pub fn sendNotif(self: *const @This(), notif: anytype) !void {
-            var msg_buf = std.ArrayList(u8).init(self.allocator);
-            defer msg_buf.deinit();
+        pub fn sendNotif(self: *@This(), notif: anytype) !void {
+            try self.sendMsg(self.encoding, notif);
+        }
 
-            try self.sendMsg(&msg_buf, notif);
+        /// Send a response or notification in a given encoding, for answering
+        /// a request other than the last one read.
+        pub fn sendIn(self: *@This(), encoding: Encoding, msg: anytype) !void {
+            try self.sendMsg(encoding, msg);
         }
     };
 }
@@ -0,0 +1,720 @@
+//! A minimal MessagePack codec for the ipc messages.
+//!
+//! Values are encoded by reflection the same way `std.json` stringifies them:
+//! structs as maps keyed by field name, tagged unions as their active payload,
+//! enums as their integer value. Decoding follows `std.json.parse` semantics:
+//! unknown fields are ignored, comptime fields must match, and unions take the
+//! first variant that decodes.
+//!
+//! Decoded strings are borrowed from the input bytes. Only other slices are
+//! allocated, and `free` only releases those.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+const nil: u8 = 0xc0;
+const false_: u8 = 0xc2;
+const true_: u8 = 0xc3;
+
+/// Nesting allowed when skipping unknown values.
+const max_skip_depth = 32;
+
+pub const DecodeError = error{
+    UnexpectedEndOfInput,
+    UnexpectedType,
+    UnexpectedValue,
+    InvalidEnumTag,
+    MissingField,
+    DuplicateField,
+    NoUnionMembersMatched,
+    TrailingData,
+    TooDeep,
+    Overflow,
+} || Allocator.Error;
+
+// == Encoding ==
+
+pub fn encode(value: anytype, writer: anytype) @TypeOf(writer).Error!void {
+    const T = @TypeOf(value);
+    switch (@typeInfo(T)) {
+        .Void, .Null => try writer.writeByte(nil),
+        .Bool => try writer.writeByte(if (value) true_ else false_),
+        .Int, .ComptimeInt => try encodeInt(@intCast(i64, value), writer),
+        .Enum => try encodeInt(@enumToInt(value), writer),
+        .Optional => {
+            if (value) |payload| {
+                try encode(payload, writer);
+            } else {
+                try writer.writeByte(nil);
+            }
+        },
+        .Pointer => |info| switch (info.size) {
+            .One => try encode(value.*, writer),
+            .Slice => {
+                if (info.child == u8) {
+                    try encodeStr(value, writer);
+                } else {
+                    try encodeLen(value.len, .{ 0x90, 0xdc, 0xdd }, writer);
+                    for (value) |item|
+                        try encode(item, writer);
+                }
+            },
+            else => @compileError("Unable to encode type " ++ @typeName(T)),
+        },
+        .Array => |info| try encode(@as([]const info.child, &value), writer),
+        .Struct => |info| {
+            try encodeLen(info.fields.len, .{ 0x80, 0xde, 0xdf }, writer);
+            inline for (info.fields) |field| {
+                try encodeStr(field.name, writer);
+                try encode(@field(value, field.name), writer);
+            }
+        },
+        .Union => |info| {
+            const Tag = info.tag_type orelse
+                @compileError("Unable to encode untagged union " ++
+                @typeName(T));
+            inline for (info.fields) |field| {
+                if (value == @field(Tag, field.name))
+                    return encode(@field(value, field.name), writer);
+            }
+            unreachable;
+        },
+        else => @compileError("Unable to encode type " ++ @typeName(T)),
+    }
+}
+
+fn encodeInt(value: i64, writer: anytype) @TypeOf(writer).Error!void {
+    if (value >= 0) {
+        if (value <= 0x7f) {
+            try writer.writeByte(@intCast(u8, value));
+        } else if (value <= std.math.maxInt(u8)) {
+            try writer.writeByte(0xcc);
+            try writer.writeIntBig(u8, @intCast(u8, value));
+        } else if (value <= std.math.maxInt(u16)) {
+            try writer.writeByte(0xcd);
+            try writer.writeIntBig(u16, @intCast(u16, value));
+        } else if (value <= std.math.maxInt(u32)) {
+            try writer.writeByte(0xce);
+            try writer.writeIntBig(u32, @intCast(u32, value));
+        } else {
+            try writer.writeByte(0xcf);
+            try writer.writeIntBig(u64, @intCast(u64, value));
+        }
+    } else {
+        if (value >= -32) {
+            try writer.writeByte(@bitCast(u8, @intCast(i8, value)));
+        } else if (value >= std.math.minInt(i8)) {
+            try writer.writeByte(0xd0);
+            try writer.writeIntBig(i8, @intCast(i8, value));
+        } else if (value >= std.math.minInt(i16)) {
+            try writer.writeByte(0xd1);
+            try writer.writeIntBig(i16, @intCast(i16, value));
+        } else if (value >= std.math.minInt(i32)) {
+            try writer.writeByte(0xd2);
+            try writer.writeIntBig(i32, @intCast(i32, value));
+        } else {
+            try writer.writeByte(0xd3);
+            try writer.writeIntBig(i64, value);
+        }
+    }
+}
+
+fn encodeStr(str: []const u8, writer: anytype) @TypeOf(writer).Error!void {
+    if (str.len < 32) {
+        try writer.writeByte(0xa0 | @intCast(u8, str.len));
+    } else if (str.len <= std.math.maxInt(u8)) {
+        try writer.writeByte(0xd9);
+        try writer.writeIntBig(u8, @intCast(u8, str.len));
+    } else if (str.len <= std.math.maxInt(u16)) {
+        try writer.writeByte(0xda);
+        try writer.writeIntBig(u16, @intCast(u16, str.len));
+    } else {
+        try writer.writeByte(0xdb);
+        try writer.writeIntBig(u32, @intCast(u32, str.len));
+    }
+    try writer.writeAll(str);
+}
+
+/// Write the header of an array or map given its fix, 16 and 32 bit formats.
+fn encodeLen(
+    len: usize,
+    comptime formats: [3]u8,
+    writer: anytype,
+) @TypeOf(writer).Error!void {
+    if (len < 16) {
+        try writer.writeByte(formats[0] | @intCast(u8, len));
+    } else if (len <= std.math.maxInt(u16)) {
+        try writer.writeByte(formats[1]);
+        try writer.writeIntBig(u16, @intCast(u16, len));
+    } else {
+        try writer.writeByte(formats[2]);
+        try writer.writeIntBig(u32, @intCast(u32, len));
+    }
+}
+
+// == Decoding ==
+
+const Decoder = struct {
+    bytes: []const u8,
+    pos: usize = 0,
+    allocator: *Allocator,
+
+    fn remaining(self: *const Decoder) usize {
+        return self.bytes.len - self.pos;
+    }
+
+    fn peekByte(self: *const Decoder) DecodeError!u8 {
+        if (self.pos >= self.bytes.len)
+            return error.UnexpectedEndOfInput;
+        return self.bytes[self.pos];
+    }
+
+    fn readByte(self: *Decoder) DecodeError!u8 {
+        const byte = try self.peekByte();
+        self.pos += 1;
+        return byte;
+    }
+
+    fn readBytes(self: *Decoder, len: usize) DecodeError![]const u8 {
+        if (self.remaining() < len)
+            return error.UnexpectedEndOfInput;
+        defer self.pos += len;
+        return self.bytes[self.pos .. self.pos + len];
+    }
+
+    fn readIntBig(self: *Decoder, comptime T: type) DecodeError!T {
+        const bytes = try self.readBytes(@sizeOf(T));
+        return std.mem.readIntBig(T, bytes[0..@sizeOf(T)]);
+    }
+
+    fn readInt(self: *Decoder) DecodeError!i64 {
+        const byte = try self.readByte();
+        switch (byte) {
+            0x00...0x7f => return @as(i64, byte),
+            0xe0...0xff => return @as(i64, @bitCast(i8, byte)),
+            0xcc => return @as(i64, try self.readIntBig(u8)),
+            0xcd => return @as(i64, try self.readIntBig(u16)),
+            0xce => return @as(i64, try self.readIntBig(u32)),
+            0xcf => return std.math.cast(i64, try self.readIntBig(u64)),
+            0xd0 => return @as(i64, try self.readIntBig(i8)),
+            0xd1 => return @as(i64, try self.readIntBig(i16)),
+            0xd2 => return @as(i64, try self.readIntBig(i32)),
+            0xd3 => return try self.readIntBig(i64),
+            else => return error.UnexpectedType,
+        }
+    }
+
+    /// Read a str (or bin) without copying it.
+    fn readStr(self: *Decoder) DecodeError![]const u8 {
+        const byte = try self.readByte();
+        const len: usize = switch (byte) {
+            0xa0...0xbf => byte & 0x1f,
+            0xc4, 0xd9 => try self.readIntBig(u8),
+            0xc5, 0xda => try self.readIntBig(u16),
+            0xc6, 0xdb => try self.readIntBig(u32),
+            else => return error.UnexpectedType,
+        };
+        return self.readBytes(len);
+    }
+
+    fn readArrayLen(self: *Decoder) DecodeError!usize {
+        const byte = try self.readByte();
+        return switch (byte) {
+            0x90...0x9f => byte & 0x0f,
+            0xdc => try self.readIntBig(u16),
+            0xdd => try self.readIntBig(u32),
+            else => error.UnexpectedType,
+        };
+    }
+
+    fn readMapLen(self: *Decoder) DecodeError!usize {
+        const byte = try self.readByte();
+        return switch (byte) {
+            0x80...0x8f => byte & 0x0f,
+            0xde => try self.readIntBig(u16),
+            0xdf => try self.readIntBig(u32),
+            else => error.UnexpectedType,
+        };
+    }
+
+    /// Skip over a value of any type.
+    fn skip(self: *Decoder, depth: u8) DecodeError!void {
+        if (depth > max_skip_depth)
+            return error.TooDeep;
+
+        const byte = try self.readByte();
+        const skip_len: usize = switch (byte) {
+            0x00...0x7f, 0xe0...0xff, nil, false_, true_ => 0,
+            0x80...0x8f, 0xde, 0xdf => {
+                self.pos -= 1;
+                var n = try self.readMapLen();
+                while (n > 0) : (n -= 1) {
+                    try self.skip(depth + 1);
+                    try self.skip(depth + 1);
+                }
+                return;
+            },
+            0x90...0x9f, 0xdc, 0xdd => {
+                self.pos -= 1;
+                var n = try self.readArrayLen();
+                while (n > 0) : (n -= 1)
+                    try self.skip(depth + 1);
+                return;
+            },
+            0xa0...0xbf => byte & 0x1f,
+            0xc4, 0xd9 => try self.readIntBig(u8),
+            0xc5, 0xda => try self.readIntBig(u16),
+            0xc6, 0xdb => try self.readIntBig(u32),
+            0xc7 => @as(usize, try self.readIntBig(u8)) + 1,
+            0xc8 => @as(usize, try self.readIntBig(u16)) + 1,
+            0xc9 => @as(usize, try self.readIntBig(u32)) + 1,
+            0xcc, 0xd0 => 1,
+            0xcd, 0xd1 => 2,
+            0xca, 0xce, 0xd2 => 4,
+            0xcb, 0xcf, 0xd3 => 8,
+            0xd4 => 1 + 1,
+            0xd5 => 1 + 2,
+            0xd6 => 1 + 4,
+            0xd7 => 1 + 8,
+            0xd8 => 1 + 16,
+            else => return error.UnexpectedType,
+        };
+        _ = try self.readBytes(skip_len);
+    }
+};
+
+/// Decode a whole message. Strings in the result point into `bytes`.
+pub fn decode(
+    comptime T: type,
+    bytes: []const u8,
+    allocator: *Allocator,
+) DecodeError!T {
+    var decoder = Decoder{ .bytes = bytes, .allocator = allocator };
+    const value = try decodeValue(T, &decoder);
+    errdefer free(T, value, allocator);
+
+    if (decoder.remaining() != 0)
+        return error.TrailingData;
+    return value;
+}
+
+fn decodeValue(comptime T: type, d: *Decoder) DecodeError!T {
+    switch (@typeInfo(T)) {
+        .Void => {
+            if ((try d.readByte()) != nil)
+                return error.UnexpectedType;
+            return {};
+        },
+        .Bool => return switch (try d.readByte()) {
+            false_ => false,
+            true_ => true,
+            else => error.UnexpectedType,
+        },
+        .Int => return std.math.cast(T, try d.readInt()),
+        .Enum => |info| {
+            const tag = try std.math.cast(info.tag_type, try d.readInt());
+            return std.meta.intToEnum(T, tag);
+        },
+        .Optional => |info| {
+            if ((try d.peekByte()) == nil) {
+                d.pos += 1;
+                return null;
+            }
+            return try decodeValue(info.child, d);
+        },
+        .Pointer => |info| {
+            if (info.size != .Slice)
+                @compileError("Unable to decode type " ++ @typeName(T));
+
+            if (info.child == u8) {
+                if (!info.is_const)
+                    @compileError("Decoded strings are borrowed and const");
+                return d.readStr();
+            }
+
+            const len = try d.readArrayLen();
+            // Every item takes at least a byte. Don't let a bogus length make
+            // us allocate.
+            if (len > d.remaining())
+                return error.UnexpectedEndOfInput;
+
+            const slice = try d.allocator.alloc(info.child, len);
+            var i: usize = 0;
+            errdefer {
+                for (slice[0..i]) |item|
+                    free(info.child, item, d.allocator);
+                d.allocator.free(slice);
+            }
+            while (i < len) : (i += 1)
+                slice[i] = try decodeValue(info.child, d);
+            return slice;
+        },
+        .Struct => |info| {
+            var result: T = undefined;
+            var seen = [_]bool{false} ** info.fields.len;
+            errdefer inline for (info.fields) |field, i| {
+                if (!field.is_comptime and seen[i]) {
+                    const value = @field(result, field.name);
+                    free(field.field_type, value, d.allocator);
+                }
+            };
+
+            var n = try d.readMapLen();
+            while (n > 0) : (n -= 1) {
+                const key = try d.readStr();
+                var found = false;
+                inline for (info.fields) |field, i| {
+                    if (!found and std.mem.eql(u8, key, field.name)) {
+                        found = true;
+                        if (seen[i])
+                            return error.DuplicateField;
+
+                        if (field.is_comptime) {
+                            if (field.field_type != []const u8)
+                                @compileError("Only string comptime fields " ++
+                                    "can be decoded");
+                            const value = try d.readStr();
+                            if (!std.mem.eql(u8, value, field.default_value.?))
+                                return error.UnexpectedValue;
+                        } else {
+                            @field(result, field.name) =
+                                try decodeValue(field.field_type, d);
+                        }
+                        seen[i] = true;
+                    }
+                }
+                if (!found)
+                    try d.skip(0);
+            }
+
+            inline for (info.fields) |field, i| {
+                if (!seen[i]) {
+                    if (field.default_value) |default| {
+                        if (!field.is_comptime)
+                            @field(result, field.name) = default;
+                    } else {
+                        return error.MissingField;
+                    }
+                }
+            }
+            return result;
+        },
+        .Union => |info| {
+            if (info.tag_type == null)
+                @compileError("Unable to decode untagged union " ++
+                    @typeName(T));
+
+            const start = d.pos;
+            inline for (info.fields) |field| {
+                if (decodeValue(field.field_type, d)) |value| {
+                    return @unionInit(T, field.name, value);
+                } else |err| {
+                    if (err == error.OutOfMemory)
+                        return err;
+                    d.pos = start;
+                }
+            }
+            return error.NoUnionMembersMatched;
+        },
+        else => @compileError("Unable to decode type " ++ @typeName(T)),
+    }
+}
+
+/// Release the memory allocated by `decode`.
+pub fn free(comptime T: type, value: T, allocator: *Allocator) void {
+    switch (@typeInfo(T)) {
+        .Optional => |info| {
+            if (value) |payload|
+                free(info.child, payload, allocator);
+        },
+        .Pointer => |info| {
+            // Strings are borrowed from the decoded bytes.
+            if (info.size == .Slice and info.child != u8) {
+                for (value) |item|
+                    free(info.child, item, allocator);
+                allocator.free(value);
+            }
+        },
+        .Struct => |info| {
+            inline for (info.fields) |field| {
+                if (!field.is_comptime) {
+                    const field_value = @field(value, field.name);
+                    free(field.field_type, field_value, allocator);
+                }
+            }
+        },
+        .Union => |info| {
+            const Tag = info.tag_type.?;
+            inline for (info.fields) |field| {
+                if (value == @field(Tag, field.name)) {
+                    const payload = @field(value, field.name);
+                    free(field.field_type, payload, allocator);
+                    break;
+                }
+            }
+        },
+        else => {},
+    }
+}
+
+// == Tests ==
+
+const testing = std.testing;
+
+fn encodeAlloc(value: anytype) ![]u8 {
+    var bytes = std.ArrayList(u8).init(testing.allocator);
+    errdefer bytes.deinit();
+    try encode(value, bytes.writer());
+    return bytes.toOwnedSlice();
+}
+
+fn expectIntRoundTrip(value: i64, format: u8, len: usize) !void {
+    const bytes = try encodeAlloc(value);
+    defer testing.allocator.free(bytes);
+
+    try testing.expectEqual(format, bytes[0]);
+    try testing.expectEqual(len, bytes.len);
+    try testing.expectEqual(value, try decode(i64, bytes, testing.allocator));
+}
+
+test "ints at each width boundary" {
+    try expectIntRoundTrip(0, 0x00, 1);
+    try expectIntRoundTrip(0x7f, 0x7f, 1);
+    try expectIntRoundTrip(0x80, 0xcc, 2);
+    try expectIntRoundTrip(std.math.maxInt(u8), 0xcc, 2);
+    try expectIntRoundTrip(std.math.maxInt(u8) + 1, 0xcd, 3);
+    try expectIntRoundTrip(std.math.maxInt(u16), 0xcd, 3);
+    try expectIntRoundTrip(std.math.maxInt(u16) + 1, 0xce, 5);
+    try expectIntRoundTrip(std.math.maxInt(u32), 0xce, 5);
+    try expectIntRoundTrip(std.math.maxInt(u32) + 1, 0xcf, 9);
+    try expectIntRoundTrip(std.math.maxInt(i64), 0xcf, 9);
+
+    try expectIntRoundTrip(-33, 0xd0, 2);
+    try expectIntRoundTrip(std.math.minInt(i8), 0xd0, 2);
+    try expectIntRoundTrip(std.math.minInt(i8) - 1, 0xd1, 3);
+    try expectIntRoundTrip(std.math.minInt(i16), 0xd1, 3);
+    try expectIntRoundTrip(std.math.minInt(i16) - 1, 0xd2, 5);
+    try expectIntRoundTrip(std.math.minInt(i32), 0xd2, 5);
+    try expectIntRoundTrip(std.math.minInt(i32) - 1, 0xd3, 9);
+    try expectIntRoundTrip(std.math.minInt(i64), 0xd3, 9);
+
+    // Values that don't fit the decoded type.
+    try testing.expectError(
+        error.Overflow,
+        decode(u8, &[_]u8{ 0xcd, 0x01, 0x00 }, testing.allocator),
+    );
+    try testing.expectError(
+        error.Overflow,
+        decode(u32, &[_]u8{0xff}, testing.allocator),
+    );
+    try testing.expectError(error.Overflow, decode(
+        i64,
+        &[_]u8{ 0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+        testing.allocator,
+    ));
+}
+
+test "negative fixints" {
+    try expectIntRoundTrip(-1, 0xff, 1);
+    try expectIntRoundTrip(-32, 0xe0, 1);
+    try testing.expectEqual(
+        @as(i8, -16),
+        try decode(i8, &[_]u8{0xf0}, testing.allocator),
+    );
+}
+
+fn expectStrRoundTrip(len: usize, header: []const u8) !void {
+    const str = try testing.allocator.alloc(u8, len);
+    defer testing.allocator.free(str);
+    std.mem.set(u8, str, 'x');
+
+    const bytes = try encodeAlloc(@as([]const u8, str));
+    defer testing.allocator.free(bytes);
+
+    try testing.expectEqualSlices(u8, header, bytes[0..header.len]);
+    try testing.expectEqual(header.len + len, bytes.len);
+    try testing.expectEqualStrings(
+        str,
+        try decode([]const u8, bytes, testing.allocator),
+    );
+}
+
+test "str8, str16 and str32" {
+    try expectStrRoundTrip(0, &[_]u8{0xa0});
+    try expectStrRoundTrip(31, &[_]u8{0xbf});
+    try expectStrRoundTrip(32, &[_]u8{ 0xd9, 32 });
+    try expectStrRoundTrip(255, &[_]u8{ 0xd9, 255 });
+    try expectStrRoundTrip(256, &[_]u8{ 0xda, 0x01, 0x00 });
+    try expectStrRoundTrip(65535, &[_]u8{ 0xda, 0xff, 0xff });
+    try expectStrRoundTrip(65536, &[_]u8{ 0xdb, 0x00, 0x01, 0x00, 0x00 });
+}
+
+fn expectArrayRoundTrip(len: usize, header: []const u8) !void {
+    const items = try testing.allocator.alloc(u32, len);
+    defer testing.allocator.free(items);
+    for (items) |*item, i|
+        item.* = @intCast(u32, i) * 1000;
+
+    const bytes = try encodeAlloc(@as([]const u32, items));
+    defer testing.allocator.free(bytes);
+    try testing.expectEqualSlices(u8, header, bytes[0..header.len]);
+
+    const decoded = try decode([]const u32, bytes, testing.allocator);
+    defer free([]const u32, decoded, testing.allocator);
+    try testing.expectEqualSlices(u32, items, decoded);
+}
+
+test "arrays" {
+    try expectArrayRoundTrip(0, &[_]u8{0x90});
+    try expectArrayRoundTrip(15, &[_]u8{0x9f});
+    try expectArrayRoundTrip(16, &[_]u8{ 0xdc, 0x00, 0x10 });
+    try expectArrayRoundTrip(65536, &[_]u8{ 0xdd, 0x00, 0x01, 0x00, 0x00 });
+}
+
+const TestMap = struct {
+    id: u32,
+    name: []const u8,
+    tags: []const []const u8,
+    flag: ?bool = null,
+};
+
+test "maps" {
+    const tags = [_][]const u8{ "a", "bc" };
+    const value = TestMap{ .id = 7, .name = "view", .tags = &tags };
+
+    const bytes = try encodeAlloc(value);
+    defer testing.allocator.free(bytes);
+    try testing.expectEqual(@as(u8, 0x84), bytes[0]);
+
+    const decoded = try decode(TestMap, bytes, testing.allocator);
+    defer free(TestMap, decoded, testing.allocator);
+    try testing.expectEqual(value.id, decoded.id);
+    try testing.expectEqualStrings(value.name, decoded.name);
+    try testing.expectEqual(@as(usize, 2), decoded.tags.len);
+    try testing.expectEqualStrings("bc", decoded.tags[1]);
+    try testing.expectEqual(@as(?bool, null), decoded.flag);
+
+    // Unknown fields are skipped, whatever their type.
+    const Extended = struct {
+        extra: []const []const u32,
+        id: u32,
+        name: []const u8,
+        tags: []const []const u8,
+        flag: bool,
+    };
+    const nested = [_][]const u32{&[_]u32{ 1, 70000 }};
+    const extended_bytes = try encodeAlloc(Extended{
+        .extra = &nested,
+        .id = 8,
+        .name = "",
+        .tags = &[_][]const u8{},
+        .flag = true,
+    });
+    defer testing.allocator.free(extended_bytes);
+
+    const from_extended = try decode(
+        TestMap,
+        extended_bytes,
+        testing.allocator,
+    );
+    defer free(TestMap, from_extended, testing.allocator);
+    try testing.expectEqual(@as(u32, 8), from_extended.id);
+    try testing.expectEqual(@as(?bool, true), from_extended.flag);
+
+    // { "id": 1 }
+    try testing.expectError(error.MissingField, decode(
+        TestMap,
+        &[_]u8{ 0x81, 0xa2, 'i', 'd', 0x01 },
+        testing.allocator,
+    ));
+    // { "id": 1, "id": 2 }
+    try testing.expectError(error.DuplicateField, decode(
+        TestMap,
+        &[_]u8{ 0x82, 0xa2, 'i', 'd', 0x01, 0xa2, 'i', 'd', 0x02 },
+        testing.allocator,
+    ));
+}
+
+test "nil and optionals" {
+    const nil_bytes = try encodeAlloc(null);
+    defer testing.allocator.free(nil_bytes);
+    try testing.expectEqualSlices(u8, &[_]u8{nil}, nil_bytes);
+
+    const none_bytes = try encodeAlloc(@as(?u32, null));
+    defer testing.allocator.free(none_bytes);
+    try testing.expectEqualSlices(u8, &[_]u8{nil}, none_bytes);
+    try testing.expectEqual(
+        @as(?u32, null),
+        try decode(?u32, none_bytes, testing.allocator),
+    );
+
+    const some_bytes = try encodeAlloc(@as(?u32, 300));
+    defer testing.allocator.free(some_bytes);
+    try testing.expectEqual(
+        @as(?u32, 300),
+        try decode(?u32, some_bytes, testing.allocator),
+    );
+
+    try decode(void, &[_]u8{nil}, testing.allocator);
+    try testing.expectError(
+        error.UnexpectedType,
+        decode(u32, &[_]u8{nil}, testing.allocator),
+    );
+}
+
+test "truncated input" {
+    const tags = [_][]const u8{ "a", "a string longer than a fixstr" };
+    const bytes = try encodeAlloc(TestMap{
+        .id = 70000,
+        .name = "view",
+        .tags = &tags,
+        .flag = false,
+    });
+    defer testing.allocator.free(bytes);
+
+    // Every prefix fails without leaking what was decoded so far.
+    var len: usize = 0;
+    while (len < bytes.len) : (len += 1) {
+        try testing.expectError(
+            error.UnexpectedEndOfInput,
+            decode(TestMap, bytes[0..len], testing.allocator),
+        );
+    }
+}
+
+test "invalid input" {
+    // 0xc1 is never used.
+    try testing.expectError(
+        error.UnexpectedType,
+        decode(u32, &[_]u8{0xc1}, testing.allocator),
+    );
+    try testing.expectError(
+        error.UnexpectedType,
+        decode(bool, &[_]u8{0x01}, testing.allocator),
+    );
+    try testing.expectError(
+        error.UnexpectedType,
+        decode([]const u8, &[_]u8{0x91}, testing.allocator),
+    );
+    try testing.expectError(
+        error.TrailingData,
+        decode(u32, &[_]u8{ 0x01, 0x02 }, testing.allocator),
+    );
+
+    // A length past the end of the input is refused before allocating.
+    try testing.expectError(error.UnexpectedEndOfInput, decode(
+        []const u32,
+        &[_]u8{ 0xdd, 0xff, 0xff, 0xff, 0xff, 0x01 },
+        testing.allocator,
+    ));
+
+    // Unknown values nested too deep to be skipped.
+    var deep: [max_skip_depth + 8]u8 = undefined;
+    const header = [_]u8{ 0x81, 0xa1, 'x' };
+    std.mem.copy(u8, &deep, &header);
+    std.mem.set(u8, deep[header.len..], 0x91);
+    try testing.expectError(
+        error.TooDeep,
+        decode(struct {}, &deep, testing.allocator),
+    );
+}
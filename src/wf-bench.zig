@@ -0,0 +1,412 @@
+// Benchmarks of the plugin's hot paths, run against the mock compositor of
+// wf-mock.zig. See `zig build bench`.
+const std = @import("std");
+const c = @import("c.zig");
+const ipc = @import("ipc.zig");
+const Lua = @import("Lua.zig");
+const Plugin = @import("Plugin.zig");
+const wflua = @import("wf-lua.zig");
+const mock = @cImport({
+    @cInclude("wf.h");
+    @cInclude("wf-mock.h");
+});
+
+const net = std.net;
+const Proto = ipc.Protocol(net.Stream.Reader, net.Stream.Writer);
+
+pub const log = wflua.log;
+// Keep the plugin quiet while measuring.
+pub const log_level: std.log.Level = .warn;
+
+/// Rerun by the reload benchmark. Stands in for a typical user config.
+const bench_init =
+    \\local wf = require 'wf'
+    \\local ipc = require 'wf.ipc'
+    \\
+    \\for key = string.byte 'a', string.byte 'z' do
+    \\    for digit = 0, 9 do
+    \\        wf.map(string.format('s-%c %d', key, digit), wf.action.run 'true')
+    \\    end
+    \\end
+    \\
+    \\for _ = 1, 50 do
+    \\    wf.outputs:hook('view-focused', function(output, data) end)
+    \\end
+    \\
+    \\ipc.def_cmd {
+    \\    'bench_ping', 'Resolve right away. USAGE: bench_ping',
+    \\    function(promise, args) promise:resolve('pong') end
+    \\}
+    \\
+    \\ipc.def_cmd {
+    \\    'bench_big', 'Resolve with a large result. USAGE: bench_big <bytes>',
+    \\    function(promise, args)
+    \\        promise:resolve(string.rep('x', tonumber(args[1])))
+    \\    end
+    \\}
+    \\
+    \\ipc.def_cmd {
+    \\    'bench_stream', 'Send notifications. USAGE: bench_stream <count>',
+    \\    function(promise, args)
+    \\        promise:begin_notifications()
+    \\        for _ = 1, tonumber(args[1]) do promise:notify('notif') end
+    \\        promise:end_notifications()
+    \\    end
+    \\}
+    \\
+;
+
+/// Evdev keycodes of the letters a to z on a qwerty layout.
+const letter_keycodes = [26]c_uint{
+    30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38, 50,
+    49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44,
+};
+
+const Context = struct {
+    L: *c.lua_State,
+    event_loop: *c.wl_event_loop,
+    output: *mock.wf_Output,
+    view: *mock.wf_View,
+};
+
+fn report(name: []const u8, ops: u64, ns: u64) void {
+    const stdout = std.io.getStdOut().writer();
+    stdout.print("{s:<40} {d:>9} ops {d:>9} ns/op {d:>10} ops/s\n", .{
+        name,
+        ops,
+        ns / ops,
+        ops * std.time.ns_per_s / std.math.max(ns, 1),
+    }) catch {};
+}
+
+/// Read the `bench_hits` counter bumped by the lua handlers.
+fn luaHits(L: *c.lua_State) i64 {
+    c.lua_getglobal(L, "bench_hits");
+    defer c.lua_pop(L, 1);
+    return c.lua_tointeger(L, -1);
+}
+
+fn expectHits(L: *c.lua_State, expected: i64) !void {
+    const hits = luaHits(L);
+    if (hits != expected) {
+        std.log.err("Expected {d} lua calls, got {d}", .{ expected, hits });
+        return error.UnexpectedLuaCalls;
+    }
+}
+
+fn benchSignals(ctx: *Context) !void {
+    try Lua.doString(ctx.L,
+        \\local wf = require 'wf'
+        \\bench_hits = 0
+        \\local function hit() bench_hits = bench_hits + 1 end
+        \\wf.outputs:hook('view-attached', hit)
+        \\wf.outputs:hook('view-detached', hit, {filter = {app_id = 'none'}})
+        \\wf.outputs:hook('view-layer-attached', hit, {coalesce = true})
+    );
+    const output = @ptrCast(*c_void, ctx.output);
+    const n = 100_000;
+
+    var timer = try std.time.Timer.start();
+    var i: usize = 0;
+    while (i < n) : (i += 1)
+        mock.wfmock_emit(output, "view-attached", ctx.view, ctx.output);
+    report("signal: lua handler", n, timer.lap());
+    try expectHits(ctx.L, n);
+
+    i = 0;
+    while (i < n) : (i += 1)
+        mock.wfmock_emit(output, "view-detached", ctx.view, ctx.output);
+    report("signal: filtered out natively", n, timer.lap());
+    try expectHits(ctx.L, n);
+
+    i = 0;
+    while (i < n) : (i += 1)
+        mock.wfmock_emit(output, "view-layer-attached", ctx.view, ctx.output);
+    _ = c.wl_event_loop_dispatch(ctx.event_loop, 0);
+    report("signal: coalesced", n, timer.lap());
+    try expectHits(ctx.L, n + 1);
+}
+
+fn tap(keycode: c_uint) void {
+    _ = mock.wfmock_emit_key(keycode, true);
+    _ = mock.wfmock_emit_key(keycode, false);
+}
+
+fn benchKeys(ctx: *Context) !void {
+    try Lua.doString(ctx.L,
+        \\local wf = require 'wf'
+        \\bench_hits = 0
+        \\for _, mods in ipairs {'C-', 'M-'} do
+        \\    for a = string.byte 'a', string.byte 'z' do
+        \\        for b = string.byte 'a', string.byte 'z' do
+        \\            local keys = string.format('%s%c %c', mods, a, b)
+        \\            wf.map(keys, wf.action.run 'true')
+        \\        end
+        \\    end
+        \\end
+        \\wf.map('C-M-x', function() bench_hits = bench_hits + 1 end)
+    );
+    // Along with the ones from the init file.
+    const bindings = 2 * 26 * 26 + 1 + 26 * 10;
+    const ctrl = @intCast(c_uint, c.WLR_MODIFIER_CTRL);
+    const alt = @intCast(c_uint, c.WLR_MODIFIER_ALT);
+    const n = 100_000;
+
+    const runs = mock.wfmock_get_run_count();
+    var timer = try std.time.Timer.start();
+    var i: usize = 0;
+    while (i < n) : (i += 1) {
+        mock.wfmock_set_modifiers(if (i % 2 == 0) ctrl else alt);
+        tap(letter_keycodes[i % 26]);
+        mock.wfmock_set_modifiers(0);
+        tap(letter_keycodes[(i / 26) % 26]);
+    }
+    var name_buf: [64]u8 = undefined;
+    const name = try std.fmt.bufPrint(
+        &name_buf,
+        "keys: native action ({d} bindings)",
+        .{bindings},
+    );
+    report(name, n, timer.lap());
+    if (mock.wfmock_get_run_count() - runs != n)
+        return error.UnexpectedActionRuns;
+
+    i = 0;
+    mock.wfmock_set_modifiers(ctrl | alt);
+    while (i < n) : (i += 1)
+        tap(letter_keycodes['x' - 'a']);
+    mock.wfmock_set_modifiers(0);
+    report("keys: lua handler", n, timer.lap());
+    try expectHits(ctx.L, n);
+
+    // Not bound without modifiers.
+    i = 0;
+    while (i < n) : (i += 1)
+        tap(letter_keycodes['q' - 'a']);
+    report("keys: unbound key", n, timer.lap());
+    if (mock.wfmock_get_run_count() - runs != n)
+        return error.UnexpectedActionRuns;
+}
+
+/// Talks to the ipc server from another thread while the main thread runs the
+/// event loop.
+const IpcClient = struct {
+    socket_path: []const u8,
+    round_trips: u32,
+    notifs: u32,
+    /// Over the default `ipc_client_buffer_size`, responses never count
+    /// against it.
+    big_response_len: u32,
+
+    round_trip_ns: u64 = 0,
+    notif_ns: u64 = 0,
+    big_response_ns: u64 = 0,
+    err: ?anyerror = null,
+    done: bool = false,
+
+    fn run(self: *IpcClient) void {
+        self.measure() catch |err| {
+            self.err = err;
+        };
+        @atomicStore(bool, &self.done, true, .SeqCst);
+    }
+
+    fn measure(self: *IpcClient) !void {
+        const allocator = std.heap.c_allocator;
+
+        const stream = try net.connectUnixSocket(self.socket_path);
+        defer stream.close();
+
+        var proto = Proto.init(
+            allocator,
+            stream.reader(),
+            stream.writer(),
+            .msgpack,
+        );
+        defer proto.deinit();
+
+        var id: u32 = 1;
+        var no_args = [_][]const u8{};
+        var timer = try std.time.Timer.start();
+        while (id <= self.round_trips) : (id += 1) {
+            const resp = try proto.request(
+                ipc.Command.RespRecv,
+                ipc.Command.ReqSend{
+                    .id = id,
+                    .params = .{ .command = "bench_ping", .args = &no_args },
+                },
+            );
+            defer proto.freeResponse(resp);
+            if (resp != .Result)
+                return error.UnexpectedResponse;
+        }
+        self.round_trip_ns = timer.lap();
+
+        var count_buf: [16]u8 = undefined;
+        var stream_args = [_][]const u8{
+            try std.fmt.bufPrint(&count_buf, "{d}", .{self.notifs}),
+        };
+        const resp = try proto.request(
+            ipc.Command.RespRecv,
+            ipc.Command.ReqSend{
+                .id = id,
+                .params = .{ .command = "bench_stream", .args = &stream_args },
+            },
+        );
+        defer proto.freeResponse(resp);
+        if (resp != .BeginingNotifs)
+            return error.UnexpectedResponse;
+
+        var received: u32 = 0;
+        while (try proto.nextNotif(ipc.Command.NotifRecv)) |notif| {
+            defer proto.freeNotif(notif);
+            switch (notif) {
+                .Notif => received += 1,
+                .NotifEnd => break,
+                .TopicNotif => {},
+            }
+        }
+        self.notif_ns = timer.lap();
+        if (received != self.notifs)
+            return error.MissingNotifications;
+
+        id += 1;
+        var len_buf: [16]u8 = undefined;
+        var big_args = [_][]const u8{
+            try std.fmt.bufPrint(&len_buf, "{d}", .{self.big_response_len}),
+        };
+        const big_resp = try proto.request(
+            ipc.Command.RespRecv,
+            ipc.Command.ReqSend{
+                .id = id,
+                .params = .{ .command = "bench_big", .args = &big_args },
+            },
+        );
+        defer proto.freeResponse(big_resp);
+        self.big_response_ns = timer.read();
+        switch (big_resp) {
+            .Result => |result| {
+                if (result.result.cmd_result.len != self.big_response_len)
+                    return error.TruncatedResponse;
+            },
+            else => return error.UnexpectedResponse,
+        }
+    }
+};
+
+fn benchIpc(ctx: *Context) !void {
+    var client = IpcClient{
+        .socket_path = std.os.getenv("WFIPC_SOCKET").?,
+        .round_trips = 10_000,
+        .notifs = 100_000,
+        .big_response_len = 4 * 1024 * 1024,
+    };
+
+    const thread = try std.Thread.spawn(IpcClient.run, &client);
+    while (!@atomicLoad(bool, &client.done, .SeqCst))
+        _ = c.wl_event_loop_dispatch(ctx.event_loop, 10);
+    thread.wait();
+
+    if (client.err) |err|
+        return err;
+    report("ipc: request round trip", client.round_trips, client.round_trip_ns);
+    report("ipc: notification", client.notifs, client.notif_ns);
+    report("ipc: 4 MiB response", 1, client.big_response_ns);
+}
+
+fn benchReload(ctx: *Context) !void {
+    const n = 20;
+
+    var timer = try std.time.Timer.start();
+    var i: usize = 0;
+    while (i < n) : (i += 1)
+        try Lua.doString(ctx.L, "require('wf').reload_init()");
+    report("reload: init file", n, timer.lap());
+}
+
+fn setEnv(name: [*:0]const u8, value: [:0]const u8) !void {
+    if (c.setenv(name, value.ptr, 1) != 0)
+        return error.SetEnvFailed;
+}
+
+pub fn main() !u8 {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = &arena.allocator;
+
+    // Keep the init file, bytecode cache and socket out of the user's way.
+    const dir = try std.fmt.allocPrint(
+        allocator,
+        "/tmp/wf-lua-bench.{d}",
+        .{c.getpid()},
+    );
+    try std.fs.makeDirAbsolute(dir);
+    defer std.fs.deleteTreeAbsolute(dir) catch {};
+
+    const init_file = try std.fs.path.joinZ(allocator, &.{ dir, "init.lua" });
+    try std.fs.cwd().writeFile(init_file, bench_init);
+    try setEnv("WFLUA_INIT", init_file);
+    try setEnv("XDG_CACHE_HOME", try allocator.dupeZ(u8, dir));
+    try setEnv(
+        "WFIPC_SOCKET",
+        try std.fs.path.joinZ(allocator, &.{ dir, "ipc.sock" }),
+    );
+
+    if (!mock.wfmock_init())
+        return 1;
+    defer mock.wfmock_fini();
+
+    // Defaults from metadata/wf-lua.xml.
+    for ([_][2][*:0]const u8{
+        .{ "handler_budget", "0" },
+        .{ "ipc_backlog", "128" },
+        .{ "ipc_client_buffer_size", "1024" },
+        .{ "ipc_max_clients", "512" },
+        .{ "ipc_idle_timeout", "0" },
+        .{ "ipc_topic_queue_size", "64" },
+        .{ "ipc_workers", "2" },
+        .{ "lua_memory_limit", "0" },
+        .{ "lua_gc_step", "256" },
+        .{ "trace_buffer_size", "16384" },
+    }) |option| {
+        if (!mock.wfmock_add_option(
+            "wf-lua",
+            option[0],
+            .WF_OPTION_TYPE_INT,
+            option[1],
+        ))
+            return 1;
+    }
+
+    const output = mock.wfmock_add_output("BENCH-1", .{
+        .x = 0,
+        .y = 0,
+        .width = 1920,
+        .height = 1080,
+    }) orelse return 1;
+    _ = mock.wfmock_add_output("BENCH-2", .{
+        .x = 1920,
+        .y = 0,
+        .width = 1920,
+        .height = 1080,
+    }) orelse return 1;
+    const view = mock.wfmock_add_view(output, "bench", "Benchmark") orelse
+        return 1;
+
+    const plugin = wflua.plugin_init() orelse return 1;
+    defer wflua.plugin_fini(plugin);
+
+    var ctx = Context{
+        .L = Plugin.getPlugin().L.?,
+        .event_loop = c.wf_Core_get_event_loop(c.wf_get_core()).?,
+        .output = output,
+        .view = view,
+    };
+
+    try benchSignals(&ctx);
+    try benchKeys(&ctx);
+    try benchIpc(&ctx);
+    // Last since it drops the state set up by the other benchmarks.
+    try benchReload(&ctx);
+    return 0;
+}
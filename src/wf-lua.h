@@ -5,27 +5,121 @@ typedef enum {
 } wflua_LogLvl;
 
 void wflua_log(wflua_LogLvl lvl, const char *msg);
+_Bool wflua_log_enabled(wflua_LogLvl lvl);
 
 typedef enum {
     WFLUA_EVENT_TYPE_SIGNAL,
     WFLUA_EVENT_TYPE_EMITTER_DESTROYED,
+    WFLUA_EVENT_TYPE_TIMER,
+    // `data` is a `const wf_String *` chunk or line of output.
+    WFLUA_EVENT_TYPE_PROCESS_STDOUT,
+    WFLUA_EVENT_TYPE_PROCESS_STDERR,
+    // `data` is a `const wflua_ProcessExit *`. Sent last, once the output is
+    // fully read. The handle is released before it is sent.
+    WFLUA_EVENT_TYPE_PROCESS_EXIT,
+    // `data` is a `const wflua_WorkerResult *`. `handle` is the job handle.
+    WFLUA_EVENT_TYPE_WORKER_RESULT,
 } wflua_EventType;
 
-typedef void (*wflua_EventCallback)(void *emitter, wflua_EventType event_type,
-                                    const char *signal, void *data);
+// `handle` is the handle returned when subscribing or adding a timer.
+// `signal_id` is the interned id of the signal name (0 for non-signal events).
+typedef void (*wflua_EventCallback)(wflua_EventType event_type,
+                                    unsigned int handle, unsigned int signal_id,
+                                    void *data);
 
 void wflua_register_event_callback(const wflua_EventCallback callback);
 
-void wflua_lifetime_subscribe(void *object);
-void wflua_lifetime_unsubscribe(void *object);
+unsigned int wflua_lifetime_subscribe(void *object);
+void wflua_lifetime_unsubscribe(unsigned int handle);
 
-void wflua_signal_subscribe(void *object, const char *signal);
-void wflua_signal_unsubscribe(void *object, const char *signal);
-void wflua_signal_unsubscribe_all(void *object);
+// Lua keeps a data table per object, identified by an id stored on the object.
+// Get the id of an object's table or 0 if it has none. Only safe to call on
+// objects for which wflua_object_data_exists is true.
+int wflua_object_data_get(void *object);
+// Store the id of an object's table. Returns false on failure.
+_Bool wflua_object_data_set(void *object, int id);
+// Whether an object holds an id. Safe to call on dead objects.
+_Bool wflua_object_data_exists(void *object);
+// Take the id of a table whose object died, or 0 if there is none left.
+int wflua_object_data_take_released(void);
+
+typedef enum {
+    // Call into lua on every emission.
+    WFLUA_SUBSCRIBE_MODE_IMMEDIATE,
+    // Queue emissions and deliver them once per event loop iteration. Repeated
+    // emissions are collapsed and delivered without signal data.
+    WFLUA_SUBSCRIBE_MODE_COALESCE,
+} wflua_SubscribeMode;
+
+unsigned int wflua_signal_intern(const char *signal);
+unsigned int wflua_signal_subscribe(void *object, unsigned int signal_id,
+                                    wflua_SubscribeMode mode);
+void wflua_signal_unsubscribe(unsigned int handle);
+
+// What a filter looks at in the signal data.
+typedef enum {
+    // The app id, title or output name of the signaled view.
+    WFLUA_FILTER_FIELD_VIEW_APP_ID,
+    WFLUA_FILTER_FIELD_VIEW_TITLE,
+    WFLUA_FILTER_FIELD_VIEW_OUTPUT,
+    // The name of the signaled output.
+    WFLUA_FILTER_FIELD_OUTPUT_NAME,
+} wflua_FilterField;
+
+typedef enum {
+    WFLUA_FILTER_MATCH_EQUAL,
+    // Shell wildcard pattern, see fnmatch(3).
+    WFLUA_FILTER_MATCH_GLOB,
+} wflua_FilterMatch;
+
+// Only deliver emissions whose signal data matches the pattern. Filters are
+// evaluated natively before anything is queued or sent to lua. All filters
+// added to a subscription must match.
+void wflua_signal_add_filter(unsigned int handle, wflua_FilterField field,
+                             wflua_FilterMatch match, const char *pattern);
+
+// Send a WFLUA_EVENT_TYPE_TIMER event after `timeout_ms`, then every
+// `interval_ms` if it is not 0. Returns 0 on failure. One-shot timers are
+// released before their event is sent.
+unsigned int wflua_timer_add(unsigned int timeout_ms, unsigned int interval_ms);
+void wflua_timer_cancel(unsigned int handle);
+
+typedef struct {
+    // Exit code or -1 if killed by a signal.
+    int code;
+    // Signal that killed the process or 0.
+    int signal;
+} wflua_ProcessExit;
+
+// Spawn a process with its stdin from /dev/null. Its stdout and stderr are
+// read on the event loop and sent as events, either line by line or in chunks
+// as they come. `argv` is null terminated and searched for in $PATH. Returns 0
+// on failure.
+unsigned int wflua_process_spawn(const char *const *argv, _Bool line_buffered);
+_Bool wflua_process_kill(unsigned int handle, int signal);
+int wflua_process_get_pid(unsigned int handle);
+
+typedef struct {
+    // Whether the function returned rather than raised an error.
+    _Bool ok;
+    // What the function returned or the error message.
+    wf_String result;
+} wflua_WorkerResult;
+
+// Load a function dumped with string.dump for the worker states to run.
+// Returns its id or 0 if there are no workers.
+unsigned int wflua_worker_load(const char *bytecode, size_t len);
+// Run a loaded function with an array of string arguments on the least busy
+// worker. Its result is sent as a WFLUA_EVENT_TYPE_WORKER_RESULT event.
+// Returns the job handle or 0 on failure.
+unsigned int wflua_worker_run(unsigned int function, const wf_String *args,
+                              size_t nargs);
 
 typedef enum {
     WFLUA_IPC_COMMAND_ERROR = 1,
     WFLUA_IPC_COMMAND_INVALID_ARGS = 2,
+    // The request id is taken by a request still in flight on the connection.
+    WFLUA_IPC_REQUEST_ID_IN_USE = 3,
 } wflua_CommandError;
 
 void wflua_ipc_command_resolve(void *handle, const char *result);
@@ -33,5 +127,11 @@ void wflua_ipc_command_reject(void *handle, const char *error,
                               wflua_CommandError code);
 void wflua_ipc_command_begin_notifications(void *handle);
 void wflua_ipc_command_notify(void *handle, const char *notif);
+void wflua_ipc_publish(const char *topic, const char *msg);
 
 void wflua_reload_init();
+
+// Reload lua modules when their file changes. Changes to the init file reload
+// everything.
+void wflua_watch_modules();
+void wflua_watch_module(const char *name, const char *path);
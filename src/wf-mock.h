@@ -0,0 +1,46 @@
+// Control of the stand-in compositor implemented by wf-mock.zig.
+//
+// The mock implements the wf.h ABI without wayfire so that the plugin can be
+// tested and benchmarked offline. It links in place of wf.cpp and libwayfire.
+// Nothing happens on its own: objects are created and signals are emitted
+// through the functions below.
+//
+// Include after wf.h.
+
+// Create the core, its event loop and a keyboard with the default keymap.
+_Bool wfmock_init();
+// Destroy every object, running their lifetime callbacks, then the event loop.
+void wfmock_fini();
+
+// Define an option. `value` is parsed like in the config file.
+_Bool wfmock_add_option(const char *section, const char *option,
+                        wf_OptionType type, const char *value);
+
+// Emits "output-added" on the output layout. The first output gets focused.
+wf_Output *wfmock_add_output(const char *name, wf_Geometry geometry);
+// Emits "output-removed" on the output layout, then destroys the output.
+void wfmock_remove_output(wf_Output *output);
+
+// Emits "view-mapped" on the output.
+wf_View *wfmock_add_view(wf_Output *output, const char *app_id,
+                         const char *title);
+// Emits "view-unmapped" on the output, then destroys the view.
+void wfmock_remove_view(wf_View *view);
+// Emits "title-changed" on the view.
+void wfmock_set_view_title(wf_View *view, const char *title);
+
+// Emit a signal whose data holds a view and an output. Either may be null.
+void wfmock_emit(void *emitter, const char *signal, wf_View *view,
+                 wf_Output *output);
+
+// Set the pressed modifiers as a mask of wlr_keyboard_modifier bits.
+void wfmock_set_modifiers(unsigned int modifiers);
+// Emit "keyboard_key" on the core for an evdev keycode. Returns the processing
+// mode left by the handlers.
+wf_InputEventProcessingMode wfmock_emit_key(unsigned int keycode,
+                                            _Bool pressed);
+
+// Calls to wf_Core_run and wf_Output_call_plugin_plain since init. Commands
+// are never actually run.
+unsigned int wfmock_get_run_count();
+unsigned int wfmock_get_plugin_call_count();
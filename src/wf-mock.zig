@@ -0,0 +1,1278 @@
+// Stand-in for wf.cpp and libwayfire implementing the wf.h ABI, for running
+// the plugin offline in tests and benchmarks. See wf-mock.h for the controls.
+//
+// Objects are plain structs. Anything with signals or lifetime callbacks gets
+// an `Emitter` registered under its address, like wayfire's object_base_t.
+const std = @import("std");
+const c = @cImport({
+    @cInclude("xkbcommon/xkbcommon.h");
+    @cInclude("wlr/types/wlr_keyboard.h");
+    @cInclude("wlr/types/wlr_seat.h");
+    @cInclude("wayland-server-core.h");
+
+    @cInclude("wf.h");
+    @cInclude("wf-mock.h");
+});
+
+const allocator = std.heap.c_allocator;
+
+/// Last serial given to view strings. The mock refreshes them all at once.
+var view_string_serial: c_uint = 0;
+
+const Connection = struct {
+    callback: c.wf_SignalCallback,
+    data1: ?*c_void,
+    data2: ?*c_void,
+};
+
+const Subscription = struct {
+    signal: [:0]const u8,
+    /// Null once disconnected during an emission.
+    conn: ?*Connection,
+};
+
+const LifetimeCallback = struct {
+    callback: c.wf_LifetimeCallback,
+    data: ?*c_void,
+};
+
+const LifetimeCallbacks = std.ArrayList(?LifetimeCallback);
+
+const ObjectDataId = struct {
+    id: c_int,
+    callback: c.wf_ObjectDataCallback,
+    data: ?*c_void,
+};
+
+const Emitter = struct {
+    subscriptions: std.ArrayList(Subscription),
+    /// Indexed by token. Unsubscribed callbacks are nulled.
+    lifetime_callbacks: LifetimeCallbacks,
+    object_data: ?ObjectDataId = null,
+    /// Subscriptions are only removed once no emission is running.
+    emitting: u32 = 0,
+    /// Destroyed during an emission. Freed once it's done.
+    dead: bool = false,
+
+    fn create() !*Emitter {
+        const self = try allocator.create(Emitter);
+        self.* = .{
+            .subscriptions = std.ArrayList(Subscription).init(allocator),
+            .lifetime_callbacks = LifetimeCallbacks.init(allocator),
+        };
+        return self;
+    }
+
+    fn destroy(self: *Emitter) void {
+        for (self.subscriptions.items) |sub|
+            allocator.free(sub.signal);
+        self.subscriptions.deinit();
+        self.lifetime_callbacks.deinit();
+        allocator.destroy(self);
+    }
+
+    fn remove(self: *Emitter, index: usize) void {
+        if (self.emitting > 0) {
+            self.subscriptions.items[index].conn = null;
+            return;
+        }
+        allocator.free(self.subscriptions.items[index].signal);
+        _ = self.subscriptions.orderedRemove(index);
+    }
+
+    fn disconnect(self: *Emitter, conn: *Connection) void {
+        var i: usize = self.subscriptions.items.len;
+        while (i > 0) {
+            i -= 1;
+            if (self.subscriptions.items[i].conn == conn)
+                self.remove(i);
+        }
+    }
+
+    /// Drop the subscriptions disconnected during an emission.
+    fn compact(self: *Emitter) void {
+        var i: usize = self.subscriptions.items.len;
+        while (i > 0) {
+            i -= 1;
+            if (self.subscriptions.items[i].conn == null)
+                self.remove(i);
+        }
+    }
+};
+
+/// The data of every signal emitted by the mock.
+const SignalData = struct {
+    view: ?*View = null,
+    output: ?*Output = null,
+    key_event: ?*c.struct_wlr_event_keyboard_key = null,
+    key_mode: c.wf_InputEventProcessingMode =
+        .WF_INPUT_EVENT_PROC_MODE_FULL,
+};
+
+const Value = union(enum) {
+    int: c_int,
+    double: f64,
+    boolean: bool,
+    string: [:0]const u8,
+
+    /// Parse a value like in the config file. Strings are copied.
+    fn parse(option_type: c.wf_OptionType, str: []const u8) !Value {
+        if (option_type == .WF_OPTION_TYPE_INT) {
+            return Value{ .int = try std.fmt.parseInt(c_int, str, 10) };
+        } else if (option_type == .WF_OPTION_TYPE_DOUBLE) {
+            return Value{ .double = try std.fmt.parseFloat(f64, str) };
+        } else if (option_type == .WF_OPTION_TYPE_BOOL) {
+            if (std.mem.eql(u8, str, "true") or std.mem.eql(u8, str, "1"))
+                return Value{ .boolean = true };
+            if (std.mem.eql(u8, str, "false") or std.mem.eql(u8, str, "0"))
+                return Value{ .boolean = false };
+            return error.InvalidBool;
+        }
+        return Value{ .string = try allocator.dupeZ(u8, str) };
+    }
+
+    fn deinit(self: Value) void {
+        switch (self) {
+            .string => |str| allocator.free(str),
+            else => {},
+        }
+    }
+};
+
+const Option = struct {
+    option_type: c.wf_OptionType,
+    value: Value,
+};
+
+const Transaction = struct {
+    const Change = struct { option: *Option, value: Value };
+
+    changes: std.ArrayList(Change),
+
+    fn clear(self: *Transaction) void {
+        self.rollback(0);
+    }
+
+    fn rollback(self: *Transaction, size: usize) void {
+        if (size >= self.changes.items.len)
+            return;
+        for (self.changes.items[size..]) |change|
+            change.value.deinit();
+        self.changes.shrinkRetainingCapacity(size);
+    }
+};
+
+const Output = struct {
+    name: [:0]const u8,
+    geometry: c.wf_Geometry,
+    active_view: ?*View = null,
+
+    fn relativeGeometry(self: *const Output) c.wf_Geometry {
+        return .{
+            .x = 0,
+            .y = 0,
+            .width = self.geometry.width,
+            .height = self.geometry.height,
+        };
+    }
+};
+
+const View = struct {
+    output: ?*Output,
+    app_id: [:0]const u8,
+    title: [:0]const u8,
+    /// Relative to the output.
+    geometry: c.wf_Geometry,
+    mapped: bool = true,
+    properties: c.wf_ViewProperties = undefined,
+
+    fn updateProperties(self: *View) void {
+        view_string_serial += 2;
+        self.properties = .{
+            .title = .{ .len = self.title.len, .data = self.title.ptr },
+            .app_id = .{ .len = self.app_id.len, .data = self.app_id.ptr },
+            .wm_geometry = self.geometry,
+            .title_serial = view_string_serial - 1,
+            .app_id_serial = view_string_serial,
+        };
+    }
+};
+
+const OutputLayout = struct {
+    outputs: std.ArrayList(*Output),
+};
+
+const Core = struct {
+    event_loop: *c.wl_event_loop,
+    /// In stacking order, top last.
+    views: std.ArrayList(*View),
+    active_output: ?*Output,
+    cursor: c.wf_Pointf,
+
+    seat: c.struct_wlr_seat,
+    keyboard: c.struct_wlr_keyboard,
+    xkb_context: *c.xkb_context,
+
+    /// By "section/option".
+    options: std.StringHashMap(*Option),
+
+    run_count: c_uint,
+    plugin_call_count: c_uint,
+};
+
+var core: Core = undefined;
+var output_layout: OutputLayout = undefined;
+
+/// Emitters by the address of their object.
+var emitters: std.AutoHashMap(usize, *Emitter) = undefined;
+
+/// Temporary string buffer. Contents are invalid after any next function call.
+var string_buf: [256]u8 = undefined;
+
+fn bufPrint(comptime format: []const u8, args: anytype) [*:0]const u8 {
+    const str = std.fmt.bufPrintZ(&string_buf, format, args) catch {
+        // Truncate.
+        string_buf[string_buf.len - 1] = 0;
+        return @ptrCast([*:0]const u8, &string_buf);
+    };
+    return str.ptr;
+}
+
+fn wrapView(view: ?*View) ?*c.wf_View {
+    return @ptrCast(?*c.wf_View, view);
+}
+fn unwrapView(view: ?*c.wf_View) *View {
+    return @ptrCast(*View, @alignCast(@alignOf(View), view.?));
+}
+fn wrapOutput(output: ?*Output) ?*c.wf_Output {
+    return @ptrCast(?*c.wf_Output, output);
+}
+fn unwrapOutput(output: ?*c.wf_Output) *Output {
+    return @ptrCast(*Output, @alignCast(@alignOf(Output), output.?));
+}
+fn unwrapOption(option: ?*c.wf_Option) *Option {
+    return @ptrCast(*Option, @alignCast(@alignOf(Option), option.?));
+}
+fn unwrapTransaction(tx: ?*c.wf_OptionTransaction) *Transaction {
+    return @ptrCast(
+        *Transaction,
+        @alignCast(@alignOf(Transaction), tx.?),
+    );
+}
+fn unwrapSignalData(sig_data: ?*c_void) ?*SignalData {
+    return @ptrCast(
+        ?*SignalData,
+        @alignCast(@alignOf(SignalData), sig_data),
+    );
+}
+
+fn getOrCreateEmitter(object: *c_void) !*Emitter {
+    const entry = try emitters.getOrPut(@ptrToInt(object));
+    if (!entry.found_existing) {
+        entry.value_ptr.* = Emitter.create() catch |err| {
+            emitters.removeAssertDiscard(@ptrToInt(object));
+            return err;
+        };
+    }
+    return entry.value_ptr.*;
+}
+
+fn emit(object: *c_void, signal: []const u8, data: *SignalData) void {
+    const emitter = emitters.get(@ptrToInt(object)) orelse return;
+
+    // Subscriptions added by the callbacks are called as well.
+    emitter.emitting += 1;
+    var i: usize = 0;
+    while (i < emitter.subscriptions.items.len) : (i += 1) {
+        const sub = emitter.subscriptions.items[i];
+        const conn = sub.conn orelse continue;
+        if (std.mem.eql(u8, sub.signal, signal))
+            conn.callback.?(@ptrCast(*c_void, data), conn.data1, conn.data2);
+    }
+    emitter.emitting -= 1;
+
+    if (emitter.emitting == 0) {
+        if (emitter.dead) {
+            emitter.destroy();
+        } else {
+            emitter.compact();
+        }
+    }
+}
+
+/// Run the lifetime callbacks of an object and forget its emitter.
+fn destroyObject(object: *c_void) void {
+    const entry = emitters.fetchRemove(@ptrToInt(object)) orelse return;
+    const emitter = entry.value;
+
+    for (emitter.lifetime_callbacks.items) |maybe_callback| {
+        if (maybe_callback) |callback|
+            callback.callback.?(object, callback.data);
+    }
+    if (emitter.object_data) |data|
+        data.callback.?(object, data.id, data.data);
+
+    if (emitter.emitting > 0) {
+        emitter.dead = true;
+    } else {
+        emitter.destroy();
+    }
+}
+
+// == Mock controls ==
+
+export fn wfmock_init() bool {
+    initCore() catch |err| {
+        std.log.err("Failed to initialize the mock core: {any}", .{err});
+        return false;
+    };
+    return true;
+}
+
+fn initCore() !void {
+    emitters = std.AutoHashMap(usize, *Emitter).init(allocator);
+    errdefer emitters.deinit();
+    output_layout = .{ .outputs = std.ArrayList(*Output).init(allocator) };
+    errdefer output_layout.outputs.deinit();
+
+    core.event_loop = c.wl_event_loop_create() orelse
+        return error.EventLoopCreateFailed;
+    errdefer c.wl_event_loop_destroy(core.event_loop);
+
+    core.views = std.ArrayList(*View).init(allocator);
+    core.active_output = null;
+    core.cursor = .{ .x = 0, .y = 0 };
+    core.options = std.StringHashMap(*Option).init(allocator);
+    core.run_count = 0;
+    core.plugin_call_count = 0;
+
+    // Only what the plugin reads off the seat and keyboard is filled in.
+    std.mem.set(u8, std.mem.asBytes(&core.seat), 0);
+    std.mem.set(u8, std.mem.asBytes(&core.keyboard), 0);
+    core.seat.keyboard_state.keyboard = &core.keyboard;
+
+    core.xkb_context = c.xkb_context_new(
+        c.enum_xkb_context_flags.XKB_CONTEXT_NO_FLAGS,
+    ) orelse return error.XkbContextCreateFailed;
+    errdefer c.xkb_context_unref(core.xkb_context);
+
+    // Default rules, model and layout.
+    const keymap = c.xkb_keymap_new_from_names(
+        core.xkb_context,
+        null,
+        c.enum_xkb_keymap_compile_flags.XKB_KEYMAP_COMPILE_NO_FLAGS,
+    ) orelse return error.XkbKeymapCreateFailed;
+    core.keyboard.keymap = keymap;
+    core.keyboard.xkb_state = c.xkb_state_new(keymap) orelse {
+        c.xkb_keymap_unref(keymap);
+        return error.XkbStateCreateFailed;
+    };
+
+    // Same order as enum wlr_keyboard_modifier.
+    const mod_names = [_][*:0]const u8{
+        c.XKB_MOD_NAME_SHIFT, c.XKB_MOD_NAME_CAPS,
+        c.XKB_MOD_NAME_CTRL,  c.XKB_MOD_NAME_ALT,
+        "Mod2",               "Mod3",
+        c.XKB_MOD_NAME_LOGO,  "Mod5",
+    };
+    for (mod_names) |name, i|
+        core.keyboard.mod_indexes[i] = c.xkb_keymap_mod_get_index(keymap, name);
+}
+
+export fn wfmock_fini() void {
+    while (core.views.items.len > 0)
+        removeView(core.views.items[core.views.items.len - 1]);
+    while (output_layout.outputs.items.len > 0)
+        removeOutput(output_layout.outputs.items[0]);
+
+    destroyObject(&output_layout);
+    destroyObject(&core);
+
+    // Left over emitters belong to nothing anymore.
+    var it = emitters.valueIterator();
+    while (it.next()) |emitter|
+        emitter.*.destroy();
+    emitters.deinit();
+
+    var options = core.options.iterator();
+    while (options.next()) |entry| {
+        allocator.free(entry.key_ptr.*);
+        entry.value_ptr.*.value.deinit();
+        allocator.destroy(entry.value_ptr.*);
+    }
+    core.options.deinit();
+
+    c.xkb_state_unref(core.keyboard.xkb_state);
+    c.xkb_keymap_unref(core.keyboard.keymap);
+    c.xkb_context_unref(core.xkb_context);
+
+    core.views.deinit();
+    output_layout.outputs.deinit();
+    c.wl_event_loop_destroy(core.event_loop);
+}
+
+export fn wfmock_add_option(
+    section: [*c]const u8,
+    option: [*c]const u8,
+    option_type: c.wf_OptionType,
+    value: [*c]const u8,
+) bool {
+    addOption(
+        std.mem.span(section),
+        std.mem.span(option),
+        option_type,
+        std.mem.span(value),
+    ) catch |err| {
+        std.log.err(
+            "Failed to add option {s}/{s}: {any}",
+            .{ section, option, err },
+        );
+        return false;
+    };
+    return true;
+}
+
+fn addOption(
+    section: []const u8,
+    name: []const u8,
+    option_type: c.wf_OptionType,
+    value: []const u8,
+) !void {
+    const key = try std.fmt.allocPrint(
+        allocator,
+        "{s}/{s}",
+        .{ section, name },
+    );
+    errdefer allocator.free(key);
+
+    const option = try allocator.create(Option);
+    errdefer allocator.destroy(option);
+    option.* = .{
+        .option_type = option_type,
+        .value = try Value.parse(option_type, value),
+    };
+    errdefer option.value.deinit();
+
+    const entry = try core.options.getOrPut(key);
+    if (entry.found_existing)
+        return error.OptionExists;
+    entry.value_ptr.* = option;
+}
+
+export fn wfmock_add_output(
+    name: [*c]const u8,
+    geometry: c.wf_Geometry,
+) ?*c.wf_Output {
+    const output = addOutput(std.mem.span(name), geometry) catch |err| {
+        std.log.err("Failed to add output {s}: {any}", .{ name, err });
+        return null;
+    };
+    return wrapOutput(output);
+}
+
+fn addOutput(name: []const u8, geometry: c.wf_Geometry) !*Output {
+    const output = try allocator.create(Output);
+    errdefer allocator.destroy(output);
+    output.* = .{
+        .name = try allocator.dupeZ(u8, name),
+        .geometry = geometry,
+    };
+    errdefer allocator.free(output.name);
+
+    try output_layout.outputs.append(output);
+    if (core.active_output == null)
+        core.active_output = output;
+
+    var data = SignalData{ .output = output };
+    emit(&output_layout, "output-added", &data);
+    return output;
+}
+
+export fn wfmock_remove_output(output: ?*c.wf_Output) void {
+    removeOutput(unwrapOutput(output));
+}
+
+fn removeOutput(output: *Output) void {
+    var i: usize = core.views.items.len;
+    while (i > 0) {
+        i -= 1;
+        if (core.views.items[i].output == output)
+            removeView(core.views.items[i]);
+    }
+
+    var data = SignalData{ .output = output };
+    emit(&output_layout, "output-removed", &data);
+
+    const outputs = &output_layout.outputs;
+    for (outputs.items) |item, index| {
+        if (item == output) {
+            _ = outputs.orderedRemove(index);
+            break;
+        }
+    }
+    if (core.active_output == output)
+        core.active_output = if (outputs.items.len > 0)
+            outputs.items[0]
+        else
+            null;
+
+    destroyObject(output);
+    allocator.free(output.name);
+    allocator.destroy(output);
+}
+
+export fn wfmock_add_view(
+    output: ?*c.wf_Output,
+    app_id: [*c]const u8,
+    title: [*c]const u8,
+) ?*c.wf_View {
+    const view = addView(
+        unwrapOutput(output),
+        std.mem.span(app_id),
+        std.mem.span(title),
+    ) catch |err| {
+        std.log.err("Failed to add view {s}: {any}", .{ app_id, err });
+        return null;
+    };
+    return wrapView(view);
+}
+
+fn addView(output: *Output, app_id: []const u8, title: []const u8) !*View {
+    const view = try allocator.create(View);
+    errdefer allocator.destroy(view);
+    view.* = .{
+        .output = output,
+        .app_id = try allocator.dupeZ(u8, app_id),
+        .title = undefined,
+        .geometry = output.relativeGeometry(),
+    };
+    errdefer allocator.free(view.app_id);
+    view.title = try allocator.dupeZ(u8, title);
+    errdefer allocator.free(view.title);
+    view.updateProperties();
+
+    try core.views.append(view);
+    output.active_view = view;
+
+    var data = SignalData{ .view = view, .output = output };
+    emit(output, "view-mapped", &data);
+    return view;
+}
+
+export fn wfmock_remove_view(view: ?*c.wf_View) void {
+    removeView(unwrapView(view));
+}
+
+fn removeView(view: *View) void {
+    view.mapped = false;
+    if (view.output) |output| {
+        var data = SignalData{ .view = view, .output = output };
+        emit(output, "view-unmapped", &data);
+        if (output.active_view == view)
+            output.active_view = null;
+    }
+
+    for (core.views.items) |item, index| {
+        if (item == view) {
+            _ = core.views.orderedRemove(index);
+            break;
+        }
+    }
+
+    destroyObject(view);
+    allocator.free(view.app_id);
+    allocator.free(view.title);
+    allocator.destroy(view);
+}
+
+export fn wfmock_set_view_title(view_: ?*c.wf_View, title: [*c]const u8) void {
+    const view = unwrapView(view_);
+    const new_title = allocator.dupeZ(u8, std.mem.span(title)) catch {
+        std.log.err("Failed to set view title: {s}", .{title});
+        return;
+    };
+    allocator.free(view.title);
+    view.title = new_title;
+    view.updateProperties();
+
+    var data = SignalData{ .view = view, .output = view.output };
+    emit(view, "title-changed", &data);
+}
+
+export fn wfmock_emit(
+    emitter: ?*c_void,
+    signal: [*c]const u8,
+    view: ?*c.wf_View,
+    output: ?*c.wf_Output,
+) void {
+    var data = SignalData{
+        .view = if (view != null) unwrapView(view) else null,
+        .output = if (output != null) unwrapOutput(output) else null,
+    };
+    emit(emitter.?, std.mem.span(signal), &data);
+}
+
+export fn wfmock_set_modifiers(modifiers: c_uint) void {
+    const keyboard = &core.keyboard;
+
+    var depressed: c.xkb_mod_mask_t = 0;
+    var i: u5 = 0;
+    while (i < c.WLR_MODIFIER_COUNT) : (i += 1) {
+        const index = keyboard.mod_indexes[i];
+        if (index != c.XKB_MOD_INVALID and
+            (modifiers & (@as(c_uint, 1) << i)) != 0)
+            depressed |= @as(c.xkb_mod_mask_t, 1) << @intCast(u5, index);
+    }
+
+    _ = c.xkb_state_update_mask(keyboard.xkb_state, depressed, 0, 0, 0, 0, 0);
+    keyboard.modifiers.depressed = depressed;
+}
+
+export fn wfmock_emit_key(
+    keycode: c_uint,
+    pressed: bool,
+) c.wf_InputEventProcessingMode {
+    var event = c.struct_wlr_event_keyboard_key{
+        .time_msec = 0,
+        .keycode = keycode,
+        .update_state = true,
+        .state = if (pressed)
+            c.enum_wl_keyboard_key_state.WL_KEYBOARD_KEY_STATE_PRESSED
+        else
+            c.enum_wl_keyboard_key_state.WL_KEYBOARD_KEY_STATE_RELEASED,
+    };
+    var data = SignalData{ .key_event = &event };
+    emit(&core, "keyboard_key", &data);
+    return data.key_mode;
+}
+
+export fn wfmock_get_run_count() c_uint {
+    return core.run_count;
+}
+export fn wfmock_get_plugin_call_count() c_uint {
+    return core.plugin_call_count;
+}
+
+// == wf.h ==
+
+fn findOption(section: [*c]const u8, option: [*c]const u8) !*Option {
+    var key_buf: [256]u8 = undefined;
+    const key = std.fmt.bufPrint(
+        &key_buf,
+        "{s}/{s}",
+        .{ section, option },
+    ) catch return error.InvalidOption;
+    if (core.options.get(key)) |found|
+        return found;
+
+    // Tell an unknown section from an unknown option.
+    var it = core.options.keyIterator();
+    const prefix = key[0 .. std.mem.len(section) + 1];
+    while (it.next()) |other| {
+        if (std.mem.startsWith(u8, other.*, prefix))
+            return error.InvalidOption;
+    }
+    return error.InvalidOptionSection;
+}
+
+fn optionError(err: anyerror) c.wf_Error {
+    return switch (err) {
+        error.InvalidOptionSection => .WF_INVALID_OPTION_SECTION,
+        error.InvalidOption => .WF_INVALID_OPTION,
+        else => .WF_INVALID_OPTION_VALUE,
+    };
+}
+
+export fn wf_set_option_str(
+    section: [*c]const u8,
+    option_name: [*c]const u8,
+    val: [*c]const u8,
+) c.wf_Error {
+    const option = findOption(section, option_name) catch |err|
+        return optionError(err);
+    const value = Value.parse(option.option_type, std.mem.span(val)) catch
+        return .WF_INVALID_OPTION_VALUE;
+    option.value.deinit();
+    option.value = value;
+    return .WF_OK;
+}
+
+export fn wf_get_option_int(
+    section: [*c]const u8,
+    option_name: [*c]const u8,
+    val: [*c]c_int,
+) c.wf_Error {
+    const option = findOption(section, option_name) catch |err|
+        return optionError(err);
+    switch (option.value) {
+        .int => |int| val.* = int,
+        else => return .WF_INVALID_OPTION,
+    }
+    return .WF_OK;
+}
+
+export fn wf_find_option(
+    section: [*c]const u8,
+    option_name: [*c]const u8,
+    out: [*c]?*c.wf_Option,
+    option_type: [*c]c.wf_OptionType,
+) c.wf_Error {
+    const option = findOption(section, option_name) catch |err|
+        return optionError(err);
+    out.* = @ptrCast(*c.wf_Option, option);
+    option_type.* = option.option_type;
+    return .WF_OK;
+}
+
+export fn wf_create_option_transaction() ?*c.wf_OptionTransaction {
+    const tx = allocator.create(Transaction) catch return null;
+    tx.* = .{ .changes = std.ArrayList(Transaction.Change).init(allocator) };
+    return @ptrCast(*c.wf_OptionTransaction, tx);
+}
+export fn wf_destroy_option_transaction(tx_: ?*c.wf_OptionTransaction) void {
+    const tx = unwrapTransaction(tx_);
+    tx.clear();
+    tx.changes.deinit();
+    allocator.destroy(tx);
+}
+
+fn stage(
+    tx: ?*c.wf_OptionTransaction,
+    option_: ?*c.wf_Option,
+    value: Value,
+) c.wf_Error {
+    const option = unwrapOption(option_);
+    const expected: c.wf_OptionType = switch (value) {
+        .int => .WF_OPTION_TYPE_INT,
+        .double => .WF_OPTION_TYPE_DOUBLE,
+        .boolean => .WF_OPTION_TYPE_BOOL,
+        .string => .WF_OPTION_TYPE_STRING,
+    };
+    if (option.option_type != expected)
+        return .WF_INVALID_OPTION_VALUE;
+
+    unwrapTransaction(tx).changes.append(.{
+        .option = option,
+        .value = value,
+    }) catch return .WF_INVALID_OPTION_VALUE;
+    return .WF_OK;
+}
+
+export fn wf_OptionTransaction_set_int(
+    tx: ?*c.wf_OptionTransaction,
+    option: ?*c.wf_Option,
+    val: c_int,
+) c.wf_Error {
+    return stage(tx, option, .{ .int = val });
+}
+export fn wf_OptionTransaction_set_double(
+    tx: ?*c.wf_OptionTransaction,
+    option: ?*c.wf_Option,
+    val: f64,
+) c.wf_Error {
+    return stage(tx, option, .{ .double = val });
+}
+export fn wf_OptionTransaction_set_bool(
+    tx: ?*c.wf_OptionTransaction,
+    option: ?*c.wf_Option,
+    val: bool,
+) c.wf_Error {
+    return stage(tx, option, .{ .boolean = val });
+}
+export fn wf_OptionTransaction_set_str(
+    tx: ?*c.wf_OptionTransaction,
+    option_: ?*c.wf_Option,
+    val: [*c]const u8,
+) c.wf_Error {
+    const option = unwrapOption(option_);
+    const value = Value.parse(option.option_type, std.mem.span(val)) catch
+        return .WF_INVALID_OPTION_VALUE;
+    unwrapTransaction(tx).changes.append(.{
+        .option = option,
+        .value = value,
+    }) catch {
+        value.deinit();
+        return .WF_INVALID_OPTION_VALUE;
+    };
+    return .WF_OK;
+}
+
+export fn wf_OptionTransaction_clear(tx: ?*c.wf_OptionTransaction) void {
+    unwrapTransaction(tx).clear();
+}
+export fn wf_OptionTransaction_size(tx: ?*c.wf_OptionTransaction) c_uint {
+    return @intCast(c_uint, unwrapTransaction(tx).changes.items.len);
+}
+export fn wf_OptionTransaction_rollback(
+    tx: ?*c.wf_OptionTransaction,
+    size: c_uint,
+) void {
+    unwrapTransaction(tx).rollback(size);
+}
+export fn wf_OptionTransaction_commit(
+    tx_: ?*c.wf_OptionTransaction,
+    emit_reload: bool,
+) void {
+    const tx = unwrapTransaction(tx_);
+    for (tx.changes.items) |change| {
+        change.option.value.deinit();
+        change.option.value = change.value;
+    }
+    // The values are owned by the options now.
+    tx.changes.clearRetainingCapacity();
+
+    if (emit_reload) {
+        var data = SignalData{};
+        emit(&core, "reload-config", &data);
+    }
+}
+
+export fn wf_lifetime_subscribe(
+    object: ?*c_void,
+    cb: c.wf_LifetimeCallback,
+    data: ?*c_void,
+) c_uint {
+    const emitter = getOrCreateEmitter(object.?) catch
+        @panic("Failed to subscribe to object lifetime");
+    emitter.lifetime_callbacks.append(.{ .callback = cb, .data = data }) catch
+        @panic("Failed to subscribe to object lifetime");
+    return @intCast(c_uint, emitter.lifetime_callbacks.items.len - 1);
+}
+export fn wf_lifetime_unsubscribe(object: ?*c_void, token: c_uint) void {
+    const emitter = emitters.get(@ptrToInt(object.?)) orelse {
+        std.log.err("No lifetime tracker to unsubcribe from.", .{});
+        return;
+    };
+    emitter.lifetime_callbacks.items[token] = null;
+}
+
+export fn wf_object_data_set(
+    object: ?*c_void,
+    id: c_int,
+    cb: c.wf_ObjectDataCallback,
+    data: ?*c_void,
+) void {
+    const emitter = getOrCreateEmitter(object.?) catch
+        @panic("Failed to store object data");
+    const old = emitter.object_data;
+    emitter.object_data = .{ .id = id, .callback = cb, .data = data };
+    if (old) |old_data|
+        old_data.callback.?(object, old_data.id, old_data.data);
+}
+export fn wf_object_data_get(object: ?*c_void) c_int {
+    const emitter = emitters.get(@ptrToInt(object.?)) orelse return 0;
+    const data = emitter.object_data orelse return 0;
+    return data.id;
+}
+export fn wf_object_data_erase(object: ?*c_void) void {
+    const emitter = emitters.get(@ptrToInt(object.?)) orelse return;
+    const data = emitter.object_data orelse return;
+    emitter.object_data = null;
+    data.callback.?(object, data.id, data.data);
+}
+
+export fn wf_create_signal_connection(
+    cb: c.wf_SignalCallback,
+    data1: ?*c_void,
+    data2: ?*c_void,
+) ?*c.wf_SignalConnection {
+    const conn = allocator.create(Connection) catch return null;
+    conn.* = .{ .callback = cb, .data1 = data1, .data2 = data2 };
+    return @ptrCast(*c.wf_SignalConnection, conn);
+}
+export fn wf_destroy_signal_connection(conn_: ?*c.wf_SignalConnection) void {
+    const conn = @ptrCast(
+        *Connection,
+        @alignCast(@alignOf(Connection), conn_.?),
+    );
+    var it = emitters.valueIterator();
+    while (it.next()) |emitter|
+        emitter.*.disconnect(conn);
+    allocator.destroy(conn);
+}
+
+export fn wf_signal_subscribe(
+    object: ?*c_void,
+    signal: [*c]const u8,
+    conn: ?*c.wf_SignalConnection,
+) void {
+    const emitter = getOrCreateEmitter(object.?) catch
+        @panic("Failed to subscribe to signal");
+    const owned_signal = allocator.dupeZ(u8, std.mem.span(signal)) catch
+        @panic("Failed to subscribe to signal");
+    emitter.subscriptions.append(.{
+        .signal = owned_signal,
+        .conn = @ptrCast(*Connection, @alignCast(@alignOf(Connection), conn.?)),
+    }) catch @panic("Failed to subscribe to signal");
+}
+export fn wf_signal_unsubscribe(
+    object: ?*c_void,
+    conn: ?*c.wf_SignalConnection,
+) void {
+    const emitter = emitters.get(@ptrToInt(object.?)) orelse return;
+    emitter.disconnect(
+        @ptrCast(*Connection, @alignCast(@alignOf(Connection), conn.?)),
+    );
+}
+
+export fn wf_get_signaled_view(sig_data: ?*c_void) ?*c.wf_View {
+    const data = unwrapSignalData(sig_data) orelse return null;
+    return wrapView(data.view);
+}
+export fn wf_get_signaled_output(sig_data: ?*c_void) ?*c.wf_Output {
+    const data = unwrapSignalData(sig_data) orelse return null;
+    return wrapOutput(data.output);
+}
+export fn wf_get_signaled_keyboard_key_event(
+    sig_data: ?*c_void,
+) [*c]c.struct_wlr_event_keyboard_key {
+    return unwrapSignalData(sig_data).?.key_event.?;
+}
+export fn wf_set_signaled_keyboard_key_mode(
+    sig_data: ?*c_void,
+    mode: c.wf_InputEventProcessingMode,
+) void {
+    unwrapSignalData(sig_data).?.key_mode = mode;
+}
+
+export fn wf_View_to_string(view_: ?*c.wf_View) [*c]const u8 {
+    const view = unwrapView(view_);
+    return bufPrint("view {s} \"{s}\"", .{ view.app_id, view.title });
+}
+export fn wf_View_get_title(view: ?*c.wf_View) [*c]const u8 {
+    return unwrapView(view).title;
+}
+export fn wf_View_get_app_id(view: ?*c.wf_View) [*c]const u8 {
+    return unwrapView(view).app_id;
+}
+export fn wf_View_get_wm_geometry(view: ?*c.wf_View) c.wf_Geometry {
+    return unwrapView(view).geometry;
+}
+export fn wf_View_get_properties(
+    view: ?*c.wf_View,
+) [*c]const c.wf_ViewProperties {
+    return &unwrapView(view).properties;
+}
+export fn wf_View_get_output_geometry(view: ?*c.wf_View) c.wf_Geometry {
+    return unwrapView(view).geometry;
+}
+export fn wf_View_get_bounding_box(view: ?*c.wf_View) c.wf_Geometry {
+    return unwrapView(view).geometry;
+}
+export fn wf_View_get_output(view: ?*c.wf_View) ?*c.wf_Output {
+    return wrapOutput(unwrapView(view).output);
+}
+export fn wf_View_set_geometry(view_: ?*c.wf_View, geo: c.wf_Geometry) void {
+    const view = unwrapView(view_);
+    view.geometry = geo;
+    view.updateProperties();
+
+    var data = SignalData{ .view = view, .output = view.output };
+    emit(view, "geometry-changed", &data);
+}
+
+export fn wf_Output_to_string(output: ?*c.wf_Output) [*c]const u8 {
+    return bufPrint("output {s}", .{unwrapOutput(output).name});
+}
+export fn wf_Output_get_name(output: ?*c.wf_Output) [*c]const u8 {
+    return unwrapOutput(output).name;
+}
+export fn wf_Output_get_screen_size(output_: ?*c.wf_Output) c.wf_Dimensions {
+    const output = unwrapOutput(output_);
+    return .{
+        .width = output.geometry.width,
+        .height = output.geometry.height,
+    };
+}
+export fn wf_Output_get_relative_geometry(
+    output: ?*c.wf_Output,
+) c.wf_Geometry {
+    return unwrapOutput(output).relativeGeometry();
+}
+export fn wf_Output_get_layout_geometry(output: ?*c.wf_Output) c.wf_Geometry {
+    return unwrapOutput(output).geometry;
+}
+export fn wf_Output_ensure_pointer(output_: ?*c.wf_Output, center: bool) void {
+    const output = unwrapOutput(output_);
+    const geo = output.geometry;
+    if (!center and wf_OutputLayout_get_output_at(
+        null,
+        @floatToInt(c_int, core.cursor.x),
+        @floatToInt(c_int, core.cursor.y),
+    ) == output_)
+        return;
+
+    core.cursor = .{
+        .x = @intToFloat(f64, geo.x) + @intToFloat(f64, geo.width) / 2,
+        .y = @intToFloat(f64, geo.y) + @intToFloat(f64, geo.height) / 2,
+    };
+}
+export fn wf_Output_get_cursor_position(output_: ?*c.wf_Output) c.wf_Pointf {
+    const geo = unwrapOutput(output_).geometry;
+    return .{
+        .x = core.cursor.x - @intToFloat(f64, geo.x),
+        .y = core.cursor.y - @intToFloat(f64, geo.y),
+    };
+}
+export fn wf_Output_call_plugin_plain(
+    output: ?*c.wf_Output,
+    activator: [*c]const u8,
+    data: c.wf_PlainActivatorData,
+) bool {
+    core.plugin_call_count += 1;
+    return true;
+}
+export fn wf_Output_get_top_view(output_: ?*c.wf_Output) ?*c.wf_View {
+    const output = unwrapOutput(output_);
+    var i: usize = core.views.items.len;
+    while (i > 0) {
+        i -= 1;
+        if (core.views.items[i].output == output)
+            return wrapView(core.views.items[i]);
+    }
+    return null;
+}
+export fn wf_Output_get_active_view(output: ?*c.wf_Output) ?*c.wf_View {
+    return wrapView(unwrapOutput(output).active_view);
+}
+export fn wf_Output_focus_view(
+    output_: ?*c.wf_Output,
+    view_: ?*c.wf_View,
+    raise: bool,
+) void {
+    const output = unwrapOutput(output_);
+    if (view_ == null) {
+        output.active_view = null;
+        return;
+    }
+
+    const view = unwrapView(view_);
+    output.active_view = view;
+    if (raise) {
+        for (core.views.items) |item, index| {
+            if (item == view) {
+                _ = core.views.orderedRemove(index);
+                core.views.appendAssumeCapacity(view);
+                break;
+            }
+        }
+    }
+
+    var data = SignalData{ .view = view, .output = output };
+    emit(output, "view-focused", &data);
+}
+export fn wf_Output_ensure_visible(
+    output: ?*c.wf_Output,
+    view: ?*c.wf_View,
+) bool {
+    return true;
+}
+export fn wf_Output_get_workarea(output: ?*c.wf_Output) c.wf_Geometry {
+    return unwrapOutput(output).relativeGeometry();
+}
+
+export fn wf_get_core() ?*c.wf_Core {
+    return @ptrCast(*c.wf_Core, &core);
+}
+
+export fn wf_Core_to_string(core_: ?*c.wf_Core) [*c]const u8 {
+    return "mock core";
+}
+export fn wf_Core_get_current_seat(core_: ?*c.wf_Core) [*c]c.struct_wlr_seat {
+    return &core.seat;
+}
+export fn wf_Core_set_cursor(core_: ?*c.wf_Core, name: [*c]const u8) void {}
+export fn wf_Core_unhide_cursor(core_: ?*c.wf_Core) void {}
+export fn wf_Core_hide_cursor(core_: ?*c.wf_Core) void {}
+export fn wf_Core_warp_cursor(core_: ?*c.wf_Core, position: c.wf_Pointf) void {
+    core.cursor = position;
+}
+export fn wf_Core_get_cursor_position(core_: ?*c.wf_Core) c.wf_Pointf {
+    return core.cursor;
+}
+export fn wf_Core_get_cursor_focus_view(core_: ?*c.wf_Core) ?*c.wf_View {
+    return wf_Core_get_view_at(core_, core.cursor);
+}
+export fn wf_Core_get_touch_focus_view(core_: ?*c.wf_Core) ?*c.wf_View {
+    return null;
+}
+export fn wf_Core_get_view_at(
+    core_: ?*c.wf_Core,
+    point: c.wf_Pointf,
+) ?*c.wf_View {
+    var i: usize = core.views.items.len;
+    while (i > 0) {
+        i -= 1;
+        const view = core.views.items[i];
+        const output = view.output orelse continue;
+        const x = @intToFloat(f64, output.geometry.x + view.geometry.x);
+        const y = @intToFloat(f64, output.geometry.y + view.geometry.y);
+        if (point.x >= x and
+            point.x < x + @intToFloat(f64, view.geometry.width) and
+            point.y >= y and
+            point.y < y + @intToFloat(f64, view.geometry.height))
+            return wrapView(view);
+    }
+    return null;
+}
+export fn wf_Core_snapshot_views(
+    core_: ?*c.wf_Core,
+    snapshots: [*c]c.wf_ViewSnapshot,
+    max_snapshots: c_uint,
+) c_uint {
+    const views = core.views.items;
+    const count = std.math.min(views.len, max_snapshots);
+    for (views[0..count]) |view, i| {
+        snapshots[i] = .{
+            .view = wrapView(view),
+            .output = wrapOutput(view.output),
+            .wm_geometry = view.properties.wm_geometry,
+            .mapped = view.mapped,
+            .title = view.properties.title,
+            .app_id = view.properties.app_id,
+            .title_serial = view.properties.title_serial,
+            .app_id_serial = view.properties.app_id_serial,
+        };
+    }
+    return @intCast(c_uint, views.len);
+}
+export fn wf_Core_set_active_view(core_: ?*c.wf_Core, view: ?*c.wf_View) void {
+    const output = unwrapView(view).output orelse return;
+    wf_Output_focus_view(wrapOutput(output), view, false);
+}
+export fn wf_Core_focus_view(core_: ?*c.wf_Core, view: ?*c.wf_View) void {
+    const output = unwrapView(view).output orelse return;
+    wf_Core_focus_output(core_, wrapOutput(output));
+    wf_Output_focus_view(wrapOutput(output), view, true);
+}
+export fn wf_Core_focus_output(core_: ?*c.wf_Core, output: ?*c.wf_Output) void {
+    if (core.active_output == unwrapOutput(output))
+        return;
+    core.active_output = unwrapOutput(output);
+
+    var data = SignalData{ .output = core.active_output };
+    emit(&core, "output-gain-focus", &data);
+}
+export fn wf_Core_get_active_output(core_: ?*c.wf_Core) ?*c.wf_Output {
+    return wrapOutput(core.active_output);
+}
+export fn wf_Core_move_view_to_output(
+    core_: ?*c.wf_Core,
+    view_: ?*c.wf_View,
+    new_output: ?*c.wf_Output,
+    reconfigure: bool,
+) void {
+    const view = unwrapView(view_);
+    if (view.output) |output| {
+        if (output.active_view == view)
+            output.active_view = null;
+    }
+    view.output = unwrapOutput(new_output);
+
+    var data = SignalData{ .view = view, .output = view.output };
+    emit(view, "set-output", &data);
+}
+export fn wf_Core_get_wayland_display(core_: ?*c.wf_Core) [*c]const u8 {
+    return "wayland-mock";
+}
+export fn wf_Core_get_xwayland_display(core_: ?*c.wf_Core) [*c]const u8 {
+    return "";
+}
+export fn wf_Core_run(core_: ?*c.wf_Core, command: [*c]const u8) c_int {
+    core.run_count += 1;
+    return 0;
+}
+export fn wf_Core_shutdown(core_: ?*c.wf_Core) void {}
+export fn wf_Core_get_output_layout(core_: ?*c.wf_Core) ?*c.wf_OutputLayout {
+    return @ptrCast(*c.wf_OutputLayout, &output_layout);
+}
+export fn wf_Core_get_event_loop(core_: ?*c.wf_Core) ?*c.wl_event_loop {
+    return core.event_loop;
+}
+
+fn contains(geo: c.wf_Geometry, x: f64, y: f64) bool {
+    return x >= @intToFloat(f64, geo.x) and
+        x < @intToFloat(f64, geo.x + geo.width) and
+        y >= @intToFloat(f64, geo.y) and
+        y < @intToFloat(f64, geo.y + geo.height);
+}
+
+export fn wf_OutputLayout_get_output_at(
+    layout: ?*c.wf_OutputLayout,
+    x: c_int,
+    y: c_int,
+) ?*c.wf_Output {
+    for (output_layout.outputs.items) |output| {
+        if (contains(output.geometry, @intToFloat(f64, x), @intToFloat(f64, y)))
+            return wrapOutput(output);
+    }
+    return null;
+}
+export fn wf_OutputLayout_get_output_coords_at(
+    layout: ?*c.wf_OutputLayout,
+    origin: c.wf_Pointf,
+    closest: [*c]c.wf_Pointf,
+) ?*c.wf_Output {
+    var found: ?*Output = null;
+    var found_distance: f64 = std.math.inf(f64);
+    for (output_layout.outputs.items) |output| {
+        const geo = output.geometry;
+        const point = c.wf_Pointf{
+            .x = std.math.clamp(
+                origin.x,
+                @intToFloat(f64, geo.x),
+                @intToFloat(f64, geo.x + geo.width - 1),
+            ),
+            .y = std.math.clamp(
+                origin.y,
+                @intToFloat(f64, geo.y),
+                @intToFloat(f64, geo.y + geo.height - 1),
+            ),
+        };
+        const dx = point.x - origin.x;
+        const dy = point.y - origin.y;
+        if (dx * dx + dy * dy < found_distance) {
+            found = output;
+            found_distance = dx * dx + dy * dy;
+            closest.* = point;
+        }
+    }
+    return wrapOutput(found);
+}
+export fn wf_OutputLayout_get_num_outputs(layout: ?*c.wf_OutputLayout) c_uint {
+    return @intCast(c_uint, output_layout.outputs.items.len);
+}
+export fn wf_OutputLayout_get_outputs(
+    layout: ?*c.wf_OutputLayout,
+    outputs: [*c]?*c.wf_Output,
+    max_outputs: c_uint,
+) c_uint {
+    const all_outputs = output_layout.outputs.items;
+    const count = std.math.min(all_outputs.len, max_outputs);
+    for (all_outputs[0..count]) |output, i|
+        outputs[i] = wrapOutput(output);
+    return @intCast(c_uint, all_outputs.len);
+}
+export fn wf_OutputLayout_get_next_output(
+    layout: ?*c.wf_OutputLayout,
+    prev: ?*c.wf_Output,
+) ?*c.wf_Output {
+    const outputs = output_layout.outputs.items;
+    if (outputs.len == 0)
+        return null;
+    for (outputs) |output, i| {
+        if (wrapOutput(output) == prev)
+            return wrapOutput(outputs[(i + 1) % outputs.len]);
+    }
+    return wrapOutput(outputs[0]);
+}
+export fn wf_OutputLayout_find_output(
+    layout: ?*c.wf_OutputLayout,
+    name: [*c]const u8,
+) ?*c.wf_Output {
+    for (output_layout.outputs.items) |output| {
+        if (std.mem.eql(u8, output.name, std.mem.span(name)))
+            return wrapOutput(output);
+    }
+    return null;
+}
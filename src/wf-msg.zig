@@ -5,11 +5,365 @@ const os = std.os;
 const net = std.net;
 const mem = std.mem;
 
+const Allocator = mem.Allocator;
+const Proto = ipc.Protocol(net.Stream.Reader, net.Stream.Writer);
+
 fn printHelp() !void {
     const stdout = std.io.getStdOut();
     try stdout.writeAll("Usage: ");
     try stdout.writeAll(mem.span(os.argv[0]));
-    try stdout.writeAll(" [-h] <command> <args>\n");
+    try stdout.writeAll(" [-h] [--json] <command> <args>\n");
+    try stdout.writeAll("       ");
+    try stdout.writeAll(mem.span(os.argv[0]));
+    try stdout.writeAll(" [-h] [--json] --batch [-m]\n");
+    try stdout.writeAll(
+        \\
+        \\  -b, --batch    Read one command per line from stdin and send them
+        \\                 all over a single connection. Results are written
+        \\                 out in the order the commands were given.
+        \\  -m, --machine  With --batch, write tab separated lines tagged with
+        \\                 the request id (see below).
+        \\
+        \\Machine readable lines (ids start at 1 and follow input lines):
+        \\  <id> result <text>        command succeeded
+        \\  <id> error <code> <text>  command failed with exit code <code>
+        \\  <id> begin                command started sending notifications
+        \\  <id> notif <text>         notification sent by the command
+        \\  <id> end                  command stopped sending notifications
+        \\  0 topic <topic> <text>    message published to a subscribed topic
+        \\Tabs, newlines and backslashes in <text> are escaped.
+        \\
+    );
+}
+
+/// Formats a string with backslashes, tabs and newlines escaped so that it
+/// fits in a single field of a machine readable line.
+const Escaped = struct {
+    str: []const u8,
+
+    pub fn format(
+        self: @This(),
+        comptime fmt: []const u8,
+        options: std.fmt.FormatOptions,
+        writer: anytype,
+    ) !void {
+        for (self.str) |char| {
+            switch (char) {
+                '\\' => try writer.writeAll("\\\\"),
+                '\t' => try writer.writeAll("\\t"),
+                '\n' => try writer.writeAll("\\n"),
+                else => try writer.writeByte(char),
+            }
+        }
+    }
+};
+
+const OutputTarget = enum { stdout, stderr };
+
+/// Output of one batched request.
+const BatchRequest = struct {
+    done: bool = false,
+    /// Output held back until every earlier request is done.
+    out: std.ArrayList(u8),
+    err: std.ArrayList(u8),
+};
+
+/// Commands read line by line from stdin and pipelined over a single
+/// connection. Request ids are the (1-based) index of the command.
+const Batch = struct {
+    proto: *Proto,
+    /// Write tagged lines as soon as messages arrive instead of ordering the
+    /// raw output.
+    machine: bool,
+    stdout: std.io.BufferedWriter(4096, std.fs.File.Writer),
+
+    requests: std.ArrayList(BatchRequest),
+    /// First request not done yet. Its output is written out directly.
+    head: usize = 0,
+    /// Code of the first failed command.
+    exit_code: u8 = 0,
+
+    /// Incomplete line read from stdin.
+    line_buf: std.ArrayList(u8),
+    /// Words of the line being sent. Kept around to reuse its memory.
+    words: std.ArrayList([]const u8),
+
+    fn init(allocator: *Allocator, proto: *Proto, machine: bool) Batch {
+        return .{
+            .proto = proto,
+            .machine = machine,
+            .stdout = std.io.bufferedWriter(std.io.getStdOut().writer()),
+            .requests = std.ArrayList(BatchRequest).init(allocator),
+            .line_buf = std.ArrayList(u8).init(allocator),
+            .words = std.ArrayList([]const u8).init(allocator),
+        };
+    }
+
+    fn deinit(self: *Batch) void {
+        for (self.requests.items) |*req| {
+            req.out.deinit();
+            req.err.deinit();
+        }
+        self.requests.deinit();
+        self.line_buf.deinit();
+        self.words.deinit();
+    }
+
+    fn pending(self: *const Batch) bool {
+        return self.head < self.requests.items.len;
+    }
+
+    /// Send every complete line of `bytes`. The trailing incomplete line is
+    /// kept for the next call.
+    fn feed(self: *Batch, bytes: []const u8) !void {
+        try self.line_buf.appendSlice(bytes);
+        const buf = self.line_buf.items;
+
+        var start: usize = 0;
+        while (mem.indexOfScalarPos(u8, buf, start, '\n')) |end| {
+            try self.sendLine(buf[start..end]);
+            start = end + 1;
+        }
+
+        const rest = buf.len - start;
+        mem.copy(u8, buf[0..rest], buf[start..]);
+        self.line_buf.shrinkRetainingCapacity(rest);
+    }
+
+    /// Send the incomplete line left at EOF, if any.
+    fn feedEnd(self: *Batch) !void {
+        if (self.line_buf.items.len > 0)
+            try self.feed("\n");
+    }
+
+    fn sendLine(self: *Batch, line: []const u8) !void {
+        self.words.clearRetainingCapacity();
+        var it = mem.tokenize(line, " \t\r");
+        while (it.next()) |word|
+            try self.words.append(word);
+
+        // Skip blank lines and comments.
+        if (self.words.items.len == 0 or self.words.items[0][0] == '#')
+            return;
+
+        const allocator = self.requests.allocator;
+        try self.requests.append(.{
+            .out = std.ArrayList(u8).init(allocator),
+            .err = std.ArrayList(u8).init(allocator),
+        });
+        const id = @intCast(u32, self.requests.items.len);
+
+        try self.proto.sendRequest(ipc.Command.ReqSend{
+            .id = id,
+            .params = .{
+                .command = self.words.items[0],
+                .args = self.words.items[1..],
+            },
+        });
+    }
+
+    fn getRequest(self: *Batch, id: u32) ?*BatchRequest {
+        if (id == 0 or id > self.requests.items.len)
+            return null;
+        const req = &self.requests.items[id - 1];
+        return if (req.done) null else req;
+    }
+
+    fn writeOut(self: *Batch, target: OutputTarget, bytes: []const u8) !void {
+        if (bytes.len == 0)
+            return;
+        switch (target) {
+            .stdout => try self.stdout.writer().writeAll(bytes),
+            .stderr => {
+                // Keep the order between both streams.
+                try self.stdout.flush();
+                try std.io.getStdErr().writeAll(bytes);
+            },
+        }
+    }
+
+    /// Print output for a request. Output of requests waiting behind
+    /// unfinished ones is buffered unless in machine mode.
+    fn print(
+        self: *Batch,
+        id: u32,
+        target: OutputTarget,
+        comptime fmt: []const u8,
+        args: anytype,
+    ) !void {
+        if (self.machine) {
+            try self.stdout.writer().print("{d}\t", .{id});
+            try self.stdout.writer().print(fmt, args);
+        } else if (id - 1 == self.head) {
+            switch (target) {
+                .stdout => try self.stdout.writer().print(fmt, args),
+                .stderr => {
+                    try self.stdout.flush();
+                    try std.io.getStdErr().writer().print(fmt, args);
+                },
+            }
+        } else {
+            const req = &self.requests.items[id - 1];
+            const buf = switch (target) {
+                .stdout => &req.out,
+                .stderr => &req.err,
+            };
+            try buf.writer().print(fmt, args);
+        }
+    }
+
+    fn finish(self: *Batch, id: u32, code: u8) !void {
+        self.requests.items[id - 1].done = true;
+        if (code != 0 and self.exit_code == 0)
+            self.exit_code = code;
+
+        // Write out whatever the following requests buffered in the meantime.
+        while (self.head < self.requests.items.len) {
+            const req = &self.requests.items[self.head];
+            try self.writeOut(.stdout, req.out.items);
+            try self.writeOut(.stderr, req.err.items);
+            req.out.clearAndFree();
+            req.err.clearAndFree();
+
+            if (!req.done)
+                break;
+            self.head += 1;
+        }
+    }
+
+    fn handleMsg(self: *Batch, msg: ipc.ServerMsgRecv) !void {
+        switch (msg) {
+            .Response => |resp| switch (resp) {
+                .Result => |result| {
+                    if (self.getRequest(result.id) == null)
+                        return unknownId(result.id);
+                    const text = result.result.cmd_result;
+
+                    if (self.machine) {
+                        try self.print(result.id, .stdout, "result\t{}\n", .{
+                            Escaped{ .str = text },
+                        });
+                    } else {
+                        try self.print(result.id, .stdout, "{s}\n", .{text});
+                    }
+                    try self.finish(result.id, 0);
+                },
+                .Error => |err| {
+                    if (self.getRequest(err.id) == null)
+                        return unknownId(err.id);
+                    const text = err.@"error".message;
+                    // All command errors should fit into u8.
+                    const code = @intCast(u8, @enumToInt(err.@"error".code));
+
+                    if (self.machine) {
+                        try self.print(err.id, .stdout, "error\t{d}\t{}\n", .{
+                            code,
+                            Escaped{ .str = text },
+                        });
+                    } else {
+                        try self.print(err.id, .stderr, "{s}\n", .{text});
+                    }
+                    try self.finish(err.id, code);
+                },
+                .BeginingNotifs => |begin| {
+                    if (self.getRequest(begin.id) == null)
+                        return unknownId(begin.id);
+
+                    if (self.machine)
+                        try self.print(begin.id, .stdout, "begin\n", .{});
+                },
+            },
+            .Notif => |notif_| switch (notif_) {
+                .Notif => |notif| {
+                    const id = notif.params.id;
+                    if (self.getRequest(id) == null)
+                        return unknownId(id);
+                    const text = notif.params.notif;
+
+                    if (self.machine) {
+                        try self.print(id, .stdout, "notif\t{}\n", .{
+                            Escaped{ .str = text },
+                        });
+                    } else {
+                        try self.print(id, .stdout, "{s}\n", .{text});
+                    }
+                },
+                .NotifEnd => |end| {
+                    const id = end.params.id;
+                    if (self.getRequest(id) == null)
+                        return unknownId(id);
+
+                    if (self.machine)
+                        try self.print(id, .stdout, "end\n", .{});
+                    try self.finish(id, 0);
+                },
+                .TopicNotif => |notif| {
+                    // Topic messages aren't tied to a request. They are
+                    // written out as they come.
+                    const text = notif.params.notif;
+                    if (self.machine) {
+                        try self.stdout.writer().print("0\ttopic\t{}\t{}\n", .{
+                            Escaped{ .str = notif.params.topic },
+                            Escaped{ .str = text },
+                        });
+                    } else {
+                        try self.stdout.writer().print("{s}\n", .{text});
+                    }
+                },
+            },
+        }
+    }
+
+    fn unknownId(id: u32) void {
+        std.log.warn("Ignoring message for unknown request id: {d}", .{id});
+    }
+};
+
+fn runBatch(
+    allocator: *Allocator,
+    stream: net.Stream,
+    proto: *Proto,
+    machine: bool,
+) !u8 {
+    var batch = Batch.init(allocator, proto, machine);
+    defer batch.deinit();
+
+    var fds = [_]os.pollfd{
+        .{ .fd = std.io.getStdIn().handle, .events = os.POLLIN, .revents = 0 },
+        .{ .fd = stream.handle, .events = os.POLLIN, .revents = 0 },
+    };
+    const stdin_fd = &fds[0];
+    const socket_fd = &fds[1];
+
+    var read_buf: [4096]u8 = undefined;
+
+    // Negative fds are ignored by poll(). stdin is dropped at EOF.
+    while (stdin_fd.fd >= 0 or batch.pending()) {
+        try batch.stdout.flush();
+        _ = try os.poll(&fds, -1);
+
+        if (socket_fd.revents != 0) {
+            const msg = (try proto.nextServerMsg()) orelse {
+                std.log.err("Connection closed by the server.", .{});
+                return 1;
+            };
+            defer proto.freeServerMsg(msg);
+            try batch.handleMsg(msg);
+        }
+
+        if (stdin_fd.revents != 0) {
+            const len = try os.read(stdin_fd.fd, &read_buf);
+            if (len == 0) {
+                try batch.feedEnd();
+                stdin_fd.fd = -1;
+            } else {
+                try batch.feed(read_buf[0..len]);
+            }
+        }
+    }
+
+    try batch.stdout.flush();
+    return batch.exit_code;
 }
 
 pub fn main() !u8 {
@@ -22,16 +376,46 @@ pub fn main() !u8 {
     for (os.argv) |arg, i|
         argv[i] = mem.span(arg);
 
-    const args = argv[1..argv.len];
+    var args = argv[1..argv.len];
 
-    if (args.len == 0) {
-        std.log.err("Missing <command> argument.", .{});
+    // Messages are sent as msgpack unless asked otherwise.
+    var encoding = ipc.Encoding.msgpack;
+    var batch = false;
+    var machine = false;
+    while (args.len > 0 and mem.startsWith(u8, args[0], "-")) {
+        if (mem.eql(u8, args[0], "-h")) {
+            try printHelp();
+            return 0;
+        } else if (mem.eql(u8, args[0], "--json")) {
+            encoding = .json;
+        } else if (mem.eql(u8, args[0], "-b") or
+            mem.eql(u8, args[0], "--batch"))
+        {
+            batch = true;
+        } else if (mem.eql(u8, args[0], "-m") or
+            mem.eql(u8, args[0], "--machine"))
+        {
+            machine = true;
+        } else {
+            std.log.err("Unknown option: {s}", .{args[0]});
+            try printHelp();
+            return 1;
+        }
+        args = args[1..args.len];
+    }
+
+    if (batch and args.len > 0) {
+        std.log.err("Commands are read from stdin with --batch.", .{});
         try printHelp();
         return 1;
-    }
-    if (mem.eql(u8, args[0], "-h")) {
+    } else if (!batch and machine) {
+        std.log.err("Option --machine requires --batch.", .{});
+        try printHelp();
+        return 1;
+    } else if (!batch and args.len == 0) {
+        std.log.err("Missing <command> argument.", .{});
         try printHelp();
-        return 0;
+        return 1;
     }
 
     const socket_path = os.getenv("WFIPC_SOCKET") orelse {
@@ -43,11 +427,17 @@ pub fn main() !u8 {
     const stream = try net.connectUnixSocket(socket_path);
     defer stream.close();
 
-    const proto = ipc.Protocol(@TypeOf(stream).Reader, @TypeOf(stream).Writer){
-        .allocator = &gpa.allocator,
-        .reader = stream.reader(),
-        .writer = stream.writer(),
-    };
+    var proto = Proto.init(
+        &gpa.allocator,
+        stream.reader(),
+        stream.writer(),
+        encoding,
+    );
+    defer proto.deinit();
+
+    if (batch)
+        return runBatch(&gpa.allocator, stream, &proto, machine);
+
     const resp = try proto.request(ipc.Command.RespRecv, ipc.Command.ReqSend{
         .id = 1,
         .params = .{
@@ -81,6 +471,10 @@ pub fn main() !u8 {
                         try stdout.writeAll(notif.params.notif);
                         try stdout.writeAll("\n");
                     },
+                    .TopicNotif => |notif| {
+                        try stdout.writeAll(notif.params.notif);
+                        try stdout.writeAll("\n");
+                    },
                     .NotifEnd => {
                         return 0;
                     },
@@ -7,10 +7,15 @@ extern "C" {
 #include <wayfire/config/config-manager.hpp>
 #include <wayfire/core.hpp>
 #include <wayfire/debug.hpp>
+#include <wayfire/nonstd/wlroots-full.hpp>
 #include <wayfire/output-layout.hpp>
 #include <wayfire/signal-definitions.hpp>
 #include <wayfire/workspace-manager.hpp>
 
+#include <algorithm>
+#include <deque>
+#include <variant>
+
 /// Temporary string buffer. Contents are invalid after any next function call.
 static std::string string_buf;
 
@@ -116,27 +121,183 @@ struct LifetimeTracker : public wf::custom_data_t {
         void *data;
     };
 
-    wf::object_base_t *obj;                ///< Tracked object
-    std::vector<CallbackPair> callbacks{}; ///< Callbacks
+    wf::object_base_t *obj;                  ///< Tracked object
+    std::vector<CallbackPair> callbacks{};   ///< Callbacks by token
+    std::vector<unsigned int> free_tokens{}; ///< Tokens of removed callbacks
+    size_t count = 0;                        ///< Number of live callbacks
 
     LifetimeTracker(wf::object_base_t *obj) : obj(obj) {}
     virtual ~LifetimeTracker() {
-        for (auto cb : callbacks)
-            cb.callback(obj, cb.data);
+        for (auto cb : callbacks) {
+            if (cb.callback)
+                cb.callback(obj, cb.data);
+        }
     }
 
-    void add_callback(wf_LifetimeCallback cb, void *data) {
+    unsigned int add_callback(wf_LifetimeCallback cb, void *data) {
+        count++;
+        if (!free_tokens.empty()) {
+            auto token = free_tokens.back();
+            free_tokens.pop_back();
+            callbacks[token] = {cb, data};
+            return token;
+        }
+
         callbacks.push_back({cb, data});
+        return callbacks.size() - 1;
     }
-    void remove_callback(wf_LifetimeCallback cb) {
-        for (auto i = callbacks.rbegin(); i < callbacks.rend(); i++) {
-            if (i->callback == cb) {
-                callbacks.erase(i.base());
-                return;
-            }
+    void remove_callback(unsigned int token) {
+        if (token >= callbacks.size() || !callbacks[token].callback) {
+            LOGE("Cannnot find callback to unsubscribe.");
+            return;
         }
 
-        LOGE("Cannnot find callback to unsubscribe.");
+        callbacks[token] = {nullptr, nullptr};
+        free_tokens.push_back(token);
+        count--;
+    }
+};
+
+/// Id of the data lua keeps for an object.
+struct ObjectDataId : public wf::custom_data_t {
+    wf::object_base_t *obj; ///< Object holding the data
+    int id;
+    wf_ObjectDataCallback callback;
+    void *data;
+
+    ObjectDataId(wf::object_base_t *obj, int id, wf_ObjectDataCallback cb,
+                 void *data)
+        : obj(obj), id(id), callback(cb), data(data) {}
+    virtual ~ObjectDataId() { callback(obj, id, data); }
+};
+
+/// A pooled signal connection.
+///
+/// Released connections are disconnected and kept for reuse instead of being
+/// freed. The callback only captures the slot so that it fits in
+/// std::function's small buffer and assigning new data allocates nothing.
+struct SignalSlot {
+    wf_SignalCallback callback;
+    void *data1;
+    void *data2;
+
+    wf::signal_connection_t conn{[this](auto *sig_data) {
+        callback((void *)sig_data, data1, data2);
+    }};
+};
+
+/// Storage of all signal slots. A deque never moves its elements as it grows.
+static std::deque<SignalSlot> signal_slots;
+static std::vector<SignalSlot *> free_signal_slots;
+
+inline wf::signal_connection_t *unwrap_signal_connection(
+    wf_SignalConnection *conn) {
+    return &((SignalSlot *)conn)->conn;
+}
+
+/// Last serial given to a cached view string.
+static unsigned int view_string_serial = 0;
+
+/// Cache of a view's commonly read properties.
+///
+/// Entries are marked stale by the view's change signals and only refreshed
+/// when next read. The strings are owned here so the pointers handed out stay
+/// valid until the property actually changes.
+struct ViewPropertyCache : public wf::custom_data_t {
+    wf::view_interface_t *view; ///< Cached view
+    std::string title{};
+    std::string app_id{};
+    wf_ViewProperties props{};
+
+    bool title_stale = true;
+    bool app_id_stale = true;
+    bool geometry_stale = true;
+
+    wf::signal_connection_t on_title_changed{
+        [this](wf::signal_data_t *) { title_stale = true; }};
+    wf::signal_connection_t on_app_id_changed{
+        [this](wf::signal_data_t *) { app_id_stale = true; }};
+    wf::signal_connection_t on_geometry_changed{
+        [this](wf::signal_data_t *) { geometry_stale = true; }};
+
+    ViewPropertyCache(wf::view_interface_t *view) : view(view) {
+        view->connect_signal("title-changed", &on_title_changed);
+        view->connect_signal("app-id-changed", &on_app_id_changed);
+        view->connect_signal("geometry-changed", &on_geometry_changed);
+    }
+
+    const wf_ViewProperties *get() {
+        if (title_stale) {
+            title = view->get_title();
+            props.title = {title.size(), title.c_str()};
+            props.title_serial = ++view_string_serial;
+            title_stale = false;
+        }
+        if (app_id_stale) {
+            app_id = view->get_app_id();
+            props.app_id = {app_id.size(), app_id.c_str()};
+            props.app_id_serial = ++view_string_serial;
+            app_id_stale = false;
+        }
+        if (geometry_stale) {
+            props.wm_geometry = wrap_geo(view->get_wm_geometry());
+            geometry_stale = false;
+        }
+        return &props;
+    }
+
+    static ViewPropertyCache *of(wf::view_interface_t *view) {
+        auto cache = view->get_data<ViewPropertyCache>();
+        if (!cache) {
+            auto owned_cache = std::make_unique<ViewPropertyCache>(view);
+            cache = owned_cache.get();
+            view->store_data(std::move(owned_cache));
+        }
+        return cache;
+    }
+};
+
+inline wf_Option *wrap_option(wf::config::option_base_t *option) {
+    return (wf_Option *)option;
+}
+inline wf::config::option_base_t *unwrap_option(wf_Option *option) {
+    return (wf::config::option_base_t *)option;
+}
+
+template <class T>
+inline wf::config::option_t<T> *typed_option(wf_Option *option) {
+    return dynamic_cast<wf::config::option_t<T> *>(unwrap_option(option));
+}
+
+struct wf_OptionTransaction {
+    struct Change {
+        wf::config::option_base_t *option;
+        /// Strings set on non-string options are parsed by the option.
+        std::variant<int, double, bool, std::string> value;
+    };
+
+    std::vector<Change> changes{};
+
+    template <class T> wf_Error stage(wf_Option *option, T val) {
+        if (!typed_option<T>(option))
+            return wf_Error::WF_INVALID_OPTION_VALUE;
+
+        changes.push_back({unwrap_option(option), std::move(val)});
+        return wf_Error::WF_OK;
+    }
+
+    void apply(Change &change) {
+        std::visit(
+            [&](auto &val) {
+                using T = std::decay_t<decltype(val)>;
+                if (auto opt = dynamic_cast<wf::config::option_t<T> *>(
+                        change.option)) {
+                    opt->set_value(val);
+                } else if constexpr (std::is_same_v<T, std::string>) {
+                    change.option->set_value_str(val);
+                }
+            },
+            change.value);
     }
 };
 
@@ -161,7 +322,105 @@ wf_Error wf_set_option_str(const char *section, const char *option,
     return wf_Error::WF_INVALID_OPTION_VALUE;
 }
 
-void wf_lifetime_subscribe(void *object_, wf_LifetimeCallback cb, void *data) {
+wf_Error wf_get_option_int(const char *section, const char *option, int *val) {
+    auto &core = wf::get_core();
+
+    auto sec = core.config.get_section(section);
+    if (!sec)
+        return wf_Error::WF_INVALID_OPTION_SECTION;
+
+    auto opt = std::dynamic_pointer_cast<wf::config::option_t<int>>(
+        sec->get_option_or(option));
+    if (!opt)
+        return wf_Error::WF_INVALID_OPTION;
+
+    *val = opt->get_value();
+    return wf_Error::WF_OK;
+}
+
+wf_Error wf_find_option(const char *section, const char *option,
+                        wf_Option **out, wf_OptionType *type) {
+    auto &core = wf::get_core();
+
+    auto sec = core.config.get_section(section);
+    if (!sec)
+        return wf_Error::WF_INVALID_OPTION_SECTION;
+
+    auto opt = sec->get_option_or(option);
+    if (!opt)
+        return wf_Error::WF_INVALID_OPTION;
+
+    *out = wrap_option(opt.get());
+    if (typed_option<int>(*out))
+        *type = WF_OPTION_TYPE_INT;
+    else if (typed_option<double>(*out))
+        *type = WF_OPTION_TYPE_DOUBLE;
+    else if (typed_option<bool>(*out))
+        *type = WF_OPTION_TYPE_BOOL;
+    else if (typed_option<std::string>(*out))
+        *type = WF_OPTION_TYPE_STRING;
+    else
+        *type = WF_OPTION_TYPE_OTHER;
+    return wf_Error::WF_OK;
+}
+
+wf_OptionTransaction *wf_create_option_transaction() {
+    return new wf_OptionTransaction();
+}
+void wf_destroy_option_transaction(wf_OptionTransaction *tx) { delete tx; }
+
+wf_Error wf_OptionTransaction_set_int(wf_OptionTransaction *tx,
+                                      wf_Option *option, int val) {
+    return tx->stage<int>(option, val);
+}
+wf_Error wf_OptionTransaction_set_double(wf_OptionTransaction *tx,
+                                         wf_Option *option, double val) {
+    return tx->stage<double>(option, val);
+}
+wf_Error wf_OptionTransaction_set_bool(wf_OptionTransaction *tx,
+                                       wf_Option *option, bool val) {
+    return tx->stage<bool>(option, val);
+}
+wf_Error wf_OptionTransaction_set_str(wf_OptionTransaction *tx,
+                                      wf_Option *option, const char *val) {
+    if (typed_option<std::string>(option))
+        return tx->stage<std::string>(option, val);
+
+    // Validate the value on a copy so that committing can't fail.
+    if (!unwrap_option(option)->clone_option()->set_value_str(val))
+        return wf_Error::WF_INVALID_OPTION_VALUE;
+
+    tx->changes.push_back({unwrap_option(option), std::string(val)});
+    return wf_Error::WF_OK;
+}
+
+void wf_OptionTransaction_clear(wf_OptionTransaction *tx) {
+    tx->changes.clear();
+}
+
+unsigned int wf_OptionTransaction_size(wf_OptionTransaction *tx) {
+    return tx->changes.size();
+}
+
+void wf_OptionTransaction_rollback(wf_OptionTransaction *tx,
+                                   unsigned int size) {
+    if (size < tx->changes.size())
+        tx->changes.resize(size);
+}
+
+void wf_OptionTransaction_commit(wf_OptionTransaction *tx, bool emit_reload) {
+    for (auto &change : tx->changes)
+        tx->apply(change);
+
+    LOGD("Options set: ", tx->changes.size());
+    tx->changes.clear();
+
+    if (emit_reload)
+        wf::get_core().emit_signal("reload-config", nullptr);
+}
+
+unsigned int wf_lifetime_subscribe(void *object_, wf_LifetimeCallback cb,
+                                   void *data) {
     auto object = static_cast<wf::object_base_t *>(object_);
     auto tracker = object->get_data<LifetimeTracker>();
     if (!tracker) {
@@ -170,10 +429,10 @@ void wf_lifetime_subscribe(void *object_, wf_LifetimeCallback cb, void *data) {
         object->store_data(std::move(owned_tracker));
     }
 
-    tracker->add_callback(cb, data);
+    return tracker->add_callback(cb, data);
 }
 
-void wf_lifetime_unsubscribe(void *object_, wf_LifetimeCallback cb) {
+void wf_lifetime_unsubscribe(void *object_, unsigned int token) {
     auto object = static_cast<wf::object_base_t *>(object_);
     auto tracker = object->get_data<LifetimeTracker>();
     if (!tracker) {
@@ -181,31 +440,58 @@ void wf_lifetime_unsubscribe(void *object_, wf_LifetimeCallback cb) {
         return;
     }
 
-    tracker->remove_callback(cb);
-    if (tracker->callbacks.empty())
+    tracker->remove_callback(token);
+    if (tracker->count == 0)
         object->erase_data<LifetimeTracker>();
 }
 
+void wf_object_data_set(void *object_, int id, wf_ObjectDataCallback cb,
+                        void *data) {
+    auto object = static_cast<wf::object_base_t *>(object_);
+    object->store_data(std::make_unique<ObjectDataId>(object, id, cb, data));
+}
+
+int wf_object_data_get(void *object_) {
+    auto object = static_cast<wf::object_base_t *>(object_);
+    auto data = object->get_data<ObjectDataId>();
+    return data ? data->id : 0;
+}
+
+void wf_object_data_erase(void *object_) {
+    auto object = static_cast<wf::object_base_t *>(object_);
+    object->erase_data<ObjectDataId>();
+}
+
 wf_SignalConnection *wf_create_signal_connection(wf_SignalCallback cb,
                                                  void *data1, void *data2) {
-    return (wf_SignalConnection *)(new wf::signal_connection_t(
-        [=](auto *sig_data) { cb((void *)sig_data, data1, data2); }));
+    SignalSlot *slot;
+    if (!free_signal_slots.empty()) {
+        slot = free_signal_slots.back();
+        free_signal_slots.pop_back();
+    } else {
+        slot = &signal_slots.emplace_back();
+    }
+
+    slot->callback = cb;
+    slot->data1 = data1;
+    slot->data2 = data2;
+    return (wf_SignalConnection *)slot;
 }
 void wf_destroy_signal_connection(wf_SignalConnection *conn) {
-    delete (wf::signal_connection_t *)conn;
+    unwrap_signal_connection(conn)->disconnect();
+    free_signal_slots.push_back((SignalSlot *)conn);
 }
-void wf_signal_subscribe(void *emitter_, const char *signal_,
+void wf_signal_subscribe(void *emitter_, const char *signal,
                          wf_SignalConnection *conn) {
-    string_buf = signal_;
     auto emitter = static_cast<wf::signal_provider_t *>(emitter_);
 
-    emitter->connect_signal(string_buf, (wf::signal_connection_t *)conn);
+    emitter->connect_signal(signal, unwrap_signal_connection(conn));
 }
 
 void wf_signal_unsubscribe(void *emitter_, wf_SignalConnection *conn) {
     const auto emitter = static_cast<wf::signal_provider_t *>(emitter_);
 
-    emitter->disconnect_signal((wf::signal_connection_t *)conn);
+    emitter->disconnect_signal(unwrap_signal_connection(conn));
 }
 
 wf_View *wf_get_signaled_view(void *sig_data) {
@@ -255,6 +541,10 @@ wf_Geometry wf_View_get_bounding_box(wf_View *view) {
     return wrap_geo(unwrap_view(view)->get_bounding_box());
 }
 
+const wf_ViewProperties *wf_View_get_properties(wf_View *view) {
+    return ViewPropertyCache::of(unwrap_view(view))->get();
+}
+
 wf_Output *wf_View_get_output(wf_View *view) {
     return wrap_output(unwrap_view(view)->get_output());
 }
@@ -263,6 +553,10 @@ void wf_View_set_geometry(wf_View *view, wf_Geometry geo) {
     unwrap_view(view)->set_geometry(unwrap_geo(geo));
 }
 
+const char *wf_Output_get_name(wf_Output *output) {
+    return unwrap_output(output)->handle->name;
+}
+
 wf_Dimensions wf_Output_get_screen_size(wf_Output *output) {
     return wrap_dims(unwrap_output(output)->get_screen_size());
 }
@@ -339,6 +633,28 @@ wf_View *wf_Core_get_touch_focus_view(wf_Core *core) {
 wf_View *wf_Core_get_view_at(wf_Core *core, wf_Pointf point) {
     return wrap_view(unwrap_core(core)->get_view_at(unwrap_pointf(point)));
 }
+unsigned int wf_Core_snapshot_views(wf_Core *core, wf_ViewSnapshot *snapshots,
+                                    unsigned int max_snapshots) {
+    const auto views = unwrap_core(core)->get_all_views();
+    const auto count = std::min<size_t>(views.size(), max_snapshots);
+
+    for (size_t i = 0; i < count; i++) {
+        const auto &view = views[i];
+        const auto props = ViewPropertyCache::of(view.get())->get();
+        auto &snapshot = snapshots[i];
+
+        snapshot.view = wrap_view(view);
+        snapshot.output = wrap_output(view->get_output());
+        snapshot.wm_geometry = props->wm_geometry;
+        snapshot.mapped = view->is_mapped();
+        snapshot.title = props->title;
+        snapshot.app_id = props->app_id;
+        snapshot.title_serial = props->title_serial;
+        snapshot.app_id_serial = props->app_id_serial;
+    }
+
+    return views.size();
+}
 void wf_Core_set_active_view(wf_Core *core, wf_View *v) {
     unwrap_core(core)->set_active_view(unwrap_view(v));
 }
@@ -395,6 +711,17 @@ wf_Output *wf_OutputLayout_get_output_coords_at(wf_OutputLayout *layout,
 unsigned int wf_OutputLayout_get_num_outputs(wf_OutputLayout *layout) {
     return unwrap_output_layout(layout)->get_num_outputs();
 }
+unsigned int wf_OutputLayout_get_outputs(wf_OutputLayout *layout,
+                                         wf_Output **outputs,
+                                         unsigned int max_outputs) {
+    const auto all_outputs = unwrap_output_layout(layout)->get_outputs();
+    const auto count = std::min<size_t>(all_outputs.size(), max_outputs);
+
+    for (size_t i = 0; i < count; i++)
+        outputs[i] = wrap_output(all_outputs[i]);
+
+    return all_outputs.size();
+}
 wf_Output *wf_OutputLayout_get_next_output(wf_OutputLayout *layout,
                                            wf_Output *prev) {
     return wrap_output(
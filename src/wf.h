@@ -13,13 +13,74 @@ typedef enum {
 
 wf_Error wf_set_option_str(const char *section, const char *option,
                            const char *val);
+wf_Error wf_get_option_int(const char *section, const char *option, int *val);
+
+// A resolved option. Stays valid for the lifetime of the compositor.
+typedef struct wf_Option wf_Option;
+
+// The type of value an option natively holds.
+typedef enum {
+    WF_OPTION_TYPE_INT,
+    WF_OPTION_TYPE_DOUBLE,
+    WF_OPTION_TYPE_BOOL,
+    WF_OPTION_TYPE_STRING,
+    // Any other type (colors, bindings, ...) can only be set from a string.
+    WF_OPTION_TYPE_OTHER,
+} wf_OptionType;
+
+wf_Error wf_find_option(const char *section, const char *option,
+                        wf_Option **out, wf_OptionType *type);
+
+// Option changes staged to be applied all at once.
+//
+// Values are validated when staged so that committing never fails halfway.
+// Typed setters must match the option's type. Strings are accepted for any
+// option and parsed like in the config file.
+typedef struct wf_OptionTransaction wf_OptionTransaction;
+
+wf_OptionTransaction *wf_create_option_transaction();
+void wf_destroy_option_transaction(wf_OptionTransaction *tx);
+
+wf_Error wf_OptionTransaction_set_int(wf_OptionTransaction *tx,
+                                      wf_Option *option, int val);
+wf_Error wf_OptionTransaction_set_double(wf_OptionTransaction *tx,
+                                         wf_Option *option, double val);
+wf_Error wf_OptionTransaction_set_bool(wf_OptionTransaction *tx,
+                                       wf_Option *option, _Bool val);
+wf_Error wf_OptionTransaction_set_str(wf_OptionTransaction *tx,
+                                      wf_Option *option, const char *val);
+// Drop the staged changes.
+void wf_OptionTransaction_clear(wf_OptionTransaction *tx);
+// Number of staged changes.
+unsigned int wf_OptionTransaction_size(wf_OptionTransaction *tx);
+// Drop the changes staged after the first `size` ones.
+void wf_OptionTransaction_rollback(wf_OptionTransaction *tx,
+                                   unsigned int size);
+// Apply the staged changes and clear them. If `emit_reload` is set, the core's
+// "reload-config" signal is emitted once afterwards.
+void wf_OptionTransaction_commit(wf_OptionTransaction *tx, _Bool emit_reload);
 
 typedef void (*wf_LifetimeCallback)(void *emitter, void *data);
 
-void wf_lifetime_subscribe(void *object, wf_LifetimeCallback cb, void *data);
-void wf_lifetime_unsubscribe(void *object, wf_LifetimeCallback cb);
+// Returns a token identifying this callback to unsubscribe it.
+unsigned int wf_lifetime_subscribe(void *object, wf_LifetimeCallback cb,
+                                   void *data);
+void wf_lifetime_unsubscribe(void *object, unsigned int token);
+
+typedef void (*wf_ObjectDataCallback)(void *object, int id, void *data);
+
+// Store the id of some data on an object, replacing any stored before. `cb` is
+// called with it once the object is destroyed or the id erased.
+void wf_object_data_set(void *object, int id, wf_ObjectDataCallback cb,
+                        void *data);
+// Get the id stored on an object or 0 if there is none.
+int wf_object_data_get(void *object);
+// Erase the id stored on an object, calling its callback.
+void wf_object_data_erase(void *object);
 
 typedef void (*wf_SignalCallback)(void *signal_data, void *data1, void *data2);
+// Signal connections are pooled. Destroying one disconnects it and keeps it
+// around to be reused by the next one created.
 typedef struct wf_SignalConnection wf_SignalConnection;
 
 wf_SignalConnection *wf_create_signal_connection(wf_SignalCallback cb,
@@ -43,12 +104,43 @@ typedef struct {
     double x, y;
 } wf_Pointf;
 
+// A non-owning string with an explicit length.
+typedef struct {
+    unsigned long len;
+    const char *data;
+} wf_String;
+
 typedef struct wf_View wf_View;
 wf_View *wf_get_signaled_view(void *sig_data);
 
 typedef struct wf_Output wf_Output;
 wf_Output *wf_get_signaled_output(void *sig_data);
 
+// A view's commonly read properties, cached on the view itself.
+// The strings stay valid until the property changes or the view is destroyed.
+// Every string refreshed gets a new serial, unique across views, so copies of
+// it can be reused for as long as the serial stays the same.
+typedef struct {
+    wf_String title;
+    wf_String app_id;
+    wf_Geometry wm_geometry;
+    unsigned int title_serial;
+    unsigned int app_id_serial;
+} wf_ViewProperties;
+
+// A plain copy of a view's state.
+// The strings come from the view's property cache (see wf_ViewProperties).
+typedef struct {
+    wf_View *view;
+    wf_Output *output;
+    wf_Geometry wm_geometry;
+    _Bool mapped;
+    wf_String title;
+    wf_String app_id;
+    unsigned int title_serial;
+    unsigned int app_id_serial;
+} wf_ViewSnapshot;
+
 typedef enum {
     WF_INPUT_EVENT_PROC_MODE_FULL,
     WF_INPUT_EVENT_PROC_MODE_NO_CLIENT,
@@ -63,6 +155,7 @@ const char *wf_View_to_string(wf_View *view);
 const char *wf_View_get_title(wf_View *view);
 const char *wf_View_get_app_id(wf_View *view);
 wf_Geometry wf_View_get_wm_geometry(wf_View *view);
+const wf_ViewProperties *wf_View_get_properties(wf_View *view);
 wf_Geometry wf_View_get_output_geometry(wf_View *view);
 wf_Geometry wf_View_get_bounding_box(wf_View *view);
 wf_Output *wf_View_get_output(wf_View *view);
@@ -83,6 +176,8 @@ typedef struct {
 } wf_PlainActivatorData;
 
 const char *wf_Output_to_string(wf_Output *output);
+// The name is valid for the lifetime of the output.
+const char *wf_Output_get_name(wf_Output *output);
 wf_Dimensions wf_Output_get_screen_size(wf_Output *output);
 wf_Geometry wf_Output_get_relative_geometry(wf_Output *output);
 wf_Geometry wf_Output_get_layout_geometry(wf_Output *output);
@@ -110,7 +205,8 @@ wf_Pointf wf_Core_get_cursor_position(wf_Core *core);
 wf_View *wf_Core_get_cursor_focus_view(wf_Core *core);
 wf_View *wf_Core_get_touch_focus_view(wf_Core *core);
 wf_View *wf_Core_get_view_at(wf_Core *core, wf_Pointf point);
-// TODO: port wf_Output_get_all_views(wf_Core *core)
+unsigned int wf_Core_snapshot_views(wf_Core *core, wf_ViewSnapshot *snapshots,
+                                    unsigned int max_snapshots);
 void wf_Core_set_active_view(wf_Core *core, wf_View *v);
 void wf_Core_focus_view(wf_Core *core, wf_View *win);
 void wf_Core_focus_output(wf_Core *core, wf_Output *o);
@@ -129,7 +225,9 @@ wf_Output *wf_OutputLayout_get_output_coords_at(wf_OutputLayout *layout,
                                                 wf_Pointf origin,
                                                 wf_Pointf *closest);
 unsigned int wf_OutputLayout_get_num_outputs(wf_OutputLayout *layout);
-// TODO: wf_Output* wf_OutputLayout_get_outputs(wf_OutputLayout *layout);
+unsigned int wf_OutputLayout_get_outputs(wf_OutputLayout *layout,
+                                         wf_Output **outputs,
+                                         unsigned int max_outputs);
 wf_Output *wf_OutputLayout_get_next_output(wf_OutputLayout *layout,
                                            wf_Output *prev);
 wf_Output *wf_OutputLayout_find_output(wf_OutputLayout *layout,